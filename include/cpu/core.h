@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include "cpu.h"
+#include "cpu/model.h"
+#include "cpu/hooks.h"
+#include "cpu/im/i386im.h"
+
+namespace x86e::cpu {
+    // decoder and instruction set of one CPU model, see cpu/model.h and cpu/hooks.h
+    template<typename Model, typename Hooks = NoHooks>
+    class Core : public CPU {
+    public:
+        Core(uint32_t memory, bool hugePages = false);
+        Core(memory::Memory& memory, devices::IOBus& ioBus);
+        ~Core();
+
+        // runs until count more instructions have been retired, or the CPU halts with nothing
+        // to wake it up. exceptions are delivered within the slice
+        void run(uint64_t count);
+
+        // a single instruction
+        void cycle();
+
+        inline Hooks& hooks() {
+            return _hooks;
+        }
+
+    private:
+        // decodes and executes one instruction, decoded gets its front end.
+        // returns the length of the instruction
+        uint32_t step(DecodedInstruction* decoded = nullptr);
+        void execute(Opcode& opcode);
+        // a fused pair through its handler, false if it has to run one instruction at a time
+        bool executeFused(Opcode& first, Opcode& second);
+        // commits EIP and retires an executed instruction
+        void complete(Opcode& opcode);
+        // the instructions from EIP on up to the end of their block, in the tier the block is in
+        void runBlock(uint64_t end);
+        // tier 0
+        void interpret(uint64_t end);
+        void invalidOpcode(Opcode& opcode);
+        bool lockable(Opcode& opcode);
+
+        im::i386_InstructionsManager<Model> _instructionsManager;
+        [[no_unique_address]] Hooks _hooks;
+
+    };
+
+    typedef Core<Model8086> i8086;
+    typedef Core<Model286> i286;
+    typedef Core<Model386> i386;
+
+    extern template class Core<Model8086>;
+    extern template class Core<Model286>;
+    extern template class Core<Model386>;
+
+}
@@ -0,0 +1,738 @@
+#pragma once
+
+// definitions of Core. core.cpp instantiates the built in models, include this
+// to instantiate a core with your own hooks
+
+#include "cpu/core.h"
+
+// opcodes introduced after the model are decoded as invalid ones
+#define REQUIRE(FEATURE)                    \
+        if constexpr (!FEATURE<Model>) {    \
+            invalidOpcode(opcode);          \
+            break;                          \
+        }
+
+namespace x86e::cpu {
+
+    template<typename Model, typename Hooks>
+    Core<Model, Hooks>::Core(uint32_t memory, bool hugePages)
+        : CPU::CPU(memory, hugePages), _instructionsManager(this) {
+    }
+
+    template<typename Model, typename Hooks>
+    Core<Model, Hooks>::Core(memory::Memory &memory, devices::IOBus &ioBus)
+        : CPU::CPU(memory, ioBus), _instructionsManager(this) {
+    }
+
+    template<typename Model, typename Hooks>
+    Core<Model, Hooks>::~Core() {
+    }
+
+    template<typename Model, typename Hooks>
+    void Core<Model, Hooks>::invalidOpcode(Opcode &opcode) {
+        if (opcode.instruction == 0x0f && opcode.bytes[opcode.position - 1] != 0x0f)
+            io::debug_print(io::WARNING, "Invalid opcode 0x0f 0x%02x!!! EIP=0x%x",
+                            opcode.bytes[opcode.position - 1],
+                            opcode.beginIP);
+        else
+            io::debug_print(io::WARNING, "Invalid opcode 0x%02x!!! EIP=0x%x",
+                            opcode.instruction,
+                            opcode.beginIP);
+
+        // the 8086 has no #UD, undefined opcodes just do something else
+        if constexpr (HAS_186_INSTRUCTIONS<Model>)
+            raiseFault(EXCEPTION_UD);
+    }
+
+    template<typename Model, typename Hooks>
+    bool Core<Model, Hooks>::lockable(Opcode &opcode) {
+        switch (opcode.instruction) {
+            case 0x00:
+            case 0x01:
+            case 0x08:
+            case 0x09:
+            case 0x10:
+            case 0x11:
+            case 0x86:
+            case 0x87:
+                break;
+
+            default:
+                return false;
+        }
+
+        // only with a memory operand, the ModR/M byte is decoded again by the handler
+        uint8_t modrm = nextImm8(opcode);
+        opcode.position--;
+
+        return (modrm >> 6) != 0b11;
+    }
+
+    template<typename Model, typename Hooks>
+    void Core<Model, Hooks>::run(uint64_t count) {
+        uint64_t end = instructionsRetired() + count;
+
+        // a faulting instruction lands here instead of returning, this is the only
+        // place that pays for exceptions when none are raised
+        if (setjmp(_faultJump)) {
+            // a locked instruction that faulted or has to be restarted
+            endLocked();
+
+            if constexpr (Hooks::EXCEPTION) {
+                if (pendingFault().pending)
+                    _hooks.exception(*this, pendingFault().vector);
+            }
+
+            deliverFault();
+        }
+
+        _faultArmed = true;
+
+        while (instructionsRetired() < end) {
+            if (_isHalted && !wakeUp())
+                break;
+
+            if (decodeCache())
+                runBlock(end);
+            else
+                step();
+        }
+
+        _faultArmed = false;
+    }
+
+    template<typename Model, typename Hooks>
+    void Core<Model, Hooks>::cycle() {
+        run(1);
+    }
+
+    template<typename Model, typename Hooks>
+    void Core<Model, Hooks>::runBlock(uint64_t end) {
+        uint32_t available;
+        const uint8_t* host = instructionPointer(available);
+        uint8_t mode = DecodeCache::MODE_VALID | (codeSize32() ? DecodeCache::MODE_32BIT : 0);
+
+        DecodedBlock* block = host ? decodeCache()->lookup(host, mode) : nullptr;
+        if (!block) {
+            interpret(end);
+            return;
+        }
+
+        DecodeCacheStatistics& statistics = decodeCache()->statistics();
+
+        // the block is left as soon as the next instruction is not the one that follows in it, and
+        // when the TLB is flushed, which is the only way the page under EIP can change in between
+        uint32_t start = getRegister(EIP);
+        uint64_t flushes = getMMU().statistics().flushes;
+
+        if (!block->count) {
+            // decoded while it runs, a faulting instruction is not added
+            while (true) {
+                DecodedInstruction& decoded = block->instructions[block->count];
+                uint32_t offset = getRegister(EIP) - start;
+                uint32_t length = step(&decoded);
+
+                ++statistics.interpreted;
+
+                if (offset + length > available || decoded.start > DecodedInstruction::HEAD_SIZE)
+                    return;
+
+                decoded.offset = offset;
+
+                if (block->count)
+                    decodeCache()->fuse(block->instructions[block->count - 1], decoded);
+
+                if (++block->count == DecodedBlock::MAX_INSTRUCTIONS || instructionsRetired() >= end || _isHalted ||
+                    getRegister(EIP) != start + offset + length || getMMU().statistics().flushes != flushes)
+                    return;
+            }
+        }
+
+        // the window of an instruction, false if its code was changed since it was decoded
+        auto load = [&](const DecodedInstruction& decoded, cpu::Opcode& opcode) {
+            opcode.beginIP = start + decoded.offset;
+
+            // a full window is a fixed size copy
+            if (available - decoded.offset >= Opcode::MAX_LENGTH) [[likely]] {
+                std::memcpy(opcode.bytes, host + decoded.offset, Opcode::MAX_LENGTH);
+                opcode.length = Opcode::MAX_LENGTH;
+            }
+            else {
+                opcode.length = available - decoded.offset;
+                std::memcpy(opcode.bytes, host + decoded.offset, opcode.length);
+            }
+
+            uint32_t head;
+            uint32_t expected;
+            std::memcpy(&head, opcode.bytes, sizeof(head));
+            std::memcpy(&expected, decoded.head, sizeof(expected));
+
+            if ((head ^ expected) & (0xffffffffu >> (32 - decoded.start * 8)))
+                return false;
+
+            opcode.position = decoded.start;
+            opcode.prefixes.mask = decoded.prefixes;
+            opcode.instruction = decoded.instruction;
+            opcode.segment = (Registers) decoded.segment;
+            opcode.segmentOverride = decoded.flags & DecodedInstruction::SEGMENT_OVERRIDE;
+            return true;
+        };
+
+        for (uint32_t i = 0; ; ) {
+            const DecodedInstruction& decoded = block->instructions[i];
+            cpu::Opcode opcode;
+
+            // the code was changed, it is decoded again the next time
+            if (!load(decoded, opcode)) {
+                block->count = 0;
+                return;
+            }
+
+            // a pair only runs as one when nothing can come between its instructions: both fit
+            // into the slice and no event falls due when the first one retires
+            if ((decoded.flags & DecodedInstruction::FUSED) && instructionsRetired() + 2 <= end && !eventDue(1)) {
+                const DecodedInstruction& second = block->instructions[i + 1];
+                cpu::Opcode next;
+
+                if (!load(second, next)) {
+                    block->count = 0;
+                    return;
+                }
+
+                if (executeFused(opcode, next)) {
+                    statistics.predecoded += 2;
+                    ++statistics.fused;
+
+                    if ((i += 2) == block->count || instructionsRetired() >= end || _isHalted ||
+                        getRegister(EIP) != start + block->instructions[i].offset)
+                        return;
+
+                    continue;
+                }
+            }
+
+            execute(opcode);
+
+            ++statistics.predecoded;
+
+            if (++i == block->count || instructionsRetired() >= end || _isHalted ||
+                getRegister(EIP) != start + block->instructions[i].offset || getMMU().statistics().flushes != flushes)
+                return;
+        }
+    }
+
+    template<typename Model, typename Hooks>
+    void Core<Model, Hooks>::interpret(uint64_t end) {
+        DecodeCacheStatistics& statistics = decodeCache()->statistics();
+
+        // up to the next jump, that is where the next block starts
+        while (true) {
+            uint32_t begin = getRegister(EIP);
+            uint32_t length = step();
+
+            ++statistics.interpreted;
+
+            if (instructionsRetired() >= end || _isHalted || getRegister(EIP) != begin + length)
+                return;
+        }
+    }
+
+    template<typename Model, typename Hooks>
+    uint32_t Core<Model, Hooks>::step(DecodedInstruction* decoded) {
+        cpu::Opcode opcode;
+
+        fetchInstruction(opcode);
+        opcode.instruction = nextImm8(opcode);
+
+        bool isPrefix = true;
+
+        while (isPrefix) {
+            // FS/GS overrides and the size prefixes arrived with the 386
+            if constexpr (!HAS_32BIT<Model>) {
+                if (opcode.instruction >= 0x64 && opcode.instruction <= 0x67)
+                    break;
+            }
+
+            // check if this instruction has prefixes
+            switch (opcode.instruction) {
+                case InstructionPrefix::CS_OVERRIDE:
+                case InstructionPrefix::SS_OVERRIDE:
+                case InstructionPrefix::DS_OVERRIDE:
+                case InstructionPrefix::ES_OVERRIDE:
+                case InstructionPrefix::FS_OVERRIDE:
+                case InstructionPrefix::GS_OVERRIDE:
+                    opcode.segment = opcode.instruction == InstructionPrefix::CS_OVERRIDE ? CS :
+                                     opcode.instruction == InstructionPrefix::SS_OVERRIDE ? SS :
+                                     opcode.instruction == InstructionPrefix::DS_OVERRIDE ? DS :
+                                     opcode.instruction == InstructionPrefix::ES_OVERRIDE ? ES :
+                                     opcode.instruction == InstructionPrefix::FS_OVERRIDE ? FS : GS;
+                    opcode.segmentOverride = true;
+                    [[fallthrough]];
+
+                case InstructionPrefix::OPERAND_SIZE:
+                case InstructionPrefix::ADDRESS_SIZE:
+                case InstructionPrefix::REPNE:
+                case InstructionPrefix::REP:
+                case InstructionPrefix::LOCK:
+                    opcode.prefixes.add(opcode.instruction);
+                    opcode.instruction = nextImm8(opcode);
+                    break;
+
+                default:
+                    isPrefix = false;
+            }
+        }
+
+        // in a 32 bit code segment the size prefixes select 16 bits instead
+        if constexpr (HAS_32BIT<Model>) {
+            if (codeSize32())
+                opcode.prefixes.mask ^= PrefixSet::bit(InstructionPrefix::OPERAND_SIZE) | PrefixSet::bit(InstructionPrefix::ADDRESS_SIZE);
+        }
+
+        if (decoded) {
+            std::memcpy(decoded->head, opcode.bytes, DecodedInstruction::HEAD_SIZE);
+            decoded->prefixes = opcode.prefixes.mask;
+            decoded->instruction = opcode.instruction;
+            decoded->start = opcode.position;
+            decoded->segment = opcode.segment;
+            decoded->flags = opcode.segmentOverride ? DecodedInstruction::SEGMENT_OVERRIDE : 0;
+        }
+
+        execute(opcode);
+        return opcode.position;
+    }
+
+    template<typename Model, typename Hooks>
+    void Core<Model, Hooks>::execute(Opcode& opcode) {
+
+        // the memory operand of a locked instruction is updated atomically, XCHG with memory always is
+        bool locked = false;
+
+        if (opcode.prefixes.has(InstructionPrefix::LOCK) || opcode.instruction == 0x86 || opcode.instruction == 0x87) {
+            if (lockable(opcode)) {
+                beginLocked();
+                locked = true;
+            }
+            else if constexpr (HAS_32BIT<Model>) {
+                if (opcode.prefixes.has(InstructionPrefix::LOCK))
+                    raiseFault(EXCEPTION_UD);
+            }
+        }
+
+        // parse instruction
+        switch (opcode.instruction) {
+            case 0x00:  // 	add	r/m8 , r8
+                _instructionsManager.add_rm8_r8(opcode);
+                break;
+
+            case 0x01:  // 	add	r/m16/32 , r16/32
+                _instructionsManager.add_rm16_32_r16_32(opcode);
+                break;
+
+            case 0x02:  // 	add	r8 , r/m8
+                _instructionsManager.add_r8_rm8(opcode);
+                break;
+
+            case 0x03:  // 	add	r16/32 , r/m16/32
+                _instructionsManager.add_r16_32_rm16_32(opcode);
+                break;
+
+            case 0x04:  // 	add	al , imm8
+                _instructionsManager.add_al_imm8(opcode);
+                break;
+
+            case 0x05:  // 	add	eAX , imm16/32
+                _instructionsManager.add_eAX_imm16_32(opcode);
+                break;
+
+            case 0x06:  // 	push es
+                _instructionsManager.push_es(opcode);
+                break;
+
+            case 0x07:  // 	pop es
+                _instructionsManager.pop_es(opcode);
+                break;
+
+            case 0x08:  // 	or r/m8 , r8
+                _instructionsManager.or_rm8_r8(opcode);
+                break;
+
+            case 0x9:  // 	or r/m16/32 , r16/32
+                _instructionsManager.or_rm16_32_r16_32(opcode);
+                break;
+
+            case 0x0a:  // 	or r8 , r/m8
+                _instructionsManager.or_r8_rm8(opcode);
+                break;
+
+            case 0x0b:  // 	or r16/32 , r/m16/32
+                _instructionsManager.or_r16_32_rm16_32(opcode);
+                break;
+
+            case 0x0c:  // 	or al , imm8
+                _instructionsManager.or_al_imm8(opcode);
+                break;
+
+            case 0x0d:  // 	or eAX , imm16/32
+                _instructionsManager.or_eAX_imm16_32(opcode);
+                break;
+
+            case 0x0e:  // 	push cs
+                _instructionsManager.push_cs(opcode);
+                break;
+
+            case 0x0f:  //  two-byte instructions
+                REQUIRE(HAS_PROTECTED_MODE)
+                switch (nextImm8(opcode)) {
+                    case 0x00:  //  sldt/str/lldt/ltr r/m16
+                        if (!protectedMode() || getFlag(VM)) {
+                            raiseFault(EXCEPTION_UD);
+                            break;
+                        }
+
+                        _instructionsManager.sldt_str_lldt_ltr_rm16(opcode);
+                        break;
+
+                    case 0x01:  //  lgdt/lidt m16&32
+                        _instructionsManager.lgdt_lidt_m16_32(opcode);
+                        break;
+
+                    case 0x20:  //  mov r32 , cr
+                        REQUIRE(HAS_32BIT)
+                        _instructionsManager.mov_r32_cr(opcode);
+                        break;
+
+                    case 0x22:  //  mov cr , r32
+                        REQUIRE(HAS_32BIT)
+                        _instructionsManager.mov_cr_r32(opcode);
+                        break;
+
+                    case 0x80:  //  jcc rel16/32
+                    case 0x81:
+                    case 0x82:
+                    case 0x83:
+                    case 0x84:
+                    case 0x85:
+                    case 0x86:
+                    case 0x87:
+                    case 0x88:
+                    case 0x89:
+                    case 0x8a:
+                    case 0x8b:
+                    case 0x8c:
+                    case 0x8d:
+                    case 0x8e:
+                    case 0x8f:
+                        REQUIRE(HAS_32BIT)
+                        _instructionsManager.jcc_rel16_32(opcode);
+                        break;
+
+                    default:
+                        invalidOpcode(opcode);
+                        break;
+                }
+                break;
+
+            case 0x10:  // 	adc r/m8 , r8
+                _instructionsManager.adc_rm8_r8(opcode);
+                break;
+
+            case 0x11:  // 	adc r/m16/32 , r16/32
+                _instructionsManager.adc_rm16_32_r16_32(opcode);
+                break;
+
+            case 0x12:  // 	adc r8, r/m8
+                _instructionsManager.adc_r8_rm8(opcode);
+                break;
+
+            case 0x13:  // 	adc r16/32 , r/m16/32
+                _instructionsManager.adc_r16_32_rm16_32(opcode);
+                break;
+
+            case 0x14:  // 	adc al , imm8
+                _instructionsManager.adc_al_imm8(opcode);
+                break;
+
+            case 0x15:  // 	adc eAX, imm16/32
+                _instructionsManager.adc_eAX_imm16_32(opcode);
+                break;
+
+            case 0x16:  // 	push ss
+                _instructionsManager.push_ss(opcode);
+                break;
+
+            case 0x17:  // 	pop ss
+                _instructionsManager.pop_ss(opcode);
+                break;
+
+            case 0x50:  // 	push r16/32
+            case 0x51:
+            case 0x52:
+            case 0x53:
+            case 0x54:
+            case 0x55:
+            case 0x56:
+            case 0x57:
+                _instructionsManager.push_r16_32(opcode);
+                break;
+
+            case 0x58:  // 	pop r16/32
+            case 0x59:
+            case 0x5a:
+            case 0x5b:
+            case 0x5c:
+            case 0x5d:
+            case 0x5e:
+            case 0x5f:
+                _instructionsManager.pop_r16_32(opcode);
+                break;
+
+            case 0x60:  // 	pusha
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.pusha(opcode);
+                break;
+
+            case 0x61:  // 	popa
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.popa(opcode);
+                break;
+
+            case 0x68:  // 	push imm16/32
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.push_imm16_32(opcode);
+                break;
+
+            case 0x6a:  // 	push imm8
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.push_imm8(opcode);
+                break;
+
+            case 0x6c:  // 	ins m8 , dx
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.ins_m8_dx(opcode);
+                break;
+
+            case 0x6d:  // 	ins m16/32 , dx
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.ins_m16_32_dx(opcode);
+                break;
+
+            case 0x6e:  // 	outs dx , m8
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.outs_dx_m8(opcode);
+                break;
+
+            case 0x6f:  // 	outs dx , m16/32
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.outs_dx_m16_32(opcode);
+                break;
+
+            case 0x70:  // 	jcc rel8
+            case 0x71:
+            case 0x72:
+            case 0x73:
+            case 0x74:
+            case 0x75:
+            case 0x76:
+            case 0x77:
+            case 0x78:
+            case 0x79:
+            case 0x7a:
+            case 0x7b:
+            case 0x7c:
+            case 0x7d:
+            case 0x7e:
+            case 0x7f:
+                _instructionsManager.jcc_rel8(opcode);
+                break;
+
+            case 0x86:  // 	xchg r/m8 , r8
+                _instructionsManager.xchg_rm8_r8(opcode);
+                break;
+
+            case 0x87:  // 	xchg r/m16/32 , r16/32
+                _instructionsManager.xchg_rm16_32_r16_32(opcode);
+                break;
+
+            case 0x8c:  // 	mov r/m16 , sreg
+                _instructionsManager.mov_rm16_sreg(opcode);
+                break;
+
+            case 0x8e:  // 	mov sreg , r/m16
+                _instructionsManager.mov_sreg_rm16(opcode);
+                break;
+
+            case 0x90:  // 	xchg eAX , r16/32
+            case 0x91:
+            case 0x92:
+            case 0x93:
+            case 0x94:
+            case 0x95:
+            case 0x96:
+            case 0x97:
+                _instructionsManager.xchg_eAX_r16_32(opcode);
+                break;
+
+            case 0x9a:  // 	call ptr16:16/32
+                _instructionsManager.call_ptr16_16_32(opcode);
+                break;
+
+            case 0xc2:  // 	ret imm16
+                _instructionsManager.ret_imm16(opcode);
+                break;
+
+            case 0xc3:  // 	ret
+                _instructionsManager.ret(opcode);
+                break;
+
+            case 0xc8:  // 	enter imm16 , imm8
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.enter_imm16_imm8(opcode);
+                break;
+
+            case 0xc9:  // 	leave
+                REQUIRE(HAS_186_INSTRUCTIONS)
+                _instructionsManager.leave(opcode);
+                break;
+
+            case 0xca:  // 	retf imm16
+                _instructionsManager.retf_imm16(opcode);
+                break;
+
+            case 0xcb:  // 	retf
+                _instructionsManager.retf(opcode);
+                break;
+
+            case 0xcd:  // 	int imm8
+                _instructionsManager.int_imm8(opcode);
+                break;
+
+            case 0xcf:  // 	iret
+                _instructionsManager.iret(opcode);
+                break;
+
+            case 0xe4:  // 	in al , imm8
+                _instructionsManager.in_al_imm8(opcode);
+                break;
+
+            case 0xe5:  // 	in eAX , imm8
+                _instructionsManager.in_eAX_imm8(opcode);
+                break;
+
+            case 0xe6:  // 	out imm8 , al
+                _instructionsManager.out_imm8_al(opcode);
+                break;
+
+            case 0xe7:  // 	out imm8 , eAX
+                _instructionsManager.out_imm8_eAX(opcode);
+                break;
+
+            case 0xe8:  // 	call rel16/32
+                _instructionsManager.call_rel16_32(opcode);
+                break;
+
+            case 0xe9:  // 	jmp rel16/32
+                _instructionsManager.jmp_rel16_32(opcode);
+                break;
+
+            case 0xea:  // 	jmp ptr16:16/32
+                _instructionsManager.jmp_ptr16_16_32(opcode);
+                break;
+
+            case 0xeb:  // 	jmp rel8
+                _instructionsManager.jmp_rel8(opcode);
+                break;
+
+            case 0xec:  // 	in al , dx
+                _instructionsManager.in_al_dx(opcode);
+                break;
+
+            case 0xed:  // 	in eAX , dx
+                _instructionsManager.in_eAX_dx(opcode);
+                break;
+
+            case 0xee:  // 	out dx , al
+                _instructionsManager.out_dx_al(opcode);
+                break;
+
+            case 0xef:  // 	out dx , eAX
+                _instructionsManager.out_dx_eAX(opcode);
+                break;
+
+            case 0xf4:
+                _instructionsManager.halt(opcode);
+                break;
+
+            case 0xfa:  // 	cli
+                _instructionsManager.cli(opcode);
+                break;
+
+            case 0xfb:  // 	sti
+                _instructionsManager.sti(opcode);
+                break;
+
+            default:
+                invalidOpcode(opcode);
+                break;
+        }
+
+        if (locked)
+            endLocked();
+
+        complete(opcode);
+    }
+
+    template<typename Model, typename Hooks>
+    bool Core<Model, Hooks>::executeFused(Opcode &first, Opcode &second) {
+        // the retire hook sees every instruction on its own
+        if constexpr (Hooks::RETIRE)
+            return false;
+
+        bool fused;
+
+        switch (first.instruction) {
+            case 0x50:  // 	push r16/32, push imm16/32, push imm8 and a pop
+            case 0x51:
+            case 0x52:
+            case 0x53:
+            case 0x54:
+            case 0x55:
+            case 0x56:
+            case 0x57:
+            case 0x68:
+            case 0x6a:
+                fused = _instructionsManager.push_pop(first, second);
+                break;
+
+            default:    // 	add, or, adc and a jcc
+                fused = _instructionsManager.alu_jcc(first, second);
+                break;
+        }
+
+        if (!fused)
+            return false;
+
+        // the first one neither branches nor has anything due when it retires, EIP is only
+        // written for the second
+        retire();
+        complete(second);
+        return true;
+    }
+
+    template<typename Model, typename Hooks>
+    void Core<Model, Hooks>::complete(Opcode &opcode) {
+        // EIP is written once per instruction
+        if (!opcode.branch)
+            setRegister(EIP, opcode.beginIP + opcode.position);
+        else if constexpr (Hooks::BRANCH)
+            _hooks.branch(*this, opcode.beginIP, getRegister(EIP));
+
+        if constexpr (Hooks::RETIRE)
+            _hooks.retire(*this, opcode);
+
+        retire();
+    }
+
+}
+
+#undef REQUIRE
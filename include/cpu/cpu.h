@@ -1,12 +1,18 @@
 #pragma once
 
 #include "memory/memory.h"
+#include "memory/mmu.h"
+#include "devices/iobus.h"
+#include "cpu/scheduler.h"
+#include "cpu/decodecache.h"
 #include "io/Logger.h"
 
 #include <cstdint>
-#include <vector>
+#include <cstring>
+#include <csetjmp>
+#include <memory>
 
-#define OP_CHECK_PREFIX(VEC, PRE) std::count(VEC.begin(), VEC.end(), PRE)
+#define OP_CHECK_PREFIX(SET, PRE) ((SET).has(PRE))
 
 namespace x86e::cpu {
     typedef uint32_t RegisterValue;
@@ -49,6 +55,15 @@ namespace x86e::cpu {
         FS,
         GS,
         SS,
+
+        CR0,
+        CR2,
+        CR3,
+        CR4,
+
+        // selectors of the LDT and the TSS
+        LDTR,
+        TR,
     };
 
     enum Flags {
@@ -70,17 +85,76 @@ namespace x86e::cpu {
         VM = 17,
     };
 
-    struct Opcode {
-        std::vector<uint8_t> prefixes;
+    enum ControlRegisterBits {
+        CR0_PE = 1 << 0,
+        CR0_PG = 1u << 31,
 
-        uint32_t beginIP;
+        CR4_PGE = 1 << 7,
+    };
 
-        uint8_t instruction;
+    // exception vectors
+    enum Exceptions {
+        EXCEPTION_DE = 0,       // divide error
+        EXCEPTION_UD = 6,       // invalid opcode
+        EXCEPTION_DF = 8,       // double fault
+        EXCEPTION_TS = 10,      // invalid TSS
+        EXCEPTION_NP = 11,      // segment not present
+        EXCEPTION_SS = 12,      // stack fault
+        EXCEPTION_GP = 13,      // general protection
+        EXCEPTION_PF = 14,      // page fault
+    };
 
-        uint8_t mod_or_index;
-        uint8_t rm_or_ss;
-        uint8_t modrm_or_sib_value;
+    // IDT gate types
+    enum GateTypes {
+        GATE_TASK = 0x5,
+        GATE_INTERRUPT16 = 0x6,
+        GATE_TRAP16 = 0x7,
+        GATE_INTERRUPT32 = 0xe,
+        GATE_TRAP32 = 0xf,
+    };
+
+    // types of the descriptors LLDT and LTR load
+    enum SystemSegmentTypes {
+        SYSTEM_TSS16 = 0x1,
+        SYSTEM_LDT = 0x2,
+        SYSTEM_TSS16_BUSY = 0x3,
+        SYSTEM_TSS32 = 0x9,
+        SYSTEM_TSS32_BUSY = 0xb,
+    };
+
+    struct Fault {
+        uint8_t vector;
+        bool hasErrorCode;
+        uint32_t errorCode;
+
+        bool pending;
+        bool delivering;
+    };
+
+    // access byte of a descriptor in bits 0-7, flags nibble (AVL, L, D/B, G) in bits 8-11
+    enum SegmentAttributes {
+        SEG_ACCESSED   = 1 << 0,
+        SEG_RW         = 1 << 1,
+        SEG_CONFORMING = 1 << 2,
+        SEG_EXECUTABLE = 1 << 3,
+        SEG_CODE_DATA  = 1 << 4,
+        SEG_DPL        = 3 << 5,
+        SEG_PRESENT    = 1 << 7,
+        SEG_DB         = 1 << 10,
+        SEG_GRANULAR   = 1 << 11,
+    };
 
+    // hidden part of a segment register. filled only when the selector is loaded,
+    // so a memory access never has to touch the descriptor tables
+    struct SegmentDescriptor {
+        uint32_t base;
+        uint32_t limit;
+        uint16_t attributes;
+    };
+
+    struct DescriptorTableRegister {
+        uint32_t base;
+        uint16_t limit;
     };
 
     enum InstructionPrefix {
@@ -92,16 +166,113 @@ namespace x86e::cpu {
         GS_OVERRIDE = 0x65,
 
         OPERAND_SIZE = 0x66,
-        ADDRESS_SIZE = 0x67
+        ADDRESS_SIZE = 0x67,
+
+        LOCK = 0xF0,
+        REPNE = 0xF2,
+        REP = 0xF3,
+    };
+
+    // prefixes seen on an instruction, one bit each
+    struct PrefixSet {
+        uint16_t mask = 0;
+
+        static constexpr uint16_t bit(uint8_t prefix) {
+            switch (prefix) {
+                case CS_OVERRIDE:  return 1 << 0;
+                case SS_OVERRIDE:  return 1 << 1;
+                case DS_OVERRIDE:  return 1 << 2;
+                case ES_OVERRIDE:  return 1 << 3;
+                case FS_OVERRIDE:  return 1 << 4;
+                case GS_OVERRIDE:  return 1 << 5;
+                case OPERAND_SIZE: return 1 << 6;
+                case ADDRESS_SIZE: return 1 << 7;
+                case REPNE:        return 1 << 8;
+                case REP:          return 1 << 9;
+                case LOCK:         return 1 << 10;
+                default:           return 0;
+            }
+        }
+
+        inline void add(uint8_t prefix) {
+            mask |= bit(prefix);
+        }
+
+        inline bool has(uint8_t prefix) const {
+            return mask & bit(prefix);
+        }
+    };
+
+    struct Opcode {
+        static constexpr uint8_t MAX_LENGTH = 15;
+
+        // instruction window, loaded once per instruction by CPU::fetchInstruction().
+        // decoding reads from here and only goes back to memory if the instruction
+        // runs past the bytes that could be loaded up front
+        uint8_t bytes[MAX_LENGTH];
+        uint8_t length;
+        uint8_t position;
+
+        PrefixSet prefixes;
+
+        Registers segment = DS;
+        bool segmentOverride = false;
+
+        // set by handlers that load EIP themselves
+        bool branch = false;
+
+        uint32_t beginIP;
+
+        uint8_t instruction;
+
+        uint8_t mod_or_index;
+        uint8_t rm_or_ss;
+        uint8_t modrm_or_sib_value;
+
+    };
+
+    struct CPUStatistics {
+        uint64_t exceptions;
+        uint64_t pageFaults;
+    };
+
+    // everything the CPU itself holds, see CPU::saveState()
+    struct CPUState {
+        Fault fault;
+
+        uint64_t instructions;
+        uint64_t pendingInterrupts[4];
+        uint32_t registers[64];
+        _1bit flags[64];
+
+        SegmentDescriptor segments[6];
+        DescriptorTableRegister gdtr;
+        DescriptorTableRegister idtr;
+        SegmentDescriptor ldt;
+        SegmentDescriptor tss;
+
+        Scheduler scheduler;
+        bool halted;
+    };
+
+    // memory operand of a locked instruction, see CPU::beginLocked()
+    struct LockedAccess {
+        bool active;
+        bool busLocked;
+
+        uint32_t linear;
+        uint8_t* host;      // nullptr until the operand has been read atomically
+        uint32_t value;     // what was read from host
     };
 
     class CPU {
     public:
-        CPU(uint64_t memory);
+        CPU(uint64_t memory, bool hugePages = false);
+        // shares memory and devices with other CPUs, for SMP machines
+        CPU(x86e::memory::Memory& memory, x86e::devices::IOBus& ioBus);
         ~CPU();
 
-        virtual void          reset();
-        virtual void          cycle();
+        void reset();
 
         void setRegister(Registers reg, RegisterValue value);
         RegisterValue getRegister(Registers reg);
@@ -109,41 +280,315 @@ namespace x86e::cpu {
         void setFlag(Flags flag, _1bit value);
         _1bit getFlag(Flags flag);
 
-        void parseModRM(Opcode& opcode, uint64_t address);
+        // loads the instruction at CS:EIP into the opcode window
+        void fetchInstruction(Opcode& opcode);
+
+        // host address of CS:EIP and how many bytes up to the end of its page and of CS are there,
+        // nullptr if it cannot be fetched directly. may raise a page fault
+        const uint8_t* instructionPointer(uint32_t& available);
+
+        inline uint8_t nextImm8(Opcode& opcode) {
+            if (opcode.position < opcode.length) [[likely]]
+                return opcode.bytes[opcode.position++];
+
+            return fetchSlow(opcode);
+        }
+
+        inline uint16_t nextImm16(Opcode& opcode) {
+            if (opcode.position + 2 <= opcode.length) [[likely]] {
+                uint16_t value;
+                std::memcpy(&value, opcode.bytes + opcode.position, 2);
+                opcode.position += 2;
+                return value;
+            }
+
+            uint16_t low = nextImm8(opcode);
+            return low | (nextImm8(opcode) << 8);
+        }
+
+        inline uint32_t nextImm32(Opcode& opcode) {
+            if (opcode.position + 4 <= opcode.length) [[likely]] {
+                uint32_t value;
+                std::memcpy(&value, opcode.bytes + opcode.position, 4);
+                opcode.position += 4;
+                return value;
+            }
+
+            uint32_t low = nextImm16(opcode);
+            return low | (nextImm16(opcode) << 16);
+        }
+
+        void parseModRM(Opcode& opcode);
 
         RegisterValue incGetRegister(Registers reg, uint32_t value);
         RegisterValue incGetRegister(Registers reg);
         RegisterValue decGetRegister(Registers reg);
         RegisterValue decGetRegister(Registers reg, uint32_t value);
         x86e::memory::Memory& getMemory();
+        x86e::memory::MMU& getMMU();
+        x86e::devices::IOBus& getIOBus();
+        Scheduler& getScheduler();
+
+        // snapshots of the CPU. memory and devices are not part of it, and the scheduler
+        // events keep pointing to the devices they were scheduled by. restoring drops the TLB
+        void saveState(CPUState& state);
+        void restoreState(const CPUState& state);
+
+        // execution is tiered while a cache is set, hot blocks run decoded from it. a cache belongs
+        // to a single CPU
+        void setDecodeCache(DecodeCache* cache);
+
+        inline DecodeCache* decodeCache() {
+            return _decodeCache;
+        }
+
+        // Memory::watch() plus a TLB flush, so pages that were already translated are watched too
+        void watchMemory(uint64_t base, uint64_t size, const x86e::memory::MemoryWatchHandler& handler);
+        void unwatchMemory(uint64_t base, uint64_t size);
 
         // side = true ; get from top side
         // side = false ; get from left side
         // http://ref.x86asm.net/coder32.html#modrm_byte_16
         uint32_t ModRMValue16bit(Opcode& opcode, bool side, uint8_t offset=0);
         uint32_t ModRMValue32bit(Opcode& opcode, bool side, uint8_t offset=0);
-        uint32_t sibByte32bit(Opcode& opcode, bool side);
+        // reads the SIB byte and the displacement of a bare base, the caller adds any other displacement
+        uint32_t sibByte32bit(Opcode& opcode);
 
         void halt();
+
+        // halted with no way of being woken up by an interrupt
         bool isHalted();
 
-        void pushOntoStackImm8(uint8_t value);
+        // executed HLT and waits for an interrupt, whether or not one can still come
+        inline bool isSleeping() {
+            return _isHalted;
+        }
+
+        uint32_t getEFLAGS();
+        void setEFLAGS(uint32_t value);
+
+        // hardware interrupt, delivered at the next instruction boundary once IF is set
+        void raiseInterrupt(uint8_t vector);
+        // delivers an interrupt right away through the IVT or the IDT, returnIP is pushed as the return address.
+        // a handler at a more privileged level gets the stack of its level from the TSS. the whole frame is
+        // written before CS:EIP and SS:ESP change, so a fault on the way leaves the CPU as it was. software
+        // is INT n, which may only use gates open to the current privilege level. task switches are not
+        // emulated, task gates fault like gates of an invalid type
+        void interrupt(uint8_t vector, uint32_t returnIP, bool hasErrorCode = false, uint32_t errorCode = 0,
+                       bool software = false);
+
+        // aborts the current instruction and delivers the exception before the next one.
+        // does not return while an instruction is executing, so nothing after a faulting memory
+        // access runs. outside of an instruction (e.g. the embedder poking memory) it only warns
+        void raiseFault(uint8_t vector);
+        void raiseFault(uint8_t vector, uint32_t errorCode);
+        // re-arms delivery after IF has been set
+        void checkInterrupts();
+
+        inline uint64_t instructionsRetired() {
+            return _instructions;
+        }
+
+        CPUStatistics& statistics();
+
+        // called after every instruction. a single compare unless an event or interrupt is due
+        inline void retire() {
+            if (++_instructions >= _scheduler.nextDeadline()) [[unlikely]]
+                serviceEvents();
+        }
+
+        // whether an event or an interrupt falls due within the next count instructions
+        inline bool eventDue(uint32_t count) {
+            return _instructions + count >= _scheduler.nextDeadline();
+        }
+
+        // the B bit of the stack segment selects between SP and ESP
+        inline uint32_t stackMask() {
+            return (_segments[SS - CS].attributes & SEG_DB) ? 0xffffffff : 0xffff;
+        }
+
+        // the D bit of the code segment makes 32 bit operands and addresses the default
+        inline bool codeSize32() {
+            return _segments[0].attributes & SEG_DB;
+        }
+
+        inline uint32_t getStackPointer() {
+            return _registers[ESP] & stackMask();
+        }
+
+        inline void setStackPointer(uint32_t value) {
+            uint32_t mask = stackMask();
+            _registers[ESP] = (_registers[ESP] & ~mask) | (value & mask);
+        }
+
         void pushOntoStackImm16(uint16_t value);
         void pushOntoStackImm32(uint32_t value);
 
-        uint8_t popFromStackImm8();
         uint16_t popFromStackImm16();
         uint32_t popFromStackImm32();
 
-        bool longMode();
+        // reads offset bytes above the top of the stack without popping, for instructions
+        // that may still fault after reading it
+        uint16_t peekStackImm16(uint32_t offset);
+        uint32_t peekStackImm32(uint32_t offset);
+
+        // pushes up to 8 values of width bytes, in the order given. the whole frame is written or, if that
+        // faults, nothing is and SP stays where it was
+        void pushFrame(const uint32_t* values, uint32_t count, uint32_t width);
+
+        // PUSHA/POPA, the whole frame is copied at once when it is on a single page
+        void pushAll(bool operand32);
+        void popAll(bool operand32);
+
+        // ENTER/LEAVE, ESP and EBP only change once all of the frame has been accessed
+        void enterFrame(uint16_t size, uint8_t level, bool operand32);
+        void leaveFrame(bool operand32);
+
+        // far JMP, CALL, RET and IRET. CS:EIP and the stack only change once everything that can fault is
+        // done. returns may go to an outer privilege level, taking its stack from the frame. call gates are
+        // not emulated, a far transfer through one faults like one to any other system descriptor
+        void jumpFar(uint16_t selector, uint32_t offset);
+        void callFar(uint16_t selector, uint32_t offset, uint32_t returnIP, bool operand32);
+        void returnFar(bool operand32, uint16_t release, bool iret);
+
+        bool protectedMode();
+
+        // current privilege level, the RPL of CS in protected mode
+        inline uint8_t cpl() {
+            return (_registers[CR0] & CR0_PE) && !_flags[VM] ? _registers[CS] & 3 : 0;
+        }
+
+        // loads the visible selector and refreshes the cached descriptor
+        void loadSegment(Registers seg, uint16_t selector);
+        SegmentDescriptor& getSegment(Registers seg);
+
+        // LLDT and LTR, with a selector from the GDT. loading a TSS marks it busy
+        void loadLDT(uint16_t selector);
+        void loadTaskRegister(uint16_t selector);
+
+        // CR0/CR3/CR4 writes with their paging side effects
+        void setControlRegister(Registers reg, uint32_t value);
+
+        void loadGDT(uint32_t base, uint16_t limit);
+        void loadIDT(uint32_t base, uint16_t limit);
+        // what SGDT and SIDT store
+        DescriptorTableRegister getGDT();
+        DescriptorTableRegister getIDT();
+
+        // VERR and VERW: whether the segment selector refers to can be read, or written, at the
+        // current privilege level. a selector that is no good gives false rather than a fault
+        bool verifySegment(uint16_t selector, bool write);
+
+        inline uint32_t linearAddress(Registers seg, uint32_t offset, uint32_t size) {
+            SegmentDescriptor& descriptor = _segments[seg - CS];
+
+            // a segment loaded with a null selector is not present and cannot be accessed at all
+            if ((uint64_t) offset + size - 1 > descriptor.limit || !(descriptor.attributes & SEG_PRESENT)) [[unlikely]]
+                segmentLimitViolation(seg, offset);
+
+            return descriptor.base + offset;
+        }
+
+        // segment relative memory access
+        uint8_t readImm8(Registers seg, uint32_t offset);
+        uint16_t readImm16(Registers seg, uint32_t offset);
+        uint32_t readImm32(Registers seg, uint32_t offset);
+        void writeImm8(uint8_t val, Registers seg, uint32_t offset);
+        void writeImm16(uint16_t val, Registers seg, uint32_t offset);
+        void writeImm32(uint32_t val, Registers seg, uint32_t offset);
+
+        // raises the fault a write of size bytes at seg:offset would, without writing anything
+        void probeWrite(Registers seg, uint32_t offset, uint32_t size);
+
+        // instruction stream, CS relative
+        uint8_t fetchImm8(uint32_t offset);
+
+        // LOCK prefixed instructions and XCHG with memory. in between, the memory operand is read
+        // with an atomic load and written back with a compare-and-swap against what was read. if
+        // another CPU changed it in the meantime the instruction is restarted, so handlers must not
+        // change any state before their last memory write. operands that are unaligned, cross a page
+        // or are not RAM take the bus lock instead, which only excludes other locked instructions
+        void beginLocked();
+        void endLocked();
 
     private:
-
-        x86e::memory::Memory _memory;
+        uint8_t fetchSlow(Opcode& opcode);
+        void serviceEvents();
+        bool hasPendingInterrupt();
+
+        // SS relative accesses, through the MMU stack page when possible
+        template<typename T>
+        void stackWrite(uint32_t offset, T value);
+        template<typename T>
+        T stackRead(uint32_t offset);
+        void stackWriteBlock(uint32_t offset, const uint8_t* data, uint32_t size);
+        void stackReadBlock(uint32_t offset, uint8_t* data, uint32_t size);
+
+        template<typename T>
+        T lockedRead(uint32_t linear);
+        template<typename T>
+        void lockedWrite(T value, uint32_t linear);
+
+        // the descriptor selector refers to, checked for loading seg with it at privilege level cpl. raises the
+        // fault loading it would, invalid is the vector for selectors of the wrong type or privilege level
+        SegmentDescriptor readDescriptor(Registers seg, uint16_t selector, uint8_t cpl, uint8_t invalid = EXCEPTION_GP);
+        void commitSegment(Registers seg, uint16_t selector, const SegmentDescriptor& descriptor);
+        // the code segment a far JMP or CALL goes to
+        SegmentDescriptor transferTarget(uint16_t selector, uint32_t offset);
+        // SS:ESP of a more privileged level from the TSS
+        void innerStack(uint8_t level, uint16_t& selector, uint32_t& esp);
+
+        // writes a block to the stack segment described by stack, wrapping around at its B bit. the limit is
+        // checked and every page translated before anything is written, with the permissions of user
+        void writeStack(const SegmentDescriptor& stack, uint32_t offset, const uint8_t* data, uint32_t size, bool user,
+                        uint32_t errorCode);
+
+        void segmentLimitViolation(Registers seg, uint32_t offset);
+        static void pageFault(void* context, uint32_t address, uint32_t errorCode);
+        void fault(uint8_t vector, bool hasErrorCode, uint32_t errorCode);
+
+        Fault _fault;
+        CPUStatistics _statistics;
+
+        // set when the CPU has memory and devices of its own
+        std::unique_ptr<x86e::memory::Memory> _ownMemory;
+        std::unique_ptr<x86e::devices::IOBus> _ownIOBus;
+
+        x86e::memory::Memory& _memory;
+        x86e::memory::MMU _mmu;
+        x86e::devices::IOBus& _ioBus;
+        LockedAccess _locked;
+        Scheduler _scheduler;
+        DecodeCache* _decodeCache;
+
+        uint64_t _instructions;
+        uint64_t _pendingInterrupts[4];
         uint32_t _registers[64];
         _1bit _flags[64];
 
+        SegmentDescriptor _segments[6];
+        DescriptorTableRegister _gdtr;
+        DescriptorTableRegister _idtr;
+        SegmentDescriptor _ldt;
+        SegmentDescriptor _tss;
+
     protected:
+        // wakes up a halted CPU if an interrupt can arrive, skipping ahead in virtual time
+        bool wakeUp();
+
+        // delivers the exception recorded by raiseFault(). EIP is only committed once an instruction
+        // completes, so it still points to the one that faulted
+        void deliverFault();
+
+        inline const Fault& pendingFault() {
+            return _fault;
+        }
+
+        // the run loop arms this with setjmp once per slice, a fault longjmps back to it.
+        // instruction handlers must not keep objects with destructors alive across memory accesses
+        std::jmp_buf _faultJump;
+        bool _faultArmed;
+
         bool _isHalted;
 
     };
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "memory/memory.h"
+
+namespace x86e::cpu {
+    // front end of one instruction: what the prefix loop found and where the handler starts
+    struct DecodedInstruction {
+        static constexpr uint8_t SEGMENT_OVERRIDE = 1 << 0;
+        static constexpr uint8_t FUSED = 1 << 1;          // runs together with the next one, see FusedPair
+        static constexpr uint8_t HEAD_SIZE = 4;
+
+        uint8_t head[HEAD_SIZE];    // prefix and opcode bytes, compared before every use
+        uint16_t prefixes;
+        uint16_t offset;            // from the start of the block
+        uint8_t instruction;
+        uint8_t start;              // bytes taken by the prefixes and the opcode
+        uint8_t segment;
+        uint8_t flags;
+    };
+
+    // straight line run of instructions within one page of RAM, keyed by its physical address
+    struct DecodedBlock {
+        static constexpr uint32_t MAX_INSTRUCTIONS = 16;
+
+        uint32_t physical;
+        uint8_t mode;               // MODE_VALID plus MODE_32BIT for a 32 bit code segment
+        uint8_t count;
+        uint16_t uses;              // hits, halved whenever another block wants its place
+
+        DecodedInstruction instructions[MAX_INSTRUCTIONS];
+    };
+
+    // pairs of instructions that run as one in tier 1, through a handler of their own that does the
+    // work of both (see i386_InstructionsManager::alu_jcc() and push_pop()). forms it does not cover,
+    // like an ALU operand in memory, run one instruction at a time. flags stay architecturally
+    // visible after the pair, so they are still written
+    enum FusedPair : uint32_t {
+        FUSE_ALU_JCC = 1 << 0,      // ADD, OR or ADC followed by a conditional jump
+        FUSE_PUSH_POP = 1 << 1,     // PUSH followed by POP, a register copied through the stack
+
+        FUSE_NONE = 0,
+        FUSE_ALL = FUSE_ALU_JCC | FUSE_PUSH_POP,
+    };
+
+    // code starts out interpreted one instruction at a time (tier 0). a block that has been run
+    // threshold times from there is decoded and runs from the cache from then on (tier 1)
+    struct TierSettings {
+        uint32_t threshold = 8;
+        uint64_t budget = 4 * 1024 * 1024;      // bytes of decoded blocks
+        uint32_t fusion = FUSE_ALL;             // FusedPair kinds
+    };
+
+    struct DecodeCacheStatistics {
+        uint64_t hits;          // blocks found decoded
+        uint64_t misses;        // blocks that were not, whether they were decoded or interpreted
+        uint64_t promotions;    // blocks decoded, moving them up to tier 1
+        uint64_t evictions;     // decoded blocks dropped for a hotter one
+        uint64_t loadedPages;   // code pages whose blocks came from the file
+
+        uint64_t interpreted;   // instructions run in tier 0
+        uint64_t predecoded;    // instructions run in tier 1
+        uint64_t fused;         // pairs run as one, counted once
+    };
+
+    // decoded blocks of one CPU. a block is only decoded once it is hot, and it is kept in a direct
+    // mapped table sized by the budget, where it only gives way to a block that is used more.
+    // the blocks can be saved to a file, keyed by a hash of the contents their code page had when it
+    // was first executed, so the next run of the same code starts from decoded blocks wherever that
+    // code is loaded. the file is mmap'ed, a page's blocks are only taken from it when the page is
+    // first executed and its hash matches. the prefix and opcode bytes of every instruction are
+    // compared before it is executed, so modified code is never run from a stale decode, it just misses
+    class DecodeCache {
+    public:
+        static constexpr uint8_t MODE_VALID = 1 << 0;
+        static constexpr uint8_t MODE_32BIT = 1 << 1;
+
+        // tier 0 runs counted per block
+        static constexpr uint32_t COUNTERS = 4096;
+
+        // model is stored in the file, decodes of another CPU model are not used
+        DecodeCache(memory::Memory& memory, const char* model, const TierSettings& settings = TierSettings());
+        ~DecodeCache();
+
+        // maps a cache file written by save(). a missing file is not an error, it is created by save()
+        bool open(const std::string& path);
+        // writes every block whose code is still in place, along with the pages of the old
+        // file that were not executed this time
+        bool save();
+
+        // block starting at host for a code segment of mode. nullptr if it is to be interpreted,
+        // a block without instructions if it has to be decoded while it runs
+        inline DecodedBlock* lookup(const uint8_t* host, uint8_t mode) {
+            uint64_t physical = host - _ram;
+
+            if (physical >= _size)
+                return nullptr;
+
+            DecodedBlock& block = _blocks[index(physical)];
+
+            if (block.physical == physical && block.mode == mode && block.count) [[likely]] {
+                ++_statistics.hits;
+
+                if (block.uses != UINT16_MAX)
+                    ++block.uses;
+
+                return &block;
+            }
+
+            return miss(physical, mode);
+        }
+
+        DecodeCacheStatistics& statistics();
+
+        // the FusedPair of two instructions, 0 if they are not one. an opcode of the 0Fh map is 0x100
+        // plus its second byte
+        static uint32_t pairOf(uint16_t first, uint16_t second);
+        // the opcode of a decoded instruction as pairOf() takes it, 0xffff if its second byte is not known
+        static uint16_t opcodeOf(const DecodedInstruction& instruction);
+
+        // marks first if it makes one of the enabled pairs with second, which directly follows it
+        void fuse(DecodedInstruction& first, const DecodedInstruction& second);
+
+    private:
+        struct FileHeader {
+            static constexpr uint32_t MAGIC = 0x64363878;  // "x86d"
+            // bumped whenever the decoder or the layout changes
+            static constexpr uint32_t FORMAT_VERSION = 1;
+
+            uint32_t magic;
+            uint32_t version;
+            char model[16];
+            uint32_t blockSize;
+            uint32_t pages;
+            uint32_t blocks;
+            uint32_t reserved;
+        };
+
+        // the blocks of one code page, offsets in their physical field
+        struct PageRecord {
+            uint64_t hash;
+            uint32_t first;
+            uint32_t count;
+        };
+
+        struct Counter {
+            uint32_t physical;
+            uint32_t runs;
+        };
+
+        inline uint32_t index(uint64_t physical) {
+            return (physical ^ (physical >> 14)) & _mask;
+        }
+
+        static uint64_t hashPage(const uint8_t* page);
+
+        DecodedBlock* miss(uint64_t physical, uint8_t mode);
+        bool hot(uint64_t physical);
+        // whether block may take the place of what is in slot, ages what is there if not
+        bool claim(DecodedBlock& slot, const DecodedBlock& block);
+        void loadPage(uint64_t page, uint64_t hash);
+        void unmap();
+
+        uint8_t* _ram;
+        uint64_t _size;
+        std::string _model;
+
+        TierSettings _settings;
+        std::vector<DecodedBlock> _blocks;
+        uint32_t _mask;
+        std::vector<Counter> _counters;
+        DecodeCacheStatistics _statistics;
+
+        // code pages run so far, hashed when they were first executed
+        std::unordered_map<uint64_t, uint64_t> _pageHashes;
+
+        // the mapped file
+        std::string _path;
+        const uint8_t* _file;
+        uint64_t _fileSize;
+        const PageRecord* _pages;
+        const DecodedBlock* _fileBlocks;
+        uint32_t _pageCount;
+
+    };
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+
+namespace x86e::cpu {
+    class CPU;
+    struct Opcode;
+
+    // compile time hooks for Core. every call is guarded by its constant, so a policy
+    // that leaves them false compiles to the same code as a core without hooks.
+    // derive from NoHooks and enable what you need, then instantiate Core through
+    // cpu/core_impl.h:
+    //
+    //     struct Coverage : cpu::NoHooks {
+    //         static constexpr bool BRANCH = true;
+    //         void branch(cpu::CPU& cpu, uint32_t from, uint32_t to) { ... }
+    //     };
+    //
+    // memory and port accesses are watched at runtime instead, see Memory::watch()
+    // and IOBus::watchPorts()
+    struct NoHooks {
+        static constexpr bool RETIRE = false;
+        static constexpr bool BRANCH = false;
+        static constexpr bool EXCEPTION = false;
+
+        // after an instruction completed, EIP already points to the next one
+        inline void retire(CPU& cpu, Opcode& opcode) {}
+
+        // control transfer made by an instruction (jumps, calls, returns, INT, IRET)
+        inline void branch(CPU& cpu, uint32_t from, uint32_t to) {}
+
+        // a faulting instruction was aborted, called before the exception is delivered
+        inline void exception(CPU& cpu, uint8_t vector) {}
+    };
+
+}
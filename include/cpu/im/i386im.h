@@ -1,14 +1,19 @@
 #pragma once
 
 #include "cpu/im/x86im.h"
+#include "cpu/model.h"
 #include "utils/utils.h"
 
 namespace x86e::im {
 
     // all instruction from 8086 till i386 intel CPUs
 
+    template<typename Model>
     class i386_InstructionsManager : public InstructionsManager {
     public:
+        // largest part of a REP INS/OUTS run handed to a device in one call
+        static constexpr uint32_t STRING_IO_CHUNK = 4096;
+
         i386_InstructionsManager(cpu::CPU* cpu);
         ~i386_InstructionsManager();
 
@@ -36,7 +41,103 @@ namespace x86e::im {
         ADD_INSTRUCTION(adc_eAX_imm16_32);
         ADD_INSTRUCTION(push_ss);
         ADD_INSTRUCTION(pop_ss);
+        ADD_INSTRUCTION(mov_rm16_sreg);
+        ADD_INSTRUCTION(mov_sreg_rm16);
+        ADD_INSTRUCTION(lgdt_lidt_m16_32);
+        ADD_INSTRUCTION(mov_r32_cr);
+        ADD_INSTRUCTION(mov_cr_r32);
+        ADD_INSTRUCTION(sldt_str_lldt_ltr_rm16);
+        ADD_INSTRUCTION(in_al_imm8);
+        ADD_INSTRUCTION(in_eAX_imm8);
+        ADD_INSTRUCTION(out_imm8_al);
+        ADD_INSTRUCTION(out_imm8_eAX);
+        ADD_INSTRUCTION(in_al_dx);
+        ADD_INSTRUCTION(in_eAX_dx);
+        ADD_INSTRUCTION(out_dx_al);
+        ADD_INSTRUCTION(out_dx_eAX);
+        ADD_INSTRUCTION(ins_m8_dx);
+        ADD_INSTRUCTION(ins_m16_32_dx);
+        ADD_INSTRUCTION(outs_dx_m8);
+        ADD_INSTRUCTION(outs_dx_m16_32);
+        ADD_INSTRUCTION(int_imm8);
+        ADD_INSTRUCTION(iret);
+        ADD_INSTRUCTION(cli);
+        ADD_INSTRUCTION(sti);
+        ADD_INSTRUCTION(push_r16_32);
+        ADD_INSTRUCTION(pop_r16_32);
+        ADD_INSTRUCTION(pusha);
+        ADD_INSTRUCTION(popa);
+        ADD_INSTRUCTION(push_imm16_32);
+        ADD_INSTRUCTION(push_imm8);
+        ADD_INSTRUCTION(call_rel16_32);
+        ADD_INSTRUCTION(call_ptr16_16_32);
+        ADD_INSTRUCTION(ret_imm16);
+        ADD_INSTRUCTION(ret);
+        ADD_INSTRUCTION(retf_imm16);
+        ADD_INSTRUCTION(retf);
+        ADD_INSTRUCTION(enter_imm16_imm8);
+        ADD_INSTRUCTION(leave);
+        ADD_INSTRUCTION(jmp_rel8);
+        ADD_INSTRUCTION(jmp_rel16_32);
+        ADD_INSTRUCTION(jmp_ptr16_16_32);
+        ADD_INSTRUCTION(jcc_rel8);
+        ADD_INSTRUCTION(jcc_rel16_32);
+        ADD_INSTRUCTION(xchg_rm8_r8);
+        ADD_INSTRUCTION(xchg_rm16_32_r16_32);
+        ADD_INSTRUCTION(xchg_eAX_r16_32);
+
+        // pairs tier 1 runs as one, see cpu::FusedPair. EIP is left to the core for both of them.
+        // false before anything is done when the pair is not one of the forms they cover, the
+        // instructions then run one at a time
+
+        // ADD, OR or ADC between registers or into the accumulator, then Jcc. the condition is
+        // evaluated from the result, the flags are only written for whoever reads them later
+        bool alu_jcc(cpu::Opcode& alu, cpu::Opcode& jcc);
+        // PUSH followed by POP of the same size: one stack write and a register move, ESP ends
+        // up where it was unless it is the register popped
+        bool push_pop(cpu::Opcode& push, cpu::Opcode& pop);
+
+    private:
+        // operand and address size, always 16 bit before the 386
+        inline bool operand32bit(cpu::Opcode& opcode) {
+            if constexpr (cpu::HAS_32BIT<Model>)
+                return OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE);
+            else
+                return false;
+        }
+
+        inline bool address32bit(cpu::Opcode& opcode) {
+            if constexpr (cpu::HAS_32BIT<Model>)
+                return OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE);
+            else
+                return false;
+        }
+
+        inline bool protectedMode() {
+            if constexpr (cpu::HAS_PROTECTED_MODE<Model>)
+                return _cpu->protectedMode();
+            else
+                return false;
+        }
+
+        // INS/OUTS, a REP run is passed to the device in chunks of STRING_IO_CHUNK bytes
+        void stringIO(cpu::Opcode& opcode, uint8_t size, bool input);
+
+        // condition encoded in the low nibble of Jcc/SETcc/CMOVcc
+        bool condition(uint8_t code);
+        static bool condition(uint8_t code, bool cf, bool pf, bool zf, bool sf, bool of);
+
+        // jumps relative to the next instruction, IP wraps at 64K with 16 bit operands
+        void jumpRelative(cpu::Opcode& opcode, int32_t displacement);
+
+        // near and far returns, release is the number of bytes dropped from the stack afterwards
+        void returnNear(cpu::Opcode& opcode, uint16_t release);
+        void returnFar(cpu::Opcode& opcode, uint16_t release);
 
     };
 
+    extern template class i386_InstructionsManager<cpu::Model8086>;
+    extern template class i386_InstructionsManager<cpu::Model286>;
+    extern template class i386_InstructionsManager<cpu::Model386>;
+
 }
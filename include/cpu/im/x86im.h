@@ -2,8 +2,9 @@
 
 #include "cpu/cpu.h"
 
-#define REF_INSTRUCTION(CLASS, NAME) void CLASS::NAME(cpu::Opcode& opcode)
-#define ADD_INSTRUCTION(NAME) virtual void NAME(cpu::Opcode& opcode)
+// instruction managers are templates over the CPU model (see cpu/model.h)
+#define REF_INSTRUCTION(CLASS, NAME) template<typename Model> void CLASS<Model>::NAME(cpu::Opcode& opcode)
+#define ADD_INSTRUCTION(NAME) void NAME(cpu::Opcode& opcode)
 
 // x86 instruction manager
 
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "cpu/core.h"
+
+namespace x86e::cpu {
+    // several cores of one model sharing memory and devices, each running on a host thread of its own.
+    // there is no local APIC, guests use a small controller on ports IPI_PORT to IPI_PORT + 2 instead:
+    //   IPI_PORT      read, index of the CPU doing the read
+    //   IPI_PORT + 1  read, number of CPUs
+    //   IPI_PORT + 2  16 bit write, interrupt vector in the low byte, target CPU in the high byte
+    //                 or ALL_OTHERS
+    // every CPU starts at the reset vector, the guest tells them apart by their index
+    template<typename Model>
+    class Machine {
+    public:
+        static constexpr uint16_t IPI_PORT = 0xb0;
+        static constexpr uint8_t ALL_OTHERS = 0xff;
+
+        // instructions a CPU runs between two looks at its mailbox
+        static constexpr uint64_t SLICE = 10000;
+
+        Machine(uint32_t memory, uint32_t cpus, bool hugePages = false);
+        ~Machine();
+
+        void reset();
+
+        uint32_t cpus();
+        Core<Model>& cpu(uint32_t index);
+        memory::Memory& getMemory();
+        devices::IOBus& getIOBus();
+
+        // lock-free, from any thread. the interrupt is raised on the target before its next slice
+        void sendIPI(uint32_t target, uint8_t vector);
+
+        // runs until every CPU is halted with nothing left that could wake it up, or stop() is called
+        void run();
+        void stop();
+
+    private:
+        struct VCPU {
+            std::unique_ptr<Core<Model>> core;
+
+            std::atomic<uint64_t> mailbox[4];   // pending IPI vectors, one bit each
+            std::atomic<uint32_t> signal;       // bumped on every IPI, halted CPUs wait on it
+        };
+
+        static uint32_t read(void* context, uint16_t port, uint8_t size);
+        static void write(void* context, uint16_t port, uint32_t value, uint8_t size);
+
+        void runCPU(uint32_t index);
+        void drainMailbox(VCPU& vcpu);
+        bool mailboxesEmpty();
+
+        memory::Memory _memory;
+        devices::IOBus _ioBus;
+
+        // not movable because of the atomics
+        std::vector<std::unique_ptr<VCPU>> _cpus;
+
+        std::atomic<bool> _stop;
+        std::atomic<uint32_t> _idle;
+
+    };
+
+    extern template class Machine<Model8086>;
+    extern template class Machine<Model286>;
+    extern template class Machine<Model386>;
+
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+
+namespace x86e::cpu {
+    enum Generation {
+        GEN_8086,
+        GEN_80186,
+        GEN_80286,
+        GEN_80386,
+    };
+
+    // CPU models are compile time policies. the core and the instruction manager are
+    // instantiated once per model, so every feature check on the instruction path
+    // is an if constexpr on one of these constants
+
+    struct Model8086 {
+        static constexpr const char* NAME = "8086";
+        static constexpr Generation GENERATION = GEN_8086;
+    };
+
+    struct Model286 {
+        static constexpr const char* NAME = "286";
+        static constexpr Generation GENERATION = GEN_80286;
+    };
+
+    struct Model386 {
+        static constexpr const char* NAME = "386";
+        static constexpr Generation GENERATION = GEN_80386;
+    };
+
+    // PUSHA/POPA, ENTER/LEAVE, PUSH imm, INS/OUTS
+    template<typename Model>
+    constexpr bool HAS_186_INSTRUCTIONS = Model::GENERATION >= GEN_80186;
+
+    // protected mode, descriptor tables and the 0x0f opcode space
+    template<typename Model>
+    constexpr bool HAS_PROTECTED_MODE = Model::GENERATION >= GEN_80286;
+
+    // 32 bit operands and addressing, FS/GS, control registers
+    template<typename Model>
+    constexpr bool HAS_32BIT = Model::GENERATION >= GEN_80386;
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "cpu/core.h"
+
+namespace x86e::cpu {
+    // counts which instruction follows which, to see what is worth fusing in a workload (see FusedPair).
+    // a pair is only counted when the second instruction is the one that directly follows the first in
+    // memory, not when the first one jumped or an interrupt came in between. opcodes are keyed like
+    // DecodeCache::pairOf() takes them
+    struct PairProfile : NoHooks {
+        static constexpr bool RETIRE = true;
+        static constexpr uint32_t OPCODES = 0x200;
+        static constexpr uint16_t NONE = 0xffff;
+
+        std::vector<uint64_t> counts = std::vector<uint64_t>(OPCODES * OPCODES);
+        uint64_t instructions = 0;
+
+        uint16_t previous = NONE;
+        uint32_t next = 0;
+
+        inline void retire(CPU& cpu, Opcode& opcode) {
+            uint16_t current = opcode.instruction;
+
+            // the byte after 0Fh, the prefixes are never 0Fh themselves
+            if (current == 0x0f) {
+                uint8_t i = 0;
+                while (i + 2 < opcode.length && opcode.bytes[i] != 0x0f)
+                    i++;
+
+                current = 0x100 | opcode.bytes[i + 1];
+            }
+
+            if (previous != NONE && opcode.beginIP == next)
+                counts[previous * OPCODES + current]++;
+
+            // EIP already holds the target of a taken branch, which is no sequential pair
+            previous = opcode.branch ? NONE : current;
+            next = opcode.beginIP + opcode.position;
+            instructions++;
+        }
+
+        // the most frequent pairs, and how many of them the fusion settings cover
+        void report(FILE* out, uint32_t fusion, uint32_t top = 20);
+    };
+
+    extern template class Core<Model386, PairProfile>;
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace x86e::cpu {
+    typedef void (*EventCallback)(void* context, uint64_t now);
+
+    struct Event {
+        uint64_t deadline;
+        uint32_t id;
+
+        EventCallback callback;
+        void* context;
+
+        bool observer;
+    };
+
+    // virtual time is the number of retired instructions. devices schedule callbacks
+    // for a point in the future instead of being polled, and the CPU only compares
+    // its instruction counter against nextDeadline() after every instruction
+    class Scheduler {
+    public:
+        static constexpr uint64_t NEVER = UINT64_MAX;
+
+        // rate of the virtual clock, used by devices to convert their own time base
+        static constexpr uint64_t INSTRUCTIONS_PER_SECOND = 100000000;
+
+        Scheduler();
+        ~Scheduler();
+
+        void reset();
+
+        // returns an id that can be passed to cancel()
+        uint32_t schedule(uint64_t deadline, EventCallback callback, void* context);
+        // an event of something that only watches the guest, like the stats publisher. it runs
+        // like any other one, but it is not something a halted CPU waits for, so hasEvents()
+        // and earliestEvent() leave it out
+        uint32_t observe(uint64_t deadline, EventCallback callback, void* context);
+        void cancel(uint32_t id);
+
+        // runs every event with deadline <= now
+        void run(uint64_t now);
+
+        // makes the next deadline check fire right away, e.g. for a pending interrupt
+        inline void kick() {
+            _nextDeadline = 0;
+        }
+
+        inline uint64_t nextDeadline() {
+            return _nextDeadline;
+        }
+
+        // events that can wake up a halted CPU, observers are not counted
+        bool hasEvents();
+        uint64_t earliestEvent();
+
+    private:
+        uint32_t add(const Event& event);
+        void update();
+
+        std::vector<Event> _events;     // min-heap on deadline
+        uint32_t _observers;            // of the events, the ones added by observe()
+        uint64_t _nextDeadline;
+        uint32_t _nextId;
+
+    };
+
+}
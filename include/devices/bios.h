@@ -0,0 +1,108 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include "cpu/cpu.h"
+#include "io/block.h"
+
+namespace x86e::devices {
+    // high level PC BIOS. the IVT points into a small ROM at F000 whose stubs trap to the services
+    // below by writing to a port from TRAP_PORT on, so nothing of a real BIOS is emulated and a boot
+    // sector starts running right after boot(). services are real mode only:
+    //   INT 08h  IRQ 0, counts the ticks in the BIOS data area
+    //   INT 10h  teletype output to the text mode screen and the teletype handler, cursor, video mode
+    //   INT 11h  equipment list
+    //   INT 12h  conventional memory size
+    //   INT 13h  disk reads and writes, CHS and LBA (AH=42h/43h)
+    //   INT 16h  keyboard, keys come from pushKey()
+    //   INT 1Ah  tick count and the host's clock
+    // every other vector returns right away
+    class BIOS {
+    public:
+        static constexpr uint16_t TRAP_PORT = 0xe0;
+
+        static constexpr uint32_t ROM_BASE = 0xfe000;
+        static constexpr uint32_t ROM_SIZE = 0x1000;
+        static constexpr uint16_t ROM_SEGMENT = 0xf000;
+        static constexpr uint32_t BOOT_ADDRESS = 0x7c00;
+
+        // gets every character written through INT 10h
+        struct TeletypeHandler {
+            void* context;
+            void (*write)(void* context, uint8_t character);
+        };
+
+        BIOS(cpu::CPU& cpu);
+        ~BIOS();
+
+        // the boot drive. up to 1.44 MB it is a floppy (drive 00h), a hard disk (80h) otherwise
+        void attachDisk(io::BlockBackend* disk);
+
+        // stdout unless set
+        void setTeletype(const TeletypeHandler& handler);
+
+        // scan code in the high byte, ASCII in the low one
+        void pushKey(uint16_t key);
+
+        // fills the IVT and the BIOS data area, starts the timer and loads the boot sector
+        // to 0000:7C00 with DL set to the boot drive. false if there is no disk to boot from
+        bool boot();
+
+    private:
+        enum Service {
+            SERVICE_TIMER,
+            SERVICE_VIDEO,
+            SERVICE_EQUIPMENT,
+            SERVICE_MEMORY,
+            SERVICE_DISK,
+            SERVICE_KEYBOARD,
+            SERVICE_CLOCK,
+            SERVICES
+        };
+
+        struct Geometry {
+            uint32_t cylinders;
+            uint32_t heads;
+            uint32_t sectors;
+        };
+
+        static uint32_t read(void* context, uint16_t port, uint8_t size);
+        static void trap(void* context, uint16_t port, uint32_t value, uint8_t size);
+        static void writeStdout(void* context, uint8_t character);
+
+        void buildROM();
+
+        void timer();
+        void video();
+        void disk();
+        void keyboard();
+        void clock();
+
+        // characters also go to the text mode screen while one is set
+        void teletype(uint8_t character);
+        bool textMode();
+        void clearScreen();
+        // transfers count sectors between lba and a linear address, returns the BIOS status in AH
+        uint8_t transferSectors(uint64_t lba, uint32_t count, uint32_t address, bool write);
+        bool floppy();
+
+        // sets AH and CF the way INT 13h reports a status
+        void diskStatus(uint8_t status);
+
+        uint32_t linear(cpu::Registers segment, uint16_t offset);
+
+        cpu::CPU& _cpu;
+
+        io::BlockBackend* _disk;
+        Geometry _geometry;
+        uint8_t _drive;
+
+        TeletypeHandler _teletype;
+        std::deque<uint16_t> _keys;
+
+        uint8_t _rom[ROM_SIZE];
+        uint16_t _entries[SERVICES];   // offset of every service stub in the F000 segment
+
+    };
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include "cpu/cpu.h"
+#include "io/block.h"
+
+namespace x86e::devices {
+    // a paravirtual disk controller that queues requests to BlockWorkers, so the CPU keeps running
+    // while the host does the I/O. requests are descriptors in guest memory:
+    //   +0   uint8   command, COMMAND_*
+    //   +1   uint8   status, STATUS_PENDING until the request completes
+    //   +2   uint16  sectors
+    //   +4   uint32  physical address of the buffer
+    //   +8   uint64  first sector
+    // ports from PORT on:
+    //   PORT      32 bit write, submits the descriptor at that physical address
+    //             32 bit read, the next completed descriptor, 0 if there is none
+    //   PORT + 4  read, capacity in sectors, low 32 bits
+    //   PORT + 8  read, requests in flight
+    // every completion raises the interrupt vector. read data is copied into the guest when the
+    // request completes and write data when it is submitted, both on the CPU thread
+    class BlockDevice {
+    public:
+        static constexpr uint16_t PORT = 0x1e0;
+
+        // IRQ 14 as the BIOS programs it
+        static constexpr uint8_t VECTOR = 0x76;
+
+        static constexpr uint8_t COMMAND_READ = 1;
+        static constexpr uint8_t COMMAND_WRITE = 2;
+        static constexpr uint8_t COMMAND_FLUSH = 3;
+
+        static constexpr uint8_t STATUS_OK = 0;
+        static constexpr uint8_t STATUS_ERROR = 1;
+        static constexpr uint8_t STATUS_PENDING = 0xff;
+
+        // how often completions are looked for while requests are in flight, in virtual time
+        static constexpr uint64_t POLL_INTERVAL = cpu::Scheduler::INSTRUCTIONS_PER_SECOND / 10000;
+
+        BlockDevice(cpu::CPU& cpu, io::BlockBackend& backend, io::BlockWorkers& workers);
+        // waits for the requests in flight
+        ~BlockDevice();
+
+    private:
+        struct Request {
+            io::BlockRequest block;     // its context is the request
+            BlockDevice* device;
+            uint32_t descriptor;
+            uint32_t buffer;
+        };
+
+        static uint32_t read(void* context, uint16_t port, uint8_t size);
+        static void write(void* context, uint16_t port, uint32_t value, uint8_t size);
+        static void poll(void* context, uint64_t now);
+        // worker thread
+        static void complete(void* context, io::BlockRequest* request);
+
+        void submit(uint32_t descriptor);
+        void finish(Request* request, uint8_t status);
+
+        cpu::CPU& _cpu;
+        io::BlockBackend& _backend;
+        io::BlockWorkers& _workers;
+
+        uint32_t _inFlight;
+        uint32_t _event;
+        std::deque<uint32_t> _completed;        // descriptors the guest has not picked up yet
+
+        // filled by the workers
+        std::mutex _lock;
+        std::condition_variable _done;
+        std::deque<Request*> _finished;
+
+    };
+
+}
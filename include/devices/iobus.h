@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+
+namespace x86e::devices {
+    // a device's view of the port space. plain function pointers so the dispatch
+    // from IN/OUT is one table load and one indirect call
+    struct PortHandler {
+        void* context;
+
+        uint32_t (*read)(void* context, uint16_t port, uint8_t size);
+        void (*write)(void* context, uint16_t port, uint32_t value, uint8_t size);
+
+        // optional. a whole REP INS/OUTS run is handed over in one call, count elements of size bytes
+        void (*readString)(void* context, uint16_t port, uint8_t size, uint8_t* buffer, uint32_t count);
+        void (*writeString)(void* context, uint16_t port, uint8_t size, const uint8_t* buffer, uint32_t count);
+    };
+
+    // observes port accesses without being the device behind them, value is what was read or written
+    struct PortWatch {
+        void* context;
+
+        void (*access)(void* context, uint16_t port, uint32_t value, uint8_t size, bool write);
+    };
+
+    class IOBus {
+    public:
+        static constexpr uint32_t PORTS = 0x10000;
+        static constexpr uint32_t MAX_HANDLERS = 256;
+        static constexpr uint8_t WATCH_HANDLER = 1;
+
+        IOBus();
+        ~IOBus();
+
+        // returns false if one of the ports is already taken or there are no free handler slots
+        bool registerPorts(uint16_t first, uint32_t count, const PortHandler& handler);
+        void unregisterPorts(uint16_t first, uint32_t count);
+
+        // a watched port is routed through the watch handler, which calls the device and then the watch.
+        // ports that are not watched keep their direct dispatch. one watch per port, watching again replaces it
+        void watchPorts(uint16_t first, uint32_t count, const PortWatch& watch);
+        void unwatchPorts(uint16_t first, uint32_t count);
+
+        inline uint32_t in(uint16_t port, uint8_t size) {
+            if (_shared) [[unlikely]]
+                return inShared(port, size);
+
+            ++_exits;
+            PortHandler& handler = _handlers[_dispatch[port]];
+            return handler.read(handler.context, port, size);
+        }
+
+        inline void out(uint16_t port, uint32_t value, uint8_t size) {
+            if (_shared) [[unlikely]]
+                return outShared(port, value, size);
+
+            ++_exits;
+            PortHandler& handler = _handlers[_dispatch[port]];
+            handler.write(handler.context, port, value, size);
+        }
+
+        void inString(uint16_t port, uint8_t size, uint8_t* buffer, uint32_t count);
+        void outString(uint16_t port, uint8_t size, const uint8_t* buffer, uint32_t count);
+
+        // accesses that left the CPU for a device, a string transfer counts once
+        uint64_t exits();
+
+        // set when several CPUs use the bus from their own threads. accesses are then serialized,
+        // so devices never see two at once
+        void setShared(bool shared);
+
+    private:
+        struct WatchedPort {
+            uint8_t handler;    // where the port would be dispatched to if it was not watched
+            PortWatch watch;
+        };
+
+        uint32_t inShared(uint16_t port, uint8_t size);
+        void outShared(uint16_t port, uint32_t value, uint8_t size);
+
+        static uint32_t watchedRead(void* context, uint16_t port, uint8_t size);
+        static void watchedWrite(void* context, uint16_t port, uint32_t value, uint8_t size);
+
+        // the device behind a port, watched or not
+        inline uint8_t& handlerIndex(uint16_t port) {
+            return _dispatch[port] == WATCH_HANDLER ? _watched[port].handler : _dispatch[port];
+        }
+
+        // index into _handlers for every port. 0 is the unassigned port handler, 1 the watch handler
+        uint8_t _dispatch[PORTS];
+
+        // allocated on the first watch
+        WatchedPort* _watched;
+
+        PortHandler _handlers[MAX_HANDLERS];
+        uint32_t _handlersCount;
+
+        uint64_t _exits;
+
+        bool _shared;
+        std::mutex _lock;
+
+    };
+
+}
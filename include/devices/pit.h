@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include "cpu/cpu.h"
+
+namespace x86e::devices {
+    // 8254 programmable interval timer on ports 0x40-0x43.
+    // channel 0 raises IRQ 0 through scheduler events, nothing is polled. there is no 8259 PIC,
+    // IRQ 0 goes straight to the CPU as the vector the BIOS programs for it. the gate inputs are
+    // not wired, so modes 1 and 5 never start counting, and counts are always binary, BCD mode
+    // is taken as binary
+    class PIT {
+    public:
+        static constexpr uint64_t FREQUENCY = 1193182;
+
+        static constexpr uint8_t IRQ0_VECTOR = 0x08;
+
+        PIT(cpu::CPU& cpu);
+        ~PIT();
+
+        void reset();
+
+    private:
+        struct Channel {
+            uint16_t reload;
+            uint8_t mode;
+            uint8_t access;     // 1 = low byte, 2 = high byte, 3 = low then high
+
+            bool writeHigh;
+            bool readHigh;
+
+            bool latched;
+            uint16_t latch;
+
+            // read-back status, read before a latched count
+            bool statusLatched;
+            uint8_t status;
+            // a control word was written, the count that goes with it was not yet
+            bool nullCount;
+
+            uint64_t start;     // virtual time the count was loaded at
+        };
+
+        static uint32_t read(void* context, uint16_t port, uint8_t size);
+        static void write(void* context, uint16_t port, uint32_t value, uint8_t size);
+        static void tick(void* context, uint64_t now);
+
+        void load(Channel& channel);
+        uint16_t count(Channel& channel);
+        // level of the OUT pin
+        bool output(Channel& channel);
+        uint64_t period(Channel& channel);
+
+        cpu::CPU& _cpu;
+        Channel _channels[3];
+
+        uint32_t _event;
+        uint64_t _deadline;
+
+    };
+
+}
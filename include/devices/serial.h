@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "cpu/cpu.h"
+
+namespace x86e::devices {
+    // 16550 style UART. transmitted bytes are collected and written to the host in one go once
+    // FLUSH_THRESHOLD bytes are waiting or FLUSH_DELAY of virtual time after the first one, so a
+    // guest printing character by character does not cost a write(2) each. input is read from
+    // the host in chunks of up to INPUT_CHUNK bytes, at most once every INPUT_INTERVAL while the
+    // guest is looking for it. there is no FIFO or line control emulation beyond what polling
+    // and interrupt driven drivers check
+    class Serial {
+    public:
+        static constexpr uint16_t COM1 = 0x3f8;
+
+        // IRQ 4 as the BIOS programs it
+        static constexpr uint8_t VECTOR = 0x0c;
+
+        static constexpr uint32_t FLUSH_THRESHOLD = 4096;
+        static constexpr uint64_t FLUSH_DELAY = cpu::Scheduler::INSTRUCTIONS_PER_SECOND / 100;
+
+        static constexpr uint32_t INPUT_CHUNK = 4096;
+        static constexpr uint64_t INPUT_INTERVAL = cpu::Scheduler::INSTRUCTIONS_PER_SECOND / 100;
+
+        // input < 0 for a port that never receives anything. the input is made non-blocking
+        Serial(cpu::CPU& cpu, int output, int input = -1, uint16_t base = COM1);
+        // flushes what is left
+        ~Serial();
+
+        void reset();
+
+        // writes everything that is buffered to the host
+        void flush();
+
+    private:
+        static uint32_t read(void* context, uint16_t port, uint8_t size);
+        static void write(void* context, uint16_t port, uint32_t value, uint8_t size);
+        static void writeString(void* context, uint16_t port, uint8_t size, const uint8_t* buffer, uint32_t count);
+        static void flushEvent(void* context, uint64_t now);
+        // looks for input while the receive interrupt is enabled
+        static void inputEvent(void* context, uint64_t now);
+
+        void transmit(const uint8_t* data, uint32_t count);
+        // refills the receive buffer if it is empty and the host was not asked recently
+        bool receiveReady();
+        void updateInterrupt();
+
+        cpu::CPU& _cpu;
+        int _output;
+        int _input;
+        uint16_t _base;
+
+        std::vector<uint8_t> _transmit;
+        uint32_t _event;
+
+        uint32_t _inputEvent;
+        std::vector<uint8_t> _receive;
+        uint32_t _receivePosition;
+        uint64_t _lastInput;
+        bool _inputClosed;
+
+        uint8_t _ier;
+        uint8_t _lcr;
+        uint8_t _mcr;
+        uint8_t _scratch;
+        uint16_t _divisor;
+        bool _transmitInterrupt;    // THRE until IIR reports it or THR is written again
+
+    };
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "cpu/cpu.h"
+
+namespace x86e::devices {
+    // the 80x25 text mode screen at 0xB8000. the buffer stays ordinary RAM with a memory watch on it,
+    // so only writes to the screen leave the fast path and every one of them marks its row dirty.
+    // refresh() renders the dirty rows again and nothing else, an unchanged screen costs nothing.
+    // characters are rendered as ASCII, everything outside of it as '.', attributes are dropped
+    class TextDisplay {
+    public:
+        static constexpr uint32_t BASE = 0xb8000;
+        static constexpr uint32_t COLUMNS = 80;
+        static constexpr uint32_t ROWS = 25;
+        static constexpr uint32_t SIZE = COLUMNS * ROWS * 2;
+
+        TextDisplay(cpu::CPU& cpu);
+        // writes the last dump, if one was set up
+        ~TextDisplay();
+
+        // false if nothing was written since the last call
+        bool refresh();
+        const std::vector<std::string>& lines();
+
+        // headless capture. the screen is appended to path when the display goes away and, with an
+        // interval, at most every interval instructions of virtual time while the guest changes it.
+        // every frame starts with a line holding the virtual time
+        bool setDump(const std::string& path, uint64_t interval = 0);
+        void dump(FILE* out);
+
+    private:
+        static void access(void* context, uint64_t address, uint32_t value, uint8_t size, bool write);
+        static void dumpEvent(void* context, uint64_t now);
+
+        void renderRow(uint32_t row);
+        void writeFrame();
+
+        cpu::CPU& _cpu;
+
+        uint32_t _dirty;    // one bit per row
+        std::vector<std::string> _lines;
+
+        FILE* _dump;
+        uint64_t _interval;
+        uint32_t _event;
+
+    };
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "fuzz/fuzzer.h"
+
+namespace x86e::fuzz {
+    struct BatchStatistics {
+        uint64_t lockstep;      // instructions run once for a whole group of lanes
+        uint64_t vectorized;    // of those, the ones that ran on the register file of the group
+        uint64_t splits;        // lanes that left their group before the input was done
+        uint64_t mismatches;    // inputs whose scalar run came out differently, when verifying
+    };
+
+    // runs the same program on many inputs in lockstep. each lane is a Fuzzer of its own, so it has its
+    // own memory, and the lanes of a group run one instruction at a time together for as long as they
+    // follow the same path. the general purpose registers and the arithmetic flags of a group are kept
+    // as one array per register with an element per lane. register to register and accumulator forms
+    // of ADD, OR and ADC in 32 bit code update all lanes at once, with AVX2 when the host has it, and
+    // conditional jumps are decided per lane from there. anything else runs on every lane's own CPU.
+    // a lane whose EIP goes another way than most of its group is split off and runs its input to the
+    // end on its own. lanes that take an exception, halt or run out of budget finish the same way.
+    // with verify, every input is run on a separate scalar machine as well and the outcome, the
+    // instruction count and the final registers have to match
+    template<typename Model>
+    class Batch {
+    public:
+        // 32 bit lanes in an AVX2 register, the number of lanes is rounded up to a multiple of it
+        static constexpr uint32_t VECTOR = 8;
+
+        // bitmap = nullptr keeps the coverage of all lanes in a map owned by the first one
+        Batch(uint32_t memory, uint32_t lanes, bool verify = false, uint8_t* bitmap = nullptr);
+        ~Batch();
+
+        // set this machine up as a Fuzzer's, snapshot() hands it to every lane
+        cpu::Core<Model, EdgeCoverage>& machine();
+        uint8_t* bitmap();
+
+        void setInput(uint32_t address, uint32_t capacity, cpu::Registers sizeRegister = cpu::ECX);
+        void snapshot();
+
+        // every input, a group of lanes at a time. the results are in the order of the inputs
+        std::vector<Execution> execute(const std::vector<std::vector<uint8_t>>& inputs, uint64_t budget);
+
+        uint32_t lanes();
+        // whether the vector ALU runs on AVX2, the portable loops are used otherwise
+        bool avx2();
+        BatchStatistics& statistics();
+
+    private:
+        // flags kept per lane, in this order
+        enum LaneFlag {
+            LANE_CF,
+            LANE_PF,
+            LANE_AF,
+            LANE_ZF,
+            LANE_SF,
+            LANE_OF,
+
+            LANE_FLAGS,
+        };
+
+        void run(const std::vector<std::vector<uint8_t>>& inputs, uint32_t first, uint32_t count, uint64_t budget,
+                 std::vector<Execution>& results);
+
+        // one instruction for all active lanes, false if it has to run on the lanes themselves
+        bool vectorStep();
+        void scalarStep();
+        // ADD, OR or ADC by the opcode of the instruction, into a register of every lane
+        void alu(uint8_t instruction, uint32_t destination, const uint32_t* source);
+        bool condition(uint8_t code, uint32_t lane);
+
+        // the register file of the group and the CPUs of its lanes
+        void gather();
+        void scatter(uint32_t lane);
+        // lanes that are done or not with the most of the group leave it
+        void regroup();
+        // runs the input of a lane to the end on its own
+        void split(uint32_t lane);
+        void verify(uint32_t lane, const Execution& execution);
+
+        inline uint32_t& laneRegister(uint32_t reg, uint32_t lane) {
+            return _registers[reg * _lanes + lane];
+        }
+
+        inline uint32_t& laneFlag(uint32_t flag, uint32_t lane) {
+            return _flags[flag * _lanes + lane];
+        }
+
+        uint32_t _lanes;
+        std::vector<std::unique_ptr<Fuzzer<Model>>> _machines;
+        std::unique_ptr<Fuzzer<Model>> _reference;
+        bool _avx2;
+
+        std::vector<uint32_t> _registers;
+        std::vector<uint32_t> _flags;
+        std::vector<uint32_t> _immediate;
+        // whether _registers and _flags hold the state of the group rather than the lanes' CPUs
+        bool _resident;
+
+        // lanes of the current group still in lockstep, and where each input ended up
+        std::vector<uint32_t> _active;
+        std::vector<uint32_t> _running;
+        std::vector<uint32_t> _done;
+        const std::vector<std::vector<uint8_t>>* _inputs;
+        std::vector<Execution>* _results;
+        uint32_t _first;
+        uint64_t _begin;
+        uint64_t _end;
+
+        BatchStatistics _statistics;
+
+    };
+
+    extern template class Batch<cpu::Model8086>;
+    extern template class Batch<cpu::Model286>;
+    extern template class Batch<cpu::Model386>;
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "cpu/core.h"
+
+namespace x86e::fuzz {
+    constexpr uint32_t MAP_SIZE = 1 << 16;
+
+    // AFL style edge coverage from taken branches. the edge is the hash of the target
+    // combined with the previous one, so A->B and B->A land in different counters
+    struct EdgeCoverage : cpu::NoHooks {
+        static constexpr bool BRANCH = true;
+        static constexpr bool EXCEPTION = true;
+
+        uint8_t* map = nullptr;
+        uint32_t previous = 0;
+
+        bool crashed = false;
+        uint8_t vector = 0;
+
+        inline void branch(cpu::CPU& cpu, uint32_t from, uint32_t to) {
+            uint32_t current = ((to ^ (to >> 16)) * 0x9e3779b1u) >> 16;
+
+            map[(current ^ previous) & (MAP_SIZE - 1)]++;
+            previous = current >> 1;
+        }
+
+        // the first exception ends the run, the handler it would have reached is not of interest
+        inline void exception(cpu::CPU& cpu, uint8_t exceptionVector) {
+            if (!crashed) {
+                crashed = true;
+                vector = exceptionVector;
+            }
+        }
+    };
+
+    enum Outcome {
+        OUTCOME_HALTED,     // the guest ran HLT, the input was consumed
+        OUTCOME_TIMEOUT,    // the instruction budget ran out
+        OUTCOME_CRASHED,    // a CPU exception was raised
+    };
+
+    struct Execution {
+        Outcome outcome;
+        uint8_t vector;     // exception for OUTCOME_CRASHED
+        uint64_t instructions;
+    };
+
+    // runs many inputs through one machine without recreating it. set the machine up to the point
+    // where it is about to read its input, take a snapshot(), then call execute() per input. between
+    // executions only the pages the guest wrote are copied back, so a run costs about as much as the
+    // guest code it executes. devices are not snapshotted, fuzzed machines should not need them
+    template<typename Model>
+    class Fuzzer {
+    public:
+        // bitmap = nullptr keeps the coverage in a map owned by the fuzzer
+        Fuzzer(uint32_t memory, uint8_t* bitmap = nullptr);
+        ~Fuzzer();
+
+        cpu::Core<Model, EdgeCoverage>& machine();
+        uint8_t* bitmap();
+
+        // every execution copies the input to address, truncated to capacity bytes,
+        // and puts its length into sizeRegister
+        void setInput(uint32_t address, uint32_t capacity, cpu::Registers sizeRegister = cpu::ECX);
+
+        void snapshot();
+        Execution execute(const uint8_t* data, uint32_t size, uint64_t budget);
+
+        // execute() in steps, for callers that run part of the input themselves: load() puts the
+        // input in place, resume() runs it on until instruction end and restore() goes back to
+        // the snapshot. begin is the instruction count the input was loaded at
+        void load(const uint8_t* data, uint32_t size);
+        Execution resume(uint64_t begin, uint64_t end);
+        void restore();
+
+        // pages copied back by the last execution
+        uint64_t restoredPages();
+
+    private:
+
+        cpu::Core<Model, EdgeCoverage> _machine;
+
+        std::vector<uint8_t> _ownBitmap;
+        uint8_t* _bitmap;
+
+        cpu::CPUState _state;
+        std::vector<uint8_t> _memory;
+        uint64_t _restoredPages;
+
+        uint32_t _inputAddress;
+        uint32_t _inputCapacity;
+        cpu::Registers _sizeRegister;
+
+    };
+
+    extern template class Fuzzer<cpu::Model8086>;
+    extern template class Fuzzer<cpu::Model286>;
+    extern template class Fuzzer<cpu::Model386>;
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace x86e::io {
+    // a raw disk image. with an overlay the image is opened read-only and every write goes to the
+    // overlay instead, so any number of machines can share one base image. the overlay is a sparse
+    // file with a bitmap of the clusters it holds, clusters that were never written cost no space:
+    //   header   OverlayHeader, padded to OVERLAY_ALIGNMENT
+    //   bitmap   one bit per cluster, padded to OVERLAY_ALIGNMENT
+    //   data     cluster n at data + n * CLUSTER_SIZE
+    // reads and writes are synchronous and may come from several threads at once
+    class BlockBackend {
+    public:
+        static constexpr uint32_t SECTOR_SIZE = 512;
+        static constexpr uint32_t CLUSTER_SIZE = 4096;
+
+        static constexpr uint32_t OVERLAY_MAGIC = 0x6f363878;  // "x86o"
+        static constexpr uint32_t OVERLAY_VERSION = 1;
+        static constexpr uint32_t OVERLAY_ALIGNMENT = 4096;
+
+        struct OverlayHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t size;          // of the base image, an overlay only fits the image it was made for
+            uint32_t clusterSize;
+            uint32_t reserved;
+            uint64_t bitmap;        // file offsets
+            uint64_t data;
+        };
+
+        BlockBackend();
+        ~BlockBackend();
+
+        // an overlay that does not exist yet is created. false if a file cannot be opened or
+        // the overlay belongs to an image of another size
+        bool open(const std::string& path, const std::string& overlay = "");
+        void close();
+
+        uint64_t size();
+        uint64_t sectors();
+        const std::string& path();
+
+        // false on a host error or if the range is beyond the end of the disk
+        bool read(uint64_t offset, uint8_t* buffer, uint64_t size);
+        bool write(uint64_t offset, const uint8_t* buffer, uint64_t size);
+        bool flush();
+
+    private:
+        bool openOverlay(const std::string& overlay);
+
+        bool present(uint64_t cluster);
+        // copies the cluster from the base image into the overlay and merges the write into it
+        bool writeCluster(uint64_t cluster, uint32_t offset, const uint8_t* buffer, uint32_t size);
+
+        std::string _path;
+        int _base;
+        int _overlay;
+        uint64_t _size;
+
+        OverlayHeader _header;
+        std::vector<uint8_t> _bitmap;
+
+        // guards the bitmap and clusters on their way into the overlay
+        std::mutex _lock;
+
+    };
+
+    enum BlockOperation {
+        BLOCK_READ,
+        BLOCK_WRITE,
+        BLOCK_FLUSH
+    };
+
+    struct BlockRequest;
+    typedef void (*BlockCompletion)(void* context, BlockRequest* request);
+
+    // the data of a request is owned by the request, so nothing touches guest memory off the CPU thread
+    struct BlockRequest {
+        BlockBackend* backend;
+        BlockOperation operation;
+        uint64_t offset;
+        std::vector<uint8_t> data;
+
+        bool success;
+
+        // called on the worker thread once the request is done
+        void* context;
+        BlockCompletion complete;
+    };
+
+    // host threads doing the I/O of block devices, shared by every device in the process
+    class BlockWorkers {
+    public:
+        // 0 picks one per host CPU, at most MAX_THREADS
+        static constexpr uint32_t MAX_THREADS = 8;
+
+        BlockWorkers(uint32_t threads = 0);
+        ~BlockWorkers();
+
+        void submit(BlockRequest* request);
+
+    private:
+        void work();
+
+        std::vector<std::thread> _threads;
+        std::deque<BlockRequest*> _queue;
+
+        std::mutex _lock;
+        std::condition_variable _wake;
+        bool _stop;
+
+    };
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+namespace x86e::io {
+    // a guest image kept in a memfd, so every machine can map the same host pages
+    struct Image {
+        std::string path;
+        int fd;             // sealed, padded with zeros up to a whole page
+        uint64_t size;      // size of the file
+    };
+
+    // loads every distinct file once per process. images stay alive as long as the cache,
+    // the cache can be shared between threads
+    class ImageCache {
+    public:
+        ImageCache();
+        ~ImageCache();
+
+        // nullptr if the file cannot be read
+        const Image* load(const std::string& path);
+
+    private:
+        // device, inode and modification time, a file that changed on disk is loaded again
+        typedef std::tuple<uint64_t, uint64_t, int64_t, int64_t> Key;
+
+        std::mutex _lock;
+        std::map<Key, std::unique_ptr<Image>> _images;
+
+    };
+
+}
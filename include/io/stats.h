@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace x86e::io {
+    // layout of a stats file. the publisher updates every counter with a relaxed atomic store,
+    // readers map the file read-only and load them the same way, so nobody waits on anybody.
+    // fields are only ever appended, LAYOUT_VERSION counts the additions
+    struct StatsPage {
+        static constexpr uint32_t MAGIC = 0x65363878;  // "x86e"
+        static constexpr uint32_t LAYOUT_VERSION = 2;
+
+        uint32_t magic;
+        uint32_t version;
+        uint64_t pid;
+        char model[16];
+
+        uint64_t updated;               // host time of the last update, ns since the epoch
+        uint64_t instructions;
+        uint64_t instructionsPerSecond; // over the last interval, host time
+        uint64_t blockHits;             // decode cache, zero while there is none
+        uint64_t blockMisses;
+        uint64_t tlbHits;
+        uint64_t tlbMisses;
+        uint64_t exceptions;
+        uint64_t pageFaults;
+        uint64_t ioExits;
+        uint64_t halted;
+        uint64_t exited;                // the machine is gone, the rest is its final state
+
+        // version 2, tiered execution
+        uint64_t interpreted;           // instructions run in tier 0
+        uint64_t predecoded;            // instructions run from decoded blocks
+        uint64_t promotions;
+        uint64_t evictions;
+    };
+
+    constexpr size_t STATS_FILE_SIZE = 4096;
+
+    static_assert(sizeof(StatsPage) <= STATS_FILE_SIZE);
+
+    // fails unless the file has at least the fields of this LAYOUT_VERSION
+    bool mapStats(const std::string& path, const StatsPage*& page);
+    void unmapStats(const StatsPage* page);
+
+    // relaxed loads and stores of a counter
+    uint64_t loadStat(const uint64_t& field);
+    void storeStat(uint64_t& field, uint64_t value);
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "io/stats.h"
+#include "cpu/cpu.h"
+
+namespace x86e::io {
+    // publishes the counters of one machine into an mmap'ed file every INTERVAL instructions
+    // of virtual time, and on update()
+    class StatsPublisher {
+    public:
+        static constexpr uint64_t INTERVAL = cpu::Scheduler::INSTRUCTIONS_PER_SECOND / 10;
+
+        StatsPublisher(cpu::CPU& cpu, const std::string& path, const char* model);
+        ~StatsPublisher();
+
+        void update();
+
+    private:
+        static void tick(void* context, uint64_t now);
+
+        cpu::CPU& _cpu;
+        StatsPage* _page;
+        uint32_t _event;
+
+        uint64_t _lastTime;
+        uint64_t _lastInstructions;
+
+    };
+
+}
@@ -1,11 +1,69 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
+#include <mutex>
+#include "io/image.h"
 
 namespace x86e::memory {
+    constexpr uint32_t PAGE_SHIFT = 12;
+    constexpr uint32_t PAGE_SIZE = 1 << PAGE_SHIFT;
+    constexpr uint32_t PAGE_MASK = PAGE_SIZE - 1;
+
+    constexpr uint64_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    enum PageType : uint8_t {
+        RAM, ROM, MMIO
+    };
+
+    // or-ed into the page type of pages with a watch on them, keeps them off the direct path
+    constexpr uint8_t PAGE_WATCHED = 0x80;
+
+    // where guest RAM lives on the host
+    enum Backing {
+        BACKING_HEAP,
+        BACKING_MMAP,
+        BACKING_TRANSPARENT_HUGE_PAGES,     // 2 MiB aligned with MADV_HUGEPAGE
+        BACKING_HUGETLB,                    // MAP_HUGETLB, needs reserved huge pages
+    };
+
+    // device registers mapped into the physical address space.
+    // addresses passed to the callbacks are relative to the start of the region
+    struct MMIOHandler {
+        void* context;
+
+        uint32_t (*read)(void* context, uint64_t offset, uint8_t size);
+        void (*write)(void* context, uint64_t offset, uint32_t value, uint8_t size);
+    };
+
+    // observes accesses to physical memory, value is what was read or written
+    struct MemoryWatchHandler {
+        void* context;
+
+        void (*access)(void* context, uint64_t address, uint32_t value, uint8_t size, bool write);
+    };
+
+    struct MemoryWatch {
+        uint64_t base;
+        uint64_t size;
+
+        MemoryWatchHandler handler;
+    };
+
+    struct Region {
+        uint64_t base;
+        uint64_t size;
+        PageType type;
+
+        MMIOHandler handler;
+        std::vector<uint8_t> rom;   // contents of a ROM outside of RAM
+    };
+
     class Memory {
     public:
-        Memory(uint64_t size);
+        // RAM is an anonymous mapping, so untouched memory costs nothing. hugePages = true backs it
+        // with 2 MiB pages when the host allows it, backing() tells which one was used
+        Memory(uint64_t size, bool hugePages = false);
         ~Memory();
 
         uint8_t readImm8(uint64_t address);
@@ -17,10 +75,101 @@ namespace x86e::memory {
         void *getMemLocation();
         uint64_t memorySize();
 
+        Backing backing();
+        static const char* backingName(Backing backing);
+
+        // bytes of RAM the host currently has on huge pages
+        uint64_t hugePageBytes();
+
+        // regions are page granular. map them before the CPU runs, translations that are
+        // already cached in a TLB are not updated
+        void mapROM(uint64_t base, const uint8_t* data, uint64_t size);
+        void mapMMIO(uint64_t base, uint64_t size, const MMIOHandler& handler);
+
+        // places an image into RAM. page aligned images are mapped copy-on-write, so every machine
+        // loading the same image shares the pages it never writes. the rest of the last page is
+        // cleared, load images before anything else is written there
+        void loadImage(uint64_t base, const io::Image& image);
+
+        // host address of the page containing address if it can be accessed directly, nullptr otherwise
+        uint8_t* hostPage(uint64_t address, bool write);
+
+        // every access overlapping [base, base + size) is reported once, after it is done. the pages
+        // the range is on lose their direct access, the rest of memory is not slowed down. like regions,
+        // translations already cached in a TLB are not updated, see CPU::watchMemory().
+        // instruction fetches are reported as single byte reads
+        void watch(uint64_t base, uint64_t size, const MemoryWatchHandler& handler);
+        // removes the watches that were added with exactly this range
+        void unwatch(uint64_t base, uint64_t size);
+
+        // while a sampler is set no page is handed out for direct access, so every access that
+        // goes through the TLB is refilled through Memory and reported. flush the TLB after setting it
+        void setSampler(const MemoryWatchHandler* sampler);
+
+        // records the RAM pages written while tracking is on. a page handed out by hostPage() for
+        // writing counts as written, so the TLB has to be flushed when the list is cleared.
+        // writes through getMemLocation() are not seen
+        void trackDirtyPages(bool enabled);
+        const std::vector<uint64_t>& dirtyPages();
+        void clearDirtyPages();
+
+        // serializes locked instructions whose operand cannot be updated with a host atomic,
+        // between all CPUs sharing this memory
+        std::mutex& busLock();
+
+        // copies into and out of RAM, page by page where possible
+        void writeBlock(uint64_t address, const uint8_t* data, uint64_t size);
+        void readBlock(uint64_t address, uint8_t* data, uint64_t size);
+
     private:
+        bool allocate(uint64_t size, bool hugePages);
+
+        inline bool direct(uint64_t address, uint32_t size, bool write) {
+            if (address + size > _size || _sampler)
+                return false;
+
+            uint8_t first = _pageTypes[address >> PAGE_SHIFT];
+            uint8_t last = _pageTypes[(address + size - 1) >> PAGE_SHIFT];
+
+            // watched pages fail both, their type is above MMIO
+            return write ? (first | last) == RAM : first <= ROM && last <= ROM;
+        }
+
+        inline void markDirty(uint64_t address, uint32_t size) {
+            if (_trackDirty) [[unlikely]] {
+                markDirtyPage(address >> PAGE_SHIFT);
+                markDirtyPage((address + size - 1) >> PAGE_SHIFT);
+            }
+        }
+
+        void markDirtyPage(uint64_t page);
+
+        Region* findRegion(uint64_t address);
+        void updateWatchedPages();
+        void notifyWatches(uint64_t address, uint32_t value, uint8_t size, bool write);
+
+        uint32_t readSlow(uint64_t address, uint8_t size);
+        void writeSlow(uint32_t val, uint64_t address, uint8_t size);
+        uint32_t readRegion(uint64_t address, uint8_t size);
+        void writeRegion(uint32_t val, uint64_t address, uint8_t size);
+
         uint8_t* _memory;
         uint64_t _size;
 
+        Backing _backing;
+        uint64_t _mappingSize;
+
+        // PageType per page, plus PAGE_WATCHED
+        std::vector<uint8_t> _pageTypes;
+        std::vector<Region> _regions;
+        std::vector<MemoryWatch> _watches;
+        const MemoryWatchHandler* _sampler;
+        std::mutex _busLock;
+
+        bool _trackDirty;
+        std::vector<bool> _dirty;
+        std::vector<uint64_t> _dirtyPages;
+
     };
 
-}
\ No newline at end of file
+}
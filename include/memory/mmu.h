@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include "memory/memory.h"
+
+namespace x86e::memory {
+    enum AccessType {
+        READ, WRITE, EXECUTE
+    };
+
+    enum PageFlags {
+        PAGE_PRESENT  = 1 << 0,
+        PAGE_WRITABLE = 1 << 1,
+        PAGE_USER     = 1 << 2,
+        PAGE_ACCESSED = 1 << 5,
+        PAGE_DIRTY    = 1 << 6,
+        PAGE_GLOBAL   = 1 << 8,
+    };
+
+    // #PF error code bits
+    enum PageFaultCode {
+        PF_PRESENT = 1 << 0,
+        PF_WRITE   = 1 << 1,
+        PF_USER    = 1 << 2,
+    };
+
+    struct TLBEntry {
+        uint32_t tag;       // linear page address, TLB_INVALID if the entry is empty
+        bool global;
+        uint8_t* host;      // host address of the page
+    };
+
+    struct TLBStatistics {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t flushes;
+    };
+
+    typedef void (*PageFaultHandler)(void* context, uint32_t address, uint32_t errorCode);
+
+    // linear -> physical translation in front of Memory.
+    // the TLB keeps host pointers per linear page, separately for reads, writes and fetches,
+    // so a hit is a tag compare and a load from host memory. with paging disabled the TLB is
+    // filled with an identity mapping and takes the same fast path
+    class MMU {
+    public:
+        static constexpr uint32_t TLB_SIZE = 256;
+        static constexpr uint32_t TLB_INVALID = 1;
+
+        MMU(Memory& memory);
+        ~MMU();
+
+        void reset();
+
+        void setPaging(bool enabled);
+        void setPageDirectory(uint32_t cr3);
+        void setGlobalPages(bool enabled);
+        void setUserMode(bool user);
+        void setPageFaultHandler(PageFaultHandler handler, void* context);
+
+        // global = true also drops global pages
+        void flush(bool global);
+
+        bool translate(uint32_t linear, AccessType access, uint32_t& physical);
+
+        // translates every page of size bytes at linear for the access without touching them, raising
+        // the page fault the access itself would. for instructions that must not change anything
+        // before they know all of their writes go through. false if a page faulted
+        bool probe(uint32_t linear, uint32_t size, AccessType access);
+        // the same with the permissions of user rather than of the current privilege level
+        bool probe(uint32_t linear, uint32_t size, AccessType access, bool user);
+
+        // descriptor tables and the TSS are read with supervisor permissions whatever the privilege level.
+        // bypasses the TLB in user mode, where it holds user translations
+        uint32_t readSystem32(uint32_t linear);
+
+        // writes up to a page worth of bytes at linear. every page they touch is translated with the
+        // permissions of user before the first byte is written, so a page fault leaves all of them
+        // unchanged. bypasses the TLB
+        bool writeBlock(uint32_t linear, const uint8_t* data, uint32_t size, bool user);
+
+        inline uint8_t readImm8(uint32_t linear) { return load<uint8_t>(_read, linear, READ); }
+        inline uint16_t readImm16(uint32_t linear) { return load<uint16_t>(_read, linear, READ); }
+        inline uint32_t readImm32(uint32_t linear) { return load<uint32_t>(_read, linear, READ); }
+
+        inline uint8_t fetchImm8(uint32_t linear) { return load<uint8_t>(_exec, linear, EXECUTE); }
+        inline uint16_t fetchImm16(uint32_t linear) { return load<uint16_t>(_exec, linear, EXECUTE); }
+        inline uint32_t fetchImm32(uint32_t linear) { return load<uint32_t>(_exec, linear, EXECUTE); }
+
+        // host address of linear for instruction fetch, nullptr if the page is not directly accessible.
+        // may raise a page fault just like fetchImm8()
+        const uint8_t* fetchPointer(uint32_t linear);
+
+        // the same for a write, used for atomic accesses. may raise a page fault just like writeImm8()
+        uint8_t* writePointer(uint32_t linear);
+
+        inline void writeImm8(uint8_t val, uint32_t linear) { store<uint8_t>(val, linear); }
+        inline void writeImm16(uint16_t val, uint32_t linear) { store<uint16_t>(val, linear); }
+        inline void writeImm32(uint32_t val, uint32_t linear) { store<uint32_t>(val, linear); }
+
+        // host address of the page holding linear for stack accesses, nullptr if it is not known to be
+        // directly writable. the page the stack is on is kept in a single entry in front of the TLB,
+        // it is taken over from the write TLB, so a push to a page that has never been written returns
+        // nullptr and has to go through writeImm*() once
+        inline uint8_t* stackPage(uint32_t linear) {
+            if ((linear & ~PAGE_MASK) == _stack.tag) [[likely]] {
+                ++_statistics.hits;
+                return _stack.host;
+            }
+
+            return stackPageSlow(linear);
+        }
+
+        inline bool userMode() {
+            return _userMode;
+        }
+
+        TLBStatistics& statistics();
+
+    private:
+        template<typename T>
+        inline T load(TLBEntry* tlb, uint32_t linear, AccessType access) {
+            TLBEntry& entry = tlb[(linear >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+
+            if (entry.tag == (linear & ~PAGE_MASK) && (linear & PAGE_MASK) <= PAGE_SIZE - sizeof(T)) [[likely]] {
+                T value;
+                ++_statistics.hits;
+                std::memcpy(&value, entry.host + (linear & PAGE_MASK), sizeof(T));
+                return value;
+            }
+
+            return (T) loadSlow(linear, sizeof(T), access);
+        }
+
+        template<typename T>
+        inline void store(T val, uint32_t linear) {
+            TLBEntry& entry = _write[(linear >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+
+            if (entry.tag == (linear & ~PAGE_MASK) && (linear & PAGE_MASK) <= PAGE_SIZE - sizeof(T)) [[likely]] {
+                ++_statistics.hits;
+                std::memcpy(entry.host + (linear & PAGE_MASK), &val, sizeof(T));
+                return;
+            }
+
+            storeSlow(val, linear, sizeof(T));
+        }
+
+        uint8_t* hostPointer(TLBEntry* tlb, uint32_t linear, AccessType access);
+        uint8_t* stackPageSlow(uint32_t linear);
+        bool walk(uint32_t linear, AccessType access, uint32_t& physical, bool& global, bool user);
+        // sets a page table entry to value if it still is expected, false if another CPU changed it
+        bool updateEntry(uint32_t address, uint32_t expected, uint32_t value);
+        uint32_t loadSlow(uint32_t linear, uint32_t size, AccessType access);
+        void storeSlow(uint32_t val, uint32_t linear, uint32_t size);
+        void fill(TLBEntry* tlb, uint32_t linear, uint32_t physical, bool global);
+
+        Memory& _memory;
+
+        TLBEntry _read[TLB_SIZE];
+        TLBEntry _write[TLB_SIZE];
+        TLBEntry _exec[TLB_SIZE];
+        TLBEntry _stack;
+
+        TLBStatistics _statistics;
+
+        bool _paging;
+        bool _globalPages;
+        bool _userMode;
+        uint32_t _pageDirectory;
+
+        PageFaultHandler _pageFaultHandler;
+        void* _pageFaultContext;
+
+    };
+
+}
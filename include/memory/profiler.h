@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include "cpu/cpu.h"
+
+namespace x86e::memory {
+    // samples guest memory accesses in windows of WINDOW instructions, one window out of every
+    // ratio. during a window the TLB is kept empty and every access is recorded at cache line
+    // granularity, the rest of the time the CPU runs untouched. nothing is recorded or scheduled
+    // unless a profiler exists, and its windows are observer events that never keep a halted CPU
+    // from stopping
+    class Profiler {
+    public:
+        static constexpr uint64_t WINDOW = 1000;
+        static constexpr uint32_t LINE_SHIFT = 6;
+
+        Profiler(cpu::CPU& cpu, uint32_t ratio);
+        ~Profiler();
+
+        // heatmap of the address space, working set size per window and the hottest pages
+        void report(FILE* out);
+
+    private:
+        struct PageCounters {
+            uint64_t reads;
+            uint64_t writes;
+            uint64_t lines;         // cache lines touched over the whole run, one bit each
+            uint64_t windowLines;   // the same for the window in _window
+            uint32_t window;
+        };
+
+        struct WorkingSet {
+            uint64_t time;
+            uint32_t pages;
+            uint32_t lines;
+        };
+
+        static void access(void* context, uint64_t address, uint32_t value, uint8_t size, bool write);
+        static void open(void* context, uint64_t now);
+        static void close(void* context, uint64_t now);
+
+        cpu::CPU& _cpu;
+        MemoryWatchHandler _sampler;
+        uint32_t _ratio;
+        uint32_t _event;
+
+        std::vector<PageCounters> _pages;
+        std::vector<WorkingSet> _workingSet;
+
+        uint32_t _window;
+        uint32_t _windowPages;
+        uint32_t _windowLines;
+        uint64_t _samples;
+
+    };
+
+}
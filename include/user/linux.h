@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "cpu/cpu.h"
+
+namespace x86e::user {
+    // runs a static i386 Linux executable without a kernel. the CPU is put into flat 32 bit
+    // protected mode with RAM mapped 1:1, so guest addresses are RAM offsets, and the program
+    // runs at CPL 3. page 0 is not mapped, so NULL pointers fault, and the system area below
+    // the executable and the page tables at the top of RAM can only be reached from CPL 0.
+    // INT 80h and every exception go through IDT gates to CPL 0 stubs, on a stack of their own,
+    // that trap to native code with an OUT:
+    //   SYSCALL_PORT  the syscall in EAX with its arguments in EBX, ECX, EDX, ESI, EDI and EBP
+    //   FAULT_PORT    an exception, the process is terminated as if by the matching signal
+    // file descriptors are the host's own, and buffers in guest RAM are handed to the host
+    // calls directly, so file I/O is not copied.
+    // the decoder does not have MOV, CMP, SUB, XOR, TEST, INC, DEC or the shifts yet, so real
+    // static libc binaries die with SIGILL at _start. only programs written for the instructions
+    // there are (see i386_InstructionsManager) run to the end
+    class LinuxProcess {
+    public:
+        static constexpr uint16_t SYSCALL_PORT = 0xe8;
+        static constexpr uint16_t FAULT_PORT = 0xe9;
+
+        static constexpr uint32_t PAGE_SIZE = 4096;
+        static constexpr uint32_t STACK_SIZE = 8 * 1024 * 1024;
+
+        // GDT, IDT, TSS, the stubs and the page tables, below anything an executable is linked at
+        static constexpr uint32_t SYSTEM_BASE = 0x1000;
+
+        LinuxProcess(cpu::CPU& cpu);
+        ~LinuxProcess();
+
+        // loads the executable and sets the CPU up to start at its entry point.
+        // argv[0] is the name the program sees
+        bool load(const std::string& path, const std::vector<std::string>& argv, const std::vector<std::string>& envp);
+
+        // the CPU is halted once the process is gone
+        bool exited();
+        // exit status, 128 + the signal for a process that was killed
+        int exitCode();
+
+    private:
+        struct Segment {
+            uint32_t base;
+            uint32_t limit;
+            uint8_t access;
+            uint8_t flags;
+        };
+
+        static uint32_t read(void* context, uint16_t port, uint8_t size);
+        static void trap(void* context, uint16_t port, uint32_t value, uint8_t size);
+
+        bool loadExecutable(const std::string& path);
+        void setupSystem();
+        void setupStack(const std::vector<std::string>& argv, const std::vector<std::string>& envp);
+        void setDescriptor(uint32_t index, const Segment& segment);
+
+        void syscall();
+        void fault();
+        void terminate(int code);
+
+        int32_t brk(uint32_t address);
+        int32_t mmap(uint32_t address, uint32_t length, uint32_t flags, int32_t fd, uint64_t offset);
+        int32_t munmap(uint32_t address, uint32_t length);
+        // adds a range to the unmapped ones, the lowest mapping goes back to the space the break can use
+        void release(uint32_t address, uint32_t length);
+        int32_t setThreadArea(uint32_t info);
+        int32_t stat(int32_t result, const struct stat& info);
+
+        // whether the program may hand the range to a syscall, it has to be RAM between the system area
+        // and the page tables
+        bool userRange(uint32_t address, uint32_t size);
+        // syscall results into guest memory, false if the range is not the program's
+        bool copyOut(uint32_t address, const void* data, uint32_t size);
+        // host pointer to guest memory, nullptr if any of it cannot be accessed directly
+        uint8_t* hostBuffer(uint32_t address, uint32_t size, bool write);
+        // read(2)/write(2) style calls, through a bounce buffer when the memory is not direct
+        int32_t readInto(int fd, uint32_t address, uint32_t size);
+        int32_t writeFrom(int fd, uint32_t address, uint32_t size);
+        std::string readString(uint32_t address);
+        void zero(uint32_t address, uint32_t size);
+
+        cpu::CPU& _cpu;
+
+        std::string _path;
+        uint32_t _entry;
+        uint32_t _programHeaders;
+        uint32_t _programHeaderCount;
+
+        uint32_t _brkStart;
+        uint32_t _brk;
+        uint32_t _brkHigh;      // memory above it was never handed out and is still zero
+        uint32_t _mmapTop;      // mappings grow down from here towards the break
+        uint32_t _stackBottom;
+        uint32_t _pageTables;   // up to the top of RAM
+
+        // ranges between _mmapTop and the stack that were unmapped again, by address. mmap reuses them
+        std::map<uint32_t, uint32_t> _unmapped;
+
+        bool _exited;
+        int _exitCode;
+
+    };
+
+}
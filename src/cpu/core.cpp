@@ -0,0 +1,9 @@
+#include "cpu/core_impl.h"
+
+namespace x86e::cpu {
+
+    template class Core<Model8086>;
+    template class Core<Model286>;
+    template class Core<Model386>;
+
+}
@@ -1,11 +1,40 @@
 #include <cstdint>
+#include <algorithm>
+#include <atomic>
 #include "cpu/cpu.h"
+#include "io/Logger.h"
 
 namespace x86e::cpu {
 
-    CPU::CPU(uint64_t memory)
-        : _memory(memory) {
+    // base, limit and attributes from the two words of a descriptor
+    static SegmentDescriptor decodeDescriptor(uint32_t low, uint32_t high) {
+        uint16_t attributes = (high >> 8) & 0xf0ff;
+        attributes = (attributes & 0xff) | ((attributes >> 4) & 0xf00);
 
+        uint32_t limit = (low & 0xffff) | (high & 0xf0000);
+        if (attributes & SEG_GRANULAR)
+            limit = (limit << 12) | 0xfff;
+
+        return { (low >> 16) | ((high & 0xff) << 16) | (high & 0xff000000), limit, attributes };
+    }
+
+    // values of width bytes laid out like pushing them in order would, the last one lowest
+    static void serializeFrame(const uint32_t* values, uint32_t count, uint32_t width, uint8_t* bytes) {
+        for (uint32_t i = 0; i < count; i++)
+            std::memcpy(bytes + (count - 1 - i) * width, &values[i], width);
+    }
+
+    CPU::CPU(uint64_t memory, bool hugePages)
+        : _ownMemory(std::make_unique<memory::Memory>(memory, hugePages)), _ownIOBus(std::make_unique<devices::IOBus>()),
+          _memory(*_ownMemory), _mmu(_memory), _ioBus(*_ownIOBus), _decodeCache(nullptr), _faultArmed(false) {
+        _mmu.setPageFaultHandler(&CPU::pageFault, this);
+        _locked = { false, false, 0, nullptr, 0 };
+    }
+
+    CPU::CPU(memory::Memory &memory, devices::IOBus &ioBus)
+        : _memory(memory), _mmu(_memory), _ioBus(ioBus), _decodeCache(nullptr), _faultArmed(false) {
+        _mmu.setPageFaultHandler(&CPU::pageFault, this);
+        _locked = { false, false, 0, nullptr, 0 };
     }
 
     CPU::~CPU() {
@@ -111,13 +140,77 @@ namespace x86e::cpu {
         return currVal-1;
     }
 
-    void CPU::cycle() {
-    }
-
     x86e::memory::Memory &CPU::getMemory() {
         return _memory;
     }
 
+    x86e::memory::MMU &CPU::getMMU() {
+        return _mmu;
+    }
+
+    x86e::devices::IOBus &CPU::getIOBus() {
+        return _ioBus;
+    }
+
+    CPUStatistics &CPU::statistics() {
+        return _statistics;
+    }
+
+    void CPU::saveState(CPUState &state) {
+        state.fault = _fault;
+        state.instructions = _instructions;
+        std::copy(std::begin(_pendingInterrupts), std::end(_pendingInterrupts), state.pendingInterrupts);
+        std::copy(std::begin(_registers), std::end(_registers), state.registers);
+        std::copy(std::begin(_flags), std::end(_flags), state.flags);
+        std::copy(std::begin(_segments), std::end(_segments), state.segments);
+        state.gdtr = _gdtr;
+        state.idtr = _idtr;
+        state.ldt = _ldt;
+        state.tss = _tss;
+        state.scheduler = _scheduler;
+        state.halted = _isHalted;
+    }
+
+    void CPU::restoreState(const CPUState &state) {
+        _fault = state.fault;
+        _instructions = state.instructions;
+        std::copy(std::begin(state.pendingInterrupts), std::end(state.pendingInterrupts), _pendingInterrupts);
+        std::copy(std::begin(state.registers), std::end(state.registers), _registers);
+        std::copy(std::begin(state.flags), std::end(state.flags), _flags);
+        std::copy(std::begin(state.segments), std::end(state.segments), _segments);
+        _gdtr = state.gdtr;
+        _idtr = state.idtr;
+        _ldt = state.ldt;
+        _tss = state.tss;
+        _scheduler = state.scheduler;
+        _isHalted = state.halted;
+
+        // the MMU configuration follows from the restored registers
+        setControlRegister(CR0, _registers[CR0]);
+        setControlRegister(CR3, _registers[CR3]);
+        setControlRegister(CR4, _registers[CR4]);
+        _mmu.setUserMode((_registers[CS] & 3) == 3);
+        _mmu.flush(true);
+    }
+
+    void CPU::watchMemory(uint64_t base, uint64_t size, const x86e::memory::MemoryWatchHandler &handler) {
+        _memory.watch(base, size, handler);
+        _mmu.flush(true);
+    }
+
+    void CPU::setDecodeCache(DecodeCache *cache) {
+        _decodeCache = cache;
+    }
+
+    void CPU::unwatchMemory(uint64_t base, uint64_t size) {
+        _memory.unwatch(base, size);
+        _mmu.flush(true);
+    }
+
+    Scheduler &CPU::getScheduler() {
+        return _scheduler;
+    }
+
     void CPU::reset() {
         _isHalted = false;
 
@@ -132,10 +225,874 @@ namespace x86e::cpu {
 
         setFlag((Flags) 1, 1);
         setFlag((Flags) 15, 0);
+
+        for (auto& descriptor : _segments) {
+            descriptor.base = 0;
+            descriptor.limit = 0xffff;
+            descriptor.attributes = SEG_PRESENT | SEG_CODE_DATA | SEG_RW | SEG_ACCESSED;
+        }
+
+        _segments[CS - CS].attributes |= SEG_EXECUTABLE;
+
+        _gdtr = { 0, 0xffff };
+        _idtr = { 0, 0x3ff };
+        _ldt = { 0, 0, 0 };
+        _tss = { 0, 0, 0 };
+
+        _mmu.reset();
+        _scheduler.reset();
+
+        _instructions = 0;
+        std::fill(std::begin(_pendingInterrupts), std::end(_pendingInterrupts), 0);
+
+        _fault = { 0, false, 0, false, false };
+        _statistics = { 0, 0 };
     }
 
-    void CPU::parseModRM(Opcode &opcode, uint64_t address) {
-        opcode.modrm_or_sib_value = _memory.readImm8(address);
+    uint32_t CPU::getEFLAGS() {
+        uint32_t value = 0;
+
+        for (int i = 0; i < 32; i++)
+            value |= (uint32_t) _flags[i] << i;
+
+        return value;
+    }
+
+    void CPU::setEFLAGS(uint32_t value) {
+        // bit 1 always reads as set, 3, 5 and 15 as clear
+        value = (value | 0b10) & ~((1 << 3) | (1 << 5) | (1 << 15));
+
+        for (int i = 0; i < 32; i++)
+            _flags[i] = (value >> i) & 1;
+    }
+
+    void CPU::raiseInterrupt(uint8_t vector) {
+        _pendingInterrupts[vector >> 6] |= 1ull << (vector & 63);
+        checkInterrupts();
+    }
+
+    bool CPU::hasPendingInterrupt() {
+        return _pendingInterrupts[0] | _pendingInterrupts[1] | _pendingInterrupts[2] | _pendingInterrupts[3];
+    }
+
+    void CPU::checkInterrupts() {
+        if (getFlag(IF) && hasPendingInterrupt())
+            _scheduler.kick();
+    }
+
+    void CPU::interrupt(uint8_t vector, uint32_t returnIP, bool hasErrorCode, uint32_t errorCode, bool software) {
+        if (!protectedMode()) {
+            // IVT, real mode exceptions have no error codes
+            uint32_t entry = _idtr.base + vector * 4;
+            uint16_t ip = _mmu.readImm16(entry);
+            uint16_t cs = _mmu.readImm16(entry + 2);
+
+            const uint32_t frame[] = { getEFLAGS(), getRegister(CS), returnIP };
+            pushFrame(frame, 3, 2);
+
+            setFlag(IF, 0);
+            setFlag(TF, 0);
+
+            loadSegment(CS, cs);
+            setRegister(EIP, ip);
+            return;
+        }
+
+        // faults caused by the gate itself report its index with the IDT bit set
+        uint32_t gateError = vector * 8 + 2;
+
+        if (vector * 8 + 7 > _idtr.limit) {
+            raiseFault(EXCEPTION_GP, gateError);
+            return;
+        }
+
+        uint32_t low = _mmu.readSystem32(_idtr.base + vector * 8);
+        uint32_t high = _mmu.readSystem32(_idtr.base + vector * 8 + 4);
+        uint8_t type = (high >> 8) & 0x1f;
+        uint8_t current = cpl();
+
+        // task gates are refused like anything else that is not an interrupt or trap gate
+        if (type != GATE_INTERRUPT16 && type != GATE_TRAP16 && type != GATE_INTERRUPT32 && type != GATE_TRAP32) {
+            raiseFault(EXCEPTION_GP, gateError);
+            return;
+        }
+
+        // INT n may only use the gates its privilege level is allowed to
+        if (software && ((high >> 13) & 3) < current) {
+            raiseFault(EXCEPTION_GP, gateError);
+            return;
+        }
+
+        if (!(high & (1 << 15))) {
+            raiseFault(EXCEPTION_NP, gateError);
+            return;
+        }
+
+        bool gate32 = type == GATE_INTERRUPT32 || type == GATE_TRAP32;
+        uint16_t selector = low >> 16;
+        uint32_t offset = (high & 0xffff0000) | (low & 0xffff);
+
+        if (!gate32)
+            offset &= 0xffff;
+
+        SegmentDescriptor code = readDescriptor(CS, selector, current);
+        uint8_t dpl = (code.attributes & SEG_DPL) >> 5;
+
+        if (dpl > current) {
+            raiseFault(EXCEPTION_GP, selector & 0xfffc);
+            return;
+        }
+
+        if (offset > code.limit) {
+            raiseFault(EXCEPTION_GP, 0);
+            return;
+        }
+
+        // conforming handlers run at the privilege level of the code they interrupt
+        uint8_t level = (code.attributes & SEG_CONFORMING) ? current : dpl;
+
+        uint16_t stackSelector = getRegister(SS);
+        SegmentDescriptor stack = _segments[SS - CS];
+        uint32_t esp = _registers[ESP];
+        uint32_t frame[6];
+        uint32_t count = 0;
+
+        if (level < current) {
+            // the handler runs on the stack of its level, which starts with the old SS:ESP
+            innerStack(level, stackSelector, esp);
+            stack = readDescriptor(SS, stackSelector, level, EXCEPTION_TS);
+
+            frame[count++] = getRegister(SS);
+            frame[count++] = _registers[ESP];
+        }
+
+        frame[count++] = getEFLAGS();
+        frame[count++] = getRegister(CS);
+        frame[count++] = returnIP;
+
+        if (hasErrorCode)
+            frame[count++] = errorCode;
+
+        uint32_t width = gate32 ? 4 : 2;
+        uint32_t mask = (stack.attributes & SEG_DB) ? 0xffffffff : 0xffff;
+        uint32_t sp = (esp - count * width) & mask;
+        uint8_t bytes[24];
+
+        serializeFrame(frame, count, width, bytes);
+        writeStack(stack, sp, bytes, count * width, level == 3, level < current ? stackSelector & 0xfffc : 0);
+
+        // everything that can fault is done
+        if (level < current) {
+            commitSegment(SS, stackSelector, stack);
+            _registers[ESP] = esp;
+        }
+
+        setStackPointer(sp);
+        commitSegment(CS, (selector & 0xfffc) | level, code);
+
+        // trap gates leave interrupts enabled
+        if (type == GATE_INTERRUPT16 || type == GATE_INTERRUPT32)
+            setFlag(IF, 0);
+
+        setFlag(TF, 0);
+        setFlag(NT, 0);
+        setFlag(RF, 0);
+
+        setRegister(EIP, offset);
+    }
+
+    void CPU::raiseFault(uint8_t vector) {
+        fault(vector, false, 0);
+    }
+
+    void CPU::raiseFault(uint8_t vector, uint32_t errorCode) {
+        fault(vector, true, errorCode);
+    }
+
+    void CPU::fault(uint8_t vector, bool hasErrorCode, uint32_t errorCode) {
+        if (!_faultArmed) {
+            io::debug_print(io::WARNING, "Exception %d (error code 0x%x) outside of an instruction, EIP=0x%x",
+                            vector, errorCode, getRegister(EIP));
+            return;
+        }
+
+        if (_fault.delivering) {
+            if (_fault.vector == EXCEPTION_DF) {
+                // triple fault, the CPU shuts down until it is reset
+                io::debug_print(io::ERROR, "Triple fault, EIP=0x%x", getRegister(EIP));
+
+                _fault = { 0, false, 0, false, false };
+                setFlag(IF, 0);
+                halt();
+
+                std::longjmp(_faultJump, 1);
+            }
+
+            // a contributory exception on top of another one or of a page fault, or a page fault on top
+            // of a page fault, is a double fault. anything else is delivered instead of the first one
+            auto contributory = [](uint8_t v) {
+                return v == EXCEPTION_DE || (v >= EXCEPTION_TS && v <= EXCEPTION_GP);
+            };
+
+            bool first = contributory(_fault.vector);
+            bool second = contributory(vector) || vector == EXCEPTION_PF;
+
+            if ((first && contributory(vector)) || (_fault.vector == EXCEPTION_PF && second)) {
+                vector = EXCEPTION_DF;
+                hasErrorCode = true;
+                errorCode = 0;
+            }
+        }
+
+        _fault = { vector, hasErrorCode, errorCode, true, false };
+
+        _statistics.exceptions++;
+        if (vector == EXCEPTION_PF)
+            _statistics.pageFaults++;
+
+        std::longjmp(_faultJump, 1);
+    }
+
+    void CPU::deliverFault() {
+        if (!_fault.pending)
+            return;
+
+        _fault.pending = false;
+        _fault.delivering = true;
+
+        interrupt(_fault.vector, getRegister(EIP), _fault.hasErrorCode, _fault.errorCode);
+
+        _fault.delivering = false;
+
+        // interrupts that were already pending may have lost their kick
+        checkInterrupts();
+    }
+
+    void CPU::serviceEvents() {
+        _scheduler.run(_instructions);
+
+        if (!getFlag(IF) || !hasPendingInterrupt())
+            return;
+
+        // lowest vector first
+        for (int i = 0; i < 4; i++) {
+            if (!_pendingInterrupts[i])
+                continue;
+
+            int bit = __builtin_ctzll(_pendingInterrupts[i]);
+
+            // an interrupt whose delivery faults stays pending
+            interrupt(i * 64 + bit, getRegister(EIP));
+            _pendingInterrupts[i] &= ~(1ull << bit);
+            _isHalted = false;
+            break;
+        }
+
+        // more may be pending, they are delivered after the first instruction of the handler
+        checkInterrupts();
+    }
+
+    bool CPU::wakeUp() {
+        if (!getFlag(IF))
+            return false;
+
+        if (!hasPendingInterrupt()) {
+            if (!_scheduler.hasEvents())
+                return false;
+
+            // nothing happens until the next event, jump straight to it
+            _instructions = std::max(_instructions, _scheduler.earliestEvent());
+        }
+
+        serviceEvents();
+        return !_isHalted;
+    }
+
+    void CPU::setControlRegister(Registers reg, uint32_t value) {
+        setRegister(reg, value);
+
+        switch (reg) {
+            case CR0:
+                _mmu.setPaging((value & CR0_PG) && (value & CR0_PE));
+                break;
+
+            case CR3:
+                _mmu.setPageDirectory(value);
+                break;
+
+            case CR4:
+                _mmu.setGlobalPages(value & CR4_PGE);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    void CPU::pageFault(void *context, uint32_t address, uint32_t errorCode) {
+        CPU* cpu = (CPU*) context;
+
+        cpu->setRegister(CR2, address);
+        cpu->fault(EXCEPTION_PF, true, errorCode);
+    }
+
+    bool CPU::protectedMode() {
+        return getRegister(CR0) & CR0_PE;
+    }
+
+    SegmentDescriptor &CPU::getSegment(Registers seg) {
+        return _segments[seg - CS];
+    }
+
+    void CPU::loadSegment(Registers seg, uint16_t selector) {
+        if (!protectedMode() || getFlag(VM)) {
+            // real mode keeps the cached limit and attributes, only the base follows the selector
+            setRegister(seg, selector);
+            _segments[seg - CS].base = (uint32_t) selector << 4;
+            return;
+        }
+
+        // nothing is changed until the descriptor has been checked, a fault leaves the old segment in place
+        commitSegment(seg, selector, readDescriptor(seg, selector, cpl()));
+    }
+
+    SegmentDescriptor CPU::readDescriptor(Registers seg, uint16_t selector, uint8_t cpl, uint8_t invalid) {
+        uint16_t error = selector & 0xfffc;
+
+        if (error == 0) {
+            // null selector. fine for data segments until something is accessed through it
+            if (seg == CS || seg == SS)
+                raiseFault(invalid, 0);
+
+            // not present, so any access through it faults
+            return { 0, 0, 0 };
+        }
+
+        uint32_t base = _gdtr.base;
+        uint32_t limit = _gdtr.limit;
+
+        if (selector & 0b100) {
+            if (!(_ldt.attributes & SEG_PRESENT)) {
+                raiseFault(invalid, error);
+                return { 0, 0, 0 };
+            }
+
+            base = _ldt.base;
+            limit = _ldt.limit;
+        }
+
+        uint32_t index = selector & 0xfff8;
+        if (index + 7 > limit) {
+            raiseFault(invalid, error);
+            return { 0, 0, 0 };
+        }
+
+        SegmentDescriptor descriptor = decodeDescriptor(_mmu.readSystem32(base + index),
+                                                        _mmu.readSystem32(base + index + 4));
+
+        uint16_t attributes = descriptor.attributes;
+        uint8_t dpl = (attributes & SEG_DPL) >> 5;
+        uint8_t rpl = selector & 3;
+        bool executable = attributes & SEG_EXECUTABLE;
+        bool valid = attributes & SEG_CODE_DATA;
+
+        if (seg == CS) {
+            // the privilege levels of code are up to the transfer that loads it
+            valid = valid && executable;
+        }
+        else if (seg == SS) {
+            valid = valid && !executable && (attributes & SEG_RW) && rpl == cpl && dpl == cpl;
+        }
+        else {
+            // readable code or data, conforming code can be used from any level
+            bool conforming = executable && (attributes & SEG_CONFORMING);
+            valid = valid && (!executable || (attributes & SEG_RW)) && (conforming || dpl >= std::max(cpl, rpl));
+        }
+
+        if (!valid) {
+            raiseFault(invalid, error);
+            return { 0, 0, 0 };
+        }
+
+        if (!(attributes & SEG_PRESENT)) {
+            raiseFault(seg == SS ? EXCEPTION_SS : EXCEPTION_NP, error);
+            return { 0, 0, 0 };
+        }
+
+        return descriptor;
+    }
+
+    void CPU::commitSegment(Registers seg, uint16_t selector, const SegmentDescriptor &descriptor) {
+        setRegister(seg, selector);
+        _segments[seg - CS] = descriptor;
+
+        if (seg == CS)
+            _mmu.setUserMode((selector & 3) == 3);
+    }
+
+    SegmentDescriptor CPU::transferTarget(uint16_t selector, uint32_t offset) {
+        uint8_t current = cpl();
+
+        // call gates and TSS descriptors fail the code segment check
+        SegmentDescriptor code = readDescriptor(CS, selector, current);
+        uint8_t dpl = (code.attributes & SEG_DPL) >> 5;
+
+        // conforming code runs at the level of its caller, anything else needs to be at that level
+        bool allowed = (code.attributes & SEG_CONFORMING) ? dpl <= current : (selector & 3) <= current && dpl == current;
+
+        if (!allowed) {
+            raiseFault(EXCEPTION_GP, selector & 0xfffc);
+            return { 0, 0, 0 };
+        }
+
+        if (offset > code.limit) {
+            raiseFault(EXCEPTION_GP, 0);
+            return { 0, 0, 0 };
+        }
+
+        return code;
+    }
+
+    void CPU::jumpFar(uint16_t selector, uint32_t offset) {
+        if (!protectedMode() || getFlag(VM)) {
+            loadSegment(CS, selector);
+            setRegister(EIP, offset);
+            return;
+        }
+
+        SegmentDescriptor code = transferTarget(selector, offset);
+
+        commitSegment(CS, (selector & 0xfffc) | cpl(), code);
+        setRegister(EIP, offset);
+    }
+
+    void CPU::callFar(uint16_t selector, uint32_t offset, uint32_t returnIP, bool operand32) {
+        const uint32_t frame[] = { getRegister(CS), returnIP };
+
+        if (!protectedMode() || getFlag(VM)) {
+            pushFrame(frame, 2, operand32 ? 4 : 2);
+            loadSegment(CS, selector);
+            setRegister(EIP, offset);
+            return;
+        }
+
+        SegmentDescriptor code = transferTarget(selector, offset);
+
+        pushFrame(frame, 2, operand32 ? 4 : 2);
+        commitSegment(CS, (selector & 0xfffc) | cpl(), code);
+        setRegister(EIP, offset);
+    }
+
+    void CPU::returnFar(bool operand32, uint16_t release, bool iret) {
+        uint32_t width = operand32 ? 4 : 2;
+        uint32_t sp = getStackPointer();
+
+        // SP only moves once everything has been checked
+        uint32_t ip = operand32 ? peekStackImm32(0) : peekStackImm16(0);
+        uint16_t selector = operand32 ? peekStackImm32(4) : peekStackImm16(2);
+        uint32_t flags = getEFLAGS();
+        uint32_t frame = width * 2;
+
+        if (iret) {
+            flags = operand32 ? peekStackImm32(8) : (flags & 0xffff0000) | peekStackImm16(4);
+            frame += width;
+        }
+
+        if (!protectedMode() || getFlag(VM)) {
+            loadSegment(CS, selector);
+            setStackPointer(sp + frame + release);
+            setRegister(EIP, ip);
+
+            if (iret)
+                setEFLAGS(flags);
+
+            return;
+        }
+
+        uint8_t current = cpl();
+        uint8_t rpl = selector & 3;
+
+        if (rpl < current) {
+            raiseFault(EXCEPTION_GP, selector & 0xfffc);
+            return;
+        }
+
+        SegmentDescriptor code = readDescriptor(CS, selector, current);
+        uint8_t dpl = (code.attributes & SEG_DPL) >> 5;
+
+        if ((code.attributes & SEG_CONFORMING) ? dpl > rpl : dpl != rpl) {
+            raiseFault(EXCEPTION_GP, selector & 0xfffc);
+            return;
+        }
+
+        if (ip > code.limit) {
+            raiseFault(EXCEPTION_GP, 0);
+            return;
+        }
+
+        if (iret) {
+            // virtual 8086 mode is not emulated, IOPL only changes at CPL 0 and IF only within IOPL
+            uint32_t kept = 1 << VM;
+
+            if (current > 0)
+                kept |= 3 << IOPL;
+            if (current > ((getEFLAGS() >> IOPL) & 3))
+                kept |= 1 << IF;
+
+            flags = (flags & ~kept) | (getEFLAGS() & kept);
+        }
+
+        if (rpl == current) {
+            commitSegment(CS, selector, code);
+            setStackPointer(sp + frame + release);
+            setRegister(EIP, ip);
+
+            if (iret)
+                setEFLAGS(flags);
+
+            return;
+        }
+
+        // back to an outer level, its SS:ESP come after the return address. RET n releases the
+        // parameters from both stacks
+        frame += iret ? 0 : release;
+
+        uint32_t esp = operand32 ? peekStackImm32(frame) : peekStackImm16(frame);
+        uint16_t stackSelector = operand32 ? peekStackImm32(frame + 4) : peekStackImm16(frame + 2);
+        SegmentDescriptor stack = readDescriptor(SS, stackSelector, rpl);
+
+        commitSegment(CS, selector, code);
+        commitSegment(SS, stackSelector, stack);
+
+        if (operand32)
+            _registers[ESP] = esp;
+
+        setStackPointer(esp + (iret ? 0 : release));
+        setRegister(EIP, ip);
+
+        if (iret)
+            setEFLAGS(flags);
+
+        // data segments the outer level may not use are nulled rather than left behind
+        for (Registers seg : { DS, ES, FS, GS }) {
+            uint16_t attributes = _segments[seg - CS].attributes;
+            bool conforming = (attributes & SEG_EXECUTABLE) && (attributes & SEG_CONFORMING);
+
+            if (!conforming && ((attributes & SEG_DPL) >> 5) < rpl)
+                commitSegment(seg, 0, { 0, 0, 0 });
+        }
+    }
+
+    void CPU::innerStack(uint8_t level, uint16_t &selector, uint32_t &esp) {
+        // a 32 bit TSS has ESPn:SSn at 4 + 8n, a 16 bit one SPn:SSn at 2 + 4n
+        bool tss32 = _tss.attributes & 0b1000;
+        uint32_t offset = tss32 ? 4 + level * 8 : 2 + level * 4;
+
+        if (!(_tss.attributes & SEG_PRESENT) || offset + (tss32 ? 7 : 3) > _tss.limit) {
+            raiseFault(EXCEPTION_TS, getRegister(TR) & 0xfffc);
+            return;
+        }
+
+        if (tss32) {
+            esp = _mmu.readSystem32(_tss.base + offset);
+            selector = _mmu.readSystem32(_tss.base + offset + 4);
+        }
+        else {
+            uint32_t value = _mmu.readSystem32(_tss.base + offset);
+            esp = value & 0xffff;
+            selector = value >> 16;
+        }
+    }
+
+    void CPU::loadLDT(uint16_t selector) {
+        uint16_t error = selector & 0xfffc;
+
+        if (error == 0) {
+            // a null LDT leaves every LDT selector invalid
+            setRegister(LDTR, selector);
+            _ldt = { 0, 0, 0 };
+            return;
+        }
+
+        if ((selector & 0b100) || (selector & 0xfff8) + 7 > _gdtr.limit) {
+            raiseFault(EXCEPTION_GP, error);
+            return;
+        }
+
+        SegmentDescriptor descriptor = decodeDescriptor(_mmu.readSystem32(_gdtr.base + (selector & 0xfff8)),
+                                                        _mmu.readSystem32(_gdtr.base + (selector & 0xfff8) + 4));
+
+        if ((descriptor.attributes & (SEG_CODE_DATA | 0xf)) != SYSTEM_LDT) {
+            raiseFault(EXCEPTION_GP, error);
+            return;
+        }
+
+        if (!(descriptor.attributes & SEG_PRESENT)) {
+            raiseFault(EXCEPTION_NP, error);
+            return;
+        }
+
+        setRegister(LDTR, selector);
+        _ldt = descriptor;
+    }
+
+    void CPU::loadTaskRegister(uint16_t selector) {
+        uint16_t error = selector & 0xfffc;
+
+        if (error == 0 || (selector & 0b100) || (selector & 0xfff8) + 7 > _gdtr.limit) {
+            raiseFault(EXCEPTION_GP, error);
+            return;
+        }
+
+        uint32_t entry = _gdtr.base + (selector & 0xfff8);
+        uint32_t high = _mmu.readSystem32(entry + 4);
+        SegmentDescriptor descriptor = decodeDescriptor(_mmu.readSystem32(entry), high);
+        uint8_t type = descriptor.attributes & (SEG_CODE_DATA | 0xf);
+
+        // only an available TSS can be loaded
+        if (type != SYSTEM_TSS16 && type != SYSTEM_TSS32) {
+            raiseFault(EXCEPTION_GP, error);
+            return;
+        }
+
+        if (!(descriptor.attributes & SEG_PRESENT)) {
+            raiseFault(EXCEPTION_NP, error);
+            return;
+        }
+
+        // the busy bit is the second bit of the type
+        high |= 1 << 9;
+        _mmu.writeBlock(entry + 4, (const uint8_t*) &high, 4, false);
+
+        descriptor.attributes |= 0b10;
+        setRegister(TR, selector);
+        _tss = descriptor;
+    }
+
+    void CPU::loadGDT(uint32_t base, uint16_t limit) {
+        _gdtr = { base, limit };
+    }
+
+    void CPU::loadIDT(uint32_t base, uint16_t limit) {
+        _idtr = { base, limit };
+    }
+
+    DescriptorTableRegister CPU::getGDT() {
+        return _gdtr;
+    }
+
+    DescriptorTableRegister CPU::getIDT() {
+        return _idtr;
+    }
+
+    bool CPU::verifySegment(uint16_t selector, bool write) {
+        uint32_t base = _gdtr.base;
+        uint32_t limit = _gdtr.limit;
+
+        if (selector & 0b100) {
+            if (!(_ldt.attributes & SEG_PRESENT))
+                return false;
+
+            base = _ldt.base;
+            limit = _ldt.limit;
+        }
+
+        uint32_t index = selector & 0xfff8;
+        if ((selector & 0xfffc) == 0 || index + 7 > limit)
+            return false;
+
+        uint16_t attributes = decodeDescriptor(_mmu.readSystem32(base + index),
+                                               _mmu.readSystem32(base + index + 4)).attributes;
+        uint8_t dpl = (attributes & SEG_DPL) >> 5;
+        bool executable = attributes & SEG_EXECUTABLE;
+
+        if (!(attributes & SEG_CODE_DATA))
+            return false;
+
+        // conforming code can be read from any level
+        if (!(executable && (attributes & SEG_CONFORMING)) && dpl < std::max<uint8_t>(cpl(), selector & 3))
+            return false;
+
+        // code is never writable, and only readable with the R bit
+        if (write)
+            return !executable && (attributes & SEG_RW);
+
+        return !executable || (attributes & SEG_RW);
+    }
+
+    void CPU::segmentLimitViolation(Registers seg, uint32_t offset) {
+        fault(seg == SS ? EXCEPTION_SS : EXCEPTION_GP, true, 0);
+    }
+
+    uint8_t CPU::readImm8(Registers seg, uint32_t offset) {
+        if (_locked.active) [[unlikely]]
+            return lockedRead<uint8_t>(linearAddress(seg, offset, 1));
+
+        return _mmu.readImm8(linearAddress(seg, offset, 1));
+    }
+
+    uint16_t CPU::readImm16(Registers seg, uint32_t offset) {
+        if (_locked.active) [[unlikely]]
+            return lockedRead<uint16_t>(linearAddress(seg, offset, 2));
+
+        return _mmu.readImm16(linearAddress(seg, offset, 2));
+    }
+
+    uint32_t CPU::readImm32(Registers seg, uint32_t offset) {
+        if (_locked.active) [[unlikely]]
+            return lockedRead<uint32_t>(linearAddress(seg, offset, 4));
+
+        return _mmu.readImm32(linearAddress(seg, offset, 4));
+    }
+
+    void CPU::probeWrite(Registers seg, uint32_t offset, uint32_t size) {
+        _mmu.probe(linearAddress(seg, offset, size), size, memory::WRITE);
+    }
+
+    uint8_t CPU::fetchImm8(uint32_t offset) {
+        return _mmu.fetchImm8(linearAddress(CS, offset, 1));
+    }
+
+    void CPU::writeImm8(uint8_t val, Registers seg, uint32_t offset) {
+        if (_locked.active) [[unlikely]]
+            return lockedWrite<uint8_t>(val, linearAddress(seg, offset, 1));
+
+        _mmu.writeImm8(val, linearAddress(seg, offset, 1));
+    }
+
+    void CPU::writeImm16(uint16_t val, Registers seg, uint32_t offset) {
+        if (_locked.active) [[unlikely]]
+            return lockedWrite<uint16_t>(val, linearAddress(seg, offset, 2));
+
+        _mmu.writeImm16(val, linearAddress(seg, offset, 2));
+    }
+
+    void CPU::writeImm32(uint32_t val, Registers seg, uint32_t offset) {
+        if (_locked.active) [[unlikely]]
+            return lockedWrite<uint32_t>(val, linearAddress(seg, offset, 4));
+
+        _mmu.writeImm32(val, linearAddress(seg, offset, 4));
+    }
+
+    void CPU::beginLocked() {
+        _locked = { true, false, 0, nullptr, 0 };
+    }
+
+    void CPU::endLocked() {
+        if (_locked.busLocked)
+            _memory.busLock().unlock();
+
+        _locked.active = false;
+        _locked.busLocked = false;
+    }
+
+    template<typename T>
+    T CPU::lockedRead(uint32_t linear) {
+        // host atomics need natural alignment, which also keeps the operand on one page
+        uint8_t* host = (linear & (sizeof(T) - 1)) == 0 ? _mmu.writePointer(linear) : nullptr;
+
+        if (host) {
+            T value = std::atomic_ref<T>(*(T*) host).load();
+
+            _locked.linear = linear;
+            _locked.host = host;
+            _locked.value = value;
+            return value;
+        }
+
+        if (!_locked.busLocked) {
+            _memory.busLock().lock();
+            _locked.busLocked = true;
+        }
+
+        if constexpr (sizeof(T) == 1)
+            return _mmu.readImm8(linear);
+        else if constexpr (sizeof(T) == 2)
+            return _mmu.readImm16(linear);
+        else
+            return _mmu.readImm32(linear);
+    }
+
+    template<typename T>
+    void CPU::lockedWrite(T value, uint32_t linear) {
+        if (_locked.host && _locked.linear == linear) {
+            T expected = (T) _locked.value;
+
+            // another CPU got in between, the run loop restarts the instruction on the new value
+            if (!std::atomic_ref<T>(*(T*) _locked.host).compare_exchange_strong(expected, value))
+                std::longjmp(_faultJump, 1);
+
+            return;
+        }
+
+        if (!_locked.busLocked) {
+            _memory.busLock().lock();
+            _locked.busLocked = true;
+        }
+
+        if constexpr (sizeof(T) == 1)
+            _mmu.writeImm8(value, linear);
+        else if constexpr (sizeof(T) == 2)
+            _mmu.writeImm16(value, linear);
+        else
+            _mmu.writeImm32(value, linear);
+    }
+
+    void CPU::fetchInstruction(Opcode &opcode) {
+        uint32_t eip = getRegister(EIP);
+        SegmentDescriptor& cs = _segments[CS - CS];
+
+        opcode.beginIP = eip;
+        opcode.position = 0;
+        opcode.length = 0;
+
+        if (eip > cs.limit) {
+            // let the slow path report it
+            return;
+        }
+
+        // everything up to the end of the page and the segment can be loaded at once,
+        // the rest is fetched on demand so a fault is only raised for bytes that are really used
+        uint32_t linear = cs.base + eip;
+        uint32_t available = std::min<uint32_t>(Opcode::MAX_LENGTH, cs.limit - eip + 1);
+        available = std::min<uint32_t>(available, memory::PAGE_SIZE - (linear & memory::PAGE_MASK));
+
+        const uint8_t* host = _mmu.fetchPointer(linear);
+
+        if (host) [[likely]] {
+            std::memcpy(opcode.bytes, host, available);
+            opcode.length = available;
+        }
+    }
+
+    const uint8_t *CPU::instructionPointer(uint32_t &available) {
+        uint32_t eip = getRegister(EIP);
+        SegmentDescriptor& cs = _segments[CS - CS];
+
+        if (eip > cs.limit)
+            return nullptr;
+
+        uint32_t linear = cs.base + eip;
+        available = std::min<uint32_t>(cs.limit - eip + 1, memory::PAGE_SIZE - (linear & memory::PAGE_MASK));
+
+        return _mmu.fetchPointer(linear);
+    }
+
+    uint8_t CPU::fetchSlow(Opcode &opcode) {
+        if (opcode.length >= Opcode::MAX_LENGTH) {
+            raiseFault(EXCEPTION_GP, 0);
+            return 0;
+        }
+
+        uint8_t value = fetchImm8(opcode.beginIP + opcode.length);
+        opcode.bytes[opcode.length++] = value;
+        opcode.position++;
+
+        return value;
+    }
+
+    void CPU::parseModRM(Opcode &opcode) {
+        opcode.modrm_or_sib_value = nextImm8(opcode);
         opcode.mod_or_index = opcode.modrm_or_sib_value >> 6;
         opcode.rm_or_ss = opcode.modrm_or_sib_value & 0b00000111;
     }
@@ -164,6 +1121,12 @@ namespace x86e::cpu {
                 return offset == 0 ? BH : offset == 1 ? DI : EDI;           \
         }
 
+        // BP based addressing defaults to the stack segment
+        if (!side && !opcode.segmentOverride && opcode.mod_or_index != 0b11) {
+            if (opcode.rm_or_ss == 0x2 || opcode.rm_or_ss == 0x3 || (opcode.rm_or_ss == 0x6 && opcode.mod_or_index != 0b00))
+                opcode.segment = SS;
+        }
+
         // todo: this is a mess. I'll make it better someday
         switch (opcode.mod_or_index) {
             case 0b00:
@@ -177,40 +1140,40 @@ namespace x86e::cpu {
                     if (opcode.rm_or_ss == 0x3) return getRegister(BP) + getRegister(DI);
                     if (opcode.rm_or_ss == 0x4) return getRegister(SI);
                     if (opcode.rm_or_ss == 0x5) return getRegister(DI);
-                    if (opcode.rm_or_ss == 0x6) return _memory.readImm16(incGetRegister(EIP, 2));
+                    if (opcode.rm_or_ss == 0x6) return nextImm16(opcode);
                     if (opcode.rm_or_ss == 0x7) return getRegister(BX);
                 }
                 break;
 
             case 0b01:
                 if (side) {
-                    GET_REGISTER16(0x40)
+                    GET_REGISTER16(0x4)
                 }
                 else {
-                    if (opcode.rm_or_ss == 0x0) return getRegister(BX) + getRegister(SI) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x1) return getRegister(BX) + getRegister(DI) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x2) return getRegister(BP) + getRegister(SI) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x3) return getRegister(BP) + getRegister(DI) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x4) return getRegister(SI) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x5) return getRegister(DI) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x6) return getRegister(BP) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x7) return getRegister(BX) + _memory.readImm8(incGetRegister(EIP));
+                    if (opcode.rm_or_ss == 0x0) return getRegister(BX) + getRegister(SI) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x1) return getRegister(BX) + getRegister(DI) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x2) return getRegister(BP) + getRegister(SI) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x3) return getRegister(BP) + getRegister(DI) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x4) return getRegister(SI) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x5) return getRegister(DI) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x6) return getRegister(BP) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x7) return getRegister(BX) + (int8_t) nextImm8(opcode);
                 }
                 break;
 
             case 0b10:
                 if (side) {
-                    GET_REGISTER16(0x80)
+                    GET_REGISTER16(0x8)
                 }
                 else {
-                    if (opcode.rm_or_ss == 0x0) return getRegister(BX) + getRegister(SI) + _memory.readImm16(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x1) return getRegister(BX) + getRegister(DI) + _memory.readImm16(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x2) return getRegister(BP) + getRegister(SI) + _memory.readImm16(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x3) return getRegister(BP) + getRegister(DI) + _memory.readImm16(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x4) return getRegister(SI) + _memory.readImm16(incGetRegister(EIP, 2));
-                    if (opcode.rm_or_ss == 0x5) return getRegister(DI) + _memory.readImm16(incGetRegister(EIP, 2));
-                    if (opcode.rm_or_ss == 0x6) return getRegister(BP) + _memory.readImm16(incGetRegister(EIP, 2));
-                    if (opcode.rm_or_ss == 0x7) return getRegister(BX) + _memory.readImm16(incGetRegister(EIP, 2));
+                    if (opcode.rm_or_ss == 0x0) return getRegister(BX) + getRegister(SI) + nextImm16(opcode);
+                    if (opcode.rm_or_ss == 0x1) return getRegister(BX) + getRegister(DI) + nextImm16(opcode);
+                    if (opcode.rm_or_ss == 0x2) return getRegister(BP) + getRegister(SI) + nextImm16(opcode);
+                    if (opcode.rm_or_ss == 0x3) return getRegister(BP) + getRegister(DI) + nextImm16(opcode);
+                    if (opcode.rm_or_ss == 0x4) return getRegister(SI) + nextImm16(opcode);
+                    if (opcode.rm_or_ss == 0x5) return getRegister(DI) + nextImm16(opcode);
+                    if (opcode.rm_or_ss == 0x6) return getRegister(BP) + nextImm16(opcode);
+                    if (opcode.rm_or_ss == 0x7) return getRegister(BX) + nextImm16(opcode);
                 }
                 break;
 
@@ -263,6 +1226,12 @@ namespace x86e::cpu {
                 return offset == 0 ? BH : offset == 1 ? DI : EDI;           \
         }
 
+        // EBP based addressing defaults to the stack segment, see sibByte32bit() for the SIB forms
+        if (!side && !opcode.segmentOverride && opcode.mod_or_index != 0b11) {
+            if (opcode.rm_or_ss == 0x5 && opcode.mod_or_index != 0b00)
+                opcode.segment = SS;
+        }
+
         // todo: this is a mess. I'll make it better someday
         switch (opcode.mod_or_index) {
             case 0b00:
@@ -274,8 +1243,8 @@ namespace x86e::cpu {
                     if (opcode.rm_or_ss == 0x1) return getRegister(ECX);
                     if (opcode.rm_or_ss == 0x2) return getRegister(EDX);
                     if (opcode.rm_or_ss == 0x3) return getRegister(EBX);
-                    if (opcode.rm_or_ss == 0x4) return sibByte32bit(opcode, side);
-                    if (opcode.rm_or_ss == 0x5) return _memory.readImm32(incGetRegister(EIP, 4));
+                    if (opcode.rm_or_ss == 0x4) return sibByte32bit(opcode);
+                    if (opcode.rm_or_ss == 0x5) return nextImm32(opcode);
                     if (opcode.rm_or_ss == 0x6) return getRegister(ESI);
                     if (opcode.rm_or_ss == 0x7) return getRegister(EDI);
                 }
@@ -283,33 +1252,40 @@ namespace x86e::cpu {
 
             case 0b01:
                 if (side) {
-                    GET_REGISTER32(0x40)
+                    GET_REGISTER32(0x4)
                 }
                 else {
-                    if (opcode.rm_or_ss == 0x0) return getRegister(EAX) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x1) return getRegister(ECX) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x2) return getRegister(EDX) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x3) return getRegister(EBX) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x4) return sibByte32bit(opcode, side) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x5) return getRegister(EBP) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x6) return getRegister(ESI) + _memory.readImm8(incGetRegister(EIP));
-                    if (opcode.rm_or_ss == 0x7) return getRegister(EDI) + _memory.readImm8(incGetRegister(EIP));
+                    if (opcode.rm_or_ss == 0x0) return getRegister(EAX) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x1) return getRegister(ECX) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x2) return getRegister(EDX) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x3) return getRegister(EBX) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x4) {
+                        // the displacement follows the SIB byte
+                        uint32_t address = sibByte32bit(opcode);
+                        return address + (int8_t) nextImm8(opcode);
+                    }
+                    if (opcode.rm_or_ss == 0x5) return getRegister(EBP) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x6) return getRegister(ESI) + (int8_t) nextImm8(opcode);
+                    if (opcode.rm_or_ss == 0x7) return getRegister(EDI) + (int8_t) nextImm8(opcode);
                 }
                 break;
 
             case 0b10:
                 if (side) {
-                    GET_REGISTER32(0x80)
+                    GET_REGISTER32(0x8)
                 }
                 else {
-                    if (opcode.rm_or_ss == 0x0) return getRegister(EAX) + _memory.readImm32(incGetRegister(EIP, 4));
-                    if (opcode.rm_or_ss == 0x1) return getRegister(ECX) + _memory.readImm32(incGetRegister(EIP, 4));
-                    if (opcode.rm_or_ss == 0x2) return getRegister(EDX) + _memory.readImm32(incGetRegister(EIP, 4));
-                    if (opcode.rm_or_ss == 0x3) return getRegister(EBX) + _memory.readImm32(incGetRegister(EIP, 4));
-                    if (opcode.rm_or_ss == 0x4) return sibByte32bit(opcode, side) + _memory.readImm32(incGetRegister(EIP, 4));
-                    if (opcode.rm_or_ss == 0x5) return getRegister(EBP) + _memory.readImm32(incGetRegister(EIP, 4));
-                    if (opcode.rm_or_ss == 0x6) return getRegister(ESI) + _memory.readImm32(incGetRegister(EIP, 4));
-                    if (opcode.rm_or_ss == 0x7) return getRegister(EDI) + _memory.readImm32(incGetRegister(EIP, 4));
+                    if (opcode.rm_or_ss == 0x0) return getRegister(EAX) + nextImm32(opcode);
+                    if (opcode.rm_or_ss == 0x1) return getRegister(ECX) + nextImm32(opcode);
+                    if (opcode.rm_or_ss == 0x2) return getRegister(EDX) + nextImm32(opcode);
+                    if (opcode.rm_or_ss == 0x3) return getRegister(EBX) + nextImm32(opcode);
+                    if (opcode.rm_or_ss == 0x4) {
+                        uint32_t address = sibByte32bit(opcode);
+                        return address + nextImm32(opcode);
+                    }
+                    if (opcode.rm_or_ss == 0x5) return getRegister(EBP) + nextImm32(opcode);
+                    if (opcode.rm_or_ss == 0x6) return getRegister(ESI) + nextImm32(opcode);
+                    if (opcode.rm_or_ss == 0x7) return getRegister(EDI) + nextImm32(opcode);
                 }
                 break;
 
@@ -338,123 +1314,238 @@ namespace x86e::cpu {
         return 0;
     }
 
-    uint32_t CPU::sibByte32bit(Opcode &opcode, bool side) {
-#define GET_REGISTER_SIB                                                    \
-        switch (opcode.modrm_or_sib_value >> 4) {                           \
-            case 0x00:                                                      \
-            case 0x08:                                                      \
-                return EAX;                                                 \
-                                                                            \
-            case 0x01:                                                      \
-            case 0x09:                                                      \
-                return ECX;                                                 \
-                                                                            \
-            case 0x02:                                                      \
-            case 0x0A:                                                      \
-                return EDX;                                                 \
-                                                                            \
-            case 0x03:                                                      \
-            case 0x0B:                                                      \
-                return EBX;                                                 \
-                                                                            \
-            case 0x04:                                                      \
-            case 0x0C:                                                      \
-                return ESP;                                                 \
-                                                                            \
-            case 0x05:                                                      \
-            case 0x0D:                                                      \
-                return opcode.mod_or_index == 0b00 ? _memory.readImm32(incGetRegister(EIP, 4)) \
-                        : opcode.mod_or_index == 0b01 ? getRegister(EBP) + _memory.readImm8(incGetRegister(EIP)) : \
-                                                        getRegister(EBP) + _memory.readImm32(incGetRegister(EIP, 4)); \
-                                                                            \
-            case 0x06:                                                      \
-            case 0x0E:                                                      \
-                return ESI;                                                 \
-                                                                            \
-            case 0x07:                                                      \
-            case 0x0F:                                                      \
-                return EDI;                                                 \
-                                                                            \
+    uint32_t CPU::sibByte32bit(Opcode &opcode) {
+        uint8_t sib = nextImm8(opcode);
+        uint8_t scale = sib >> 6;
+        uint8_t index = (sib >> 3) & 0b111;
+        uint8_t base = sib & 0b111;
+
+        // ESP based addressing defaults to the stack segment, EBP based too unless it is a bare displacement
+        if (!opcode.segmentOverride && (base == 0x4 || (base == 0x5 && opcode.mod_or_index != 0b00)))
+            opcode.segment = SS;
+
+        // an index of ESP means none
+        uint32_t address = index == 0x4 ? 0 : _registers[EAX + index] << scale;
+
+        if (base == 0x5 && opcode.mod_or_index == 0b00)
+            return address + nextImm32(opcode);
+
+        return address + _registers[EAX + base];
+    }
+
+    template<typename T>
+    inline void CPU::stackWrite(uint32_t offset, T value) {
+        uint32_t linear = linearAddress(SS, offset, sizeof(T));
+        uint8_t* host = (linear & memory::PAGE_MASK) <= memory::PAGE_SIZE - sizeof(T) ? _mmu.stackPage(linear) : nullptr;
+
+        if (host) [[likely]] {
+            std::memcpy(host + (linear & memory::PAGE_MASK), &value, sizeof(T));
+            return;
         }
 
-        if (side)
-            GET_REGISTER_SIB
+        if constexpr (sizeof(T) == 1) _mmu.writeImm8(value, linear);
+        else if constexpr (sizeof(T) == 2) _mmu.writeImm16(value, linear);
+        else _mmu.writeImm32(value, linear);
+    }
 
-        switch (opcode.mod_or_index) {
-            case 0b00:
-                if (opcode.rm_or_ss == 0x0) return getRegister(EAX);
-                if (opcode.rm_or_ss == 0x1) return getRegister(ECX);
-                if (opcode.rm_or_ss == 0x2) return getRegister(EDX);
-                if (opcode.rm_or_ss == 0x3) return getRegister(EBX);
-                if (opcode.rm_or_ss == 0x4) return 0;
-                if (opcode.rm_or_ss == 0x5) return getRegister(EBP);
-                if (opcode.rm_or_ss == 0x6) return getRegister(ESI);
-                if (opcode.rm_or_ss == 0x7) return getRegister(EDI);
-                break;
+    template<typename T>
+    inline T CPU::stackRead(uint32_t offset) {
+        uint32_t linear = linearAddress(SS, offset, sizeof(T));
+        uint8_t* host = (linear & memory::PAGE_MASK) <= memory::PAGE_SIZE - sizeof(T) ? _mmu.stackPage(linear) : nullptr;
 
-            case 0b01:
-                if (opcode.rm_or_ss == 0x0) return getRegister(EAX) * 2;
-                if (opcode.rm_or_ss == 0x1) return getRegister(ECX) * 2;
-                if (opcode.rm_or_ss == 0x2) return getRegister(EDX) * 2;
-                if (opcode.rm_or_ss == 0x3) return getRegister(EBX) * 2;
-                if (opcode.rm_or_ss == 0x4) return 0;
-                if (opcode.rm_or_ss == 0x5) return getRegister(EBP) * 2;
-                if (opcode.rm_or_ss == 0x6) return getRegister(ESI) * 2;
-                if (opcode.rm_or_ss == 0x7) return getRegister(EDI) * 2;
-                break;
+        if (host) [[likely]] {
+            T value;
+            std::memcpy(&value, host + (linear & memory::PAGE_MASK), sizeof(T));
+            return value;
+        }
 
-            case 0b10:
-                if (opcode.rm_or_ss == 0x0) return getRegister(EAX) * 4;
-                if (opcode.rm_or_ss == 0x1) return getRegister(ECX) * 4;
-                if (opcode.rm_or_ss == 0x2) return getRegister(EDX) * 4;
-                if (opcode.rm_or_ss == 0x3) return getRegister(EBX) * 4;
-                if (opcode.rm_or_ss == 0x4) return 0;
-                if (opcode.rm_or_ss == 0x5) return getRegister(EBP) * 4;
-                if (opcode.rm_or_ss == 0x6) return getRegister(ESI) * 4;
-                if (opcode.rm_or_ss == 0x7) return getRegister(EDI) * 4;
-                break;
+        if constexpr (sizeof(T) == 1) return _mmu.readImm8(linear);
+        else if constexpr (sizeof(T) == 2) return _mmu.readImm16(linear);
+        else return _mmu.readImm32(linear);
+    }
 
-            case 0b11:
-                if (opcode.rm_or_ss == 0x0) return getRegister(EAX) * 8;
-                if (opcode.rm_or_ss == 0x1) return getRegister(ECX) * 8;
-                if (opcode.rm_or_ss == 0x2) return getRegister(EDX) * 8;
-                if (opcode.rm_or_ss == 0x3) return getRegister(EBX) * 8;
-                if (opcode.rm_or_ss == 0x4) return 0;
-                if (opcode.rm_or_ss == 0x5) return getRegister(EBP) * 8;
-                if (opcode.rm_or_ss == 0x6) return getRegister(ESI) * 8;
-                if (opcode.rm_or_ss == 0x7) return getRegister(EDI) * 8;
-                break;
+    void CPU::stackWriteBlock(uint32_t offset, const uint8_t *data, uint32_t size) {
+        uint32_t linear = _segments[SS - CS].base + offset;
 
-            default:
-                // huh?
-                return 0;
+        // blocks that wrap around the stack segment or cross a page go byte by byte
+        if ((uint64_t) offset + size - 1 <= stackMask() && (linear & memory::PAGE_MASK) + size <= memory::PAGE_SIZE) {
+            uint8_t* host = _mmu.stackPage(linearAddress(SS, offset, size));
+
+            if (host) [[likely]] {
+                std::memcpy(host + (linear & memory::PAGE_MASK), data, size);
+                return;
+            }
         }
 
-        return 0;
+        writeStack(_segments[SS - CS], offset, data, size, _mmu.userMode(), 0);
     }
 
-    void CPU::pushOntoStackImm8(uint8_t value) {
-        _memory.writeImm8(value, decGetRegister(ESP));
+    void CPU::writeStack(const SegmentDescriptor &stack, uint32_t offset, const uint8_t *data, uint32_t size, bool user,
+                         uint32_t errorCode) {
+        uint32_t mask = (stack.attributes & SEG_DB) ? 0xffffffff : 0xffff;
+        // the part above offset, the rest wraps around to the bottom of the segment
+        uint32_t first = std::min<uint64_t>(size, (uint64_t) mask - offset + 1);
+
+        if (!(stack.attributes & SEG_PRESENT) || (uint64_t) offset + first - 1 > stack.limit ||
+            (first < size && size - first - 1 > stack.limit)) {
+            raiseFault(EXCEPTION_SS, errorCode);
+            return;
+        }
+
+        if (first < size && !_mmu.probe(stack.base, size - first, memory::WRITE, user))
+            return;
+
+        // both parts are translated before either is written
+        if (!_mmu.writeBlock(stack.base + offset, data, first, user))
+            return;
+
+        if (first < size)
+            _mmu.writeBlock(stack.base, data + first, size - first, user);
     }
 
-    void CPU::pushOntoStackImm16(uint16_t value) {
-        _memory.writeImm16(value, decGetRegister(ESP, 2));
+    void CPU::stackReadBlock(uint32_t offset, uint8_t *data, uint32_t size) {
+        uint32_t linear = _segments[SS - CS].base + offset;
+
+        if ((uint64_t) offset + size - 1 <= stackMask() && (linear & memory::PAGE_MASK) + size <= memory::PAGE_SIZE) {
+            uint8_t* host = _mmu.stackPage(linearAddress(SS, offset, size));
+
+            if (host) [[likely]] {
+                std::memcpy(data, host + (linear & memory::PAGE_MASK), size);
+                return;
+            }
+        }
+
+        for (uint32_t i = 0; i < size; i++)
+            data[i] = stackRead<uint8_t>((offset + i) & stackMask());
     }
 
-    void CPU::pushOntoStackImm32(uint32_t value) {
-        _memory.writeImm32(value, decGetRegister(ESP, 4));
+    void CPU::pushFrame(const uint32_t *values, uint32_t count, uint32_t width) {
+        uint32_t sp = (getStackPointer() - count * width) & stackMask();
+        uint8_t frame[32];
+
+        serializeFrame(values, count, width, frame);
+        stackWriteBlock(sp, frame, count * width);
+        setStackPointer(sp);
     }
 
-    uint8_t CPU::popFromStackImm8() {
-        return _memory.readImm8(incGetRegister(ESP));
+    void CPU::pushOntoStackImm16(uint16_t value) {
+        uint32_t sp = (getStackPointer() - 2) & stackMask();
+        stackWrite<uint16_t>(sp, value);
+        setStackPointer(sp);
+    }
+
+    void CPU::pushOntoStackImm32(uint32_t value) {
+        uint32_t sp = (getStackPointer() - 4) & stackMask();
+        stackWrite<uint32_t>(sp, value);
+        setStackPointer(sp);
     }
 
     uint16_t CPU::popFromStackImm16() {
-        return _memory.readImm16(incGetRegister(ESP, 1));
+        uint32_t sp = getStackPointer();
+        uint16_t value = stackRead<uint16_t>(sp);
+        setStackPointer(sp + 2);
+        return value;
     }
 
     uint32_t CPU::popFromStackImm32() {
-        return _memory.readImm32(incGetRegister(ESP, 3));
+        uint32_t sp = getStackPointer();
+        uint32_t value = stackRead<uint32_t>(sp);
+        setStackPointer(sp + 4);
+        return value;
+    }
+
+    uint16_t CPU::peekStackImm16(uint32_t offset) {
+        return stackRead<uint16_t>((getStackPointer() + offset) & stackMask());
+    }
+
+    uint32_t CPU::peekStackImm32(uint32_t offset) {
+        return stackRead<uint32_t>((getStackPointer() + offset) & stackMask());
+    }
+
+    void CPU::pushAll(bool operand32) {
+        uint32_t width = operand32 ? 4 : 2;
+        uint32_t sp = (getStackPointer() - width * 8) & stackMask();
+        uint8_t frame[32];
+
+        // EDI ends up on top, the pushed ESP is the one from before the instruction
+        for (int i = 0; i < 8; i++)
+            std::memcpy(frame + (7 - i) * width, &_registers[EAX + i], width);
+
+        stackWriteBlock(sp, frame, width * 8);
+        setStackPointer(sp);
+    }
+
+    void CPU::popAll(bool operand32) {
+        uint32_t width = operand32 ? 4 : 2;
+        uint32_t sp = getStackPointer();
+        uint8_t frame[32];
+
+        stackReadBlock(sp, frame, width * 8);
+
+        for (int i = 0; i < 8; i++) {
+            // the saved ESP is skipped
+            if (EAX + i == ESP)
+                continue;
+
+            uint32_t value = 0;
+            std::memcpy(&value, frame + (7 - i) * width, width);
+
+            if (operand32)
+                _registers[EAX + i] = value;
+            else
+                _registers[EAX + i] = (_registers[EAX + i] & 0xffff0000) | value;
+        }
+
+        setStackPointer(sp + width * 8);
+    }
+
+    void CPU::enterFrame(uint16_t size, uint8_t level, bool operand32) {
+        uint32_t width = operand32 ? 4 : 2;
+        uint32_t values[32];
+        uint32_t count = 0;
+        level &= 0x1f;
+
+        values[count++] = _registers[EBP];
+        uint32_t frame = (getStackPointer() - width) & stackMask();
+
+        if (level > 0) {
+            // copy the frame pointers of the enclosing procedures
+            uint32_t bp = _registers[EBP] & stackMask();
+
+            for (uint8_t i = 1; i < level; i++) {
+                bp = (bp - width) & stackMask();
+                values[count++] = operand32 ? stackRead<uint32_t>(bp) : stackRead<uint16_t>(bp);
+            }
+
+            values[count++] = frame;
+        }
+
+        // the whole frame goes onto the stack at once, only then do EBP and ESP change
+        uint32_t top = (getStackPointer() - count * width) & stackMask();
+        uint8_t bytes[128];
+
+        serializeFrame(values, count, width, bytes);
+        stackWriteBlock(top, bytes, count * width);
+
+        if (operand32)
+            _registers[EBP] = frame;
+        else
+            _registers[EBP] = (_registers[EBP] & 0xffff0000) | (uint16_t) frame;
+
+        setStackPointer(top - size);
+    }
+
+    void CPU::leaveFrame(bool operand32) {
+        // the saved frame pointer is read before either register changes
+        uint32_t sp = _registers[EBP] & stackMask();
+        uint32_t bp = operand32 ? stackRead<uint32_t>(sp) : stackRead<uint16_t>(sp);
+
+        setStackPointer(sp + (operand32 ? 4 : 2));
+
+        if (operand32)
+            _registers[EBP] = bp;
+        else
+            _registers[EBP] = (_registers[EBP] & 0xffff0000) | bp;
     }
 
     void CPU::halt() {
@@ -462,11 +1553,7 @@ namespace x86e::cpu {
     }
 
     bool CPU::isHalted() {
-        return _isHalted;
-    }
-
-    bool CPU::longMode() {
-        return false;
+        return _isHalted && !(getFlag(IF) && (hasPendingInterrupt() || _scheduler.hasEvents()));
     }
 
 }
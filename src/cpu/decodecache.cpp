@@ -0,0 +1,330 @@
+#include "cpu/decodecache.h"
+#include "cpu/cpu.h"
+#include "io/Logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace x86e::cpu {
+    DecodeCache::DecodeCache(memory::Memory &memory, const char *model, const TierSettings &settings)
+        : _ram((uint8_t*) memory.getMemLocation()), _size(memory.memorySize()), _model(model), _settings(settings),
+          _counters(COUNTERS), _statistics(), _file(nullptr), _fileSize(0), _pages(nullptr), _fileBlocks(nullptr),
+          _pageCount(0) {
+        // a power of two, so a slot is found with a mask
+        uint32_t entries = 64;
+        while (entries * 2 * sizeof(DecodedBlock) <= _settings.budget)
+            entries *= 2;
+
+        _blocks.resize(entries);
+        _mask = entries - 1;
+    }
+
+    DecodeCache::~DecodeCache() {
+        unmap();
+    }
+
+    DecodeCacheStatistics &DecodeCache::statistics() {
+        return _statistics;
+    }
+
+    uint32_t DecodeCache::pairOf(uint16_t first, uint16_t second) {
+        bool alu = first <= 0x15 && (first & 0x07) <= 0x05;
+        bool jcc = (second >= 0x70 && second <= 0x7f) || (second >= 0x180 && second <= 0x18f);
+
+        if (alu && jcc)
+            return FUSE_ALU_JCC;
+
+        bool push = (first >= 0x50 && first <= 0x57) || first == 0x68 || first == 0x6a;
+
+        if (push && second >= 0x58 && second <= 0x5f)
+            return FUSE_PUSH_POP;
+
+        return 0;
+    }
+
+    uint16_t DecodeCache::opcodeOf(const DecodedInstruction &instruction) {
+        if (instruction.instruction != 0x0f)
+            return instruction.instruction;
+
+        // the byte after 0Fh is only there when the prefixes left room for it
+        return instruction.start < DecodedInstruction::HEAD_SIZE ? 0x100 | instruction.head[instruction.start] : 0xffff;
+    }
+
+    void DecodeCache::fuse(DecodedInstruction &first, const DecodedInstruction &second) {
+        first.flags &= ~DecodedInstruction::FUSED;
+
+        if (second.prefixes & PrefixSet::bit(LOCK))
+            return;
+
+        if (pairOf(opcodeOf(first), opcodeOf(second)) & _settings.fusion)
+            first.flags |= DecodedInstruction::FUSED;
+    }
+
+    uint64_t DecodeCache::hashPage(const uint8_t *page) {
+        uint64_t hash = 0xcbf29ce484222325;
+
+        for (uint32_t i = 0; i < memory::PAGE_SIZE; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, page + i, 8);
+
+            hash = (hash ^ word) * 0x100000001b3;
+            hash ^= hash >> 29;
+        }
+
+        return hash;
+    }
+
+    void DecodeCache::unmap() {
+        if (_file)
+            munmap((void*) _file, _fileSize);
+
+        _file = nullptr;
+        _fileSize = 0;
+        _pages = nullptr;
+        _fileBlocks = nullptr;
+        _pageCount = 0;
+    }
+
+    bool DecodeCache::open(const std::string &path) {
+        unmap();
+        _path = path;
+
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return errno == ENOENT;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(FileHeader)) {
+            io::debug_print(io::WARNING, "Ignoring the decode cache %s, it is truncated", path.c_str());
+            close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+            return false;
+
+        _file = (const uint8_t*) mapping;
+        _fileSize = info.st_size;
+
+        const FileHeader* header = (const FileHeader*) _file;
+        uint64_t expected = sizeof(FileHeader) + (uint64_t) header->pages * sizeof(PageRecord) +
+                            (uint64_t) header->blocks * sizeof(DecodedBlock);
+
+        // written by another version, for another model or cut short. it is replaced by save()
+        if (header->magic != FileHeader::MAGIC || header->version != FileHeader::FORMAT_VERSION ||
+            strncmp(header->model, _model.c_str(), sizeof(header->model)) != 0 ||
+            header->blockSize != sizeof(DecodedBlock) || _fileSize < expected) {
+            io::debug_print(io::WARNING, "Ignoring the decode cache %s, it does not match this build", path.c_str());
+            unmap();
+            return false;
+        }
+
+        _pageCount = header->pages;
+        _pages = (const PageRecord*) (_file + sizeof(FileHeader));
+        _fileBlocks = (const DecodedBlock*) (_pages + _pageCount);
+
+        for (uint32_t i = 0; i < _pageCount; i++) {
+            if ((uint64_t) _pages[i].first + _pages[i].count > header->blocks) {
+                io::debug_print(io::WARNING, "Ignoring the decode cache %s, it is corrupted", path.c_str());
+                unmap();
+                return false;
+            }
+        }
+
+        io::debug_print(io::INFO, "Decode cache %s: %u code pages", path.c_str(), _pageCount);
+        return true;
+    }
+
+    void DecodeCache::loadPage(uint64_t page, uint64_t hash) {
+        uint64_t base = page << memory::PAGE_SHIFT;
+        const PageRecord* end = _pages + _pageCount;
+        const PageRecord* record = std::lower_bound(_pages, end, hash, [](const PageRecord& record, uint64_t hash) {
+            return record.hash < hash;
+        });
+
+        if (record == end || record->hash != hash)
+            return;
+
+        for (uint32_t i = 0; i < record->count; i++) {
+            DecodedBlock block = _fileBlocks[record->first + i];
+
+            if (block.physical >= memory::PAGE_SIZE || block.count > DecodedBlock::MAX_INSTRUCTIONS)
+                continue;
+
+            block.physical += base;
+
+            // the pairs are those of this run's settings
+            for (uint32_t j = 0; j < block.count; j++) {
+                if (j + 1 < block.count)
+                    fuse(block.instructions[j], block.instructions[j + 1]);
+                else
+                    block.instructions[j].flags &= ~DecodedInstruction::FUSED;
+            }
+
+            DecodedBlock& slot = _blocks[index(block.physical)];
+            if (claim(slot, block))
+                slot = block;
+        }
+
+        ++_statistics.loadedPages;
+    }
+
+    DecodedBlock *DecodeCache::miss(uint64_t physical, uint8_t mode) {
+        DecodedBlock& block = _blocks[index(physical)];
+
+        // the first time code runs from a page its contents are what the page is known by,
+        // later on there may be data on it that changes from run to run
+        uint64_t page = physical >> memory::PAGE_SHIFT;
+
+        if (!_pageHashes.count(page)) {
+            uint64_t hash = hashPage(_ram + (page << memory::PAGE_SHIFT));
+            _pageHashes.emplace(page, hash);
+
+            if (_file) {
+                loadPage(page, hash);
+
+                if (block.physical == physical && block.mode == mode && block.count) {
+                    ++_statistics.hits;
+                    return &block;
+                }
+            }
+        }
+
+        ++_statistics.misses;
+
+        // a block whose code changed is decoded again right away
+        bool stale = block.physical == physical && block.mode == mode;
+
+        if (!stale && !hot(physical))
+            return nullptr;
+
+        DecodedBlock promoted = {};
+        promoted.physical = physical;
+        promoted.mode = mode;
+
+        if (!stale && !claim(block, promoted))
+            return nullptr;
+
+        ++_statistics.promotions;
+
+        block = promoted;
+        return &block;
+    }
+
+    bool DecodeCache::hot(uint64_t physical) {
+        Counter& counter = _counters[(physical ^ (physical >> 12)) & (COUNTERS - 1)];
+
+        if (counter.physical != physical) {
+            counter.physical = physical;
+            counter.runs = 0;
+        }
+
+        return ++counter.runs >= _settings.threshold;
+    }
+
+    bool DecodeCache::claim(DecodedBlock &slot, const DecodedBlock &block) {
+        if (!(slot.mode & MODE_VALID) || !slot.count)
+            return true;
+
+        // every block that wants the place halves the uses of the one holding it, so a block that
+        // stopped running goes soon and one that keeps running outlasts the ones that come by
+        if (slot.uses > block.uses) {
+            slot.uses /= 2;
+            return false;
+        }
+
+        ++_statistics.evictions;
+        return true;
+    }
+
+    bool DecodeCache::save() {
+        if (_path.empty())
+            return false;
+
+        // by page hash, so the file comes out sorted
+        std::map<uint64_t, std::vector<DecodedBlock>> pages;
+
+        for (const DecodedBlock& block : _blocks) {
+            if (!(block.mode & MODE_VALID) || !block.count)
+                continue;
+
+            // only what still matches the code in RAM
+            bool current = true;
+
+            for (uint32_t i = 0; i < block.count && current; i++) {
+                const DecodedInstruction& instruction = block.instructions[i];
+                current = std::memcmp(_ram + block.physical + instruction.offset, instruction.head, instruction.start) == 0;
+            }
+
+            auto hash = _pageHashes.find(block.physical >> memory::PAGE_SHIFT);
+
+            if (!current || hash == _pageHashes.end())
+                continue;
+
+            DecodedBlock saved = block;
+            saved.physical &= memory::PAGE_MASK;
+            pages[hash->second].push_back(saved);
+        }
+
+        // code of earlier runs that did not come up this time
+        for (uint32_t i = 0; i < _pageCount; i++) {
+            const PageRecord& record = _pages[i];
+
+            if (pages.count(record.hash))
+                continue;
+
+            pages[record.hash].assign(_fileBlocks + record.first, _fileBlocks + record.first + record.count);
+        }
+
+        FileHeader header = {};
+        header.magic = FileHeader::MAGIC;
+        header.version = FileHeader::FORMAT_VERSION;
+        strncpy(header.model, _model.c_str(), sizeof(header.model) - 1);
+        header.blockSize = sizeof(DecodedBlock);
+        header.pages = pages.size();
+
+        std::vector<PageRecord> records;
+        records.reserve(pages.size());
+
+        for (auto& [hash, blocks] : pages) {
+            records.push_back({ hash, header.blocks, (uint32_t) blocks.size() });
+            header.blocks += blocks.size();
+        }
+
+        // written next to it and renamed, a run that starts meanwhile maps either one or the other
+        std::string temporary = _path + ".tmp";
+        FILE* out = fopen(temporary.c_str(), "wb");
+
+        if (!out) {
+            io::debug_print(io::ERROR, "Unable to write the decode cache %s", temporary.c_str());
+            return false;
+        }
+
+        bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+                       fwrite(records.data(), sizeof(PageRecord), records.size(), out) == records.size();
+
+        for (auto& [hash, blocks] : pages)
+            written = written && fwrite(blocks.data(), sizeof(DecodedBlock), blocks.size(), out) == blocks.size();
+
+        written = fclose(out) == 0 && written;
+
+        if (!written || rename(temporary.c_str(), _path.c_str()) != 0) {
+            io::debug_print(io::ERROR, "Unable to write the decode cache %s", _path.c_str());
+            unlink(temporary.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+}
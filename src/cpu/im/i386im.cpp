@@ -1,25 +1,46 @@
 #include "cpu/im/i386im.h"
 
 #include <algorithm>
+#include <cstring>
 
 
 namespace x86e::im {
 
-    i386_InstructionsManager::i386_InstructionsManager(cpu::CPU* cpu)
+    // segment registers in the order of the reg field of ModR/M
+    static const cpu::Registers segmentRegisters[] = {
+            cpu::Registers::ES, cpu::Registers::CS, cpu::Registers::SS,
+            cpu::Registers::DS, cpu::Registers::FS, cpu::Registers::GS,
+    };
+
+    // CR1 is reserved, mapped to CR0 only to keep the table indexable
+    static const cpu::Registers controlRegisters[] = {
+            cpu::Registers::CR0, cpu::Registers::CR0, cpu::Registers::CR2, cpu::Registers::CR3,
+            cpu::Registers::CR4,
+    };
+
+    // 16 bit general purpose registers in the order of their encoding
+    static const cpu::Registers wordRegisters[] = {
+            cpu::Registers::AX, cpu::Registers::CX, cpu::Registers::DX, cpu::Registers::BX,
+            cpu::Registers::SP, cpu::Registers::BP, cpu::Registers::SI, cpu::Registers::DI,
+    };
+
+    template<typename Model>
+    i386_InstructionsManager<Model>::i386_InstructionsManager(cpu::CPU* cpu)
             : InstructionsManager(cpu) {
     }
 
-    i386_InstructionsManager::~i386_InstructionsManager() {
+    template<typename Model>
+    i386_InstructionsManager<Model>::~i386_InstructionsManager() {
     }
 
 
     REF_INSTRUCTION(i386_InstructionsManager, add_rm8_r8) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false);
             secondRegister = _cpu->ModRMValue32bit(opcode, true);
         }
@@ -32,11 +53,11 @@ namespace x86e::im {
         uint8_t sResult;
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
-            uint16_t addr = firstRegister;
-            fResult = _cpu->getMemory().readImm8(addr);
+            uint32_t addr = firstRegister;
+            fResult = _cpu->readImm8(opcode.segment, addr);
             sResult = _cpu->getRegister((cpu::Registers)secondRegister);
 
-            _cpu->getMemory().writeImm8(fResult + sResult, addr);
+            _cpu->writeImm8(fResult + sResult, opcode.segment, addr);
         }
         else if (opcode.mod_or_index == 0b11) {
             fResult = _cpu->getRegister((cpu::Registers)firstRegister);
@@ -63,17 +84,17 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, add_rm16_32_r16_32) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint8_t offset = 1;
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             ++offset;
         }
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false, offset);
             secondRegister = _cpu->ModRMValue32bit(opcode, true, offset);
         }
@@ -90,18 +111,18 @@ namespace x86e::im {
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
             if (offset == 1) { // 16 bit
-                uint16_t addr = firstRegister;
-                fResult16 = _cpu->getMemory().readImm16(addr);
+                uint32_t addr = firstRegister;
+                fResult16 = _cpu->readImm16(opcode.segment, addr);
                 sResult16 = _cpu->getRegister((cpu::Registers)secondRegister);
 
-                _cpu->getMemory().writeImm16(fResult16 + sResult16, addr);
+                _cpu->writeImm16(fResult16 + sResult16, opcode.segment, addr);
             }
             else { // 32 bit
                 uint32_t addr = firstRegister;
-                fResult32 = _cpu->getMemory().readImm32(addr);
+                fResult32 = _cpu->readImm32(opcode.segment, addr);
                 sResult32 = _cpu->getRegister((cpu::Registers)secondRegister);
 
-                _cpu->getMemory().writeImm32(fResult32 + sResult32, addr);
+                _cpu->writeImm32(fResult32 + sResult32, opcode.segment, addr);
             }
         }
         else if (opcode.mod_or_index == 0b11) {
@@ -152,12 +173,12 @@ namespace x86e::im {
 
 
     REF_INSTRUCTION(i386_InstructionsManager, add_r8_rm8) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false);
             secondRegister = _cpu->ModRMValue32bit(opcode, true);
         }
@@ -170,8 +191,8 @@ namespace x86e::im {
         uint8_t sResult;
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
-            uint16_t addr = firstRegister;
-            fResult = _cpu->getMemory().readImm8(addr);
+            uint32_t addr = firstRegister;
+            fResult = _cpu->readImm8(opcode.segment, addr);
             sResult = _cpu->getRegister((cpu::Registers)secondRegister);
 
             _cpu->setRegister((cpu::Registers) secondRegister, fResult + sResult);
@@ -201,17 +222,17 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, add_r16_32_rm16_32) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint8_t offset = 1;
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             ++offset;
         }
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false, offset);
             secondRegister = _cpu->ModRMValue32bit(opcode, true, offset);
         }
@@ -228,15 +249,15 @@ namespace x86e::im {
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
             if (offset == 1) { // 16 bit
-                uint16_t addr = firstRegister;
-                fResult16 = _cpu->getMemory().readImm16(addr);
+                uint32_t addr = firstRegister;
+                fResult16 = _cpu->readImm16(opcode.segment, addr);
                 sResult16 = _cpu->getRegister((cpu::Registers)secondRegister);
 
                 _cpu->setRegister((cpu::Registers) secondRegister, fResult16 + sResult16);
             }
             else { // 32 bit
                 uint32_t addr = firstRegister;
-                fResult32 = _cpu->getMemory().readImm32(addr);
+                fResult32 = _cpu->readImm32(opcode.segment, addr);
                 sResult32 = _cpu->getRegister((cpu::Registers)secondRegister);
 
                 _cpu->setRegister((cpu::Registers) secondRegister, fResult32 + sResult32);
@@ -293,7 +314,7 @@ namespace x86e::im {
         uint8_t sResult;
 
         fResult = _cpu->getRegister(cpu::Registers::AL);
-        sResult = _cpu->getMemory().readImm8(_cpu->incGetRegister(cpu::Registers::EIP));
+        sResult = _cpu->nextImm8(opcode);
 
         _cpu->setRegister(cpu::Registers::AL,fResult + sResult);
 
@@ -322,9 +343,9 @@ namespace x86e::im {
 
         uint8_t offset;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             fResult32 = (uint32_t)_cpu->getRegister(cpu::Registers::EAX);
-            sResult32 = (uint32_t)_cpu->getMemory().readImm32(_cpu->incGetRegister(cpu::Registers::EIP, 4));
+            sResult32 = (uint32_t)_cpu->nextImm32(opcode);
             _cpu->setRegister(cpu::Registers::EAX,fResult32 + sResult32);
 
             offset = 2;
@@ -333,7 +354,7 @@ namespace x86e::im {
             offset = 1;
 
             fResult16 = (uint32_t)_cpu->getRegister(cpu::Registers::AX);
-            sResult16 = (uint32_t)_cpu->getMemory().readImm16(_cpu->incGetRegister(cpu::Registers::EIP, 2));
+            sResult16 = (uint32_t)_cpu->nextImm16(opcode);
             _cpu->setRegister(cpu::Registers::AX,fResult16 + sResult16);
         }
 
@@ -369,6 +390,11 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, halt) {
+        if (_cpu->cpl() > 0) {
+            _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+            return;
+        }
+
         _cpu->halt();
     }
 
@@ -377,7 +403,9 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, pop_es) {
-        _cpu->setRegister(cpu::Registers::ES, _cpu->popFromStackImm16());
+        // SP only moves once the segment has been loaded
+        _cpu->loadSegment(cpu::Registers::ES, _cpu->peekStackImm16(0));
+        _cpu->setStackPointer(_cpu->getStackPointer() + 2);
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, push_cs) {
@@ -385,12 +413,12 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, or_rm8_r8) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false);
             secondRegister = _cpu->ModRMValue32bit(opcode, true);
         }
@@ -403,11 +431,11 @@ namespace x86e::im {
         uint8_t sResult;
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
-            uint16_t addr = firstRegister;
-            fResult = _cpu->getMemory().readImm8(addr);
+            uint32_t addr = firstRegister;
+            fResult = _cpu->readImm8(opcode.segment, addr);
             sResult = _cpu->getRegister((cpu::Registers)secondRegister);
 
-            _cpu->getMemory().writeImm8(fResult | sResult, addr);
+            _cpu->writeImm8(fResult | sResult, opcode.segment, addr);
         }
         else if (opcode.mod_or_index == 0b11) {
             fResult = _cpu->getRegister((cpu::Registers)firstRegister);
@@ -431,17 +459,17 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, or_rm16_32_r16_32) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint8_t offset = 1;
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             ++offset;
         }
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false, offset);
             secondRegister = _cpu->ModRMValue32bit(opcode, true, offset);
         }
@@ -458,18 +486,18 @@ namespace x86e::im {
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
             if (offset == 1) { // 16 bit
-                uint16_t addr = firstRegister;
-                fResult16 = _cpu->getMemory().readImm16(addr);
+                uint32_t addr = firstRegister;
+                fResult16 = _cpu->readImm16(opcode.segment, addr);
                 sResult16 = _cpu->getRegister((cpu::Registers)secondRegister);
 
-                _cpu->getMemory().writeImm16(fResult16 | sResult16, addr);
+                _cpu->writeImm16(fResult16 | sResult16, opcode.segment, addr);
             }
             else { // 32 bit
                 uint32_t addr = firstRegister;
-                fResult32 = _cpu->getMemory().readImm32(addr);
+                fResult32 = _cpu->readImm32(opcode.segment, addr);
                 sResult32 = _cpu->getRegister((cpu::Registers)secondRegister);
 
-                _cpu->getMemory().writeImm32(fResult32 | sResult32, addr);
+                _cpu->writeImm32(fResult32 | sResult32, opcode.segment, addr);
             }
         }
         else if (opcode.mod_or_index == 0b11) {
@@ -516,12 +544,12 @@ namespace x86e::im {
 
 
     REF_INSTRUCTION(i386_InstructionsManager, or_r8_rm8) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false);
             secondRegister = _cpu->ModRMValue32bit(opcode, true);
         }
@@ -534,8 +562,8 @@ namespace x86e::im {
         uint8_t sResult;
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
-            uint16_t addr = firstRegister;
-            fResult = _cpu->getMemory().readImm8(addr);
+            uint32_t addr = firstRegister;
+            fResult = _cpu->readImm8(opcode.segment, addr);
             sResult = _cpu->getRegister((cpu::Registers)secondRegister);
 
             _cpu->setRegister((cpu::Registers) secondRegister, fResult | sResult);
@@ -562,17 +590,17 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, or_r16_32_rm16_32) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint8_t offset = 1;
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             ++offset;
         }
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false, offset);
             secondRegister = _cpu->ModRMValue32bit(opcode, true, offset);
         }
@@ -589,15 +617,15 @@ namespace x86e::im {
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
             if (offset == 1) { // 16 bit
-                uint16_t addr = firstRegister;
-                fResult16 = _cpu->getMemory().readImm16(addr);
+                uint32_t addr = firstRegister;
+                fResult16 = _cpu->readImm16(opcode.segment, addr);
                 sResult16 = _cpu->getRegister((cpu::Registers)secondRegister);
 
                 _cpu->setRegister((cpu::Registers) secondRegister, fResult16 | sResult16);
             }
             else { // 32 bit
                 uint32_t addr = firstRegister;
-                fResult32 = _cpu->getMemory().readImm32(addr);
+                fResult32 = _cpu->readImm32(opcode.segment, addr);
                 sResult32 = _cpu->getRegister((cpu::Registers)secondRegister);
 
                 _cpu->setRegister((cpu::Registers) secondRegister, fResult32 | sResult32);
@@ -650,7 +678,7 @@ namespace x86e::im {
         uint8_t sResult;
 
         fResult = _cpu->getRegister(cpu::Registers::AL);
-        sResult = _cpu->getMemory().readImm8(_cpu->incGetRegister(cpu::Registers::EIP));
+        sResult = _cpu->nextImm8(opcode);
 
         _cpu->setRegister(cpu::Registers::AL,fResult | sResult);
 
@@ -676,9 +704,9 @@ namespace x86e::im {
 
         uint8_t offset;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             fResult32 = (uint32_t)_cpu->getRegister(cpu::Registers::EAX);
-            sResult32 = (uint32_t)_cpu->getMemory().readImm32(_cpu->incGetRegister(cpu::Registers::EIP, 4));
+            sResult32 = (uint32_t)_cpu->nextImm32(opcode);
             _cpu->setRegister(cpu::Registers::EAX,fResult32 | sResult32);
 
             offset = 2;
@@ -687,7 +715,7 @@ namespace x86e::im {
             offset = 1;
 
             fResult16 = (uint32_t)_cpu->getRegister(cpu::Registers::AX);
-            sResult16 = (uint32_t)_cpu->getMemory().readImm16(_cpu->incGetRegister(cpu::Registers::EIP, 2));
+            sResult16 = (uint32_t)_cpu->nextImm16(opcode);
             _cpu->setRegister(cpu::Registers::AX,fResult16 | sResult16);
         }
 
@@ -719,12 +747,12 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, adc_rm8_r8) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false);
             secondRegister = _cpu->ModRMValue32bit(opcode, true);
         }
@@ -739,11 +767,11 @@ namespace x86e::im {
         uint8_t carryFlag = _cpu->getFlag(cpu::CF);
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
-            uint16_t addr = firstRegister;
-            fResult = _cpu->getMemory().readImm8(addr);
+            uint32_t addr = firstRegister;
+            fResult = _cpu->readImm8(opcode.segment, addr);
             sResult = _cpu->getRegister((cpu::Registers)secondRegister);
 
-            _cpu->getMemory().writeImm8(fResult + sResult + carryFlag, addr);
+            _cpu->writeImm8(fResult + sResult + carryFlag, opcode.segment, addr);
         }
         else if (opcode.mod_or_index == 0b11) {
             fResult = _cpu->getRegister((cpu::Registers)firstRegister);
@@ -770,17 +798,17 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, adc_rm16_32_r16_32) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint8_t offset = 1;
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             ++offset;
         }
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false, offset);
             secondRegister = _cpu->ModRMValue32bit(opcode, true, offset);
         }
@@ -799,18 +827,18 @@ namespace x86e::im {
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
             if (offset == 1) { // 16 bit
-                uint16_t addr = firstRegister;
-                fResult16 = _cpu->getMemory().readImm16(addr);
+                uint32_t addr = firstRegister;
+                fResult16 = _cpu->readImm16(opcode.segment, addr);
                 sResult16 = _cpu->getRegister((cpu::Registers)secondRegister);
 
-                _cpu->getMemory().writeImm16(fResult16 + sResult16 + carryFlag, addr);
+                _cpu->writeImm16(fResult16 + sResult16 + carryFlag, opcode.segment, addr);
             }
             else { // 32 bit
                 uint32_t addr = firstRegister;
-                fResult32 = _cpu->getMemory().readImm32(addr);
+                fResult32 = _cpu->readImm32(opcode.segment, addr);
                 sResult32 = _cpu->getRegister((cpu::Registers)secondRegister);
 
-                _cpu->getMemory().writeImm32(fResult32 + sResult32 + carryFlag, addr);
+                _cpu->writeImm32(fResult32 + sResult32 + carryFlag, opcode.segment, addr);
             }
         }
         else if (opcode.mod_or_index == 0b11) {
@@ -861,12 +889,12 @@ namespace x86e::im {
 
 
     REF_INSTRUCTION(i386_InstructionsManager, adc_r8_rm8) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false);
             secondRegister = _cpu->ModRMValue32bit(opcode, true);
         }
@@ -881,8 +909,8 @@ namespace x86e::im {
         uint8_t carryFlag = _cpu->getFlag(cpu::CF);
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
-            uint16_t addr = firstRegister;
-            fResult = _cpu->getMemory().readImm8(addr);
+            uint32_t addr = firstRegister;
+            fResult = _cpu->readImm8(opcode.segment, addr);
             sResult = _cpu->getRegister((cpu::Registers)secondRegister);
 
             _cpu->setRegister((cpu::Registers) secondRegister, fResult + sResult + carryFlag);
@@ -912,17 +940,17 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, adc_r16_32_rm16_32) {
-        _cpu->parseModRM(opcode, _cpu->incGetRegister(cpu::Registers::EIP));
+        _cpu->parseModRM(opcode);
 
         uint8_t offset = 1;
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             ++offset;
         }
 
         uint32_t firstRegister;
         uint32_t secondRegister;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::ADDRESS_SIZE)) {
+        if (address32bit(opcode)) {
             firstRegister = _cpu->ModRMValue32bit(opcode, false, offset);
             secondRegister = _cpu->ModRMValue32bit(opcode, true, offset);
         }
@@ -941,15 +969,15 @@ namespace x86e::im {
 
         if (opcode.mod_or_index == 0b00 || opcode.mod_or_index == 0b01 || opcode.mod_or_index == 0b10) {
             if (offset == 1) { // 16 bit
-                uint16_t addr = firstRegister;
-                fResult16 = _cpu->getMemory().readImm16(addr);
+                uint32_t addr = firstRegister;
+                fResult16 = _cpu->readImm16(opcode.segment, addr);
                 sResult16 = _cpu->getRegister((cpu::Registers)secondRegister);
 
                 _cpu->setRegister((cpu::Registers) secondRegister, fResult16 + sResult16 + carryFlag);
             }
             else { // 32 bit
                 uint32_t addr = firstRegister;
-                fResult32 = _cpu->getMemory().readImm32(addr);
+                fResult32 = _cpu->readImm32(opcode.segment, addr);
                 sResult32 = _cpu->getRegister((cpu::Registers)secondRegister);
 
                 _cpu->setRegister((cpu::Registers) secondRegister, fResult32 + sResult32 + carryFlag);
@@ -1008,7 +1036,7 @@ namespace x86e::im {
         uint8_t carryFlag = _cpu->getFlag(cpu::CF);
 
         fResult = _cpu->getRegister(cpu::Registers::AL);
-        sResult = _cpu->getMemory().readImm8(_cpu->incGetRegister(cpu::Registers::EIP));
+        sResult = _cpu->nextImm8(opcode);
 
         _cpu->setRegister(cpu::Registers::AL,fResult + sResult + carryFlag);
 
@@ -1039,9 +1067,9 @@ namespace x86e::im {
 
         uint8_t offset;
 
-        if (OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::OPERAND_SIZE) || _cpu->longMode()) {
+        if (operand32bit(opcode)) {
             fResult32 = (uint32_t)_cpu->getRegister(cpu::Registers::EAX);
-            sResult32 = (uint32_t)_cpu->getMemory().readImm32(_cpu->incGetRegister(cpu::Registers::EIP, 4));
+            sResult32 = (uint32_t)_cpu->nextImm32(opcode);
             _cpu->setRegister(cpu::Registers::EAX,fResult32 + sResult32 + carryFlag);
 
             offset = 2;
@@ -1050,7 +1078,7 @@ namespace x86e::im {
             offset = 1;
 
             fResult16 = (uint32_t)_cpu->getRegister(cpu::Registers::AX);
-            sResult16 = (uint32_t)_cpu->getMemory().readImm16(_cpu->incGetRegister(cpu::Registers::EIP, 2));
+            sResult16 = (uint32_t)_cpu->nextImm16(opcode);
             _cpu->setRegister(cpu::Registers::AX,fResult16 + sResult16 + carryFlag);
         }
 
@@ -1090,7 +1118,837 @@ namespace x86e::im {
     }
 
     REF_INSTRUCTION(i386_InstructionsManager, pop_ss) {
-        _cpu->setRegister(cpu::Registers::SS, _cpu->popFromStackImm16());
+        // the new SS decides how SP wraps, it moves on from the value it had before
+        uint32_t sp = _cpu->getStackPointer();
+        _cpu->loadSegment(cpu::Registers::SS, _cpu->peekStackImm16(0));
+        _cpu->setStackPointer(sp + 2);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, mov_rm16_sreg) {
+        _cpu->parseModRM(opcode);
+
+        uint8_t sreg = (opcode.modrm_or_sib_value >> 3) & 0b111;
+        if (sreg > 5) {
+            _cpu->raiseFault(cpu::EXCEPTION_UD);
+            return;
+        }
+
+        uint16_t value = _cpu->getRegister(segmentRegisters[sreg]);
+
+        uint32_t destination;
+        if (address32bit(opcode))
+            destination = _cpu->ModRMValue32bit(opcode, false, 1);
+        else
+            destination = _cpu->ModRMValue16bit(opcode, false, 1);
+
+        if (opcode.mod_or_index == 0b11)
+            _cpu->setRegister((cpu::Registers) destination, value);
+        else
+            _cpu->writeImm16(value, opcode.segment, destination);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, mov_sreg_rm16) {
+        _cpu->parseModRM(opcode);
+
+        uint8_t sreg = (opcode.modrm_or_sib_value >> 3) & 0b111;
+        if (sreg > 5 || segmentRegisters[sreg] == cpu::Registers::CS) {
+            _cpu->raiseFault(cpu::EXCEPTION_UD);
+            return;
+        }
+
+        uint32_t source;
+        if (address32bit(opcode))
+            source = _cpu->ModRMValue32bit(opcode, false, 1);
+        else
+            source = _cpu->ModRMValue16bit(opcode, false, 1);
+
+        uint16_t selector;
+        if (opcode.mod_or_index == 0b11)
+            selector = _cpu->getRegister((cpu::Registers) source);
+        else
+            selector = _cpu->readImm16(opcode.segment, source);
+
+        _cpu->loadSegment(segmentRegisters[sreg], selector);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, lgdt_lidt_m16_32) {
+        _cpu->parseModRM(opcode);
+
+        uint8_t operation = (opcode.modrm_or_sib_value >> 3) & 0b111;
+
+        // INVLPG came with the 486, /5 is not used
+        if (operation == 5 || operation == 7) {
+            _cpu->raiseFault(cpu::EXCEPTION_UD);
+            return;
+        }
+
+        // SMSW and LMSW take a 16 bit register as well
+        uint32_t addr;
+        if (address32bit(opcode))
+            addr = _cpu->ModRMValue32bit(opcode, false, 1);
+        else
+            addr = _cpu->ModRMValue16bit(opcode, false, 1);
+
+        if (operation == 4) {
+            uint16_t status = _cpu->getRegister(cpu::Registers::CR0);
+
+            if (opcode.mod_or_index == 0b11)
+                _cpu->setRegister((cpu::Registers) addr, status);
+            else
+                _cpu->writeImm16(status, opcode.segment, addr);
+            return;
+        }
+
+        if (operation == 6) {
+            if (_cpu->cpl() > 0) {
+                _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+                return;
+            }
+
+            uint16_t status;
+            if (opcode.mod_or_index == 0b11)
+                status = _cpu->getRegister((cpu::Registers) addr);
+            else
+                status = _cpu->readImm16(opcode.segment, addr);
+
+            // only PE, MP, EM and TS, and PE cannot be cleared this way
+            uint32_t cr0 = _cpu->getRegister(cpu::Registers::CR0);
+            _cpu->setControlRegister(cpu::Registers::CR0, (cr0 & ~0xe) | (status & 0xf));
+            return;
+        }
+
+        if (opcode.mod_or_index == 0b11) {
+            _cpu->raiseFault(cpu::EXCEPTION_UD);
+            return;
+        }
+
+        if (operation < 2) {
+            cpu::DescriptorTableRegister table = operation == 0 ? _cpu->getGDT() : _cpu->getIDT();
+            uint32_t base = table.base;
+
+            // with 16 bit operand size the top byte is not stored, the 286 leaves it all ones
+            if (!operand32bit(opcode))
+                base = cpu::HAS_32BIT<Model> ? base & 0x00ffffff : base | 0xff000000;
+
+            _cpu->probeWrite(opcode.segment, addr, 6);
+            _cpu->writeImm16(table.limit, opcode.segment, addr);
+            _cpu->writeImm32(base, opcode.segment, addr + 2);
+            return;
+        }
+
+        if (_cpu->cpl() > 0) {
+            _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+            return;
+        }
+
+        uint16_t limit = _cpu->readImm16(opcode.segment, addr);
+        uint32_t base = _cpu->readImm32(opcode.segment, addr + 2);
+
+        // with 16 bit operand size only 24 bits of the base are used
+        if (!operand32bit(opcode))
+            base &= 0x00ffffff;
+
+        if (operation == 2)
+            _cpu->loadGDT(base, limit);
+        else
+            _cpu->loadIDT(base, limit);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, mov_r32_cr) {
+        _cpu->parseModRM(opcode);
+
+        uint8_t cr = (opcode.modrm_or_sib_value >> 3) & 0b111;
+        if (cr == 1 || cr > 4) {
+            _cpu->raiseFault(cpu::EXCEPTION_UD);
+            return;
+        }
+
+        if (_cpu->cpl() > 0) {
+            _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+            return;
+        }
+
+        _cpu->setRegister((cpu::Registers) opcode.rm_or_ss, _cpu->getRegister(controlRegisters[cr]));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, mov_cr_r32) {
+        _cpu->parseModRM(opcode);
+
+        uint8_t cr = (opcode.modrm_or_sib_value >> 3) & 0b111;
+        if (cr == 1 || cr > 4) {
+            _cpu->raiseFault(cpu::EXCEPTION_UD);
+            return;
+        }
+
+        if (_cpu->cpl() > 0) {
+            _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+            return;
+        }
+
+        _cpu->setControlRegister(controlRegisters[cr], _cpu->getRegister((cpu::Registers) opcode.rm_or_ss));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, sldt_str_lldt_ltr_rm16) {
+        _cpu->parseModRM(opcode);
+
+        uint8_t operation = (opcode.modrm_or_sib_value >> 3) & 0b111;
+        if (operation > 5) {
+            _cpu->raiseFault(cpu::EXCEPTION_UD);
+            return;
+        }
+
+        uint32_t operand;
+        if (address32bit(opcode))
+            operand = _cpu->ModRMValue32bit(opcode, false, 1);
+        else
+            operand = _cpu->ModRMValue16bit(opcode, false, 1);
+
+        if (operation >= 4) {
+            uint16_t selector;
+            if (opcode.mod_or_index == 0b11)
+                selector = _cpu->getRegister((cpu::Registers) operand);
+            else
+                selector = _cpu->readImm16(opcode.segment, operand);
+
+            _cpu->setFlag(cpu::ZF, _cpu->verifySegment(selector, operation == 5));
+            return;
+        }
+
+        if (operation < 2) {
+            uint16_t selector = _cpu->getRegister(operation == 0 ? cpu::Registers::LDTR : cpu::Registers::TR);
+
+            if (opcode.mod_or_index == 0b11)
+                _cpu->setRegister((cpu::Registers) operand, selector);
+            else
+                _cpu->writeImm16(selector, opcode.segment, operand);
+
+            return;
+        }
+
+        if (_cpu->cpl() > 0) {
+            _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+            return;
+        }
+
+        uint16_t selector;
+        if (opcode.mod_or_index == 0b11)
+            selector = _cpu->getRegister((cpu::Registers) operand);
+        else
+            selector = _cpu->readImm16(opcode.segment, operand);
+
+        if (operation == 2)
+            _cpu->loadLDT(selector);
+        else
+            _cpu->loadTaskRegister(selector);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, in_al_imm8) {
+        uint8_t port = _cpu->nextImm8(opcode);
+        _cpu->setRegister(cpu::Registers::AL, _cpu->getIOBus().in(port, 1));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, in_eAX_imm8) {
+        uint8_t port = _cpu->nextImm8(opcode);
+
+        if (operand32bit(opcode))
+            _cpu->setRegister(cpu::Registers::EAX, _cpu->getIOBus().in(port, 4));
+        else
+            _cpu->setRegister(cpu::Registers::AX, _cpu->getIOBus().in(port, 2));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, out_imm8_al) {
+        uint8_t port = _cpu->nextImm8(opcode);
+        _cpu->getIOBus().out(port, _cpu->getRegister(cpu::Registers::AL), 1);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, out_imm8_eAX) {
+        uint8_t port = _cpu->nextImm8(opcode);
+
+        if (operand32bit(opcode))
+            _cpu->getIOBus().out(port, _cpu->getRegister(cpu::Registers::EAX), 4);
+        else
+            _cpu->getIOBus().out(port, _cpu->getRegister(cpu::Registers::AX), 2);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, in_al_dx) {
+        uint16_t port = _cpu->getRegister(cpu::Registers::DX);
+        _cpu->setRegister(cpu::Registers::AL, _cpu->getIOBus().in(port, 1));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, in_eAX_dx) {
+        uint16_t port = _cpu->getRegister(cpu::Registers::DX);
+
+        if (operand32bit(opcode))
+            _cpu->setRegister(cpu::Registers::EAX, _cpu->getIOBus().in(port, 4));
+        else
+            _cpu->setRegister(cpu::Registers::AX, _cpu->getIOBus().in(port, 2));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, out_dx_al) {
+        uint16_t port = _cpu->getRegister(cpu::Registers::DX);
+        _cpu->getIOBus().out(port, _cpu->getRegister(cpu::Registers::AL), 1);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, out_dx_eAX) {
+        uint16_t port = _cpu->getRegister(cpu::Registers::DX);
+
+        if (operand32bit(opcode))
+            _cpu->getIOBus().out(port, _cpu->getRegister(cpu::Registers::EAX), 4);
+        else
+            _cpu->getIOBus().out(port, _cpu->getRegister(cpu::Registers::AX), 2);
+    }
+
+    template<typename Model>
+    void i386_InstructionsManager<Model>::stringIO(cpu::Opcode& opcode, uint8_t size, bool input) {
+        bool address32 = address32bit(opcode);
+        bool repeat = OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::REP) ||
+                      OP_CHECK_PREFIX(opcode.prefixes, cpu::InstructionPrefix::REPNE);
+
+        cpu::Registers counter = address32 ? cpu::Registers::ECX : cpu::Registers::CX;
+        cpu::Registers index = input ? (address32 ? cpu::Registers::EDI : cpu::Registers::DI) :
+                                       (address32 ? cpu::Registers::ESI : cpu::Registers::SI);
+
+        // INS always writes to ES, OUTS reads from DS unless overridden
+        cpu::Registers segment = input ? cpu::Registers::ES : opcode.segment;
+
+        uint16_t port = _cpu->getRegister(cpu::Registers::DX);
+        int32_t step = _cpu->getFlag(cpu::DF) ? -size : size;
+        uint32_t mask = address32 ? 0xffffffff : 0xffff;
+        uint32_t count = repeat ? _cpu->getRegister(counter) : 1;
+
+        uint8_t buffer[STRING_IO_CHUNK];
+
+        while (count) {
+            uint32_t elements = std::min(count, STRING_IO_CHUNK / size);
+            uint32_t address = _cpu->getRegister(index);
+
+            if (input) {
+                // data taken from the device cannot be given back, so only as much is taken as fits on the
+                // page of the first element, and all of it is checked for writing before the device is asked
+                uint32_t linear = _cpu->getSegment(segment).base + address;
+                uint64_t room = step > 0 ? std::min<uint64_t>(memory::PAGE_SIZE - (linear & memory::PAGE_MASK), (uint64_t) mask - address + 1) :
+                                           std::min<uint64_t>((linear & memory::PAGE_MASK) + size, (uint64_t) address + size);
+
+                elements = std::max<uint32_t>(1, std::min<uint64_t>(elements, room / size));
+
+                uint32_t lowest = step > 0 ? address : address - (elements - 1) * size;
+                _cpu->probeWrite(segment, lowest, elements * size);
+
+                _cpu->getIOBus().inString(port, size, buffer, elements);
+            }
+
+            for (uint32_t i = 0; i < elements; i++, address = (address + step) & mask) {
+                uint32_t value = 0;
+
+                if (input) {
+                    std::memcpy(&value, buffer + i * size, size);
+
+                    if (size == 1) _cpu->writeImm8(value, segment, address);
+                    else if (size == 2) _cpu->writeImm16(value, segment, address);
+                    else _cpu->writeImm32(value, segment, address);
+                }
+                else {
+                    value = size == 1 ? _cpu->readImm8(segment, address) :
+                            size == 2 ? _cpu->readImm16(segment, address) : _cpu->readImm32(segment, address);
+
+                    std::memcpy(buffer + i * size, &value, size);
+                }
+            }
+
+            if (!input)
+                _cpu->getIOBus().outString(port, size, buffer, elements);
+
+            _cpu->setRegister(index, address);
+            count -= elements;
+
+            if (repeat)
+                _cpu->setRegister(counter, count);
+        }
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, ins_m8_dx) {
+        stringIO(opcode, 1, true);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, ins_m16_32_dx) {
+        bool operand32 = operand32bit(opcode);
+        stringIO(opcode, operand32 ? 4 : 2, true);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, outs_dx_m8) {
+        stringIO(opcode, 1, false);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, outs_dx_m16_32) {
+        bool operand32 = operand32bit(opcode);
+        stringIO(opcode, operand32 ? 4 : 2, false);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, int_imm8) {
+        uint8_t vector = _cpu->nextImm8(opcode);
+
+        _cpu->interrupt(vector, opcode.beginIP + opcode.position, false, 0, true);
+        opcode.branch = true;
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, iret) {
+        // nested tasks are not emulated, NT is ignored
+        _cpu->returnFar(operand32bit(opcode), 0, true);
+        opcode.branch = true;
+
+        _cpu->checkInterrupts();
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, cli) {
+        if (_cpu->cpl() > ((_cpu->getEFLAGS() >> cpu::IOPL) & 3)) {
+            _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+            return;
+        }
+
+        _cpu->setFlag(cpu::IF, 0);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, sti) {
+        if (_cpu->cpl() > ((_cpu->getEFLAGS() >> cpu::IOPL) & 3)) {
+            _cpu->raiseFault(cpu::EXCEPTION_GP, 0);
+            return;
+        }
+
+        _cpu->setFlag(cpu::IF, 1);
+        _cpu->checkInterrupts();
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, push_r16_32) {
+        uint8_t reg = opcode.instruction & 0b111;
+
+        // PUSH SP stores the value from before the push
+        if (operand32bit(opcode))
+            _cpu->pushOntoStackImm32(_cpu->getRegister((cpu::Registers) reg));
+        else
+            _cpu->pushOntoStackImm16(_cpu->getRegister(wordRegisters[reg]));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, pop_r16_32) {
+        uint8_t reg = opcode.instruction & 0b111;
+
+        // POP SP ends up with the popped value, the increment is overwritten
+        if (operand32bit(opcode))
+            _cpu->setRegister((cpu::Registers) reg, _cpu->popFromStackImm32());
+        else
+            _cpu->setRegister(wordRegisters[reg], _cpu->popFromStackImm16());
     }
 
+    REF_INSTRUCTION(i386_InstructionsManager, pusha) {
+        _cpu->pushAll(operand32bit(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, popa) {
+        _cpu->popAll(operand32bit(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, push_imm16_32) {
+        if (operand32bit(opcode))
+            _cpu->pushOntoStackImm32(_cpu->nextImm32(opcode));
+        else
+            _cpu->pushOntoStackImm16(_cpu->nextImm16(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, push_imm8) {
+        int8_t value = _cpu->nextImm8(opcode);
+
+        if (operand32bit(opcode))
+            _cpu->pushOntoStackImm32((int32_t) value);
+        else
+            _cpu->pushOntoStackImm16((int16_t) value);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, call_rel16_32) {
+        uint32_t target;
+
+        if (operand32bit(opcode)) {
+            int32_t displacement = _cpu->nextImm32(opcode);
+            uint32_t returnIP = opcode.beginIP + opcode.position;
+
+            _cpu->pushOntoStackImm32(returnIP);
+            target = returnIP + displacement;
+        }
+        else {
+            int16_t displacement = _cpu->nextImm16(opcode);
+            uint32_t returnIP = opcode.beginIP + opcode.position;
+
+            _cpu->pushOntoStackImm16(returnIP);
+            target = (returnIP + displacement) & 0xffff;
+        }
+
+        _cpu->setRegister(cpu::Registers::EIP, target);
+        opcode.branch = true;
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, call_ptr16_16_32) {
+        bool operand32 = operand32bit(opcode);
+        uint32_t target = operand32 ? _cpu->nextImm32(opcode) : _cpu->nextImm16(opcode);
+        uint16_t selector = _cpu->nextImm16(opcode);
+
+        _cpu->callFar(selector, target, opcode.beginIP + opcode.position, operand32);
+        opcode.branch = true;
+    }
+
+    template<typename Model>
+    void i386_InstructionsManager<Model>::returnNear(cpu::Opcode &opcode, uint16_t release) {
+        uint32_t target;
+
+        if (operand32bit(opcode))
+            target = _cpu->popFromStackImm32();
+        else
+            target = _cpu->popFromStackImm16();
+
+        if (release)
+            _cpu->setStackPointer(_cpu->getStackPointer() + release);
+
+        _cpu->setRegister(cpu::Registers::EIP, target);
+        opcode.branch = true;
+    }
+
+    template<typename Model>
+    void i386_InstructionsManager<Model>::returnFar(cpu::Opcode &opcode, uint16_t release) {
+        _cpu->returnFar(operand32bit(opcode), release, false);
+        opcode.branch = true;
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, ret_imm16) {
+        returnNear(opcode, _cpu->nextImm16(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, ret) {
+        returnNear(opcode, 0);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, retf_imm16) {
+        returnFar(opcode, _cpu->nextImm16(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, retf) {
+        returnFar(opcode, 0);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, enter_imm16_imm8) {
+        uint16_t size = _cpu->nextImm16(opcode);
+        uint8_t level = _cpu->nextImm8(opcode);
+
+        _cpu->enterFrame(size, level, operand32bit(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, leave) {
+        _cpu->leaveFrame(operand32bit(opcode));
+    }
+
+    template<typename Model>
+    bool i386_InstructionsManager<Model>::condition(uint8_t code) {
+        return condition(code, _cpu->getFlag(cpu::CF), _cpu->getFlag(cpu::PF), _cpu->getFlag(cpu::ZF),
+                         _cpu->getFlag(cpu::SF), _cpu->getFlag(cpu::OF));
+    }
+
+    template<typename Model>
+    bool i386_InstructionsManager<Model>::condition(uint8_t code, bool cf, bool pf, bool zf, bool sf, bool of) {
+        bool result;
+
+        switch ((code >> 1) & 0b111) {
+            case 0: result = of; break;
+            case 1: result = cf; break;
+            case 2: result = zf; break;
+            case 3: result = cf || zf; break;
+            case 4: result = sf; break;
+            case 5: result = pf; break;
+            case 6: result = sf != of; break;
+            default: result = zf || sf != of; break;
+        }
+
+        // odd codes are the negated ones
+        return result != (code & 1);
+    }
+
+    template<typename Model>
+    void i386_InstructionsManager<Model>::jumpRelative(cpu::Opcode &opcode, int32_t displacement) {
+        uint32_t target = opcode.beginIP + opcode.position + displacement;
+
+        if (!operand32bit(opcode))
+            target &= 0xffff;
+
+        _cpu->setRegister(cpu::Registers::EIP, target);
+        opcode.branch = true;
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, jmp_rel8) {
+        jumpRelative(opcode, (int8_t) _cpu->nextImm8(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, jmp_rel16_32) {
+        if (operand32bit(opcode))
+            jumpRelative(opcode, (int32_t) _cpu->nextImm32(opcode));
+        else
+            jumpRelative(opcode, (int16_t) _cpu->nextImm16(opcode));
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, jmp_ptr16_16_32) {
+        uint32_t target = operand32bit(opcode) ? _cpu->nextImm32(opcode) : _cpu->nextImm16(opcode);
+        uint16_t selector = _cpu->nextImm16(opcode);
+
+        _cpu->jumpFar(selector, target);
+        opcode.branch = true;
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, jcc_rel8) {
+        int8_t displacement = _cpu->nextImm8(opcode);
+
+        if (condition(opcode.instruction))
+            jumpRelative(opcode, displacement);
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, jcc_rel16_32) {
+        // 0x0f 0x8x, the condition is in the second opcode byte
+        uint8_t code = opcode.bytes[opcode.position - 1];
+        int32_t displacement = operand32bit(opcode) ? (int32_t) _cpu->nextImm32(opcode) : (int16_t) _cpu->nextImm16(opcode);
+
+        if (condition(code))
+            jumpRelative(opcode, displacement);
+    }
+
+    // the core runs XCHG with a memory operand locked, the register is only written once the
+    // memory write went through
+    REF_INSTRUCTION(i386_InstructionsManager, xchg_rm8_r8) {
+        _cpu->parseModRM(opcode);
+
+        uint32_t first;
+        uint32_t second;
+
+        if (address32bit(opcode)) {
+            first = _cpu->ModRMValue32bit(opcode, false);
+            second = _cpu->ModRMValue32bit(opcode, true);
+        }
+        else {
+            first = _cpu->ModRMValue16bit(opcode, false);
+            second = _cpu->ModRMValue16bit(opcode, true);
+        }
+
+        uint8_t value = _cpu->getRegister((cpu::Registers) second);
+
+        if (opcode.mod_or_index != 0b11) {
+            uint8_t old = _cpu->readImm8(opcode.segment, first);
+            _cpu->writeImm8(value, opcode.segment, first);
+            _cpu->setRegister((cpu::Registers) second, old);
+        }
+        else {
+            _cpu->setRegister((cpu::Registers) second, _cpu->getRegister((cpu::Registers) first));
+            _cpu->setRegister((cpu::Registers) first, value);
+        }
+    }
+
+    REF_INSTRUCTION(i386_InstructionsManager, xchg_rm16_32_r16_32) {
+        _cpu->parseModRM(opcode);
+
+        uint8_t offset = operand32bit(opcode) ? 2 : 1;
+        uint32_t first;
+        uint32_t second;
+
+        if (address32bit(opcode)) {
+            first = _cpu->ModRMValue32bit(opcode, false, offset);
+            second = _cpu->ModRMValue32bit(opcode, true, offset);
+        }
+        else {
+            first = _cpu->ModRMValue16bit(opcode, false, offset);
+            second = _cpu->ModRMValue16bit(opcode, true, offset);
+        }
+
+        uint32_t value = _cpu->getRegister((cpu::Registers) second);
+
+        if (opcode.mod_or_index != 0b11) {
+            uint32_t old;
+
+            if (offset == 2) {
+                old = _cpu->readImm32(opcode.segment, first);
+                _cpu->writeImm32(value, opcode.segment, first);
+            }
+            else {
+                old = _cpu->readImm16(opcode.segment, first);
+                _cpu->writeImm16(value, opcode.segment, first);
+            }
+
+            _cpu->setRegister((cpu::Registers) second, old);
+        }
+        else {
+            _cpu->setRegister((cpu::Registers) second, _cpu->getRegister((cpu::Registers) first));
+            _cpu->setRegister((cpu::Registers) first, value);
+        }
+    }
+
+    // 0x90 is XCHG eAX, eAX, which is NOP
+    REF_INSTRUCTION(i386_InstructionsManager, xchg_eAX_r16_32) {
+        uint8_t reg = opcode.instruction & 0b111;
+
+        if (operand32bit(opcode)) {
+            uint32_t value = _cpu->getRegister((cpu::Registers) reg);
+            _cpu->setRegister((cpu::Registers) reg, _cpu->getRegister(cpu::Registers::EAX));
+            _cpu->setRegister(cpu::Registers::EAX, value);
+        }
+        else {
+            uint16_t value = _cpu->getRegister(wordRegisters[reg]);
+            _cpu->setRegister(wordRegisters[reg], _cpu->getRegister(cpu::Registers::AX));
+            _cpu->setRegister(cpu::Registers::AX, value);
+        }
+    }
+
+    template<typename Model>
+    bool i386_InstructionsManager<Model>::alu_jcc(cpu::Opcode &alu, cpu::Opcode &jcc) {
+        // the 0Fh form of Jcc came with the 386
+        if constexpr (!cpu::HAS_32BIT<Model>) {
+            if (jcc.instruction == 0x0f)
+                return false;
+        }
+
+        bool accumulator = (alu.instruction & 0b111) >= 0b100;
+
+        // a memory operand can fault, that is left to the handlers of the two
+        if (OP_CHECK_PREFIX(alu.prefixes, cpu::InstructionPrefix::LOCK) ||
+            (!accumulator && (alu.position >= alu.length || alu.bytes[alu.position] >> 6 != 0b11)))
+            return false;
+
+        // 8, 16 or 32 bit, as the offset ModRMValue16bit() takes
+        uint8_t offset = !(alu.instruction & 1) ? 0 : operand32bit(alu) ? 2 : 1;
+        uint32_t mask = offset == 0 ? 0xff : offset == 1 ? 0xffff : 0xffffffff;
+        uint32_t sign = (mask >> 1) + 1;
+
+        cpu::Registers destination;
+        uint32_t source;
+
+        if (accumulator) {
+            destination = offset == 0 ? cpu::Registers::AL : offset == 1 ? cpu::Registers::AX : cpu::Registers::EAX;
+            source = offset == 0 ? _cpu->nextImm8(alu) : offset == 1 ? _cpu->nextImm16(alu) : _cpu->nextImm32(alu);
+        }
+        else {
+            _cpu->parseModRM(alu);
+
+            // whichever way round, the handlers put the result into the r/m register
+            if (address32bit(alu)) {
+                destination = (cpu::Registers) _cpu->ModRMValue32bit(alu, false, offset);
+                source = _cpu->getRegister((cpu::Registers) _cpu->ModRMValue32bit(alu, true, offset));
+            }
+            else {
+                destination = (cpu::Registers) _cpu->ModRMValue16bit(alu, false, offset);
+                source = _cpu->getRegister((cpu::Registers) _cpu->ModRMValue16bit(alu, true, offset));
+            }
+        }
+
+        uint32_t value = _cpu->getRegister(destination);
+        uint32_t result;
+
+        bool cf = _cpu->getFlag(cpu::CF);
+        bool of = _cpu->getFlag(cpu::OF);
+
+        // the flags as the ADD, OR and ADC handlers leave them
+        switch ((alu.instruction >> 3) & 0b111) {
+            case 1:     // or
+                result = value | source;
+                cf = false;
+                of = false;
+                break;
+
+            default: {  // add, adc
+                uint32_t carry = alu.instruction >= 0x10 ? cf : 0;
+                result = (value + source + carry) & mask;
+
+                cf = cf || result < value;
+
+                if ((carry || (alu.instruction < 0x10 && cf)) && (result & sign)) {
+                    cf = false;
+                    of = true;
+                }
+
+                _cpu->setFlag(cpu::AF, (value & 0xf) + (source & 0xf) + carry > 15);
+                break;
+            }
+        }
+
+        bool zf = result == 0;
+        bool sf = result & sign;
+        bool pf = x86e::utils::countWithOddSetBits(result & 0xff) % 2 == 0;
+
+        _cpu->setRegister(destination, result);
+        _cpu->setFlag(cpu::CF, cf);
+        _cpu->setFlag(cpu::PF, pf);
+        _cpu->setFlag(cpu::ZF, zf);
+        _cpu->setFlag(cpu::SF, sf);
+        _cpu->setFlag(cpu::OF, of);
+
+        uint8_t code = jcc.instruction;
+        int32_t displacement;
+
+        if (code == 0x0f) {
+            code = _cpu->nextImm8(jcc);
+            displacement = operand32bit(jcc) ? (int32_t) _cpu->nextImm32(jcc) : (int16_t) _cpu->nextImm16(jcc);
+        }
+        else {
+            displacement = (int8_t) _cpu->nextImm8(jcc);
+        }
+
+        if (condition(code, cf, pf, zf, sf, of))
+            jumpRelative(jcc, displacement);
+
+        return true;
+    }
+
+    template<typename Model>
+    bool i386_InstructionsManager<Model>::push_pop(cpu::Opcode &push, cpu::Opcode &pop) {
+        if constexpr (!cpu::HAS_186_INSTRUCTIONS<Model>) {
+            if (push.instruction == 0x68 || push.instruction == 0x6a)
+                return false;
+        }
+
+        bool size32 = operand32bit(push);
+        uint32_t size = size32 ? 4 : 2;
+
+        if (size32 != operand32bit(pop))
+            return false;
+
+        // the write would land on the POP, which then has to be fetched again
+        uint32_t sp = (_cpu->getStackPointer() - size) & _cpu->stackMask();
+        uint32_t slot = _cpu->getSegment(cpu::Registers::SS).base + sp;
+        uint32_t code = _cpu->getSegment(cpu::Registers::CS).base + pop.beginIP;
+
+        if (slot < code + pop.position && code < slot + size)
+            return false;
+
+        uint32_t value;
+
+        // PUSH SP stores the value from before the push
+        if (push.instruction == 0x68)
+            value = size32 ? _cpu->nextImm32(push) : _cpu->nextImm16(push);
+        else if (push.instruction == 0x6a)
+            value = (int32_t) (int8_t) _cpu->nextImm8(push);
+        else if (size32)
+            value = _cpu->getRegister((cpu::Registers) (push.instruction & 0b111));
+        else
+            value = _cpu->getRegister(wordRegisters[push.instruction & 0b111]);
+
+        if (size32)
+            _cpu->pushOntoStackImm32(value);
+        else
+            _cpu->pushOntoStackImm16(value);
+
+        // what the POP would read back, and it takes the stack pointer back to where it was
+        _cpu->setStackPointer(sp + size);
+
+        uint8_t reg = pop.instruction & 0b111;
+
+        if (size32)
+            _cpu->setRegister((cpu::Registers) reg, value);
+        else
+            _cpu->setRegister(wordRegisters[reg], value);
+
+        return true;
+    }
+
+    template class i386_InstructionsManager<cpu::Model8086>;
+    template class i386_InstructionsManager<cpu::Model286>;
+    template class i386_InstructionsManager<cpu::Model386>;
+
 }
@@ -0,0 +1,196 @@
+#include "cpu/machine.h"
+
+#include <thread>
+
+namespace x86e::cpu {
+    // index of the CPU the calling thread runs, 0 outside of run()
+    static thread_local uint32_t currentCPU = 0;
+
+    template<typename Model>
+    Machine<Model>::Machine(uint32_t memory, uint32_t cpus, bool hugePages)
+        : _memory(memory, hugePages), _stop(false), _idle(0) {
+        for (uint32_t i = 0; i < std::max(cpus, 1u); i++) {
+            auto vcpu = std::make_unique<VCPU>();
+
+            vcpu->core = std::make_unique<Core<Model>>(_memory, _ioBus);
+            for (auto& word : vcpu->mailbox)
+                word.store(0);
+            vcpu->signal.store(0);
+
+            _cpus.push_back(std::move(vcpu));
+        }
+
+        _ioBus.setShared(_cpus.size() > 1);
+        _ioBus.registerPorts(IPI_PORT, 3, { this, &Machine::read, &Machine::write, nullptr, nullptr });
+    }
+
+    template<typename Model>
+    Machine<Model>::~Machine() {
+    }
+
+    template<typename Model>
+    void Machine<Model>::reset() {
+        for (auto& vcpu : _cpus) {
+            vcpu->core->reset();
+
+            for (auto& word : vcpu->mailbox)
+                word.store(0);
+        }
+    }
+
+    template<typename Model>
+    uint32_t Machine<Model>::cpus() {
+        return _cpus.size();
+    }
+
+    template<typename Model>
+    Core<Model> &Machine<Model>::cpu(uint32_t index) {
+        return *_cpus[index]->core;
+    }
+
+    template<typename Model>
+    memory::Memory &Machine<Model>::getMemory() {
+        return _memory;
+    }
+
+    template<typename Model>
+    devices::IOBus &Machine<Model>::getIOBus() {
+        return _ioBus;
+    }
+
+    template<typename Model>
+    uint32_t Machine<Model>::read(void *context, uint16_t port, uint8_t size) {
+        Machine* machine = (Machine*) context;
+
+        switch (port - IPI_PORT) {
+            case 0:
+                return currentCPU;
+            case 1:
+                return machine->_cpus.size();
+            default:
+                return 0xffffffff;
+        }
+    }
+
+    template<typename Model>
+    void Machine<Model>::write(void *context, uint16_t port, uint32_t value, uint8_t size) {
+        Machine* machine = (Machine*) context;
+
+        if (port - IPI_PORT != 2 || size < 2)
+            return;
+
+        uint8_t vector = value & 0xff;
+        uint8_t target = (value >> 8) & 0xff;
+
+        if (target != ALL_OTHERS) {
+            machine->sendIPI(target, vector);
+            return;
+        }
+
+        for (uint32_t i = 0; i < machine->_cpus.size(); i++) {
+            if (i != currentCPU)
+                machine->sendIPI(i, vector);
+        }
+    }
+
+    template<typename Model>
+    void Machine<Model>::sendIPI(uint32_t target, uint8_t vector) {
+        if (target >= _cpus.size())
+            return;
+
+        VCPU& vcpu = *_cpus[target];
+
+        vcpu.mailbox[vector >> 6].fetch_or(1ull << (vector & 63), std::memory_order_release);
+        vcpu.signal.fetch_add(1, std::memory_order_release);
+        vcpu.signal.notify_one();
+    }
+
+    template<typename Model>
+    void Machine<Model>::drainMailbox(VCPU &vcpu) {
+        for (int i = 0; i < 4; i++) {
+            uint64_t vectors = vcpu.mailbox[i].exchange(0, std::memory_order_acquire);
+
+            while (vectors) {
+                int bit = __builtin_ctzll(vectors);
+                vectors &= vectors - 1;
+
+                vcpu.core->raiseInterrupt(i * 64 + bit);
+            }
+        }
+    }
+
+    template<typename Model>
+    bool Machine<Model>::mailboxesEmpty() {
+        for (auto& vcpu : _cpus) {
+            for (auto& word : vcpu->mailbox) {
+                if (word.load(std::memory_order_acquire))
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    template<typename Model>
+    void Machine<Model>::runCPU(uint32_t index) {
+        VCPU& vcpu = *_cpus[index];
+        Core<Model>& core = *vcpu.core;
+
+        currentCPU = index;
+
+        while (!_stop.load(std::memory_order_relaxed)) {
+            // read before draining, an IPI arriving after the drain changes it and the wait returns at once
+            uint32_t signal = vcpu.signal.load(std::memory_order_acquire);
+
+            drainMailbox(vcpu);
+
+            if (!core.isHalted()) {
+                core.run(SLICE);
+                continue;
+            }
+
+            // the last CPU to go idle ends the run, unless an IPI is still on its way to someone
+            if (_idle.fetch_add(1) + 1 == _cpus.size() && mailboxesEmpty()) {
+                stop();
+                break;
+            }
+
+            vcpu.signal.wait(signal, std::memory_order_acquire);
+            _idle.fetch_sub(1);
+        }
+    }
+
+    template<typename Model>
+    void Machine<Model>::run() {
+        std::vector<std::thread> threads;
+
+        _stop.store(false);
+        _idle.store(0);
+
+        for (uint32_t i = 1; i < _cpus.size(); i++)
+            threads.emplace_back(&Machine::runCPU, this, i);
+
+        // the bootstrap processor runs on the calling thread
+        runCPU(0);
+
+        for (std::thread& thread : threads)
+            thread.join();
+
+        currentCPU = 0;
+    }
+
+    template<typename Model>
+    void Machine<Model>::stop() {
+        _stop.store(true);
+
+        for (auto& vcpu : _cpus) {
+            vcpu->signal.fetch_add(1, std::memory_order_release);
+            vcpu->signal.notify_all();
+        }
+    }
+
+    template class Machine<Model8086>;
+    template class Machine<Model286>;
+    template class Machine<Model386>;
+
+}
@@ -0,0 +1,56 @@
+#include "cpu/pairprofile.h"
+#include "cpu/core_impl.h"
+
+#include <algorithm>
+
+namespace x86e::cpu {
+
+    template class Core<Model386, PairProfile>;
+
+    // the name of an opcode as the pair table shows it
+    static void opcodeName(char* name, size_t size, uint32_t opcode) {
+        if (opcode & 0x100)
+            snprintf(name, size, "0f %02x", opcode & 0xff);
+        else
+            snprintf(name, size, "%02x", opcode);
+    }
+
+    void PairProfile::report(FILE *out, uint32_t fusion, uint32_t top) {
+        std::vector<uint32_t> pairs;
+        uint64_t total = 0;
+        uint64_t covered = 0;
+
+        for (uint32_t pair = 0; pair < counts.size(); pair++) {
+            if (!counts[pair])
+                continue;
+
+            pairs.push_back(pair);
+            total += counts[pair];
+
+            if (DecodeCache::pairOf(pair / OPCODES, pair % OPCODES) & fusion)
+                covered += counts[pair];
+        }
+
+        std::sort(pairs.begin(), pairs.end(), [this](uint32_t a, uint32_t b) {
+            return counts[a] > counts[b];
+        });
+
+        fprintf(out, "Pair profile: %llu instructions, %llu sequential pairs of %zu kinds, %.1f%% of them fused\n",
+                (unsigned long long) instructions, (unsigned long long) total, pairs.size(),
+                total ? 100.0 * covered / total : 0.0);
+        fprintf(out, "\t%-6s %-6s %14s %7s %s\n", "first", "second", "count", "share", "fused");
+
+        for (uint32_t i = 0; i < std::min<size_t>(top, pairs.size()); i++) {
+            uint32_t pair = pairs[i];
+            char first[8];
+            char second[8];
+
+            opcodeName(first, sizeof(first), pair / OPCODES);
+            opcodeName(second, sizeof(second), pair % OPCODES);
+
+            fprintf(out, "\t%-6s %-6s %14llu %6.2f%%%s\n", first, second, (unsigned long long) counts[pair],
+                    100.0 * counts[pair] / total, DecodeCache::pairOf(pair / OPCODES, pair % OPCODES) & fusion ? " yes" : "");
+        }
+    }
+
+}
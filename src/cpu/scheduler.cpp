@@ -0,0 +1,100 @@
+#include "cpu/scheduler.h"
+
+#include <algorithm>
+
+namespace x86e::cpu {
+
+    static bool later(const Event& a, const Event& b) {
+        return a.deadline > b.deadline;
+    }
+
+    Scheduler::Scheduler() {
+        reset();
+    }
+
+    Scheduler::~Scheduler() {
+    }
+
+    void Scheduler::reset() {
+        _events.clear();
+        _observers = 0;
+        _nextDeadline = NEVER;
+        _nextId = 1;
+    }
+
+    uint32_t Scheduler::schedule(uint64_t deadline, EventCallback callback, void *context) {
+        return add({ deadline, _nextId++, callback, context, false });
+    }
+
+    uint32_t Scheduler::observe(uint64_t deadline, EventCallback callback, void *context) {
+        ++_observers;
+        return add({ deadline, _nextId++, callback, context, true });
+    }
+
+    uint32_t Scheduler::add(const Event &event) {
+        _events.push_back(event);
+        std::push_heap(_events.begin(), _events.end(), later);
+
+        _nextDeadline = std::min(_nextDeadline, event.deadline);
+        return event.id;
+    }
+
+    void Scheduler::cancel(uint32_t id) {
+        auto it = std::find_if(_events.begin(), _events.end(), [id](const Event& event) {
+            return event.id == id;
+        });
+
+        if (it == _events.end())
+            return;
+
+        if (it->observer)
+            --_observers;
+
+        _events.erase(it);
+        std::make_heap(_events.begin(), _events.end(), later);
+        update();
+    }
+
+    void Scheduler::run(uint64_t now) {
+        while (!_events.empty() && _events.front().deadline <= now) {
+            std::pop_heap(_events.begin(), _events.end(), later);
+            Event event = _events.back();
+            _events.pop_back();
+
+            if (event.observer)
+                --_observers;
+
+            // the callback is free to schedule new events
+            event.callback(event.context, now);
+        }
+
+        update();
+    }
+
+    bool Scheduler::hasEvents() {
+        return _events.size() > _observers;
+    }
+
+    uint64_t Scheduler::earliestEvent() {
+        if (!hasEvents())
+            return NEVER;
+
+        if (!_events.front().observer)
+            return _events.front().deadline;
+
+        // there are only ever a few observers, the heap is searched past them
+        uint64_t earliest = NEVER;
+
+        for (const Event& event : _events) {
+            if (!event.observer)
+                earliest = std::min(earliest, event.deadline);
+        }
+
+        return earliest;
+    }
+
+    void Scheduler::update() {
+        _nextDeadline = _events.empty() ? NEVER : _events.front().deadline;
+    }
+
+}
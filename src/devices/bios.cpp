@@ -0,0 +1,568 @@
+#include "devices/bios.h"
+#include "io/Logger.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+namespace x86e::devices {
+    // BIOS data area
+    static constexpr uint32_t BDA_EQUIPMENT = 0x410;
+    static constexpr uint32_t BDA_MEMORY_SIZE = 0x413;
+    static constexpr uint32_t BDA_VIDEO_MODE = 0x449;
+    static constexpr uint32_t BDA_COLUMNS = 0x44a;
+    static constexpr uint32_t BDA_CURSOR = 0x450;
+    static constexpr uint32_t BDA_TICKS = 0x46c;
+    static constexpr uint32_t BDA_MIDNIGHT = 0x470;
+    static constexpr uint32_t BDA_HARD_DISKS = 0x475;
+    static constexpr uint32_t BDA_ROWS = 0x484;
+
+    static constexpr uint32_t TEXT_BUFFER = 0xb8000;
+    static constexpr uint16_t BLANK = 0x0720;     // a space, light grey on black
+
+    static constexpr uint32_t TICKS_PER_DAY = 0x1800b0;
+    static constexpr uint8_t COLUMNS = 80;
+    static constexpr uint8_t ROWS = 25;
+
+    // INT 13h status codes
+    static constexpr uint8_t DISK_OK = 0x00;
+    static constexpr uint8_t DISK_BAD_COMMAND = 0x01;
+    static constexpr uint8_t DISK_SECTOR_NOT_FOUND = 0x04;
+    static constexpr uint8_t DISK_NOT_READY = 0x80;
+
+    // offsets in the F000 segment
+    static constexpr uint16_t ROM_OFFSET = BIOS::ROM_BASE - (BIOS::ROM_SEGMENT << 4);
+    static constexpr uint16_t DEFAULT_ENTRY = 0xeff0;     // a plain IRET for the vectors without a service
+    static constexpr uint16_t DISK_PARAMETERS = 0xefc7;   // 1.44 MB diskette parameter table
+
+    // the vector of every service, in the order of Service
+    static constexpr uint8_t SERVICE_VECTORS[] = { 0x08, 0x10, 0x11, 0x12, 0x13, 0x16, 0x1a };
+
+    // floppy formats by size, anything larger is a hard disk
+    static constexpr uint32_t FLOPPY_FORMATS[][3] = {
+            { 40, 2, 9 },       // 360 KB
+            { 80, 2, 9 },       // 720 KB
+            { 80, 2, 15 },      // 1.2 MB
+            { 80, 2, 18 },      // 1.44 MB
+    };
+
+    static uint8_t toBCD(uint32_t value) {
+        return ((value / 10) << 4) | (value % 10);
+    }
+
+    BIOS::BIOS(cpu::CPU &cpu)
+        : _cpu(cpu), _disk(nullptr), _geometry({ 0, 0, 0 }), _drive(0) {
+        _teletype = { nullptr, &BIOS::writeStdout };
+
+        buildROM();
+
+        _cpu.getIOBus().registerPorts(TRAP_PORT, SERVICES, { this, &BIOS::read, &BIOS::trap, nullptr, nullptr });
+    }
+
+    BIOS::~BIOS() {
+        _cpu.getIOBus().unregisterPorts(TRAP_PORT, SERVICES);
+    }
+
+    void BIOS::buildROM() {
+        uint16_t position = 0;
+
+        std::memset(_rom, 0, sizeof(_rom));
+
+        for (int service = 0; service < SERVICES; service++) {
+            uint8_t port = TRAP_PORT + service;
+            _entries[service] = ROM_OFFSET + position;
+
+            if (service == SERVICE_TIMER) {
+                // out port, al ; iret
+                const uint8_t stub[] = { 0xe6, port, 0xcf };
+                std::memcpy(_rom + position, stub, sizeof(stub));
+                position += sizeof(stub);
+            }
+            else if (service == SERVICE_KEYBOARD) {
+                // waiting for a key sets CF, the stub then sleeps until an interrupt and asks again
+                //   sti ; again: out port, al ; jnc done ; hlt ; jmp again ; done: retf 2
+                const uint8_t stub[] = { 0xfb, 0xe6, port, 0x73, 0x03, 0xf4, 0xeb, 0xf9, 0xca, 0x02, 0x00 };
+                std::memcpy(_rom + position, stub, sizeof(stub));
+                position += sizeof(stub);
+            }
+            else {
+                // sti ; out port, al ; retf 2, so the flags the service sets reach the caller
+                const uint8_t stub[] = { 0xfb, 0xe6, port, 0xca, 0x02, 0x00 };
+                std::memcpy(_rom + position, stub, sizeof(stub));
+                position += sizeof(stub);
+            }
+        }
+
+        _rom[DEFAULT_ENTRY - ROM_OFFSET] = 0xcf;
+
+        // step rate, head unload, motor off delay, 512 byte sectors, 18 per track, gap, data length,
+        // format gap, fill byte, head settle, motor start
+        const uint8_t parameters[] = { 0xaf, 0x02, 0x25, 0x02, 0x12, 0x1b, 0xff, 0x6c, 0xf6, 0x0f, 0x08 };
+        std::memcpy(_rom + DISK_PARAMETERS - ROM_OFFSET, parameters, sizeof(parameters));
+    }
+
+    void BIOS::attachDisk(io::BlockBackend *disk) {
+        _disk = disk;
+
+        if (!_disk)
+            return;
+
+        uint64_t sectors = _disk->sectors();
+
+        for (auto& format : FLOPPY_FORMATS) {
+            if (sectors <= (uint64_t) format[0] * format[1] * format[2]) {
+                _geometry = { format[0], format[1], format[2] };
+                _drive = 0x00;
+                return;
+            }
+        }
+
+        // the usual translation for small disks, CHS reaches the first 504 MB
+        _geometry.heads = 16;
+        _geometry.sectors = 63;
+        _geometry.cylinders = std::min<uint64_t>(1024, (sectors + 16 * 63 - 1) / (16 * 63));
+        _drive = 0x80;
+    }
+
+    void BIOS::setTeletype(const TeletypeHandler &handler) {
+        _teletype = handler;
+    }
+
+    void BIOS::pushKey(uint16_t key) {
+        _keys.push_back(key);
+
+        // IRQ 1, wakes up a guest waiting in INT 16h
+        _cpu.raiseInterrupt(0x09);
+    }
+
+    bool BIOS::floppy() {
+        return _drive < 0x80;
+    }
+
+    bool BIOS::boot() {
+        memory::Memory& memory = _cpu.getMemory();
+
+        memory.mapROM(ROM_BASE, _rom, sizeof(_rom));
+
+        for (uint32_t vector = 0; vector < 256; vector++)
+            memory.writeImm32((ROM_SEGMENT << 16) | DEFAULT_ENTRY, vector * 4);
+
+        for (int service = 0; service < SERVICES; service++)
+            memory.writeImm32((ROM_SEGMENT << 16) | _entries[service], SERVICE_VECTORS[service] * 4);
+
+        // one diskette drive if booting from one, 80x25 color
+        memory.writeImm16(0x0020 | (_disk && floppy() ? 1 : 0), BDA_EQUIPMENT);
+        memory.writeImm16(std::min<uint64_t>(640, memory.memorySize() / 1024), BDA_MEMORY_SIZE);
+        memory.writeImm8(0x03, BDA_VIDEO_MODE);
+        memory.writeImm16(COLUMNS, BDA_COLUMNS);
+        memory.writeImm16(0, BDA_CURSOR);
+        memory.writeImm8(ROWS - 1, BDA_ROWS);
+        memory.writeImm8(_disk && !floppy() ? 1 : 0, BDA_HARD_DISKS);
+        clearScreen();
+
+        // the tick count starts at the host's time of day
+        time_t now = time(nullptr);
+        struct tm local;
+        localtime_r(&now, &local);
+
+        uint32_t seconds = local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+        memory.writeImm32((uint64_t) seconds * TICKS_PER_DAY / 86400, BDA_TICKS);
+        memory.writeImm8(0, BDA_MIDNIGHT);
+
+        // channel 0 in mode 3 with the full count, 18.2 interrupts a second
+        IOBus& ioBus = _cpu.getIOBus();
+        ioBus.out(0x43, 0x36, 1);
+        ioBus.out(0x40, 0x00, 1);
+        ioBus.out(0x40, 0x00, 1);
+
+        if (!_disk) {
+            io::debug_print(io::ERROR, "There is no disk to boot from");
+            return false;
+        }
+
+        if (transferSectors(0, 1, BOOT_ADDRESS, false) != DISK_OK) {
+            io::debug_print(io::ERROR, "Unable to read the boot sector of %s", _disk->path().c_str());
+            return false;
+        }
+
+        if (memory.readImm16(BOOT_ADDRESS + io::BlockBackend::SECTOR_SIZE - 2) != 0xaa55)
+            io::debug_print(io::WARNING, "%s has no boot signature, booting it anyway", _disk->path().c_str());
+
+        _cpu.loadSegment(cpu::CS, 0);
+        _cpu.loadSegment(cpu::DS, 0);
+        _cpu.loadSegment(cpu::ES, 0);
+        _cpu.loadSegment(cpu::SS, 0);
+        _cpu.setRegister(cpu::ESP, BOOT_ADDRESS);
+        _cpu.setRegister(cpu::EIP, BOOT_ADDRESS);
+        _cpu.setRegister(cpu::EDX, _drive);
+        _cpu.setFlag(cpu::IF, 1);
+
+        return true;
+    }
+
+    uint32_t BIOS::read(void *context, uint16_t port, uint8_t size) {
+        return 0xffffffff;
+    }
+
+    void BIOS::trap(void *context, uint16_t port, uint32_t value, uint8_t size) {
+        BIOS* bios = (BIOS*) context;
+
+        switch (port - TRAP_PORT) {
+            case SERVICE_TIMER:
+                bios->timer();
+                break;
+            case SERVICE_VIDEO:
+                bios->video();
+                break;
+            case SERVICE_EQUIPMENT:
+                bios->_cpu.setRegister(cpu::AX, bios->_cpu.getMemory().readImm16(BDA_EQUIPMENT));
+                break;
+            case SERVICE_MEMORY:
+                bios->_cpu.setRegister(cpu::AX, bios->_cpu.getMemory().readImm16(BDA_MEMORY_SIZE));
+                break;
+            case SERVICE_DISK:
+                bios->disk();
+                break;
+            case SERVICE_KEYBOARD:
+                bios->keyboard();
+                break;
+            case SERVICE_CLOCK:
+                bios->clock();
+                break;
+        }
+    }
+
+    void BIOS::writeStdout(void *context, uint8_t character) {
+        putchar(character);
+
+        if (character == '\n')
+            fflush(stdout);
+    }
+
+    uint32_t BIOS::linear(cpu::Registers segment, uint16_t offset) {
+        return _cpu.getSegment(segment).base + offset;
+    }
+
+    void BIOS::timer() {
+        memory::Memory& memory = _cpu.getMemory();
+        uint32_t ticks = memory.readImm32(BDA_TICKS) + 1;
+
+        if (ticks >= TICKS_PER_DAY) {
+            ticks = 0;
+            memory.writeImm8(1, BDA_MIDNIGHT);
+        }
+
+        memory.writeImm32(ticks, BDA_TICKS);
+    }
+
+    bool BIOS::textMode() {
+        memory::Memory& memory = _cpu.getMemory();
+        return memory.readImm8(BDA_VIDEO_MODE) <= 3 && memory.memorySize() >= TEXT_BUFFER + COLUMNS * ROWS * 2;
+    }
+
+    void BIOS::clearScreen() {
+        if (!textMode())
+            return;
+
+        for (uint32_t cell = 0; cell < COLUMNS * ROWS; cell++)
+            _cpu.getMemory().writeImm16(BLANK, TEXT_BUFFER + cell * 2);
+    }
+
+    void BIOS::teletype(uint8_t character) {
+        memory::Memory& memory = _cpu.getMemory();
+        uint8_t column = memory.readImm8(BDA_CURSOR);
+        uint8_t row = memory.readImm8(BDA_CURSOR + 1);
+        bool text = textMode();
+
+        switch (character) {
+            case '\b':
+                if (column)
+                    column--;
+                break;
+            case '\r':
+                column = 0;
+                break;
+            case '\n':
+                row++;
+                break;
+            case '\a':
+                break;
+            default:
+                if (text)
+                    memory.writeImm8(character, TEXT_BUFFER + (row * COLUMNS + column) * 2);
+
+                if (++column == COLUMNS) {
+                    column = 0;
+                    row++;
+                }
+                break;
+        }
+
+        if (row == ROWS) {
+            row = ROWS - 1;
+
+            // scrolls the screen up by a line
+            if (text) {
+                uint8_t lines[(ROWS - 1) * COLUMNS * 2];
+
+                memory.readBlock(TEXT_BUFFER + COLUMNS * 2, lines, sizeof(lines));
+                memory.writeBlock(TEXT_BUFFER, lines, sizeof(lines));
+
+                for (uint32_t cell = 0; cell < COLUMNS; cell++)
+                    memory.writeImm16(BLANK, TEXT_BUFFER + ((ROWS - 1) * COLUMNS + cell) * 2);
+            }
+        }
+
+        memory.writeImm8(column, BDA_CURSOR);
+        memory.writeImm8(row, BDA_CURSOR + 1);
+
+        _teletype.write(_teletype.context, character);
+    }
+
+    void BIOS::video() {
+        memory::Memory& memory = _cpu.getMemory();
+
+        switch (_cpu.getRegister(cpu::AH)) {
+            case 0x00:  // set video mode, the screen is cleared unless bit 7 is set
+                memory.writeImm8(_cpu.getRegister(cpu::AL) & 0x7f, BDA_VIDEO_MODE);
+                memory.writeImm16(0, BDA_CURSOR);
+
+                if (!(_cpu.getRegister(cpu::AL) & 0x80))
+                    clearScreen();
+                break;
+            case 0x02:  // set cursor position
+                memory.writeImm8(_cpu.getRegister(cpu::DL), BDA_CURSOR);
+                memory.writeImm8(_cpu.getRegister(cpu::DH), BDA_CURSOR + 1);
+                break;
+            case 0x03:  // get cursor position and shape
+                _cpu.setRegister(cpu::DL, memory.readImm8(BDA_CURSOR));
+                _cpu.setRegister(cpu::DH, memory.readImm8(BDA_CURSOR + 1));
+                _cpu.setRegister(cpu::CX, 0x0607);
+                break;
+            case 0x0e:  // teletype output
+                teletype(_cpu.getRegister(cpu::AL));
+                break;
+            case 0x0f:  // get video mode
+                _cpu.setRegister(cpu::AL, memory.readImm8(BDA_VIDEO_MODE));
+                _cpu.setRegister(cpu::AH, COLUMNS);
+                _cpu.setRegister(cpu::BH, 0);
+                break;
+            case 0x13: { // write string from ES:BP at DH:DL, AL bit 1 = characters and attributes alternate
+                uint8_t mode = _cpu.getRegister(cpu::AL);
+                uint16_t cursor = memory.readImm16(BDA_CURSOR);
+                uint32_t string = linear(cpu::ES, _cpu.getRegister(cpu::BP));
+
+                memory.writeImm8(_cpu.getRegister(cpu::DL), BDA_CURSOR);
+                memory.writeImm8(_cpu.getRegister(cpu::DH), BDA_CURSOR + 1);
+
+                for (uint32_t i = 0; i < _cpu.getRegister(cpu::CX); i++)
+                    teletype(memory.readImm8(string + i * (mode & 2 ? 2 : 1)));
+
+                // bit 0 leaves the cursor after the string
+                if (!(mode & 1))
+                    memory.writeImm16(cursor, BDA_CURSOR);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    uint8_t BIOS::transferSectors(uint64_t lba, uint32_t count, uint32_t address, bool write) {
+        uint8_t buffer[io::BlockBackend::SECTOR_SIZE];
+        memory::Memory& memory = _cpu.getMemory();
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint64_t offset = (lba + i) * io::BlockBackend::SECTOR_SIZE;
+            uint32_t target = address + i * io::BlockBackend::SECTOR_SIZE;
+
+            if (write) {
+                memory.readBlock(target, buffer, sizeof(buffer));
+
+                if (!_disk->write(offset, buffer, sizeof(buffer)))
+                    return DISK_SECTOR_NOT_FOUND;
+            }
+            else {
+                if (!_disk->read(offset, buffer, sizeof(buffer)))
+                    return DISK_SECTOR_NOT_FOUND;
+
+                memory.writeBlock(target, buffer, sizeof(buffer));
+            }
+        }
+
+        return DISK_OK;
+    }
+
+    void BIOS::diskStatus(uint8_t status) {
+        _cpu.setRegister(cpu::AH, status);
+        _cpu.setFlag(cpu::CF, status != DISK_OK);
+    }
+
+    void BIOS::disk() {
+        uint8_t function = _cpu.getRegister(cpu::AH);
+
+        if (!_disk || _cpu.getRegister(cpu::DL) != _drive) {
+            diskStatus(function == 0x00 ? DISK_OK : DISK_NOT_READY);
+            return;
+        }
+
+        switch (function) {
+            case 0x00:  // reset
+            case 0x01:  // status of the last operation, there are no failures to remember
+                diskStatus(DISK_OK);
+                break;
+            case 0x02:  // read AL sectors at CH/CL/DH to ES:BX
+            case 0x03: { // write them
+                uint32_t count = _cpu.getRegister(cpu::AL);
+                uint32_t cl = _cpu.getRegister(cpu::CL);
+                uint32_t cylinder = _cpu.getRegister(cpu::CH) | ((cl & 0xc0) << 2);
+                uint32_t sector = cl & 0x3f;
+                uint32_t head = _cpu.getRegister(cpu::DH);
+
+                if (!sector || sector > _geometry.sectors || head >= _geometry.heads) {
+                    _cpu.setRegister(cpu::AL, 0);
+                    diskStatus(DISK_SECTOR_NOT_FOUND);
+                    break;
+                }
+
+                uint64_t lba = ((uint64_t) cylinder * _geometry.heads + head) * _geometry.sectors + sector - 1;
+                uint8_t status = transferSectors(lba, count, linear(cpu::ES, _cpu.getRegister(cpu::BX)), function == 0x03);
+
+                _cpu.setRegister(cpu::AL, status == DISK_OK ? count : 0);
+                diskStatus(status);
+                break;
+            }
+            case 0x08: { // drive parameters
+                uint32_t cylinder = _geometry.cylinders - 1;
+
+                _cpu.setRegister(cpu::CH, cylinder & 0xff);
+                _cpu.setRegister(cpu::CL, _geometry.sectors | ((cylinder >> 2) & 0xc0));
+                _cpu.setRegister(cpu::DH, _geometry.heads - 1);
+                _cpu.setRegister(cpu::DL, 1);
+
+                if (floppy()) {
+                    _cpu.setRegister(cpu::BL, 0x04);
+                    _cpu.loadSegment(cpu::ES, ROM_SEGMENT);
+                    _cpu.setRegister(cpu::DI, DISK_PARAMETERS);
+                }
+
+                diskStatus(DISK_OK);
+                break;
+            }
+            case 0x15: { // drive type, the sector count for hard disks
+                if (floppy()) {
+                    _cpu.setRegister(cpu::AH, 0x01);
+                }
+                else {
+                    uint32_t sectors = _disk->sectors();
+
+                    _cpu.setRegister(cpu::AH, 0x03);
+                    _cpu.setRegister(cpu::CX, sectors >> 16);
+                    _cpu.setRegister(cpu::DX, sectors & 0xffff);
+                }
+
+                _cpu.setFlag(cpu::CF, 0);
+                break;
+            }
+            case 0x41:  // extensions present, only the fixed disk access subset
+                if (floppy() || _cpu.getRegister(cpu::BX) != 0x55aa) {
+                    diskStatus(DISK_BAD_COMMAND);
+                    break;
+                }
+
+                _cpu.setRegister(cpu::BX, 0xaa55);
+                _cpu.setRegister(cpu::CX, 0x0001);
+                _cpu.setRegister(cpu::AH, 0x01);
+                _cpu.setFlag(cpu::CF, 0);
+                break;
+            case 0x42:  // extended read, the disk address packet is at DS:SI
+            case 0x43: { // extended write, AL selects verification which is never needed
+                memory::Memory& memory = _cpu.getMemory();
+                uint32_t packet = linear(cpu::DS, _cpu.getRegister(cpu::SI));
+
+                uint16_t count = memory.readImm16(packet + 2);
+                uint32_t buffer = ((uint32_t) memory.readImm16(packet + 6) << 4) + memory.readImm16(packet + 4);
+                uint64_t lba = memory.readImm32(packet + 8) | ((uint64_t) memory.readImm32(packet + 12) << 32);
+
+                diskStatus(transferSectors(lba, count, buffer, function == 0x43));
+                break;
+            }
+            default:
+                diskStatus(DISK_BAD_COMMAND);
+                break;
+        }
+    }
+
+    void BIOS::keyboard() {
+        switch (_cpu.getRegister(cpu::AH)) {
+            case 0x00:  // wait for a key
+            case 0x10:
+                if (_keys.empty()) {
+                    // the stub halts and asks again
+                    _cpu.setFlag(cpu::CF, 1);
+                    return;
+                }
+
+                _cpu.setRegister(cpu::AX, _keys.front());
+                _keys.pop_front();
+                break;
+            case 0x01:  // peek, ZF when there is none
+            case 0x11:
+                _cpu.setFlag(cpu::ZF, _keys.empty());
+                if (!_keys.empty())
+                    _cpu.setRegister(cpu::AX, _keys.front());
+                break;
+            case 0x02:  // shift flags, nothing is held down
+            case 0x12:
+                _cpu.setRegister(cpu::AL, 0);
+                break;
+            default:
+                break;
+        }
+
+        _cpu.setFlag(cpu::CF, 0);
+    }
+
+    void BIOS::clock() {
+        memory::Memory& memory = _cpu.getMemory();
+
+        time_t now = time(nullptr);
+        struct tm local;
+        localtime_r(&now, &local);
+
+        switch (_cpu.getRegister(cpu::AH)) {
+            case 0x00: { // tick count, AL tells whether midnight has passed since the last read
+                uint32_t ticks = memory.readImm32(BDA_TICKS);
+
+                _cpu.setRegister(cpu::CX, ticks >> 16);
+                _cpu.setRegister(cpu::DX, ticks & 0xffff);
+                _cpu.setRegister(cpu::AL, memory.readImm8(BDA_MIDNIGHT));
+                memory.writeImm8(0, BDA_MIDNIGHT);
+                break;
+            }
+            case 0x01:  // set tick count
+                memory.writeImm32((_cpu.getRegister(cpu::CX) << 16) | _cpu.getRegister(cpu::DX), BDA_TICKS);
+                memory.writeImm8(0, BDA_MIDNIGHT);
+                break;
+            case 0x02:  // real time clock, BCD
+                _cpu.setRegister(cpu::CH, toBCD(local.tm_hour));
+                _cpu.setRegister(cpu::CL, toBCD(local.tm_min));
+                _cpu.setRegister(cpu::DH, toBCD(local.tm_sec));
+                _cpu.setRegister(cpu::DL, local.tm_isdst > 0);
+                break;
+            case 0x04:  // date, BCD
+                _cpu.setRegister(cpu::CH, toBCD((local.tm_year + 1900) / 100));
+                _cpu.setRegister(cpu::CL, toBCD(local.tm_year % 100));
+                _cpu.setRegister(cpu::DH, toBCD(local.tm_mon + 1));
+                _cpu.setRegister(cpu::DL, toBCD(local.tm_mday));
+                break;
+            default:
+                // setting the clock, the host's is kept
+                break;
+        }
+
+        _cpu.setFlag(cpu::CF, 0);
+    }
+
+}
@@ -0,0 +1,151 @@
+#include "devices/blockdevice.h"
+#include "io/Logger.h"
+
+namespace x86e::devices {
+
+    BlockDevice::BlockDevice(cpu::CPU &cpu, io::BlockBackend &backend, io::BlockWorkers &workers)
+        : _cpu(cpu), _backend(backend), _workers(workers), _inFlight(0), _event(0) {
+        _cpu.getIOBus().registerPorts(PORT, 12, { this, &BlockDevice::read, &BlockDevice::write, nullptr, nullptr });
+    }
+
+    BlockDevice::~BlockDevice() {
+        _cpu.getIOBus().unregisterPorts(PORT, 12);
+
+        if (_event)
+            _cpu.getScheduler().cancel(_event);
+
+        // the workers still hold the requests, they are freed without touching the guest
+        std::unique_lock<std::mutex> guard(_lock);
+
+        while (_inFlight) {
+            _done.wait(guard, [this] { return !_finished.empty(); });
+
+            _inFlight -= _finished.size();
+            for (Request* request : _finished)
+                delete request;
+
+            _finished.clear();
+        }
+    }
+
+    uint32_t BlockDevice::read(void *context, uint16_t port, uint8_t size) {
+        BlockDevice* device = (BlockDevice*) context;
+
+        switch (port - PORT) {
+            case 0: {
+                if (device->_completed.empty())
+                    return 0;
+
+                uint32_t descriptor = device->_completed.front();
+                device->_completed.pop_front();
+                return descriptor;
+            }
+            case 4:
+                return device->_backend.sectors() & 0xffffffff;
+            case 8:
+                return device->_inFlight;
+            default:
+                return 0xffffffff;
+        }
+    }
+
+    void BlockDevice::write(void *context, uint16_t port, uint32_t value, uint8_t size) {
+        BlockDevice* device = (BlockDevice*) context;
+
+        if (port == PORT && size == 4)
+            device->submit(value);
+    }
+
+    void BlockDevice::submit(uint32_t descriptor) {
+        memory::Memory& memory = _cpu.getMemory();
+
+        uint8_t command = memory.readImm8(descriptor);
+        uint32_t sectors = memory.readImm16(descriptor + 2);
+        uint32_t buffer = memory.readImm32(descriptor + 4);
+        uint64_t lba = memory.readImm32(descriptor + 8) | ((uint64_t) memory.readImm32(descriptor + 12) << 32);
+
+        Request* request = new Request();
+        request->device = this;
+        request->descriptor = descriptor;
+        request->buffer = buffer;
+        request->block = { &_backend, io::BLOCK_READ, lba * io::BlockBackend::SECTOR_SIZE, {}, false, request, &BlockDevice::complete };
+
+        uint64_t bytes = (uint64_t) sectors * io::BlockBackend::SECTOR_SIZE;
+
+        switch (command) {
+            case COMMAND_READ:
+                request->block.data.resize(bytes);
+                break;
+            case COMMAND_WRITE:
+                request->block.operation = io::BLOCK_WRITE;
+                request->block.data.resize(bytes);
+                memory.readBlock(buffer, request->block.data.data(), bytes);
+                break;
+            case COMMAND_FLUSH:
+                request->block.operation = io::BLOCK_FLUSH;
+                break;
+            default:
+                finish(request, STATUS_ERROR);
+                return;
+        }
+
+        memory.writeImm8(STATUS_PENDING, descriptor + 1);
+        _inFlight++;
+
+        if (!_event)
+            _event = _cpu.getScheduler().schedule(_cpu.instructionsRetired() + POLL_INTERVAL, &BlockDevice::poll, this);
+
+        _workers.submit(&request->block);
+    }
+
+    void BlockDevice::complete(void *context, io::BlockRequest *block) {
+        Request* request = (Request*) context;
+        BlockDevice* device = request->device;
+
+        // notified under the lock, the device may be gone as soon as it is released
+        std::lock_guard<std::mutex> guard(device->_lock);
+
+        device->_finished.push_back(request);
+        device->_done.notify_one();
+    }
+
+    void BlockDevice::poll(void *context, uint64_t now) {
+        BlockDevice* device = (BlockDevice*) context;
+        std::deque<Request*> finished;
+
+        {
+            std::unique_lock<std::mutex> guard(device->_lock);
+
+            // a halted CPU has nothing better to do than to wait for the host
+            if (device->_finished.empty() && device->_cpu.isSleeping())
+                device->_done.wait(guard, [device] { return !device->_finished.empty(); });
+
+            finished.swap(device->_finished);
+        }
+
+        for (Request* request : finished) {
+            device->_inFlight--;
+            device->finish(request, request->block.success ? STATUS_OK : STATUS_ERROR);
+        }
+
+        device->_event = 0;
+
+        if (device->_inFlight)
+            device->_event = device->_cpu.getScheduler().schedule(now + POLL_INTERVAL, &BlockDevice::poll, device);
+    }
+
+    void BlockDevice::finish(Request *request, uint8_t status) {
+        memory::Memory& memory = _cpu.getMemory();
+
+        if (status == STATUS_OK && request->block.operation == io::BLOCK_READ)
+            memory.writeBlock(request->buffer, request->block.data.data(), request->block.data.size());
+
+        memory.writeImm8(status, request->descriptor + 1);
+
+        _completed.push_back(request->descriptor);
+        _cpu.raiseInterrupt(VECTOR);
+
+        delete request;
+    }
+
+}
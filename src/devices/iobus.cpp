@@ -0,0 +1,162 @@
+#include "devices/iobus.h"
+#include "io/Logger.h"
+
+#include <cstring>
+
+namespace x86e::devices {
+
+    // nothing is connected. reads float high, writes are dropped
+    static uint32_t unassignedRead(void* context, uint16_t port, uint8_t size) {
+        return size == 1 ? 0xff : size == 2 ? 0xffff : 0xffffffff;
+    }
+
+    static void unassignedWrite(void* context, uint16_t port, uint32_t value, uint8_t size) {
+    }
+
+    IOBus::IOBus() {
+        std::memset(_dispatch, 0, sizeof(_dispatch));
+
+        _handlers[0] = { nullptr, &unassignedRead, &unassignedWrite, nullptr, nullptr };
+        // no string callbacks, so REP INS/OUTS on a watched port reports every element
+        _handlers[WATCH_HANDLER] = { this, &watchedRead, &watchedWrite, nullptr, nullptr };
+        _handlersCount = 2;
+
+        _watched = nullptr;
+        _exits = 0;
+        _shared = false;
+    }
+
+    IOBus::~IOBus() {
+        delete[] _watched;
+    }
+
+    bool IOBus::registerPorts(uint16_t first, uint32_t count, const PortHandler& handler) {
+        if (first + count > PORTS || _handlersCount >= MAX_HANDLERS) {
+            io::debug_print(io::ERROR, "Unable to register ports 0x%x-0x%x", first, first + count - 1);
+            return false;
+        }
+
+        for (uint32_t port = first; port < first + count; port++) {
+            if (handlerIndex(port) != 0) {
+                io::debug_print(io::ERROR, "Port 0x%x is already registered", port);
+                return false;
+            }
+        }
+
+        _handlers[_handlersCount] = handler;
+
+        for (uint32_t port = first; port < first + count; port++)
+            handlerIndex(port) = _handlersCount;
+
+        _handlersCount++;
+        return true;
+    }
+
+    void IOBus::unregisterPorts(uint16_t first, uint32_t count) {
+        // the handler slot is not reused, there are few enough devices for that to not matter
+        for (uint32_t port = first; port < first + count && port < PORTS; port++)
+            handlerIndex(port) = 0;
+    }
+
+    void IOBus::watchPorts(uint16_t first, uint32_t count, const PortWatch &watch) {
+        if (!_watched)
+            _watched = new WatchedPort[PORTS];
+
+        for (uint32_t port = first; port < first + count && port < PORTS; port++) {
+            if (_dispatch[port] != WATCH_HANDLER) {
+                _watched[port].handler = _dispatch[port];
+                _dispatch[port] = WATCH_HANDLER;
+            }
+
+            _watched[port].watch = watch;
+        }
+    }
+
+    void IOBus::unwatchPorts(uint16_t first, uint32_t count) {
+        for (uint32_t port = first; port < first + count && port < PORTS; port++) {
+            if (_dispatch[port] == WATCH_HANDLER)
+                _dispatch[port] = _watched[port].handler;
+        }
+    }
+
+    uint32_t IOBus::watchedRead(void *context, uint16_t port, uint8_t size) {
+        WatchedPort& watched = ((IOBus*) context)->_watched[port];
+        PortHandler& handler = ((IOBus*) context)->_handlers[watched.handler];
+
+        uint32_t value = handler.read(handler.context, port, size);
+        watched.watch.access(watched.watch.context, port, value, size, false);
+        return value;
+    }
+
+    void IOBus::watchedWrite(void *context, uint16_t port, uint32_t value, uint8_t size) {
+        WatchedPort& watched = ((IOBus*) context)->_watched[port];
+        PortHandler& handler = ((IOBus*) context)->_handlers[watched.handler];
+
+        handler.write(handler.context, port, value, size);
+        watched.watch.access(watched.watch.context, port, value, size, true);
+    }
+
+    uint64_t IOBus::exits() {
+        return _exits;
+    }
+
+    void IOBus::setShared(bool shared) {
+        _shared = shared;
+    }
+
+    uint32_t IOBus::inShared(uint16_t port, uint8_t size) {
+        std::lock_guard<std::mutex> guard(_lock);
+        PortHandler& handler = _handlers[_dispatch[port]];
+
+        ++_exits;
+        return handler.read(handler.context, port, size);
+    }
+
+    void IOBus::outShared(uint16_t port, uint32_t value, uint8_t size) {
+        std::lock_guard<std::mutex> guard(_lock);
+        PortHandler& handler = _handlers[_dispatch[port]];
+
+        ++_exits;
+        handler.write(handler.context, port, value, size);
+    }
+
+    void IOBus::inString(uint16_t port, uint8_t size, uint8_t *buffer, uint32_t count) {
+        std::unique_lock<std::mutex> guard(_lock, std::defer_lock);
+        if (_shared)
+            guard.lock();
+
+        PortHandler& handler = _handlers[_dispatch[port]];
+        ++_exits;
+
+        if (handler.readString) {
+            handler.readString(handler.context, port, size, buffer, count);
+            return;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t value = handler.read(handler.context, port, size);
+            std::memcpy(buffer + i * size, &value, size);
+        }
+    }
+
+    void IOBus::outString(uint16_t port, uint8_t size, const uint8_t *buffer, uint32_t count) {
+        std::unique_lock<std::mutex> guard(_lock, std::defer_lock);
+        if (_shared)
+            guard.lock();
+
+        PortHandler& handler = _handlers[_dispatch[port]];
+        ++_exits;
+
+        if (handler.writeString) {
+            handler.writeString(handler.context, port, size, buffer, count);
+            return;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t value = 0;
+            std::memcpy(&value, buffer + i * size, size);
+            handler.write(handler.context, port, value, size);
+        }
+    }
+
+}
@@ -0,0 +1,207 @@
+#include "devices/pit.h"
+
+namespace x86e::devices {
+
+    PIT::PIT(cpu::CPU &cpu)
+        : _cpu(cpu), _event(0) {
+        reset();
+
+        _cpu.getIOBus().registerPorts(0x40, 4, { this, &PIT::read, &PIT::write, nullptr, nullptr });
+    }
+
+    PIT::~PIT() {
+        _cpu.getIOBus().unregisterPorts(0x40, 4);
+
+        if (_event)
+            _cpu.getScheduler().cancel(_event);
+    }
+
+    void PIT::reset() {
+        for (Channel& channel : _channels)
+            channel = { 0, 0, 3, false, false, false, 0, false, 0, false, 0 };
+
+        if (_event)
+            _cpu.getScheduler().cancel(_event);
+
+        _event = 0;
+        _deadline = 0;
+    }
+
+    uint64_t PIT::period(Channel &channel) {
+        uint64_t ticks = channel.reload ? channel.reload : 0x10000;
+        return ticks * cpu::Scheduler::INSTRUCTIONS_PER_SECOND / FREQUENCY;
+    }
+
+    uint16_t PIT::count(Channel &channel) {
+        uint64_t ticks = channel.reload ? channel.reload : 0x10000;
+        uint64_t elapsed = (_cpu.instructionsRetired() - channel.start) * FREQUENCY / cpu::Scheduler::INSTRUCTIONS_PER_SECOND;
+
+        // modes 2 and 3 reload on terminal count, everything else stops at zero
+        if (channel.mode == 2 || channel.mode == 3)
+            return ticks - elapsed % ticks;
+
+        return elapsed >= ticks ? 0 : ticks - elapsed;
+    }
+
+    bool PIT::output(Channel &channel) {
+        // mode 0 drops OUT as the control word is written, the others raise it
+        if (channel.nullCount)
+            return channel.mode != 0;
+
+        uint64_t ticks = channel.reload ? channel.reload : 0x10000;
+        uint64_t elapsed = (_cpu.instructionsRetired() - channel.start) * FREQUENCY / cpu::Scheduler::INSTRUCTIONS_PER_SECOND;
+
+        switch (channel.mode) {
+            case 0:     // goes high on terminal count
+                return elapsed >= ticks;
+
+            case 2:     // low for the last clock of every period
+                return elapsed % ticks != ticks - 1;
+
+            case 3:     // high for the first half of every period
+                return elapsed % ticks < (ticks + 1) / 2;
+
+            case 4:     // low for one clock on terminal count
+                return elapsed != ticks;
+
+            default:    // 1 and 5 wait for a gate that never comes
+                return true;
+        }
+    }
+
+    void PIT::load(Channel &channel) {
+        channel.start = _cpu.instructionsRetired();
+
+        if (&channel != &_channels[0])
+            return;
+
+        if (_event)
+            _cpu.getScheduler().cancel(_event);
+
+        _deadline = channel.start + period(channel);
+        _event = _cpu.getScheduler().schedule(_deadline, &PIT::tick, this);
+    }
+
+    void PIT::tick(void *context, uint64_t now) {
+        PIT* pit = (PIT*) context;
+        Channel& channel = pit->_channels[0];
+
+        pit->_event = 0;
+        pit->_cpu.raiseInterrupt(IRQ0_VECTOR);
+
+        if (channel.mode == 2 || channel.mode == 3) {
+            // rescheduled from the previous deadline so the rate does not drift
+            pit->_deadline += pit->period(channel);
+            pit->_event = pit->_cpu.getScheduler().schedule(pit->_deadline, &PIT::tick, pit);
+        }
+    }
+
+    uint32_t PIT::read(void *context, uint16_t port, uint8_t size) {
+        PIT* pit = (PIT*) context;
+
+        if ((port & 3) == 3)
+            return 0xff;
+
+        Channel& channel = pit->_channels[port & 3];
+
+        if (channel.statusLatched) {
+            channel.statusLatched = false;
+            return channel.status;
+        }
+
+        uint16_t value = channel.latched ? channel.latch : pit->count(channel);
+
+        // a latched count is let go once it has been read in full
+        if (channel.access == 1 || channel.access == 2) {
+            channel.latched = false;
+            return channel.access == 1 ? value & 0xff : value >> 8;
+        }
+
+        bool high = channel.readHigh;
+        channel.readHigh = !channel.readHigh;
+
+        if (high)
+            channel.latched = false;
+
+        return high ? value >> 8 : value & 0xff;
+    }
+
+    void PIT::write(void *context, uint16_t port, uint32_t value, uint8_t size) {
+        PIT* pit = (PIT*) context;
+
+        if ((port & 3) == 3) {
+            uint8_t select = (value >> 6) & 3;
+
+            if (select == 3) {
+                // read-back command: bits 1-3 pick the channels, a clear bit 5 latches their
+                // counts and a clear bit 4 their status. what is already latched stays
+                for (uint32_t i = 0; i < 3; i++) {
+                    Channel& channel = pit->_channels[i];
+
+                    if (!(value & (2 << i)))
+                        continue;
+
+                    if (!(value & 0x20) && !channel.latched) {
+                        channel.latch = pit->count(channel);
+                        channel.latched = true;
+                        channel.readHigh = false;
+                    }
+
+                    if (!(value & 0x10) && !channel.statusLatched) {
+                        channel.status = pit->output(channel) << 7 | channel.nullCount << 6 | channel.access << 4 | channel.mode << 1;
+                        channel.statusLatched = true;
+                    }
+                }
+                return;
+            }
+
+            Channel& channel = pit->_channels[select];
+            uint8_t access = (value >> 4) & 3;
+
+            if (access == 0) {
+                // counter latch command, a count that is still latched is kept
+                if (!channel.latched) {
+                    channel.latch = pit->count(channel);
+                    channel.latched = true;
+                    channel.readHigh = false;
+                }
+                return;
+            }
+
+            channel.access = access;
+            channel.mode = (value >> 1) & 7;
+            channel.mode = channel.mode > 5 ? channel.mode - 4 : channel.mode;
+            channel.writeHigh = false;
+            channel.readHigh = false;
+            channel.nullCount = true;
+            return;
+        }
+
+        Channel& channel = pit->_channels[port & 3];
+
+        switch (channel.access) {
+            case 1:
+                channel.reload = value & 0xff;
+                break;
+
+            case 2:
+                channel.reload = (value & 0xff) << 8;
+                break;
+
+            default:
+                if (!channel.writeHigh) {
+                    channel.reload = (channel.reload & 0xff00) | (value & 0xff);
+                    channel.writeHigh = true;
+                    return;
+                }
+
+                channel.reload = (channel.reload & 0x00ff) | ((value & 0xff) << 8);
+                channel.writeHigh = false;
+                break;
+        }
+
+        channel.nullCount = false;
+        pit->load(channel);
+    }
+
+}
@@ -0,0 +1,269 @@
+#include "devices/serial.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace x86e::devices {
+    // line control, divisor latch access
+    static constexpr uint8_t LCR_DLAB = 0x80;
+
+    // interrupt enable
+    static constexpr uint8_t IER_RECEIVE = 0x01;
+    static constexpr uint8_t IER_TRANSMIT = 0x02;
+
+    // line status, data ready, transmitter holding register and transmitter empty
+    static constexpr uint8_t LSR_DATA_READY = 0x01;
+    static constexpr uint8_t LSR_EMPTY = 0x60;
+
+    // interrupt identification
+    static constexpr uint8_t IIR_NONE = 0x01;
+    static constexpr uint8_t IIR_TRANSMIT = 0x02;
+    static constexpr uint8_t IIR_RECEIVE = 0x04;
+
+    // modem status, clear to send, data set ready and carrier detect
+    static constexpr uint8_t MSR_CONNECTED = 0xb0;
+
+    Serial::Serial(cpu::CPU &cpu, int output, int input, uint16_t base)
+        : _cpu(cpu), _output(output), _input(input), _base(base), _event(0), _inputEvent(0) {
+        _transmit.reserve(FLUSH_THRESHOLD);
+
+        if (_input >= 0)
+            fcntl(_input, F_SETFL, fcntl(_input, F_GETFL) | O_NONBLOCK);
+
+        reset();
+
+        _cpu.getIOBus().registerPorts(_base, 8, { this, &Serial::read, &Serial::write, nullptr, &Serial::writeString });
+    }
+
+    Serial::~Serial() {
+        _cpu.getIOBus().unregisterPorts(_base, 8);
+
+        if (_inputEvent)
+            _cpu.getScheduler().cancel(_inputEvent);
+
+        flush();
+    }
+
+    void Serial::reset() {
+        flush();
+
+        if (_inputEvent)
+            _cpu.getScheduler().cancel(_inputEvent);
+
+        _inputEvent = 0;
+        _receive.clear();
+        _receivePosition = 0;
+        _lastInput = cpu::Scheduler::NEVER;
+        _inputClosed = false;
+
+        _ier = 0;
+        _lcr = 0x03;        // 8N1
+        _mcr = 0;
+        _scratch = 0;
+        _divisor = 12;      // 9600 baud
+        _transmitInterrupt = false;
+    }
+
+    void Serial::flush() {
+        if (_event) {
+            _cpu.getScheduler().cancel(_event);
+            _event = 0;
+        }
+
+        // keeps the order with whatever the emulator printed through stdio
+        if (_output == STDOUT_FILENO)
+            fflush(stdout);
+
+        uint32_t written = 0;
+
+        while (written < _transmit.size()) {
+            ssize_t count = ::write(_output, _transmit.data() + written, _transmit.size() - written);
+
+            if (count < 0 && errno == EINTR)
+                continue;
+
+            // the host cannot take it, the output is dropped rather than stalling the guest
+            if (count <= 0)
+                break;
+
+            written += count;
+        }
+
+        _transmit.clear();
+    }
+
+    void Serial::flushEvent(void *context, uint64_t now) {
+        Serial* serial = (Serial*) context;
+
+        serial->_event = 0;
+        serial->flush();
+    }
+
+    void Serial::transmit(const uint8_t *data, uint32_t count) {
+        _transmit.insert(_transmit.end(), data, data + count);
+
+        if (_transmit.size() >= FLUSH_THRESHOLD)
+            flush();
+        else if (!_event)
+            _event = _cpu.getScheduler().schedule(_cpu.instructionsRetired() + FLUSH_DELAY, &Serial::flushEvent, this);
+    }
+
+    bool Serial::receiveReady() {
+        if (_receivePosition < _receive.size())
+            return true;
+
+        if (_input < 0 || _inputClosed)
+            return false;
+
+        // a guest polling the line status must not turn into a read(2) per poll
+        uint64_t now = _cpu.instructionsRetired();
+        if (_lastInput != cpu::Scheduler::NEVER && now < _lastInput + INPUT_INTERVAL)
+            return false;
+
+        _lastInput = now;
+        _receive.resize(INPUT_CHUNK);
+        _receivePosition = 0;
+
+        ssize_t count = ::read(_input, _receive.data(), INPUT_CHUNK);
+
+        if (count == 0)
+            _inputClosed = true;
+
+        _receive.resize(count > 0 ? count : 0);
+        return count > 0;
+    }
+
+    void Serial::updateInterrupt() {
+        bool receive = (_ier & IER_RECEIVE) && _receivePosition < _receive.size();
+        bool transmit = (_ier & IER_TRANSMIT) && _transmitInterrupt;
+
+        if (receive || transmit)
+            _cpu.raiseInterrupt(VECTOR);
+
+        if ((_ier & IER_RECEIVE) && _input >= 0 && !_inputClosed && !_inputEvent)
+            _inputEvent = _cpu.getScheduler().schedule(_cpu.instructionsRetired() + INPUT_INTERVAL, &Serial::inputEvent, this);
+    }
+
+    void Serial::inputEvent(void *context, uint64_t now) {
+        Serial* serial = (Serial*) context;
+
+        serial->_inputEvent = 0;
+
+        // nothing is raised again while the guest has not taken what is there
+        if (serial->_receivePosition < serial->_receive.size() || !serial->receiveReady()) {
+            if ((serial->_ier & IER_RECEIVE) && !serial->_inputClosed)
+                serial->_inputEvent = serial->_cpu.getScheduler().schedule(now + INPUT_INTERVAL, &Serial::inputEvent, serial);
+            return;
+        }
+
+        serial->updateInterrupt();
+    }
+
+    uint32_t Serial::read(void *context, uint16_t port, uint8_t size) {
+        Serial* serial = (Serial*) context;
+        bool dlab = serial->_lcr & LCR_DLAB;
+
+        switch (port - serial->_base) {
+            case 0: {
+                if (dlab)
+                    return serial->_divisor & 0xff;
+
+                if (!serial->receiveReady())
+                    return 0;
+
+                uint8_t value = serial->_receive[serial->_receivePosition++];
+                serial->updateInterrupt();
+                return value;
+            }
+            case 1:
+                return dlab ? serial->_divisor >> 8 : serial->_ier;
+            case 2:
+                if ((serial->_ier & IER_RECEIVE) && serial->_receivePosition < serial->_receive.size())
+                    return IIR_RECEIVE;
+
+                if ((serial->_ier & IER_TRANSMIT) && serial->_transmitInterrupt) {
+                    serial->_transmitInterrupt = false;
+                    return IIR_TRANSMIT;
+                }
+
+                return IIR_NONE;
+            case 3:
+                return serial->_lcr;
+            case 4:
+                return serial->_mcr;
+            case 5:
+                return LSR_EMPTY | (serial->receiveReady() ? LSR_DATA_READY : 0);
+            case 6:
+                return MSR_CONNECTED;
+            default:
+                return serial->_scratch;
+        }
+    }
+
+    void Serial::write(void *context, uint16_t port, uint32_t value, uint8_t size) {
+        Serial* serial = (Serial*) context;
+        bool dlab = serial->_lcr & LCR_DLAB;
+        uint8_t byte = value & 0xff;
+
+        switch (port - serial->_base) {
+            case 0:
+                if (dlab) {
+                    serial->_divisor = (serial->_divisor & 0xff00) | byte;
+                    break;
+                }
+
+                serial->transmit(&byte, 1);
+                serial->_transmitInterrupt = true;
+                serial->updateInterrupt();
+                break;
+            case 1:
+                if (dlab) {
+                    serial->_divisor = (serial->_divisor & 0x00ff) | (byte << 8);
+                    break;
+                }
+
+                // enabling the transmit interrupt raises it right away, the holding register is always empty
+                serial->_ier = byte & 0x0f;
+                serial->_transmitInterrupt = serial->_ier & IER_TRANSMIT;
+                serial->updateInterrupt();
+                break;
+            case 3:
+                serial->_lcr = byte;
+                break;
+            case 4:
+                serial->_mcr = byte;
+                break;
+            case 7:
+                serial->_scratch = byte;
+                break;
+            default:
+                // FIFO control and the read-only status registers
+                break;
+        }
+    }
+
+    void Serial::writeString(void *context, uint16_t port, uint8_t size, const uint8_t *buffer, uint32_t count) {
+        Serial* serial = (Serial*) context;
+
+        if (port != serial->_base || size != 1 || (serial->_lcr & LCR_DLAB)) {
+            for (uint32_t i = 0; i < count; i++) {
+                uint32_t value = 0;
+
+                for (uint8_t byte = 0; byte < size; byte++)
+                    value |= buffer[i * size + byte] << (byte * 8);
+
+                write(context, port, value, size);
+            }
+
+            return;
+        }
+
+        // REP OUTSB to the holding register, the whole string at once
+        serial->transmit(buffer, count);
+        serial->_transmitInterrupt = true;
+        serial->updateInterrupt();
+    }
+
+}
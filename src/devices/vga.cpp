@@ -0,0 +1,124 @@
+#include "devices/vga.h"
+#include "io/Logger.h"
+
+#include <algorithm>
+
+namespace x86e::devices {
+    static constexpr uint32_t ALL_ROWS = (1u << TextDisplay::ROWS) - 1;
+
+    TextDisplay::TextDisplay(cpu::CPU &cpu)
+        : _cpu(cpu), _dirty(ALL_ROWS), _dump(nullptr), _interval(0), _event(0) {
+        _lines.assign(ROWS, std::string(COLUMNS, ' '));
+
+        if (_cpu.getMemory().memorySize() < BASE + SIZE)
+            io::debug_print(io::WARNING, "There is no RAM behind the text mode screen, it stays blank");
+
+        _cpu.watchMemory(BASE, SIZE, { this, &TextDisplay::access });
+    }
+
+    TextDisplay::~TextDisplay() {
+        _cpu.unwatchMemory(BASE, SIZE);
+
+        if (_event)
+            _cpu.getScheduler().cancel(_event);
+
+        if (_dump) {
+            writeFrame();
+            fclose(_dump);
+        }
+    }
+
+    void TextDisplay::access(void *context, uint64_t address, uint32_t value, uint8_t size, bool write) {
+        TextDisplay* display = (TextDisplay*) context;
+
+        if (!write)
+            return;
+
+        uint32_t first = (std::max<uint64_t>(address, BASE) - BASE) / (COLUMNS * 2);
+        uint32_t last = (std::min<uint64_t>(address + size, BASE + SIZE) - 1 - BASE) / (COLUMNS * 2);
+
+        // a frame is only due when something changed since the last one
+        if (display->_interval && !display->_event)
+            display->_event = display->_cpu.getScheduler().schedule(display->_cpu.instructionsRetired() + display->_interval,
+                                                                    &TextDisplay::dumpEvent, display);
+
+        display->_dirty |= ((2u << last) - 1) & ~((1u << first) - 1);
+    }
+
+    void TextDisplay::renderRow(uint32_t row) {
+        if (_cpu.getMemory().memorySize() < BASE + SIZE)
+            return;
+
+        // straight from RAM, reading through Memory would report every access to the watch
+        const uint8_t* cells = (const uint8_t*) _cpu.getMemory().getMemLocation() + BASE + row * COLUMNS * 2;
+        std::string& line = _lines[row];
+
+        for (uint32_t column = 0; column < COLUMNS; column++) {
+            uint8_t character = cells[column * 2];
+
+            if (character == 0)
+                line[column] = ' ';
+            else if (character < 0x20 || character >= 0x7f)
+                line[column] = '.';
+            else
+                line[column] = character;
+        }
+    }
+
+    bool TextDisplay::refresh() {
+        if (!_dirty)
+            return false;
+
+        for (uint32_t row = 0; row < ROWS; row++) {
+            if (_dirty & (1u << row))
+                renderRow(row);
+        }
+
+        _dirty = 0;
+        return true;
+    }
+
+    const std::vector<std::string> &TextDisplay::lines() {
+        refresh();
+        return _lines;
+    }
+
+    bool TextDisplay::setDump(const std::string &path, uint64_t interval) {
+        if (_dump)
+            fclose(_dump);
+
+        _dump = fopen(path.c_str(), "w");
+        _interval = interval;
+
+        if (!_dump) {
+            io::debug_print(io::ERROR, "Unable to open %s for the screen dump", path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    void TextDisplay::dump(FILE *out) {
+        for (const std::string& line : lines()) {
+            // trailing blanks are not part of the picture
+            size_t end = line.find_last_not_of(' ');
+            fprintf(out, "%s\n", end == std::string::npos ? "" : line.substr(0, end + 1).c_str());
+        }
+    }
+
+    void TextDisplay::writeFrame() {
+        fprintf(_dump, "--- %llu instructions\n", (unsigned long long) _cpu.instructionsRetired());
+        dump(_dump);
+        fflush(_dump);
+    }
+
+    void TextDisplay::dumpEvent(void *context, uint64_t now) {
+        TextDisplay* display = (TextDisplay*) context;
+
+        display->_event = 0;
+
+        if (display->_dump)
+            display->writeFrame();
+    }
+
+}
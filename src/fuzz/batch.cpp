@@ -0,0 +1,586 @@
+#include "fuzz/batch.h"
+#include "io/Logger.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86E_BATCH_AVX2 1
+#endif
+
+namespace x86e::fuzz {
+    // registers and flags of the group as the lanes keep them, one row per register or flag
+    struct LaneRows {
+        uint32_t* destination;
+        const uint32_t* source;
+        uint32_t* cf;
+        uint32_t* pf;
+        uint32_t* af;
+        uint32_t* zf;
+        uint32_t* sf;
+        uint32_t* of;
+    };
+
+    // by bits 3 to 5 of the opcode, as the instructions are laid out
+    enum LaneOperation {
+        LANE_ADD = 0,
+        LANE_OR = 1,
+        LANE_ADC = 2,
+    };
+
+    // the flags come out as the handlers in i386im.cpp leave them, not as a real CPU would: CF is only
+    // ever set by an addition, and cleared again along with setting OF when the result is negative
+    static void aluLanes(uint32_t operation, const LaneRows& rows, uint32_t count) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t a = rows.destination[i];
+            uint32_t b = rows.source[i];
+            uint32_t result;
+
+            if (operation == LANE_OR) {
+                result = a | b;
+                rows.cf[i] = 0;
+                rows.of[i] = 0;
+            }
+            else {
+                uint32_t carry = operation == LANE_ADC ? rows.cf[i] : 0;
+                result = a + b + carry;
+
+                uint32_t cf = rows.cf[i] | (result < a);
+                uint32_t fix = (operation == LANE_ADC ? carry : cf) & (result >> 31);
+
+                rows.cf[i] = cf & ~fix;
+                rows.of[i] |= fix;
+                rows.af[i] = ((a & 0xf) + (b & 0xf) + carry) >> 4;
+            }
+
+            uint32_t parity = result & 0xff;
+            parity ^= parity >> 4;
+            parity ^= parity >> 2;
+            parity ^= parity >> 1;
+
+            rows.destination[i] = result;
+            rows.sf[i] = result >> 31;
+            rows.zf[i] = result == 0;
+            rows.pf[i] = ~parity & 1;
+        }
+    }
+
+#ifdef X86E_BATCH_AVX2
+    // the same eight lanes at a time, count is a multiple of Batch::VECTOR
+    __attribute__((target("avx2")))
+    static void aluLanesAVX2(uint32_t operation, const LaneRows& rows, uint32_t count) {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one = _mm256_set1_epi32(1);
+        const __m256i nibble = _mm256_set1_epi32(0xf);
+        const __m256i low = _mm256_set1_epi32(0xff);
+        const __m256i bias = _mm256_set1_epi32((int) 0x80000000);
+
+        for (uint32_t i = 0; i < count; i += 8) {
+            __m256i a = _mm256_loadu_si256((const __m256i*) (rows.destination + i));
+            __m256i b = _mm256_loadu_si256((const __m256i*) (rows.source + i));
+            __m256i result;
+
+            if (operation == LANE_OR) {
+                result = _mm256_or_si256(a, b);
+                _mm256_storeu_si256((__m256i*) (rows.cf + i), zero);
+                _mm256_storeu_si256((__m256i*) (rows.of + i), zero);
+            }
+            else {
+                __m256i cf = _mm256_loadu_si256((const __m256i*) (rows.cf + i));
+                __m256i carry = operation == LANE_ADC ? cf : zero;
+                result = _mm256_add_epi32(_mm256_add_epi32(a, b), carry);
+
+                // unsigned result < a, compared as signed with the top bits flipped
+                __m256i below = _mm256_cmpgt_epi32(_mm256_xor_si256(a, bias), _mm256_xor_si256(result, bias));
+                cf = _mm256_or_si256(cf, _mm256_and_si256(below, one));
+
+                __m256i fix = _mm256_and_si256(operation == LANE_ADC ? carry : cf, _mm256_srli_epi32(result, 31));
+                __m256i of = _mm256_loadu_si256((const __m256i*) (rows.of + i));
+                __m256i af = _mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(a, nibble), _mm256_and_si256(b, nibble)), carry);
+
+                _mm256_storeu_si256((__m256i*) (rows.cf + i), _mm256_andnot_si256(fix, cf));
+                _mm256_storeu_si256((__m256i*) (rows.of + i), _mm256_or_si256(of, fix));
+                _mm256_storeu_si256((__m256i*) (rows.af + i), _mm256_srli_epi32(af, 4));
+            }
+
+            __m256i parity = _mm256_and_si256(result, low);
+            parity = _mm256_xor_si256(parity, _mm256_srli_epi32(parity, 4));
+            parity = _mm256_xor_si256(parity, _mm256_srli_epi32(parity, 2));
+            parity = _mm256_xor_si256(parity, _mm256_srli_epi32(parity, 1));
+
+            _mm256_storeu_si256((__m256i*) (rows.destination + i), result);
+            _mm256_storeu_si256((__m256i*) (rows.sf + i), _mm256_srli_epi32(result, 31));
+            _mm256_storeu_si256((__m256i*) (rows.zf + i), _mm256_and_si256(_mm256_cmpeq_epi32(result, zero), one));
+            _mm256_storeu_si256((__m256i*) (rows.pf + i), _mm256_andnot_si256(parity, one));
+        }
+    }
+#endif
+
+    static const cpu::Flags LANE_FLAG_BITS[] = { cpu::CF, cpu::PF, cpu::AF, cpu::ZF, cpu::SF, cpu::OF };
+
+    template<typename Model>
+    Batch<Model>::Batch(uint32_t memory, uint32_t lanes, bool verify, uint8_t *bitmap)
+        : _avx2(false), _resident(false), _inputs(nullptr), _results(nullptr), _first(0), _begin(0), _end(0),
+          _statistics() {
+        _lanes = std::max(VECTOR, (lanes + VECTOR - 1) / VECTOR * VECTOR);
+
+        _machines.push_back(std::make_unique<Fuzzer<Model>>(memory, bitmap));
+        for (uint32_t lane = 1; lane < _lanes; lane++)
+            _machines.push_back(std::make_unique<Fuzzer<Model>>(memory, _machines[0]->bitmap()));
+
+        // a coverage map of its own, so nothing is counted twice
+        if (verify)
+            _reference = std::make_unique<Fuzzer<Model>>(memory);
+
+#ifdef X86E_BATCH_AVX2
+        _avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+        _registers.assign(8 * _lanes, 0);
+        _flags.assign(LANE_FLAGS * _lanes, 0);
+        _immediate.assign(_lanes, 0);
+    }
+
+    template<typename Model>
+    Batch<Model>::~Batch() {
+    }
+
+    template<typename Model>
+    cpu::Core<Model, EdgeCoverage> &Batch<Model>::machine() {
+        return _machines[0]->machine();
+    }
+
+    template<typename Model>
+    uint8_t *Batch<Model>::bitmap() {
+        return _machines[0]->bitmap();
+    }
+
+    template<typename Model>
+    uint32_t Batch<Model>::lanes() {
+        return _lanes;
+    }
+
+    template<typename Model>
+    bool Batch<Model>::avx2() {
+        return _avx2;
+    }
+
+    template<typename Model>
+    BatchStatistics &Batch<Model>::statistics() {
+        return _statistics;
+    }
+
+    template<typename Model>
+    void Batch<Model>::setInput(uint32_t address, uint32_t capacity, cpu::Registers sizeRegister) {
+        for (auto& fuzzer : _machines)
+            fuzzer->setInput(address, capacity, sizeRegister);
+
+        if (_reference)
+            _reference->setInput(address, capacity, sizeRegister);
+    }
+
+    template<typename Model>
+    void Batch<Model>::snapshot() {
+        cpu::Core<Model, EdgeCoverage>& prototype = machine();
+        memory::Memory& memory = prototype.getMemory();
+
+        cpu::CPUState state;
+        prototype.saveState(state);
+
+        auto copy = [&](Fuzzer<Model>& fuzzer) {
+            cpu::Core<Model, EdgeCoverage>& lane = fuzzer.machine();
+
+            if (&lane != &prototype) {
+                std::memcpy(lane.getMemory().getMemLocation(), memory.getMemLocation(), memory.memorySize());
+                lane.restoreState(state);
+            }
+
+            fuzzer.snapshot();
+        };
+
+        for (auto& fuzzer : _machines)
+            copy(*fuzzer);
+
+        if (_reference)
+            copy(*_reference);
+    }
+
+    template<typename Model>
+    std::vector<Execution> Batch<Model>::execute(const std::vector<std::vector<uint8_t>> &inputs, uint64_t budget) {
+        std::vector<Execution> results(inputs.size());
+
+        for (uint32_t first = 0; first < inputs.size(); first += _lanes)
+            run(inputs, first, std::min<uint32_t>(_lanes, inputs.size() - first), budget, results);
+
+        return results;
+    }
+
+    template<typename Model>
+    void Batch<Model>::run(const std::vector<std::vector<uint8_t>> &inputs, uint32_t first, uint32_t count, uint64_t budget,
+                           std::vector<Execution> &results) {
+        _inputs = &inputs;
+        _results = &results;
+        _first = first;
+        _active.clear();
+
+        for (uint32_t lane = 0; lane < count; lane++) {
+            const std::vector<uint8_t>& input = inputs[first + lane];
+
+            _machines[lane]->load(input.data(), input.size());
+            _active.push_back(lane);
+        }
+
+        // every lane starts from the same snapshot, so they all count the same from here on
+        _begin = _machines[0]->machine().instructionsRetired();
+        _end = _begin + budget;
+        _resident = false;
+
+        regroup();
+
+        while (!_active.empty()) {
+            if (!vectorStep())
+                scalarStep();
+
+            ++_statistics.lockstep;
+            regroup();
+        }
+    }
+
+    template<typename Model>
+    bool Batch<Model>::vectorStep() {
+        cpu::Core<Model, EdgeCoverage>& leader = _machines[_active[0]]->machine();
+
+        if constexpr (!cpu::HAS_32BIT<Model>)
+            return false;
+
+        if (!leader.codeSize32())
+            return false;
+
+        uint32_t available;
+        const uint8_t* code = leader.instructionPointer(available);
+
+        if (!code || available < 2)
+            return false;
+
+        uint8_t instruction = code[0];
+        uint32_t length;
+
+        switch (instruction) {
+            case 0x01:  // 	add, or and adc r/m32 , r32 and r32 , r/m32, between registers only
+            case 0x03:
+            case 0x09:
+            case 0x0b:
+            case 0x11:
+            case 0x13:
+                if ((code[1] >> 6) != 0b11)
+                    return false;
+
+                length = 2;
+                break;
+
+            case 0x05:  // 	add, or and adc eAX , imm32
+            case 0x0d:
+            case 0x15:
+                length = 5;
+                break;
+
+            case 0x70:  // 	jcc rel8
+            case 0x71:
+            case 0x72:
+            case 0x73:
+            case 0x74:
+            case 0x75:
+            case 0x76:
+            case 0x77:
+            case 0x78:
+            case 0x79:
+            case 0x7a:
+            case 0x7b:
+            case 0x7c:
+            case 0x7d:
+            case 0x7e:
+            case 0x7f:
+                length = 2;
+                break;
+
+            case 0x0f:  // 	jcc rel32
+                if ((code[1] & 0xf0) != 0x80)
+                    return false;
+
+                length = 6;
+                break;
+
+            default:
+                return false;
+        }
+
+        if (available < length)
+            return false;
+
+        // the same code on every lane, and no event comes due on any of them, events may look at the registers
+        for (uint32_t lane : _active) {
+            cpu::Core<Model, EdgeCoverage>& cpu = _machines[lane]->machine();
+
+            if (cpu.instructionsRetired() + 1 >= cpu.getScheduler().nextDeadline())
+                return false;
+
+            if (lane != _active[0]) {
+                uint32_t laneAvailable;
+                const uint8_t* laneCode = cpu.instructionPointer(laneAvailable);
+
+                if (!laneCode || laneAvailable < length || std::memcmp(laneCode, code, length) != 0)
+                    return false;
+            }
+        }
+
+        if (!_resident)
+            gather();
+
+        uint32_t eip = leader.getRegister(cpu::EIP);
+        uint32_t next = eip + length;
+
+        if (instruction == 0x05 || instruction == 0x0d || instruction == 0x15) {
+            uint32_t immediate;
+            std::memcpy(&immediate, code + 1, sizeof(immediate));
+            std::fill(_immediate.begin(), _immediate.end(), immediate);
+
+            alu(instruction, cpu::EAX, _immediate.data());
+        }
+        else if (instruction <= 0x13) {
+            // whichever way round, the handlers put the result into the r/m register
+            alu(instruction, code[1] & 0b111, &_registers[((code[1] >> 3) & 0b111) * _lanes]);
+        }
+        else {
+            uint8_t conditionCode = instruction == 0x0f ? code[1] : instruction;
+            int32_t displacement;
+
+            if (instruction == 0x0f)
+                std::memcpy(&displacement, code + 2, sizeof(displacement));
+            else
+                displacement = (int8_t) code[1];
+
+            // lanes that go the other way are split off by regroup()
+            for (uint32_t lane : _active) {
+                cpu::Core<Model, EdgeCoverage>& cpu = _machines[lane]->machine();
+
+                if (condition(conditionCode, lane)) {
+                    cpu.setRegister(cpu::EIP, next + displacement);
+
+                    if constexpr (EdgeCoverage::BRANCH)
+                        cpu.hooks().branch(cpu, eip, next + displacement);
+                }
+                else {
+                    cpu.setRegister(cpu::EIP, next);
+                }
+
+                cpu.retire();
+            }
+
+            ++_statistics.vectorized;
+            return true;
+        }
+
+        for (uint32_t lane : _active) {
+            cpu::Core<Model, EdgeCoverage>& cpu = _machines[lane]->machine();
+
+            cpu.setRegister(cpu::EIP, next);
+            cpu.retire();
+        }
+
+        ++_statistics.vectorized;
+        return true;
+    }
+
+    template<typename Model>
+    void Batch<Model>::scalarStep() {
+        if (_resident) {
+            for (uint32_t lane : _active)
+                scatter(lane);
+
+            _resident = false;
+        }
+
+        for (uint32_t lane : _active)
+            _machines[lane]->machine().run(1);
+    }
+
+    template<typename Model>
+    void Batch<Model>::alu(uint8_t instruction, uint32_t destination, const uint32_t *source) {
+        LaneRows rows = {
+                &_registers[destination * _lanes],
+                source,
+                &_flags[LANE_CF * _lanes],
+                &_flags[LANE_PF * _lanes],
+                &_flags[LANE_AF * _lanes],
+                &_flags[LANE_ZF * _lanes],
+                &_flags[LANE_SF * _lanes],
+                &_flags[LANE_OF * _lanes],
+        };
+
+        uint32_t operation = (instruction >> 3) & 0b111;
+
+#ifdef X86E_BATCH_AVX2
+        if (_avx2) {
+            aluLanesAVX2(operation, rows, _lanes);
+            return;
+        }
+#endif
+
+        aluLanes(operation, rows, _lanes);
+    }
+
+    template<typename Model>
+    bool Batch<Model>::condition(uint8_t code, uint32_t lane) {
+        bool result;
+
+        // as i386_InstructionsManager::condition()
+        switch ((code >> 1) & 0b111) {
+            case 0: result = laneFlag(LANE_OF, lane); break;
+            case 1: result = laneFlag(LANE_CF, lane); break;
+            case 2: result = laneFlag(LANE_ZF, lane); break;
+            case 3: result = laneFlag(LANE_CF, lane) || laneFlag(LANE_ZF, lane); break;
+            case 4: result = laneFlag(LANE_SF, lane); break;
+            case 5: result = laneFlag(LANE_PF, lane); break;
+            case 6: result = laneFlag(LANE_SF, lane) != laneFlag(LANE_OF, lane); break;
+            default: result = laneFlag(LANE_ZF, lane) || laneFlag(LANE_SF, lane) != laneFlag(LANE_OF, lane); break;
+        }
+
+        return result != (code & 1);
+    }
+
+    template<typename Model>
+    void Batch<Model>::gather() {
+        for (uint32_t lane : _active) {
+            cpu::Core<Model, EdgeCoverage>& cpu = _machines[lane]->machine();
+
+            for (uint32_t reg = cpu::EAX; reg <= cpu::EDI; reg++)
+                laneRegister(reg, lane) = cpu.getRegister((cpu::Registers) reg);
+
+            for (uint32_t flag = 0; flag < LANE_FLAGS; flag++)
+                laneFlag(flag, lane) = cpu.getFlag(LANE_FLAG_BITS[flag]);
+        }
+
+        _resident = true;
+    }
+
+    template<typename Model>
+    void Batch<Model>::scatter(uint32_t lane) {
+        cpu::Core<Model, EdgeCoverage>& cpu = _machines[lane]->machine();
+
+        for (uint32_t reg = cpu::EAX; reg <= cpu::EDI; reg++)
+            cpu.setRegister((cpu::Registers) reg, laneRegister(reg, lane));
+
+        for (uint32_t flag = 0; flag < LANE_FLAGS; flag++)
+            cpu.setFlag(LANE_FLAG_BITS[flag], laneFlag(flag, lane));
+    }
+
+    template<typename Model>
+    void Batch<Model>::regroup() {
+        std::vector<uint32_t>& running = _running;
+        std::vector<uint32_t>& done = _done;
+
+        running.clear();
+        done.clear();
+
+        for (uint32_t lane : _active) {
+            cpu::Core<Model, EdgeCoverage>& cpu = _machines[lane]->machine();
+
+            if (cpu.hooks().crashed || cpu.isHalted() || cpu.instructionsRetired() >= _end)
+                done.push_back(lane);
+            else
+                running.push_back(lane);
+        }
+
+        // the EIP most lanes are at, usually all of them
+        uint32_t eip = 0;
+        uint32_t most = 0;
+
+        for (uint32_t i = 0; i < running.size() && most <= (running.size() - i); i++) {
+            uint32_t candidate = _machines[running[i]]->machine().getRegister(cpu::EIP);
+            uint32_t votes = std::count_if(running.begin() + i, running.end(), [&](uint32_t lane) {
+                return _machines[lane]->machine().getRegister(cpu::EIP) == candidate;
+            });
+
+            if (votes > most) {
+                eip = candidate;
+                most = votes;
+            }
+        }
+
+        _active.clear();
+
+        for (uint32_t lane : running) {
+            if (_machines[lane]->machine().getRegister(cpu::EIP) == eip) {
+                _active.push_back(lane);
+            }
+            else {
+                ++_statistics.splits;
+                done.push_back(lane);
+            }
+        }
+
+        // a single lane is no faster in a group
+        if (_active.size() == 1) {
+            done.push_back(_active[0]);
+            _active.clear();
+        }
+
+        for (uint32_t lane : done)
+            split(lane);
+    }
+
+    template<typename Model>
+    void Batch<Model>::split(uint32_t lane) {
+        Fuzzer<Model>& fuzzer = *_machines[lane];
+
+        if (_resident)
+            scatter(lane);
+
+        Execution execution = fuzzer.resume(_begin, _end);
+
+        if (_reference)
+            verify(lane, execution);
+
+        fuzzer.restore();
+        (*_results)[_first + lane] = execution;
+    }
+
+    template<typename Model>
+    void Batch<Model>::verify(uint32_t lane, const Execution &execution) {
+        const std::vector<uint8_t>& input = (*_inputs)[_first + lane];
+        cpu::Core<Model, EdgeCoverage>& cpu = _machines[lane]->machine();
+        cpu::Core<Model, EdgeCoverage>& scalar = _reference->machine();
+
+        _reference->load(input.data(), input.size());
+
+        uint64_t begin = scalar.instructionsRetired();
+        Execution expected = _reference->resume(begin, begin + (_end - _begin));
+
+        bool same = expected.outcome == execution.outcome && expected.vector == execution.vector;
+
+        // a crash is only noticed between slices of the scalar run, it may have gone further into the handler
+        if (same && execution.outcome != OUTCOME_CRASHED) {
+            same = expected.instructions == execution.instructions;
+
+            for (uint32_t reg = cpu::EAX; reg <= cpu::EIP; reg++)
+                same = same && scalar.getRegister((cpu::Registers) reg) == cpu.getRegister((cpu::Registers) reg);
+
+            for (cpu::Flags flag : LANE_FLAG_BITS)
+                same = same && scalar.getFlag(flag) == cpu.getFlag(flag);
+        }
+
+        if (!same) {
+            ++_statistics.mismatches;
+            io::debug_print(io::WARNING, "Input %u ran differently in lockstep, EIP=0x%x instead of 0x%x",
+                            _first + lane, cpu.getRegister(cpu::EIP), scalar.getRegister(cpu::EIP));
+        }
+
+        _reference->restore();
+    }
+
+    template class Batch<cpu::Model8086>;
+    template class Batch<cpu::Model286>;
+    template class Batch<cpu::Model386>;
+
+}
@@ -0,0 +1,143 @@
+#include "fuzz/fuzzer.h"
+#include "cpu/core_impl.h"
+
+#include <cstring>
+#include <algorithm>
+
+namespace x86e::cpu {
+    template class Core<Model8086, fuzz::EdgeCoverage>;
+    template class Core<Model286, fuzz::EdgeCoverage>;
+    template class Core<Model386, fuzz::EdgeCoverage>;
+}
+
+namespace x86e::fuzz {
+    // exceptions are only checked for between slices, a crash runs at most this far into the handler
+    static constexpr uint64_t SLICE = 1024;
+
+    template<typename Model>
+    Fuzzer<Model>::Fuzzer(uint32_t memory, uint8_t *bitmap)
+        : _machine(memory), _restoredPages(0), _inputAddress(0), _inputCapacity(0), _sizeRegister(cpu::ECX) {
+        if (!bitmap) {
+            _ownBitmap.assign(MAP_SIZE, 0);
+            bitmap = _ownBitmap.data();
+        }
+
+        _bitmap = bitmap;
+        _machine.hooks().map = _bitmap;
+        _machine.reset();
+    }
+
+    template<typename Model>
+    Fuzzer<Model>::~Fuzzer() {
+    }
+
+    template<typename Model>
+    cpu::Core<Model, EdgeCoverage> &Fuzzer<Model>::machine() {
+        return _machine;
+    }
+
+    template<typename Model>
+    uint8_t *Fuzzer<Model>::bitmap() {
+        return _bitmap;
+    }
+
+    template<typename Model>
+    void Fuzzer<Model>::setInput(uint32_t address, uint32_t capacity, cpu::Registers sizeRegister) {
+        _inputAddress = address;
+        _inputCapacity = capacity;
+        _sizeRegister = sizeRegister;
+    }
+
+    template<typename Model>
+    uint64_t Fuzzer<Model>::restoredPages() {
+        return _restoredPages;
+    }
+
+    template<typename Model>
+    void Fuzzer<Model>::snapshot() {
+        memory::Memory& memory = _machine.getMemory();
+
+        _machine.saveState(_state);
+        _memory.assign((uint8_t*) memory.getMemLocation(), (uint8_t*) memory.getMemLocation() + memory.memorySize());
+
+        // pages already in the write TLB would not be recorded
+        memory.trackDirtyPages(true);
+        _machine.getMMU().flush(true);
+    }
+
+    template<typename Model>
+    void Fuzzer<Model>::restore() {
+        memory::Memory& memory = _machine.getMemory();
+        uint8_t* host = (uint8_t*) memory.getMemLocation();
+
+        _restoredPages = memory.dirtyPages().size();
+
+        for (uint64_t page : memory.dirtyPages()) {
+            uint64_t offset = page << memory::PAGE_SHIFT;
+            uint64_t size = std::min<uint64_t>(memory::PAGE_SIZE, _memory.size() - offset);
+
+            std::memcpy(host + offset, _memory.data() + offset, size);
+        }
+
+        memory.clearDirtyPages();
+
+        // also drops the TLB, so the next write to every page is recorded again
+        _machine.restoreState(_state);
+    }
+
+    template<typename Model>
+    void Fuzzer<Model>::load(const uint8_t *data, uint32_t size) {
+        EdgeCoverage& coverage = _machine.hooks();
+
+        size = std::min(size, _inputCapacity);
+
+        _machine.getMemory().writeBlock(_inputAddress, data, size);
+        _machine.setRegister(_sizeRegister, size);
+
+        coverage.previous = 0;
+        coverage.crashed = false;
+    }
+
+    template<typename Model>
+    Execution Fuzzer<Model>::resume(uint64_t begin, uint64_t end) {
+        EdgeCoverage& coverage = _machine.hooks();
+
+        while (!coverage.crashed && !_machine.isHalted() && _machine.instructionsRetired() < end) {
+            uint64_t before = _machine.instructionsRetired();
+            _machine.run(std::min(SLICE, end - before));
+
+            // halted, but an interrupt could still wake it up
+            if (_machine.instructionsRetired() == before)
+                break;
+        }
+
+        Execution execution;
+        execution.instructions = _machine.instructionsRetired() - begin;
+        execution.vector = coverage.vector;
+
+        if (coverage.crashed)
+            execution.outcome = OUTCOME_CRASHED;
+        else if (_machine.instructionsRetired() >= end)
+            execution.outcome = OUTCOME_TIMEOUT;
+        else
+            execution.outcome = OUTCOME_HALTED;
+
+        return execution;
+    }
+
+    template<typename Model>
+    Execution Fuzzer<Model>::execute(const uint8_t *data, uint32_t size, uint64_t budget) {
+        load(data, size);
+
+        uint64_t begin = _machine.instructionsRetired();
+        Execution execution = resume(begin, begin + budget);
+
+        restore();
+        return execution;
+    }
+
+    template class Fuzzer<cpu::Model8086>;
+    template class Fuzzer<cpu::Model286>;
+    template class Fuzzer<cpu::Model386>;
+
+}
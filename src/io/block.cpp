@@ -0,0 +1,304 @@
+#include "io/block.h"
+#include "io/Logger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace x86e::io {
+    static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    // pread/pwrite until everything is transferred
+    static bool readAll(int fd, uint8_t* buffer, uint64_t size, uint64_t offset) {
+        while (size) {
+            ssize_t count = pread(fd, buffer, size, offset);
+
+            if (count <= 0)
+                return false;
+
+            buffer += count;
+            size -= count;
+            offset += count;
+        }
+
+        return true;
+    }
+
+    static bool writeAll(int fd, const uint8_t* buffer, uint64_t size, uint64_t offset) {
+        while (size) {
+            ssize_t count = pwrite(fd, buffer, size, offset);
+
+            if (count <= 0)
+                return false;
+
+            buffer += count;
+            size -= count;
+            offset += count;
+        }
+
+        return true;
+    }
+
+    BlockBackend::BlockBackend()
+        : _base(-1), _overlay(-1), _size(0) {
+    }
+
+    BlockBackend::~BlockBackend() {
+        close();
+    }
+
+    bool BlockBackend::open(const std::string &path, const std::string &overlay) {
+        close();
+
+        // the base image is only written to when there is no overlay
+        _base = ::open(path.c_str(), (overlay.empty() ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (_base < 0) {
+            debug_print(ERROR, "Unable to open the disk image %s", path.c_str());
+            return false;
+        }
+
+        struct stat info;
+        fstat(_base, &info);
+
+        _path = path;
+        _size = info.st_size;
+
+        if (!overlay.empty() && !openOverlay(overlay)) {
+            close();
+            return false;
+        }
+
+        debug_print(INFO, "Attached disk %s (%llu bytes%s)", path.c_str(), (unsigned long long) _size,
+                    overlay.empty() ? "" : ", copy-on-write");
+
+        return true;
+    }
+
+    bool BlockBackend::openOverlay(const std::string &overlay) {
+        _overlay = ::open(overlay.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (_overlay < 0) {
+            debug_print(ERROR, "Unable to open the overlay %s", overlay.c_str());
+            return false;
+        }
+
+        uint64_t clusters = (_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+        struct stat info;
+        fstat(_overlay, &info);
+
+        if (info.st_size == 0) {
+            // a new overlay, everything after the header stays a hole until it is written
+            _header = { OVERLAY_MAGIC, OVERLAY_VERSION, _size, CLUSTER_SIZE, 0, 0, 0 };
+            _header.bitmap = alignUp(sizeof(OverlayHeader), OVERLAY_ALIGNMENT);
+            _header.data = _header.bitmap + alignUp((clusters + 7) / 8, OVERLAY_ALIGNMENT);
+
+            if (!writeAll(_overlay, (const uint8_t*) &_header, sizeof(_header), 0) ||
+                ftruncate(_overlay, _header.data + clusters * CLUSTER_SIZE) != 0) {
+                debug_print(ERROR, "Unable to create the overlay %s", overlay.c_str());
+                return false;
+            }
+        }
+        else if (!readAll(_overlay, (uint8_t*) &_header, sizeof(_header), 0) || _header.magic != OVERLAY_MAGIC ||
+                 _header.version != OVERLAY_VERSION || _header.clusterSize != CLUSTER_SIZE) {
+            debug_print(ERROR, "%s is not an overlay", overlay.c_str());
+            return false;
+        }
+        else if (_header.size != _size) {
+            debug_print(ERROR, "The overlay %s was made for an image of %llu bytes", overlay.c_str(),
+                        (unsigned long long) _header.size);
+            return false;
+        }
+
+        _bitmap.assign((clusters + 7) / 8, 0);
+
+        if (!readAll(_overlay, _bitmap.data(), _bitmap.size(), _header.bitmap)) {
+            debug_print(ERROR, "Unable to read the overlay %s", overlay.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    void BlockBackend::close() {
+        if (_base >= 0)
+            ::close(_base);
+
+        if (_overlay >= 0)
+            ::close(_overlay);
+
+        _base = -1;
+        _overlay = -1;
+        _size = 0;
+        _bitmap.clear();
+    }
+
+    uint64_t BlockBackend::size() {
+        return _size;
+    }
+
+    uint64_t BlockBackend::sectors() {
+        return _size / SECTOR_SIZE;
+    }
+
+    const std::string &BlockBackend::path() {
+        return _path;
+    }
+
+    bool BlockBackend::present(uint64_t cluster) {
+        std::lock_guard<std::mutex> guard(_lock);
+        return _bitmap[cluster / 8] & (1 << (cluster % 8));
+    }
+
+    bool BlockBackend::read(uint64_t offset, uint8_t *buffer, uint64_t size) {
+        if (_base < 0 || offset + size > _size)
+            return false;
+
+        if (_overlay < 0)
+            return readAll(_base, buffer, size, offset);
+
+        while (size) {
+            uint64_t cluster = offset / CLUSTER_SIZE;
+            uint64_t count = std::min<uint64_t>(size, CLUSTER_SIZE - offset % CLUSTER_SIZE);
+
+            bool success = present(cluster)
+                    ? readAll(_overlay, buffer, count, _header.data + offset)
+                    : readAll(_base, buffer, count, offset);
+
+            if (!success)
+                return false;
+
+            buffer += count;
+            offset += count;
+            size -= count;
+        }
+
+        return true;
+    }
+
+    bool BlockBackend::write(uint64_t offset, const uint8_t *buffer, uint64_t size) {
+        if (_base < 0 || offset + size > _size)
+            return false;
+
+        if (_overlay < 0)
+            return writeAll(_base, buffer, size, offset);
+
+        while (size) {
+            uint64_t cluster = offset / CLUSTER_SIZE;
+            uint64_t count = std::min<uint64_t>(size, CLUSTER_SIZE - offset % CLUSTER_SIZE);
+
+            bool success = present(cluster)
+                    ? writeAll(_overlay, buffer, count, _header.data + offset)
+                    : writeCluster(cluster, offset % CLUSTER_SIZE, buffer, count);
+
+            if (!success)
+                return false;
+
+            buffer += count;
+            offset += count;
+            size -= count;
+        }
+
+        return true;
+    }
+
+    bool BlockBackend::writeCluster(uint64_t cluster, uint32_t offset, const uint8_t *buffer, uint32_t size) {
+        std::lock_guard<std::mutex> guard(_lock);
+
+        // someone else may have copied it in the meantime
+        if (_bitmap[cluster / 8] & (1 << (cluster % 8)))
+            return writeAll(_overlay, buffer, size, _header.data + cluster * CLUSTER_SIZE + offset);
+
+        uint8_t data[CLUSTER_SIZE];
+        uint64_t start = cluster * CLUSTER_SIZE;
+        uint64_t length = std::min<uint64_t>(CLUSTER_SIZE, _size - start);
+
+        // a write of the whole cluster does not need the old contents
+        if (size < length && !readAll(_base, data, length, start))
+            return false;
+
+        std::memcpy(data + offset, buffer, size);
+
+        if (!writeAll(_overlay, data, length, _header.data + start))
+            return false;
+
+        // the bit is stored after the data, an interrupted write leaves the cluster in the base image
+        _bitmap[cluster / 8] |= 1 << (cluster % 8);
+        return writeAll(_overlay, &_bitmap[cluster / 8], 1, _header.bitmap + cluster / 8);
+    }
+
+    bool BlockBackend::flush() {
+        if (_base < 0)
+            return false;
+
+        if (_overlay >= 0)
+            return fdatasync(_overlay) == 0;
+
+        return fdatasync(_base) == 0;
+    }
+
+    BlockWorkers::BlockWorkers(uint32_t threads)
+        : _stop(false) {
+        if (!threads)
+            threads = std::clamp(std::thread::hardware_concurrency(), 1u, MAX_THREADS);
+
+        for (uint32_t i = 0; i < threads; i++)
+            _threads.emplace_back(&BlockWorkers::work, this);
+    }
+
+    BlockWorkers::~BlockWorkers() {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stop = true;
+        }
+
+        _wake.notify_all();
+
+        for (std::thread& thread : _threads)
+            thread.join();
+    }
+
+    void BlockWorkers::submit(BlockRequest *request) {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _queue.push_back(request);
+        }
+
+        _wake.notify_one();
+    }
+
+    void BlockWorkers::work() {
+        while (true) {
+            BlockRequest* request;
+
+            {
+                std::unique_lock<std::mutex> guard(_lock);
+                _wake.wait(guard, [this] { return _stop || !_queue.empty(); });
+
+                // requests still queued are finished before the workers go away
+                if (_queue.empty())
+                    return;
+
+                request = _queue.front();
+                _queue.pop_front();
+            }
+
+            switch (request->operation) {
+                case BLOCK_READ:
+                    request->success = request->backend->read(request->offset, request->data.data(), request->data.size());
+                    break;
+                case BLOCK_WRITE:
+                    request->success = request->backend->write(request->offset, request->data.data(), request->data.size());
+                    break;
+                case BLOCK_FLUSH:
+                    request->success = request->backend->flush();
+                    break;
+            }
+
+            request->complete(request->context, request);
+        }
+    }
+
+}
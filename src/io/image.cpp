@@ -0,0 +1,103 @@
+#include "io/image.h"
+#include "io/Logger.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace x86e::io {
+
+    ImageCache::ImageCache() {
+    }
+
+    ImageCache::~ImageCache() {
+        for (auto& image : _images)
+            close(image.second->fd);
+    }
+
+    const Image *ImageCache::load(const std::string &path) {
+        int file = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (file < 0) {
+            debug_print(ERROR, "Unable to open %s", path.c_str());
+            return nullptr;
+        }
+
+        struct stat info;
+        if (fstat(file, &info) != 0) {
+            debug_print(ERROR, "Unable to stat %s", path.c_str());
+            close(file);
+            return nullptr;
+        }
+
+        Key key = { info.st_dev, info.st_ino, info.st_mtim.tv_sec, info.st_mtim.tv_nsec };
+        std::lock_guard<std::mutex> guard(_lock);
+
+        auto cached = _images.find(key);
+        if (cached != _images.end()) {
+            close(file);
+            return cached->second.get();
+        }
+
+        int fd = memfd_create("x86e-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0) {
+            debug_print(ERROR, "Unable to create a memfd for %s", path.c_str());
+            close(file);
+            return nullptr;
+        }
+
+        uint8_t buffer[65536];
+        uint64_t size = 0;
+        ssize_t count;
+        bool written = true;
+
+        while (written && (count = read(file, buffer, sizeof(buffer))) > 0) {
+            // a memfd may take a write in parts
+            for (ssize_t done = 0; done < count; ) {
+                ssize_t part = write(fd, buffer + done, count - done);
+
+                if (part <= 0) {
+                    written = false;
+                    break;
+                }
+
+                done += part;
+            }
+
+            size += count;
+        }
+
+        close(file);
+
+        if (!written) {
+            debug_print(ERROR, "Unable to copy %s into memory", path.c_str());
+            close(fd);
+            return nullptr;
+        }
+
+        if (count != 0) {
+            debug_print(ERROR, "Unable to read %s", path.c_str());
+            close(fd);
+            return nullptr;
+        }
+
+        // mapping past the end of a file raises SIGBUS, so the last page is padded.
+        // sealing it makes sure no one can change the pages that are shared
+        uint64_t pageSize = sysconf(_SC_PAGESIZE);
+
+        if (ftruncate(fd, (size + pageSize - 1) & ~(pageSize - 1)) != 0 ||
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+            debug_print(ERROR, "Unable to pad and seal the copy of %s", path.c_str());
+            close(fd);
+            return nullptr;
+        }
+
+        debug_print(INFO, "Loaded image %s (%llu bytes)", path.c_str(), size);
+
+        auto& image = _images[key];
+        image.reset(new Image { path, fd, size });
+
+        return image.get();
+    }
+
+}
@@ -0,0 +1,52 @@
+#include "io/stats.h"
+
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace x86e::io {
+    uint64_t loadStat(const uint64_t &field) {
+        return std::atomic_ref<uint64_t>(const_cast<uint64_t&>(field)).load(std::memory_order_relaxed);
+    }
+
+    void storeStat(uint64_t &field, uint64_t value) {
+        std::atomic_ref<uint64_t>(field).store(value, std::memory_order_relaxed);
+    }
+
+    bool mapStats(const std::string &path, const StatsPage *&page) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+
+        // a short file would fault on access instead of failing here
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t) STATS_FILE_SIZE) {
+            close(fd);
+            return false;
+        }
+
+        void* mapping = mmap(nullptr, STATS_FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED)
+            return false;
+
+        page = (const StatsPage*) mapping;
+
+        uint32_t magic = std::atomic_ref<uint32_t>(const_cast<uint32_t&>(page->magic)).load(std::memory_order_acquire);
+        if (magic != StatsPage::MAGIC || page->version < StatsPage::LAYOUT_VERSION) {
+            munmap(mapping, STATS_FILE_SIZE);
+            return false;
+        }
+
+        return true;
+    }
+
+    void unmapStats(const StatsPage *page) {
+        munmap((void*) page, STATS_FILE_SIZE);
+    }
+
+}
@@ -0,0 +1,113 @@
+#include "io/statspublisher.h"
+#include "io/Logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace x86e::io {
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    StatsPublisher::StatsPublisher(cpu::CPU &cpu, const std::string &path, const char *model)
+        : _cpu(cpu), _page(nullptr), _event(0) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (fd < 0 || ftruncate(fd, STATS_FILE_SIZE) != 0) {
+            debug_print(WARNING, "Unable to create the stats file %s", path.c_str());
+
+            if (fd >= 0)
+                close(fd);
+            return;
+        }
+
+        void* mapping = mmap(nullptr, STATS_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (mapping == MAP_FAILED) {
+            debug_print(WARNING, "Unable to map the stats file %s", path.c_str());
+            return;
+        }
+
+        _page = (StatsPage*) mapping;
+
+        // a reader that sees the magic sees a complete header. the file may be left over from
+        // an earlier run, so its magic goes away before the header is rewritten
+        std::atomic_ref<uint32_t>(_page->magic).store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        storeStat(_page->exited, 0);
+        _page->version = StatsPage::LAYOUT_VERSION;
+        _page->pid = getpid();
+        std::strncpy(_page->model, model, sizeof(_page->model) - 1);
+        std::atomic_ref<uint32_t>(_page->magic).store(StatsPage::MAGIC, std::memory_order_release);
+
+        _lastTime = now();
+        _lastInstructions = _cpu.instructionsRetired();
+
+        update();
+        _event = _cpu.getScheduler().observe(_cpu.instructionsRetired() + INTERVAL, &StatsPublisher::tick, this);
+    }
+
+    StatsPublisher::~StatsPublisher() {
+        if (!_page)
+            return;
+
+        _cpu.getScheduler().cancel(_event);
+
+        update();
+        storeStat(_page->exited, 1);
+        munmap(_page, STATS_FILE_SIZE);
+    }
+
+    void StatsPublisher::tick(void *context, uint64_t now) {
+        StatsPublisher* publisher = (StatsPublisher*) context;
+
+        publisher->update();
+        publisher->_event = publisher->_cpu.getScheduler().observe(now + INTERVAL, &StatsPublisher::tick, publisher);
+    }
+
+    void StatsPublisher::update() {
+        if (!_page)
+            return;
+
+        uint64_t time = now();
+        uint64_t instructions = _cpu.instructionsRetired();
+
+        // keeps the last rate if no host time has passed
+        if (time > _lastTime) {
+            storeStat(_page->instructionsPerSecond, (instructions - _lastInstructions) * 1000000000 / (time - _lastTime));
+
+            _lastTime = time;
+            _lastInstructions = instructions;
+        }
+
+        memory::TLBStatistics& tlb = _cpu.getMMU().statistics();
+        cpu::CPUStatistics& statistics = _cpu.statistics();
+
+        storeStat(_page->instructions, instructions);
+        storeStat(_page->tlbHits, tlb.hits);
+        storeStat(_page->tlbMisses, tlb.misses);
+        storeStat(_page->exceptions, statistics.exceptions);
+        storeStat(_page->pageFaults, statistics.pageFaults);
+        storeStat(_page->ioExits, _cpu.getIOBus().exits());
+
+        if (cpu::DecodeCache* cache = _cpu.decodeCache()) {
+            storeStat(_page->blockHits, cache->statistics().hits);
+            storeStat(_page->blockMisses, cache->statistics().misses);
+            storeStat(_page->interpreted, cache->statistics().interpreted);
+            storeStat(_page->predecoded, cache->statistics().predecoded);
+            storeStat(_page->promotions, cache->statistics().promotions);
+            storeStat(_page->evictions, cache->statistics().evictions);
+        }
+        storeStat(_page->halted, _cpu.isHalted());
+        storeStat(_page->updated, time);
+    }
+
+}
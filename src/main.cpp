@@ -1,9 +1,36 @@
 #include <map>
 #include "io/Logger.h"
 #include "io/fs.h"
-#include "cpu/i386.h"
+#include "io/image.h"
+#include "cpu/core.h"
+#include "cpu/pairprofile.h"
+#include "devices/pit.h"
+#include "devices/bios.h"
+#include "devices/blockdevice.h"
+#include "devices/serial.h"
+#include "devices/vga.h"
+#include "user/linux.h"
+#include "fuzz/fuzzer.h"
+#include "fuzz/batch.h"
+#include "memory/profiler.h"
+#include "io/statspublisher.h"
+#include "cpu/machine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/shm.h>
+#include <unistd.h>
 
 #define MEM_SIZE 0xFFFFF /* in bytes */
+#define FUZZ_BUDGET 1000000 /* instructions per input */
+#define BOOT_SLICE 100000 /* instructions between two looks at a booted machine */
+#define USER_MEMORY 0x40000000 /* in bytes, for a Linux process */
 
 using namespace x86e;
 
@@ -59,20 +86,143 @@ std::map<cpu::Flags, std::string> cpuFlagsMap = {
         { cpu::Flags::VM, "VM" },
 };
 
-int main() {
-    io::debug_print(io::INFO, "x86e v%s", VERSION);
+// the model is picked once, everything below is specialised for it
+// every machine created in this process maps its image from here
+io::ImageCache images;
+
+// what a single CPU machine is run with
+struct Options {
+    bool hugePages = false;
+    uint32_t profileRatio = 0;
+    std::string statsPath;
+    std::string diskPath;
+    std::string overlayPath;
+    std::string serialInput;
+    std::string screenPath;
+    uint64_t screenInterval = 0;
+    std::string decodeCachePath;
+    bool tiered = false;
+    cpu::TierSettings tiers;
+    bool profilePairs = false;
+};
+
+// FusedPair kinds from a comma separated list of alu-jcc, push-pop, all and none
+uint32_t parseFusion(const std::string& list) {
+    static const std::map<std::string, uint32_t> kinds = {
+            { "alu-jcc", cpu::FUSE_ALU_JCC },
+            { "push-pop", cpu::FUSE_PUSH_POP },
+            { "all", cpu::FUSE_ALL },
+            { "none", cpu::FUSE_NONE },
+    };
+
+    uint32_t fusion = cpu::FUSE_NONE;
+    size_t start = 0;
+
+    while (start <= list.size()) {
+        size_t end = std::min(list.find(',', start), list.size());
+        std::string name = list.substr(start, end - start);
+        auto kind = kinds.find(name);
+
+        if (kind != kinds.end())
+            fusion |= kind->second;
+        else
+            io::debug_print(io::WARNING, "Unknown pair %s, expected alu-jcc, push-pop, all or none", name.c_str());
+
+        start = end + 1;
+    }
+
+    return fusion;
+}
+
+// tiered execution, starting from the decoded blocks of earlier runs if there is a cache file
+template<typename Model>
+std::unique_ptr<cpu::DecodeCache> attachDecodeCache(cpu::CPU& cpu, const Options& options) {
+    if (!options.tiered && options.decodeCachePath.empty())
+        return nullptr;
+
+    auto decodeCache = std::make_unique<cpu::DecodeCache>(cpu.getMemory(), Model::NAME, options.tiers);
+
+    if (!options.decodeCachePath.empty())
+        decodeCache->open(options.decodeCachePath);
+
+    cpu.setDecodeCache(decodeCache.get());
+    return decodeCache;
+}
 
-    cpu::i386 cpu(MEM_SIZE);
+template<typename Model, typename Hooks = cpu::NoHooks>
+void run(const Options& options) {
+    io::debug_print(io::INFO, "Emulating %s", Model::NAME);
+
+    cpu::Core<Model, Hooks> cpu(MEM_SIZE, options.hugePages);
     cpu.reset();
 
-    std::vector<uint8_t> data = io::readfile("../stuff/main");
+    devices::PIT pit(cpu);
+
+    std::unique_ptr<cpu::DecodeCache> decodeCache = attachDecodeCache<Model>(cpu, options);
+
+    // COM1 goes to stdout, its input comes from a file or a pipe if one was given
+    int serialFd = options.serialInput.empty() ? -1 : open(options.serialInput.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!options.serialInput.empty() && serialFd < 0)
+        io::debug_print(io::WARNING, "Unable to open %s for serial input", options.serialInput.c_str());
+
+    devices::Serial serial(cpu, STDOUT_FILENO, serialFd);
+
+    // the text mode screen is only watched when it is captured
+    std::unique_ptr<devices::TextDisplay> display;
+    if (!options.screenPath.empty()) {
+        display = std::make_unique<devices::TextDisplay>(cpu);
+        display->setDump(options.screenPath, options.screenInterval);
+    }
+
+    // samples one instruction window out of every profileRatio
+    std::unique_ptr<memory::Profiler> profiler;
+    if (options.profileRatio)
+        profiler = std::make_unique<memory::Profiler>(cpu, options.profileRatio);
+
+    std::unique_ptr<io::StatsPublisher> stats;
+    if (!options.statsPath.empty())
+        stats = std::make_unique<io::StatsPublisher>(cpu, options.statsPath, Model::NAME);
 
-    size_t offset = 0;
-    for (uint8_t byte : data) {
-        cpu.getMemory().writeImm8(byte, cpu.getRegister(x86e::cpu::EIP) + (offset++));
+    // a disk is booted through the BIOS, whose output would be lost between the register dumps
+    devices::BIOS bios(cpu);
+    bool booted = false;
+
+    io::BlockBackend disk;
+    std::unique_ptr<io::BlockWorkers> workers;
+    std::unique_ptr<devices::BlockDevice> blockDevice;
+
+    if (!options.diskPath.empty()) {
+        if (!disk.open(options.diskPath, options.overlayPath))
+            return;
+
+        workers = std::make_unique<io::BlockWorkers>();
+        blockDevice = std::make_unique<devices::BlockDevice>(cpu, disk, *workers);
+
+        bios.attachDisk(&disk);
+        if (!bios.boot())
+            return;
+
+        // keys typed ahead through a pipe or a file, Enter for every new line
+        if (!isatty(STDIN_FILENO)) {
+            int character;
+            while ((character = getchar()) != EOF)
+                bios.pushKey(character == '\n' ? 0x1c0d : character);
+        }
+
+        booted = true;
     }
+    else {
+        const io::Image* image = images.load("../stuff/main");
+        if (!image)
+            return;
 
-    cpu.getMemory().writeImm32(0xaafa113, 0xfa);
+        cpu.getMemory().loadImage(cpu.getRegister(x86e::cpu::EIP), *image);
+
+        cpu.getMemory().writeImm32(0xaafa113, 0xfa);
+    }
+
+    while (booted && !cpu.isHalted())
+        cpu.run(BOOT_SLICE);
 
     while (!cpu.isHalted()) {
         cpu.cycle();
@@ -99,4 +249,358 @@ int main() {
         printf("\n\t0xFA addr: 0x%x\n", cpu.getMemory().readImm32(0xfa));
     }
 
+    if (stats)
+        stats->update();
+
+    memory::TLBStatistics& tlb = cpu.getMMU().statistics();
+    memory::Memory& memory = cpu.getMemory();
+
+    io::debug_print(io::INFO, "Run statistics:");
+    printf("\t- instructions: %llu\n", (unsigned long long) cpu.instructionsRetired());
+    printf("\t- TLB: %llu hits, %llu misses, %llu flushes\n",
+           (unsigned long long) tlb.hits, (unsigned long long) tlb.misses, (unsigned long long) tlb.flushes);
+    printf("\t- guest RAM: %s, %llu KiB on huge pages\n",
+           memory::Memory::backingName(memory.backing()), (unsigned long long) memory.hugePageBytes() / 1024);
+
+    if (decodeCache) {
+        cpu::DecodeCacheStatistics& decoded = decodeCache->statistics();
+        printf("\t- decode cache: %llu hits, %llu misses, %llu code pages from the file\n",
+               (unsigned long long) decoded.hits, (unsigned long long) decoded.misses, (unsigned long long) decoded.loadedPages);
+        printf("\t- tiers: %llu instructions interpreted, %llu predecoded, %llu promotions, %llu evictions\n",
+               (unsigned long long) decoded.interpreted, (unsigned long long) decoded.predecoded,
+               (unsigned long long) decoded.promotions, (unsigned long long) decoded.evictions);
+        printf("\t- fused pairs: %llu\n", (unsigned long long) decoded.fused);
+
+        if (!options.decodeCachePath.empty())
+            decodeCache->save();
+    }
+
+    if (profiler)
+        profiler->report(stdout);
+
+    if constexpr (std::is_same_v<Hooks, cpu::PairProfile>)
+        cpu.hooks().report(stdout, options.tiers.fusion);
+
+    if (serialFd >= 0)
+        close(serialFd);
+}
+
+// every CPU runs on a thread of its own, so there is no per instruction dump. the devices, the
+// BIOS and the decode cache are built for a single CPU, options that need them are refused
+template<typename Model>
+int runSMP(uint32_t cpus, const Options& options) {
+    const std::pair<bool, const char*> unsupported[] = {
+            { !options.diskPath.empty() || !options.overlayPath.empty(), "--disk and --overlay" },
+            { !options.serialInput.empty(), "--serial-input" },
+            { !options.screenPath.empty(), "--screen" },
+            { !options.statsPath.empty(), "--stats" },
+            { options.profileRatio != 0, "--profile-memory" },
+            { !options.decodeCachePath.empty() || options.tiered, "--decode-cache and --tiered" },
+            { options.profilePairs, "--profile-pairs" },
+    };
+
+    for (const auto& [given, name] : unsupported) {
+        if (given) {
+            io::debug_print(io::ERROR, "%s cannot be used with --smp", name);
+            return 1;
+        }
+    }
+
+    io::debug_print(io::INFO, "Emulating %u %s CPUs", cpus, Model::NAME);
+
+    cpu::Machine<Model> machine(MEM_SIZE, cpus, options.hugePages);
+    machine.reset();
+
+    const io::Image* image = images.load("../stuff/main");
+    if (!image)
+        return 1;
+
+    machine.getMemory().loadImage(machine.cpu(0).getRegister(x86e::cpu::EIP), *image);
+
+    auto start = std::chrono::steady_clock::now();
+    machine.run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t total = 0;
+
+    io::debug_print(io::INFO, "Run statistics:");
+    for (uint32_t i = 0; i < machine.cpus(); i++) {
+        total += machine.cpu(i).instructionsRetired();
+        printf("\t- CPU %u: %llu instructions\n", i, (unsigned long long) machine.cpu(i).instructionsRetired());
+    }
+
+    printf("\t- %.2f MIPS over all CPUs\n", total / seconds / 1e6);
+    return 0;
+}
+
+static void printExecution(const std::string& path, const fuzz::Execution& execution) {
+    static const char* outcomes[] = { "halted", "timeout", "crashed" };
+
+    if (execution.outcome == fuzz::OUTCOME_CRASHED)
+        printf("%s: %s, exception %d after %llu instructions\n", path.c_str(), outcomes[execution.outcome],
+               execution.vector, (unsigned long long) execution.instructions);
+    else
+        printf("%s: %s after %llu instructions\n", path.c_str(), outcomes[execution.outcome],
+               (unsigned long long) execution.instructions);
+}
+
+// loads the image, snapshots the machine and runs every input file against it. under afl-fuzz
+// the coverage goes to the map in __AFL_SHM_ID, otherwise to a private one
+template<typename Model>
+int runFuzzer(uint32_t inputAddress, const std::vector<std::string>& inputs) {
+    uint8_t* bitmap = nullptr;
+
+    if (const char* shmId = getenv("__AFL_SHM_ID")) {
+        void* shared = shmat(atoi(shmId), nullptr, 0);
+
+        if (shared != (void*) -1)
+            bitmap = (uint8_t*) shared;
+        else
+            io::debug_print(io::WARNING, "Unable to attach to the AFL coverage map");
+    }
+
+    fuzz::Fuzzer<Model> fuzzer(MEM_SIZE, bitmap);
+    cpu::Core<Model, fuzz::EdgeCoverage>& cpu = fuzzer.machine();
+
+    const io::Image* image = images.load("../stuff/main");
+    if (!image)
+        return 1;
+
+    cpu.getMemory().loadImage(cpu.getRegister(x86e::cpu::EIP), *image);
+
+    fuzzer.setInput(inputAddress, MEM_SIZE - inputAddress);
+    fuzzer.snapshot();
+
+    uint64_t instructions = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (const std::string& path : inputs) {
+        std::vector<uint8_t> data = io::readfile(path);
+
+        fuzz::Execution execution = fuzzer.execute(data.data(), data.size(), FUZZ_BUDGET);
+        instructions += execution.instructions;
+
+        printExecution(path, execution);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint32_t edges = std::count_if(fuzzer.bitmap(), fuzzer.bitmap() + fuzz::MAP_SIZE, [](uint8_t hits) { return hits != 0; });
+
+    io::debug_print(io::INFO, "Fuzzing statistics:");
+    printf("\t- executions: %zu, %.0f per second\n", inputs.size(), inputs.size() / seconds);
+    printf("\t- instructions: %llu\n", (unsigned long long) instructions);
+    printf("\t- edges: %u\n", edges);
+
+    return 0;
+}
+
+// the same as runFuzzer, with the inputs run lanes at a time in lockstep. with verify every input
+// runs on a scalar machine too, a mismatch makes the exit status 1
+template<typename Model>
+int runBatch(uint32_t inputAddress, const std::vector<std::string>& inputs, uint32_t lanes, bool verify) {
+    fuzz::Batch<Model> batch(MEM_SIZE, lanes, verify);
+    cpu::Core<Model, fuzz::EdgeCoverage>& cpu = batch.machine();
+
+    const io::Image* image = images.load("../stuff/main");
+    if (!image)
+        return 1;
+
+    cpu.getMemory().loadImage(cpu.getRegister(x86e::cpu::EIP), *image);
+
+    batch.setInput(inputAddress, MEM_SIZE - inputAddress);
+    batch.snapshot();
+
+    std::vector<std::vector<uint8_t>> data;
+    for (const std::string& path : inputs)
+        data.push_back(io::readfile(path));
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<fuzz::Execution> executions = batch.execute(data, FUZZ_BUDGET);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    uint64_t instructions = 0;
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        instructions += executions[i].instructions;
+        printExecution(inputs[i], executions[i]);
+    }
+
+    uint32_t edges = std::count_if(batch.bitmap(), batch.bitmap() + fuzz::MAP_SIZE, [](uint8_t hits) { return hits != 0; });
+    fuzz::BatchStatistics& statistics = batch.statistics();
+
+    io::debug_print(io::INFO, "Batch statistics:");
+    printf("\t- executions: %zu, %.0f per second, %u lanes, %s\n", inputs.size(), inputs.size() / seconds,
+           batch.lanes(), batch.avx2() ? "AVX2" : "no AVX2");
+    printf("\t- instructions: %llu\n", (unsigned long long) instructions);
+    printf("\t- lockstep: %llu instructions, %llu vectorized, %llu lanes split off\n",
+           (unsigned long long) statistics.lockstep, (unsigned long long) statistics.vectorized,
+           (unsigned long long) statistics.splits);
+    printf("\t- edges: %u\n", edges);
+
+    if (verify)
+        printf("\t- verified against scalar runs: %llu mismatches\n", (unsigned long long) statistics.mismatches);
+
+    return statistics.mismatches ? 1 : 0;
+}
+
+// a static Linux executable on its own, its exit status becomes ours
+template<typename Model, typename Hooks = cpu::NoHooks>
+int runLinux(const std::vector<std::string>& arguments, const Options& options) {
+    cpu::Core<Model, Hooks> cpu(USER_MEMORY, options.hugePages);
+    cpu.reset();
+
+    std::unique_ptr<cpu::DecodeCache> decodeCache = attachDecodeCache<Model>(cpu, options);
+
+    user::LinuxProcess process(cpu);
+
+    std::vector<std::string> environment;
+    for (char** variable = environ; *variable; variable++)
+        environment.push_back(*variable);
+
+    if (!process.load(arguments[0], arguments, environment))
+        return 127;
+
+    while (!cpu.isHalted())
+        cpu.run(BOOT_SLICE);
+
+    if (!process.exited()) {
+        io::debug_print(io::ERROR, "%s stopped without exiting", arguments[0].c_str());
+        return 1;
+    }
+
+    if (decodeCache && !options.decodeCachePath.empty())
+        decodeCache->save();
+
+    if constexpr (std::is_same_v<Hooks, cpu::PairProfile>)
+        cpu.hooks().report(stderr, options.tiers.fusion);
+
+    return process.exitCode();
+}
+
+int main(int argc, char** argv) {
+    io::debug_print(io::INFO, "x86e v%s", VERSION);
+
+    std::string model = "386";
+    Options options;
+    uint32_t cpus = 1;
+    bool fuzzing = false;
+    uint32_t inputAddress = 0;
+    uint32_t lanes = 0;
+    bool verify = false;
+    std::vector<std::string> inputs;
+    std::vector<std::string> program;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "--cpu" && i + 1 < argc)
+            model = argv[++i];
+        else if (arg == "--huge-pages")
+            options.hugePages = true;
+        else if (arg == "--profile-memory" && i + 1 < argc)
+            options.profileRatio = strtoul(argv[++i], nullptr, 0);
+        else if (arg == "--smp" && i + 1 < argc)
+            cpus = strtoul(argv[++i], nullptr, 0);
+        else if (arg == "--stats" && i + 1 < argc)
+            options.statsPath = argv[++i];
+        else if (arg == "--disk" && i + 1 < argc)
+            options.diskPath = argv[++i];
+        else if (arg == "--overlay" && i + 1 < argc)
+            options.overlayPath = argv[++i];
+        else if (arg == "--serial-input" && i + 1 < argc)
+            options.serialInput = argv[++i];
+        else if (arg == "--screen" && i + 1 < argc)
+            options.screenPath = argv[++i];
+        else if (arg == "--screen-interval" && i + 1 < argc)
+            options.screenInterval = strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--decode-cache" && i + 1 < argc)
+            options.decodeCachePath = argv[++i];
+        else if (arg == "--tiered")
+            options.tiered = true;
+        else if (arg == "--tier-threshold" && i + 1 < argc)
+            options.tiers.threshold = strtoul(argv[++i], nullptr, 0);
+        else if (arg == "--tier-budget" && i + 1 < argc)
+            options.tiers.budget = strtoull(argv[++i], nullptr, 0);
+        else if (arg == "--fuse" && i + 1 < argc)
+            options.tiers.fusion = parseFusion(argv[++i]);
+        else if (arg == "--profile-pairs")
+            options.profilePairs = true;
+        else if (arg == "--linux" && i + 1 < argc) {
+            // a static i386 executable. the decoder lacks MOV, CMP, SUB, XOR, TEST, INC, DEC and
+            // the shifts, so libc programs stop with SIGILL, see user::LinuxProcess.
+            // everything after the executable is its own command line
+            program.assign(argv + i + 1, argv + argc);
+            break;
+        }
+        else if (arg == "--lanes" && i + 1 < argc)
+            lanes = strtoul(argv[++i], nullptr, 0);
+        else if (arg == "--verify")
+            verify = true;
+        else if (arg == "--fuzz" && i + 1 < argc) {
+            fuzzing = true;
+            inputAddress = strtoul(argv[++i], nullptr, 0);
+        }
+        else if (fuzzing)
+            inputs.push_back(arg);
+    }
+
+    if (!program.empty()) {
+        if (model != "386") {
+            io::debug_print(io::ERROR, "Linux executables need a 386");
+            return 1;
+        }
+
+        if (options.profilePairs)
+            return runLinux<cpu::Model386, cpu::PairProfile>(program, options);
+
+        return runLinux<cpu::Model386>(program, options);
+    }
+
+    // the profiling core is only built for the 386
+    if (options.profilePairs && model != "386") {
+        io::debug_print(io::ERROR, "Pair profiles need a 386");
+        return 1;
+    }
+
+    if (fuzzing && lanes) {
+        if (model == "8086")
+            return runBatch<cpu::Model8086>(inputAddress, inputs, lanes, verify);
+        else if (model == "286")
+            return runBatch<cpu::Model286>(inputAddress, inputs, lanes, verify);
+        else if (model == "386")
+            return runBatch<cpu::Model386>(inputAddress, inputs, lanes, verify);
+    }
+
+    if (fuzzing) {
+        if (model == "8086")
+            return runFuzzer<cpu::Model8086>(inputAddress, inputs);
+        else if (model == "286")
+            return runFuzzer<cpu::Model286>(inputAddress, inputs);
+        else if (model == "386")
+            return runFuzzer<cpu::Model386>(inputAddress, inputs);
+    }
+
+    if (cpus > 1) {
+        if (model == "8086")
+            return runSMP<cpu::Model8086>(cpus, options);
+        else if (model == "286")
+            return runSMP<cpu::Model286>(cpus, options);
+        else if (model == "386")
+            return runSMP<cpu::Model386>(cpus, options);
+    }
+
+    if (model == "8086")
+        run<cpu::Model8086>(options);
+    else if (model == "286")
+        run<cpu::Model286>(options);
+    else if (model == "386" && options.profilePairs)
+        run<cpu::Model386, cpu::PairProfile>(options);
+    else if (model == "386")
+        run<cpu::Model386>(options);
+    else {
+        io::debug_print(io::ERROR, "Unknown CPU model %s (expected 8086, 286 or 386)", model.c_str());
+        return 1;
+    }
+
+    return 0;
 }
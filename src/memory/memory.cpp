@@ -1,19 +1,139 @@
 #include "memory/memory.h"
 #include "io/Logger.h"
 
+#include <cstring>
+#include <algorithm>
+#include <cstdio>
+#include <sys/mman.h>
+#include <unistd.h>
+
 namespace x86e::memory {
 
-    Memory::Memory(uint64_t size) {
+    Memory::Memory(uint64_t size, bool hugePages) {
         x86e::io::debug_print(x86e::io::INFO, "Allocating %llu bytes for memory", size);
 
-        _memory = new uint8_t[size];
+        if (!allocate(size, hugePages)) {
+            _memory = new uint8_t[size];
+            _backing = BACKING_HEAP;
+            _mappingSize = 0;
+        }
+
         _size = size;
+
+        _pageTypes.assign((size + PAGE_MASK) >> PAGE_SHIFT, RAM);
+
+        _trackDirty = false;
+        _sampler = nullptr;
     }
 
     Memory::~Memory() {
         x86e::io::debug_print(x86e::io::INFO, "Deallocating memory");
 
-        delete[] _memory;
+        if (_backing == BACKING_HEAP)
+            delete[] _memory;
+        else
+            munmap(_memory, _mappingSize);
+    }
+
+    bool Memory::allocate(uint64_t size, bool hugePages) {
+        uint64_t mappingSize = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+        void* mapping;
+
+#ifdef MAP_HUGETLB
+        // only works if the admin has reserved huge pages, usually it does not
+        if (hugePages) {
+            mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+            if (mapping != MAP_FAILED) {
+                _memory = (uint8_t*) mapping;
+                _mappingSize = mappingSize;
+                _backing = BACKING_HUGETLB;
+                return true;
+            }
+        }
+#endif
+
+        // over-allocate so the start can be moved to a 2 MiB boundary, the kernel
+        // can only use a huge page for aligned 2 MiB ranges
+        mapping = mmap(nullptr, mappingSize + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mapping == MAP_FAILED) {
+            io::debug_print(io::WARNING, "Unable to map guest RAM, falling back to the heap");
+            return false;
+        }
+
+        uintptr_t start = (uintptr_t) mapping;
+        uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1);
+
+        if (aligned != start)
+            munmap(mapping, aligned - start);
+        if (aligned + mappingSize != start + mappingSize + HUGE_PAGE_SIZE)
+            munmap((void*) (aligned + mappingSize), start + HUGE_PAGE_SIZE - aligned);
+
+        _memory = (uint8_t*) aligned;
+        _mappingSize = mappingSize;
+        _backing = BACKING_MMAP;
+
+#ifdef MADV_HUGEPAGE
+        if (hugePages) {
+            if (madvise(_memory, _mappingSize, MADV_HUGEPAGE) == 0)
+                _backing = BACKING_TRANSPARENT_HUGE_PAGES;
+            else
+                io::debug_print(io::WARNING, "Transparent huge pages are not available, using 4 KiB pages");
+        }
+#endif
+
+        return true;
+    }
+
+    Backing Memory::backing() {
+        return _backing;
+    }
+
+    const char *Memory::backingName(Backing backing) {
+        switch (backing) {
+            case BACKING_HEAP:
+                return "heap";
+            case BACKING_MMAP:
+                return "mmap";
+            case BACKING_TRANSPARENT_HUGE_PAGES:
+                return "transparent huge pages";
+            case BACKING_HUGETLB:
+                return "hugetlb";
+        }
+
+        return "unknown";
+    }
+
+    uint64_t Memory::hugePageBytes() {
+        if (_backing == BACKING_HUGETLB)
+            return _mappingSize;
+
+        if (_backing != BACKING_TRANSPARENT_HUGE_PAGES)
+            return 0;
+
+        // the kernel only reports it per mapping
+        FILE* smaps = fopen("/proc/self/smaps", "r");
+        if (!smaps)
+            return 0;
+
+        char line[256];
+        bool inside = false;
+        uint64_t total = 0;
+
+        while (fgets(line, sizeof(line), smaps)) {
+            unsigned long long start, end, kilobytes;
+
+            if (sscanf(line, "%llx-%llx ", &start, &end) == 2)
+                inside = start < (uintptr_t) _memory + _mappingSize && end > (uintptr_t) _memory;
+            else if (inside && sscanf(line, "AnonHugePages: %llu kB", &kilobytes) == 1)
+                total += kilobytes * 1024;
+        }
+
+        fclose(smaps);
+        return total;
     }
 
     void *Memory::getMemLocation() {
@@ -21,27 +141,51 @@ namespace x86e::memory {
     }
 
     uint8_t Memory::readImm8(uint64_t address) {
-        return _memory[address];
+        if (direct(address, 1, false))
+            return _memory[address];
+
+        return readSlow(address, 1);
     }
 
     uint16_t Memory::readImm16(uint64_t address) {
-        return (uint16_t(_memory[address + 1]) << 8) | uint16_t(_memory[address]);
+        if (direct(address, 2, false))
+            return (uint16_t(_memory[address + 1]) << 8) | uint16_t(_memory[address]);
+
+        return readSlow(address, 2);
     }
 
     uint32_t Memory::readImm32(uint64_t address) {
-        return (uint32_t(_memory[address + 3]) << 24) | (uint32_t(_memory[address + 2]) << 16) | (uint32_t(_memory[address + 1]) << 8) | uint32_t(_memory[address]);
+        if (direct(address, 4, false))
+            return (uint32_t(_memory[address + 3]) << 24) | (uint32_t(_memory[address + 2]) << 16) | (uint32_t(_memory[address + 1]) << 8) | uint32_t(_memory[address]);
+
+        return readSlow(address, 4);
     }
 
     void Memory::writeImm8(uint8_t val, uint64_t address) {
+        if (!direct(address, 1, true))
+            return writeSlow(val, address, 1);
+
+        markDirty(address, 1);
+
         _memory[address] = val;
     }
 
     void Memory::writeImm16(uint16_t val, uint64_t address) {
+        if (!direct(address, 2, true))
+            return writeSlow(val, address, 2);
+
+        markDirty(address, 2);
+
         _memory[address] = ((uint16_t)val >> 0) & 0xFF;
         _memory[address + 1] = ((uint16_t)val >> 8) & 0xFF;
     }
 
     void Memory::writeImm32(uint32_t val, uint64_t address) {
+        if (!direct(address, 4, true))
+            return writeSlow(val, address, 4);
+
+        markDirty(address, 4);
+
         _memory[address] = ((uint32_t)val >> 0) & 0xFF;
         _memory[address + 1] = ((uint32_t)val >> 8) & 0xFF;
         _memory[address + 2] = ((uint32_t)val >> 16) & 0xFF;
@@ -52,4 +196,254 @@ namespace x86e::memory {
         return _size;
     }
 
+    void Memory::mapROM(uint64_t base, const uint8_t *data, uint64_t size) {
+        Region region = { base, size, ROM, { nullptr, nullptr, nullptr }, {} };
+
+        if (base + size <= _size) {
+            // ROM inside of RAM keeps its contents in RAM, so reads stay direct
+            std::memcpy(_memory + base, data, size);
+
+            for (uint64_t page = base >> PAGE_SHIFT; page <= (base + size - 1) >> PAGE_SHIFT; page++)
+                _pageTypes[page] = ROM | (_pageTypes[page] & PAGE_WATCHED);
+        }
+        else {
+            region.rom.assign(data, data + size);
+        }
+
+        _regions.push_back(std::move(region));
+    }
+
+    void Memory::mapMMIO(uint64_t base, uint64_t size, const MMIOHandler &handler) {
+        _regions.push_back({ base, size, MMIO, handler, {} });
+
+        for (uint64_t page = base >> PAGE_SHIFT; page <= (base + size - 1) >> PAGE_SHIFT && page < _pageTypes.size(); page++)
+            _pageTypes[page] = MMIO | (_pageTypes[page] & PAGE_WATCHED);
+    }
+
+    void Memory::loadImage(uint64_t base, const io::Image &image) {
+        if (base + image.size > _size) {
+            io::debug_print(io::WARNING, "Image %s does not fit into RAM at 0x%llx", image.path.c_str(), base);
+            return;
+        }
+
+        uint64_t pages = (image.size + PAGE_MASK) & ~(uint64_t) PAGE_MASK;
+
+        for (uint64_t page = base >> PAGE_SHIFT; page < (base + pages + PAGE_MASK) >> PAGE_SHIFT; page++)
+            markDirty(page << PAGE_SHIFT, 1);
+
+        // hugetlb mappings cannot be split into small pages
+        bool mapped = _backing == BACKING_MMAP || _backing == BACKING_TRANSPARENT_HUGE_PAGES;
+
+        if (mapped && (base & PAGE_MASK) == 0 && base + pages <= _mappingSize) {
+            void* target = _memory + base;
+
+            if (mmap(target, pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image.fd, 0) == target)
+                return;
+
+            io::debug_print(io::WARNING, "Unable to map image %s, copying it", image.path.c_str());
+        }
+
+        for (uint64_t done = 0; done < image.size;) {
+            ssize_t count = pread(image.fd, _memory + base + done, image.size - done, done);
+            if (count <= 0)
+                break;
+
+            done += count;
+        }
+    }
+
+    uint8_t *Memory::hostPage(uint64_t address, bool write) {
+        uint64_t page = address & ~(uint64_t) PAGE_MASK;
+
+        if (page + PAGE_SIZE > _size || _sampler)
+            return nullptr;
+
+        uint8_t type = _pageTypes[page >> PAGE_SHIFT];
+        if (type > ROM || (write && type == ROM))
+            return nullptr;
+
+        if (write)
+            markDirty(page, 1);
+
+        return _memory + page;
+    }
+
+    void Memory::watch(uint64_t base, uint64_t size, const MemoryWatchHandler &handler) {
+        _watches.push_back({ base, size, handler });
+        updateWatchedPages();
+    }
+
+    void Memory::unwatch(uint64_t base, uint64_t size) {
+        std::erase_if(_watches, [&](const MemoryWatch& watch) {
+            return watch.base == base && watch.size == size;
+        });
+
+        updateWatchedPages();
+    }
+
+    void Memory::setSampler(const MemoryWatchHandler *sampler) {
+        _sampler = sampler;
+    }
+
+    void Memory::trackDirtyPages(bool enabled) {
+        _trackDirty = enabled;
+        _dirty.assign(_pageTypes.size(), false);
+        _dirtyPages.clear();
+    }
+
+    const std::vector<uint64_t> &Memory::dirtyPages() {
+        return _dirtyPages;
+    }
+
+    void Memory::clearDirtyPages() {
+        for (uint64_t page : _dirtyPages)
+            _dirty[page] = false;
+
+        _dirtyPages.clear();
+    }
+
+    void Memory::markDirtyPage(uint64_t page) {
+        if (page >= _dirty.size() || _dirty[page])
+            return;
+
+        _dirty[page] = true;
+        _dirtyPages.push_back(page);
+    }
+
+    std::mutex &Memory::busLock() {
+        return _busLock;
+    }
+
+    void Memory::writeBlock(uint64_t address, const uint8_t *data, uint64_t size) {
+        while (size > 0) {
+            uint64_t chunk = std::min<uint64_t>(size, PAGE_SIZE - (address & PAGE_MASK));
+            uint8_t* host = hostPage(address, true);
+
+            if (host) {
+                std::memcpy(host + (address & PAGE_MASK), data, chunk);
+            }
+            else {
+                for (uint64_t i = 0; i < chunk; i++)
+                    writeImm8(data[i], address + i);
+            }
+
+            address += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    void Memory::readBlock(uint64_t address, uint8_t *data, uint64_t size) {
+        while (size > 0) {
+            uint64_t chunk = std::min<uint64_t>(size, PAGE_SIZE - (address & PAGE_MASK));
+            uint8_t* host = hostPage(address, false);
+
+            if (host) {
+                std::memcpy(data, host + (address & PAGE_MASK), chunk);
+            }
+            else {
+                for (uint64_t i = 0; i < chunk; i++)
+                    data[i] = readImm8(address + i);
+            }
+
+            address += chunk;
+            data += chunk;
+            size -= chunk;
+        }
+    }
+
+    void Memory::updateWatchedPages() {
+        for (uint8_t& type : _pageTypes)
+            type &= ~PAGE_WATCHED;
+
+        for (const MemoryWatch& watch : _watches) {
+            for (uint64_t page = watch.base >> PAGE_SHIFT; page <= (watch.base + watch.size - 1) >> PAGE_SHIFT && page < _pageTypes.size(); page++)
+                _pageTypes[page] |= PAGE_WATCHED;
+        }
+    }
+
+    void Memory::notifyWatches(uint64_t address, uint32_t value, uint8_t size, bool write) {
+        for (const MemoryWatch& watch : _watches) {
+            if (address < watch.base + watch.size && address + size > watch.base)
+                watch.handler.access(watch.handler.context, address, value, size, write);
+        }
+    }
+
+    Region *Memory::findRegion(uint64_t address) {
+        for (Region& region : _regions) {
+            if (address >= region.base && address < region.base + region.size)
+                return &region;
+        }
+
+        return nullptr;
+    }
+
+    uint32_t Memory::readSlow(uint64_t address, uint8_t size) {
+        uint32_t value = readRegion(address, size);
+
+        if (!_watches.empty()) [[unlikely]]
+            notifyWatches(address, value, size, false);
+        if (_sampler) [[unlikely]]
+            _sampler->access(_sampler->context, address, value, size, false);
+
+        return value;
+    }
+
+    void Memory::writeSlow(uint32_t val, uint64_t address, uint8_t size) {
+        writeRegion(val, address, size);
+
+        if (!_watches.empty()) [[unlikely]]
+            notifyWatches(address, val, size, true);
+        if (_sampler) [[unlikely]]
+            _sampler->access(_sampler->context, address, val, size, true);
+    }
+
+    uint32_t Memory::readRegion(uint64_t address, uint8_t size) {
+        Region* region = findRegion(address);
+
+        if (region && region->type == MMIO && address + size <= region->base + region->size)
+            return region->handler.read(region->handler.context, address - region->base, size);
+
+        if (size > 1) {
+            // straddles a region boundary
+            uint32_t value = 0;
+
+            for (uint8_t i = 0; i < size; i++)
+                value |= (uint32_t) readRegion(address + i, 1) << (i * 8);
+
+            return value;
+        }
+
+        if (region && region->type == ROM && !region->rom.empty())
+            return region->rom[address - region->base];
+
+        if (address < _size)
+            return _memory[address];
+
+        // nothing is mapped here
+        return 0xff;
+    }
+
+    void Memory::writeRegion(uint32_t val, uint64_t address, uint8_t size) {
+        Region* region = findRegion(address);
+
+        if (region && region->type == MMIO && address + size <= region->base + region->size) {
+            region->handler.write(region->handler.context, address - region->base, val, size);
+            return;
+        }
+
+        if (size > 1) {
+            for (uint8_t i = 0; i < size; i++)
+                writeRegion((val >> (i * 8)) & 0xff, address + i, 1);
+
+            return;
+        }
+
+        // writes to ROM and unmapped addresses are dropped
+        if (address < _size && (_pageTypes[address >> PAGE_SHIFT] & ~PAGE_WATCHED) == RAM) {
+            markDirty(address, 1);
+            _memory[address] = val;
+        }
+    }
+
 }
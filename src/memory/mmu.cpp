@@ -0,0 +1,336 @@
+#include "memory/mmu.h"
+
+#include <algorithm>
+#include <atomic>
+#include <initializer_list>
+
+namespace x86e::memory {
+
+    MMU::MMU(Memory &memory)
+        : _memory(memory), _pageFaultHandler(nullptr), _pageFaultContext(nullptr) {
+        reset();
+    }
+
+    MMU::~MMU() {
+    }
+
+    void MMU::reset() {
+        _paging = false;
+        _globalPages = false;
+        _userMode = false;
+        _pageDirectory = 0;
+        _statistics = { 0, 0, 0 };
+
+        flush(true);
+    }
+
+    void MMU::setPaging(bool enabled) {
+        if (_paging != enabled)
+            flush(true);
+
+        _paging = enabled;
+    }
+
+    void MMU::setPageDirectory(uint32_t cr3) {
+        _pageDirectory = cr3 & ~PAGE_MASK;
+        flush(false);
+    }
+
+    void MMU::setGlobalPages(bool enabled) {
+        if (_globalPages != enabled)
+            flush(true);
+
+        _globalPages = enabled;
+    }
+
+    void MMU::setUserMode(bool user) {
+        // entries are filled with the permissions of the current privilege level
+        if (_userMode != user)
+            flush(true);
+
+        _userMode = user;
+    }
+
+    void MMU::setPageFaultHandler(PageFaultHandler handler, void *context) {
+        _pageFaultHandler = handler;
+        _pageFaultContext = context;
+    }
+
+    void MMU::flush(bool global) {
+        for (TLBEntry* tlb : { _read, _write, _exec }) {
+            for (uint32_t i = 0; i < TLB_SIZE; i++) {
+                if (global || !_globalPages || !tlb[i].global)
+                    tlb[i].tag = TLB_INVALID;
+            }
+        }
+
+        // not worth checking whether it is global, it is refilled on the next push
+        _stack.tag = TLB_INVALID;
+
+        ++_statistics.flushes;
+    }
+
+    TLBStatistics &MMU::statistics() {
+        return _statistics;
+    }
+
+    bool MMU::translate(uint32_t linear, AccessType access, uint32_t &physical) {
+        bool global;
+        return walk(linear, access, physical, global, _userMode);
+    }
+
+    bool MMU::probe(uint32_t linear, uint32_t size, AccessType access) {
+        return probe(linear, size, access, _userMode);
+    }
+
+    bool MMU::probe(uint32_t linear, uint32_t size, AccessType access, bool user) {
+        uint32_t last = (linear + size - 1) & ~PAGE_MASK;
+
+        for (uint32_t address = linear; ; address = (address & ~PAGE_MASK) + PAGE_SIZE) {
+            uint32_t physical;
+            bool global;
+
+            if (!walk(address, access, physical, global, user))
+                return false;
+
+            // the TLB holds translations for the current privilege level only
+            if (user == _userMode)
+                fill(access == WRITE ? _write : access == EXECUTE ? _exec : _read, address, physical, global);
+
+            if ((address & ~PAGE_MASK) == last)
+                return true;
+        }
+    }
+
+    bool MMU::writeBlock(uint32_t linear, const uint8_t *data, uint32_t size, bool user) {
+        uint32_t split = std::min(size, PAGE_SIZE - (linear & PAGE_MASK));
+        uint32_t first;
+        uint32_t second = 0;
+        bool global;
+
+        if (!walk(linear, WRITE, first, global, user))
+            return false;
+
+        if (split < size && !walk(linear + split, WRITE, second, global, user))
+            return false;
+
+        for (uint32_t i = 0; i < size; i++)
+            _memory.writeImm8(data[i], i < split ? first + i : second + i - split);
+
+        return true;
+    }
+
+    uint32_t MMU::readSystem32(uint32_t linear) {
+        if (!_userMode)
+            return readImm32(linear);
+
+        uint32_t split = std::min<uint32_t>(4, PAGE_SIZE - (linear & PAGE_MASK));
+        uint32_t first;
+        uint32_t second = 0;
+        bool global;
+
+        if (!walk(linear, READ, first, global, false))
+            return 0;
+
+        if (split < 4 && !walk(linear + split, READ, second, global, false))
+            return 0;
+
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < 4; i++)
+            value |= (uint32_t) _memory.readImm8(i < split ? first + i : second + i - split) << (i * 8);
+
+        return value;
+    }
+
+    bool MMU::walk(uint32_t linear, AccessType access, uint32_t &physical, bool &global, bool user) {
+        global = false;
+
+        if (!_paging) {
+            physical = linear;
+            return true;
+        }
+
+        uint32_t errorCode = (access == WRITE ? PF_WRITE : 0) | (user ? PF_USER : 0);
+
+        // other CPUs may walk and update the same tables. the accessed and dirty bits are set with a
+        // compare and swap, and the walk starts over when an entry changed since it was read
+        while (true) {
+            uint32_t pdeAddress = _pageDirectory + ((linear >> 22) << 2);
+            uint32_t pde = _memory.readImm32(pdeAddress);
+
+            if (!(pde & PAGE_PRESENT)) {
+                if (_pageFaultHandler)
+                    _pageFaultHandler(_pageFaultContext, linear, errorCode);
+                return false;
+            }
+
+            uint32_t pteAddress = (pde & ~PAGE_MASK) + (((linear >> PAGE_SHIFT) & 0x3ff) << 2);
+            uint32_t pte = _memory.readImm32(pteAddress);
+
+            if (!(pte & PAGE_PRESENT)) {
+                if (_pageFaultHandler)
+                    _pageFaultHandler(_pageFaultContext, linear, errorCode);
+                return false;
+            }
+
+            // effective permissions are the intersection of both levels.
+            // supervisor accesses ignore the R/W bit like on i386 (no CR0.WP)
+            bool writable = (pde & pte & PAGE_WRITABLE) || !user;
+            bool userPage = pde & pte & PAGE_USER;
+
+            if ((user && !userPage) || (access == WRITE && !writable)) {
+                if (_pageFaultHandler)
+                    _pageFaultHandler(_pageFaultContext, linear, errorCode | PF_PRESENT);
+                return false;
+            }
+
+            if (!(pde & PAGE_ACCESSED) && !updateEntry(pdeAddress, pde, pde | PAGE_ACCESSED))
+                continue;
+
+            uint32_t updated = pte | PAGE_ACCESSED | (access == WRITE ? PAGE_DIRTY : 0);
+            if (updated != pte && !updateEntry(pteAddress, pte, updated))
+                continue;
+
+            physical = (pte & ~PAGE_MASK) | (linear & PAGE_MASK);
+            global = pte & PAGE_GLOBAL;
+
+            return true;
+        }
+    }
+
+    bool MMU::updateEntry(uint32_t address, uint32_t expected, uint32_t value) {
+        uint8_t* host = _memory.hostPage(address, true);
+
+        // tables outside of plain RAM, or while every access is sampled, are written like before
+        if (!host) {
+            _memory.writeImm32(value, address);
+            return true;
+        }
+
+        return std::atomic_ref<uint32_t>(*(uint32_t*) (host + (address & PAGE_MASK))).compare_exchange_strong(expected, value);
+    }
+
+    const uint8_t *MMU::fetchPointer(uint32_t linear) {
+        return hostPointer(_exec, linear, EXECUTE);
+    }
+
+    uint8_t *MMU::writePointer(uint32_t linear) {
+        return hostPointer(_write, linear, WRITE);
+    }
+
+    uint8_t *MMU::hostPointer(TLBEntry *tlb, uint32_t linear, AccessType access) {
+        TLBEntry& entry = tlb[(linear >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+
+        if (entry.tag != (linear & ~PAGE_MASK)) {
+            uint32_t physical;
+            bool global;
+
+            ++_statistics.misses;
+
+            if (!walk(linear, access, physical, global, _userMode))
+                return nullptr;
+
+            fill(tlb, linear, physical, global);
+
+            if (entry.tag != (linear & ~PAGE_MASK))
+                return nullptr;
+        }
+        else {
+            ++_statistics.hits;
+        }
+
+        return entry.host + (linear & PAGE_MASK);
+    }
+
+    uint8_t *MMU::stackPageSlow(uint32_t linear) {
+        TLBEntry& entry = _write[(linear >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+
+        if (entry.tag != (linear & ~PAGE_MASK))
+            return nullptr;
+
+        ++_statistics.hits;
+        _stack = entry;
+        return _stack.host;
+    }
+
+    void MMU::fill(TLBEntry *tlb, uint32_t linear, uint32_t physical, bool global) {
+        // only pages that can be accessed directly get a host pointer, ROM writes
+        // and MMIO always take the slow path through Memory
+        uint8_t* host = _memory.hostPage(physical, tlb == _write);
+        if (!host)
+            return;
+
+        TLBEntry& entry = tlb[(linear >> PAGE_SHIFT) & (TLB_SIZE - 1)];
+        entry.tag = linear & ~PAGE_MASK;
+        entry.global = global;
+        entry.host = host;
+    }
+
+    uint32_t MMU::loadSlow(uint32_t linear, uint32_t size, AccessType access) {
+        ++_statistics.misses;
+
+        if ((linear & PAGE_MASK) + size > PAGE_SIZE) {
+            // crosses a page boundary, translate byte by byte
+            uint32_t value = 0;
+
+            for (uint32_t i = 0; i < size; i++)
+                value |= loadSlow(linear + i, 1, access) << (i * 8);
+
+            return value;
+        }
+
+        uint32_t physical;
+        bool global;
+
+        if (!walk(linear, access, physical, global, _userMode))
+            return 0;
+
+        fill(access == EXECUTE ? _exec : _read, linear, physical, global);
+
+        switch (size) {
+            case 1:
+                return _memory.readImm8(physical);
+            case 2:
+                return _memory.readImm16(physical);
+            default:
+                return _memory.readImm32(physical);
+        }
+    }
+
+    void MMU::storeSlow(uint32_t val, uint32_t linear, uint32_t size) {
+        ++_statistics.misses;
+
+        if ((linear & PAGE_MASK) + size > PAGE_SIZE) {
+            // crosses a page boundary, both pages are translated before either is written
+            uint8_t bytes[4];
+
+            for (uint32_t i = 0; i < size; i++)
+                bytes[i] = val >> (i * 8);
+
+            writeBlock(linear, bytes, size, _userMode);
+            return;
+        }
+
+        uint32_t physical;
+        bool global;
+
+        if (!walk(linear, WRITE, physical, global, _userMode))
+            return;
+
+        // the walk above has set the dirty bit, so later writes can skip it
+        fill(_write, linear, physical, global);
+
+        switch (size) {
+            case 1:
+                _memory.writeImm8(val, physical);
+                break;
+            case 2:
+                _memory.writeImm16(val, physical);
+                break;
+            default:
+                _memory.writeImm32(val, physical);
+                break;
+        }
+    }
+
+}
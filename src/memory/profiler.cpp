@@ -0,0 +1,162 @@
+#include "memory/profiler.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace x86e::memory {
+    static constexpr uint32_t HEATMAP_COLUMNS = 64;
+    static constexpr uint32_t HEATMAP_ROWS = 32;
+    static constexpr uint32_t CURVE_ROWS = 20;
+    static constexpr uint32_t TOP_PAGES = 10;
+
+    Profiler::Profiler(cpu::CPU &cpu, uint32_t ratio)
+        : _cpu(cpu), _ratio(std::max(ratio, 1u)) {
+        _sampler = { this, &Profiler::access };
+
+        _pages.assign((_cpu.getMemory().memorySize() + PAGE_MASK) >> PAGE_SHIFT, { 0, 0, 0, 0, 0 });
+
+        _window = 0;
+        _windowPages = 0;
+        _windowLines = 0;
+        _samples = 0;
+
+        _event = _cpu.getScheduler().observe(_cpu.instructionsRetired(), &Profiler::open, this);
+    }
+
+    Profiler::~Profiler() {
+        if (_event)
+            _cpu.getScheduler().cancel(_event);
+
+        _cpu.getMemory().setSampler(nullptr);
+    }
+
+    void Profiler::open(void *context, uint64_t now) {
+        Profiler* profiler = (Profiler*) context;
+
+        profiler->_window++;
+        profiler->_windowPages = 0;
+        profiler->_windowLines = 0;
+
+        // everything cached so far would bypass the sampler
+        profiler->_cpu.getMemory().setSampler(&profiler->_sampler);
+        profiler->_cpu.getMMU().flush(true);
+
+        profiler->_event = profiler->_cpu.getScheduler().observe(now + WINDOW, &Profiler::close, profiler);
+    }
+
+    void Profiler::close(void *context, uint64_t now) {
+        Profiler* profiler = (Profiler*) context;
+
+        profiler->_cpu.getMemory().setSampler(nullptr);
+        profiler->_workingSet.push_back({ now, profiler->_windowPages, profiler->_windowLines });
+
+        profiler->_event = profiler->_cpu.getScheduler().observe(now + WINDOW * (profiler->_ratio - 1), &Profiler::open, profiler);
+    }
+
+    void Profiler::access(void *context, uint64_t address, uint32_t value, uint8_t size, bool write) {
+        Profiler* profiler = (Profiler*) context;
+        uint64_t page = address >> PAGE_SHIFT;
+
+        if (page >= profiler->_pages.size())
+            return;
+
+        PageCounters& counters = profiler->_pages[page];
+        uint64_t line = 1ull << ((address & PAGE_MASK) >> LINE_SHIFT);
+
+        if (counters.window != profiler->_window) {
+            counters.window = profiler->_window;
+            counters.windowLines = 0;
+            profiler->_windowPages++;
+        }
+
+        if (!(counters.windowLines & line)) {
+            counters.windowLines |= line;
+            profiler->_windowLines++;
+        }
+
+        counters.lines |= line;
+
+        if (write)
+            counters.writes++;
+        else
+            counters.reads++;
+
+        profiler->_samples++;
+    }
+
+    void Profiler::report(FILE *out) {
+        uint64_t pages = _pages.size();
+
+        fprintf(out, "Memory profile: %llu accesses sampled in %zu windows of %llu instructions, 1 in %u\n",
+                (unsigned long long) _samples, _workingSet.size(), (unsigned long long) WINDOW, _ratio);
+
+        // heatmap, each cell sums a run of pages and is scaled logarithmically against the hottest one
+        static const char levels[] = " .:-=+*#%@";
+        uint64_t cellPages = std::max<uint64_t>(1, (pages + HEATMAP_COLUMNS * HEATMAP_ROWS - 1) / (HEATMAP_COLUMNS * HEATMAP_ROWS));
+        uint64_t cells = (pages + cellPages - 1) / cellPages;
+
+        std::vector<uint64_t> heat(cells, 0);
+        for (uint64_t page = 0; page < pages; page++)
+            heat[page / cellPages] += _pages[page].reads + _pages[page].writes;
+
+        uint64_t hottest = *std::max_element(heat.begin(), heat.end());
+
+        fprintf(out, "Heatmap, %llu KiB per cell:\n", (unsigned long long) (cellPages * PAGE_SIZE / 1024));
+
+        for (uint64_t row = 0; row < cells; row += HEATMAP_COLUMNS) {
+            fprintf(out, "\t0x%08llx |", (unsigned long long) (row * cellPages * PAGE_SIZE));
+
+            for (uint64_t cell = row; cell < std::min(cells, row + HEATMAP_COLUMNS); cell++) {
+                uint32_t level = 0;
+
+                if (heat[cell])
+                    level = 1 + (uint32_t) (8 * std::log((double) heat[cell]) / std::log((double) hottest + 1));
+
+                fputc(levels[std::min<uint32_t>(level, sizeof(levels) - 2)], out);
+            }
+
+            fprintf(out, "|\n");
+        }
+
+        // working set, the largest window of every bucket
+        uint64_t bucket = std::max<uint64_t>(1, (_workingSet.size() + CURVE_ROWS - 1) / CURVE_ROWS);
+
+        fprintf(out, "Working set per window:\n");
+        fprintf(out, "\t%14s %8s %10s %8s\n", "instructions", "pages", "KiB", "lines");
+
+        for (uint64_t first = 0; first < _workingSet.size(); first += bucket) {
+            WorkingSet largest = _workingSet[first];
+
+            for (uint64_t i = first; i < std::min<uint64_t>(_workingSet.size(), first + bucket); i++) {
+                if (_workingSet[i].pages > largest.pages)
+                    largest = _workingSet[i];
+            }
+
+            fprintf(out, "\t%14llu %8u %10u %8u\n", (unsigned long long) largest.time, largest.pages,
+                    largest.pages * (PAGE_SIZE / 1024), largest.lines);
+        }
+
+        // hottest pages
+        std::vector<uint64_t> order;
+        for (uint64_t page = 0; page < pages; page++) {
+            if (_pages[page].reads + _pages[page].writes)
+                order.push_back(page);
+        }
+
+        std::sort(order.begin(), order.end(), [this](uint64_t a, uint64_t b) {
+            return _pages[a].reads + _pages[a].writes > _pages[b].reads + _pages[b].writes;
+        });
+
+        fprintf(out, "Hottest pages:\n");
+        fprintf(out, "\t%10s %12s %12s %8s\n", "page", "reads", "writes", "lines");
+
+        for (uint64_t i = 0; i < std::min<uint64_t>(order.size(), TOP_PAGES); i++) {
+            PageCounters& counters = _pages[order[i]];
+
+            fprintf(out, "\t0x%08llx %12llu %12llu %5d/64\n", (unsigned long long) (order[i] << PAGE_SHIFT),
+                    (unsigned long long) counters.reads, (unsigned long long) counters.writes, std::popcount(counters.lines));
+        }
+    }
+
+}
@@ -0,0 +1,78 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "io/stats.h"
+
+using namespace x86e;
+
+// reads the stats files of running machines without stopping them.
+// x86e-stats [-w seconds] file...
+int main(int argc, char** argv) {
+    unsigned interval = 0;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-w" && i + 1 < argc)
+            interval = strtoul(argv[++i], nullptr, 0);
+        else
+            paths.push_back(arg);
+    }
+
+    if (paths.empty()) {
+        fprintf(stderr, "usage: %s [-w seconds] stats-file...\n", argv[0]);
+        return 1;
+    }
+
+    while (true) {
+        printf("%-24s %8s %6s %14s %10s %8s %14s %10s %10s %10s %s\n", "file", "pid", "model", "instructions", "MIPS",
+               "TLB hit", "TLB misses", "faults", "#PF", "I/O exits", "state");
+
+        for (const std::string& path : paths) {
+            const io::StatsPage* page;
+
+            if (!io::mapStats(path, page)) {
+                printf("%-24s unreadable\n", path.c_str());
+                continue;
+            }
+
+            uint64_t hits = io::loadStat(page->tlbHits);
+            uint64_t misses = io::loadStat(page->tlbMisses);
+            double hitRate = hits + misses ? 100.0 * hits / (hits + misses) : 0;
+
+            const char* state = io::loadStat(page->exited) ? "exited" : io::loadStat(page->halted) ? "halted" : "running";
+
+            printf("%-24s %8llu %6.6s %14llu %10.2f %7.2f%% %14llu %10llu %10llu %10llu %s",
+                   path.c_str(), (unsigned long long) page->pid, page->model,
+                   (unsigned long long) io::loadStat(page->instructions),
+                   io::loadStat(page->instructionsPerSecond) / 1e6, hitRate, (unsigned long long) misses,
+                   (unsigned long long) io::loadStat(page->exceptions), (unsigned long long) io::loadStat(page->pageFaults),
+                   (unsigned long long) io::loadStat(page->ioExits), state);
+
+            uint64_t blockHits = io::loadStat(page->blockHits);
+            uint64_t blockMisses = io::loadStat(page->blockMisses);
+            if (blockHits + blockMisses)
+                printf(", block cache %.2f%%", 100.0 * blockHits / (blockHits + blockMisses));
+
+            uint64_t interpreted = io::loadStat(page->interpreted);
+            uint64_t predecoded = io::loadStat(page->predecoded);
+            if (interpreted + predecoded)
+                printf(", %.2f%% predecoded, %llu promotions, %llu evictions", 100.0 * predecoded / (interpreted + predecoded),
+                       (unsigned long long) io::loadStat(page->promotions), (unsigned long long) io::loadStat(page->evictions));
+
+            printf("\n");
+            io::unmapStats(page);
+        }
+
+        if (!interval)
+            break;
+
+        fflush(stdout);
+        sleep(interval);
+    }
+
+    return 0;
+}
@@ -0,0 +1,1071 @@
+#include "user/linux.h"
+#include "io/Logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace x86e::user {
+    // i386 syscall numbers
+    enum Syscall {
+        NR_EXIT = 1,
+        NR_READ = 3,
+        NR_WRITE = 4,
+        NR_OPEN = 5,
+        NR_CLOSE = 6,
+        NR_UNLINK = 10,
+        NR_CHDIR = 12,
+        NR_TIME = 13,
+        NR_LSEEK = 19,
+        NR_GETPID = 20,
+        NR_GETUID = 24,
+        NR_ACCESS = 33,
+        NR_KILL = 37,
+        NR_RENAME = 38,
+        NR_MKDIR = 39,
+        NR_RMDIR = 40,
+        NR_DUP = 41,
+        NR_PIPE = 42,
+        NR_BRK = 45,
+        NR_GETGID = 47,
+        NR_GETEUID = 49,
+        NR_GETEGID = 50,
+        NR_IOCTL = 54,
+        NR_FCNTL = 55,
+        NR_UMASK = 60,
+        NR_DUP2 = 63,
+        NR_GETPPID = 64,
+        NR_GETTIMEOFDAY = 78,
+        NR_READLINK = 85,
+        NR_MMAP = 90,
+        NR_MUNMAP = 91,
+        NR_UNAME = 122,
+        NR_MPROTECT = 125,
+        NR_LLSEEK = 140,
+        NR_READV = 145,
+        NR_WRITEV = 146,
+        NR_SCHED_YIELD = 158,
+        NR_NANOSLEEP = 162,
+        NR_RT_SIGACTION = 174,
+        NR_RT_SIGPROCMASK = 175,
+        NR_GETCWD = 183,
+        NR_SIGALTSTACK = 186,
+        NR_MMAP2 = 192,
+        NR_STAT64 = 195,
+        NR_LSTAT64 = 196,
+        NR_FSTAT64 = 197,
+        NR_GETUID32 = 199,
+        NR_GETGID32 = 200,
+        NR_GETEUID32 = 201,
+        NR_GETEGID32 = 202,
+        NR_MADVISE = 219,
+        NR_GETDENTS64 = 220,
+        NR_FCNTL64 = 221,
+        NR_GETTID = 224,
+        NR_FUTEX = 240,
+        NR_SET_THREAD_AREA = 243,
+        NR_EXIT_GROUP = 252,
+        NR_SET_TID_ADDRESS = 258,
+        NR_CLOCK_GETTIME = 265,
+        NR_TGKILL = 270,
+        NR_OPENAT = 295,
+        NR_FSTATAT64 = 300,
+        NR_UNLINKAT = 301,
+        NR_FACCESSAT = 307,
+        NR_SET_ROBUST_LIST = 311,
+        NR_PRLIMIT64 = 340,
+        NR_GETRANDOM = 355,
+        NR_CLOCK_GETTIME64 = 403,
+    };
+
+    // auxiliary vector
+    enum AuxiliaryType {
+        AUX_NULL = 0,
+        AUX_PHDR = 3,
+        AUX_PHENT = 4,
+        AUX_PHNUM = 5,
+        AUX_PAGESZ = 6,
+        AUX_BASE = 7,
+        AUX_FLAGS = 8,
+        AUX_ENTRY = 9,
+        AUX_UID = 11,
+        AUX_EUID = 12,
+        AUX_GID = 13,
+        AUX_EGID = 14,
+        AUX_PLATFORM = 15,
+        AUX_HWCAP = 16,
+        AUX_CLKTCK = 17,
+        AUX_SECURE = 23,
+        AUX_RANDOM = 25,
+        AUX_EXECFN = 31,
+    };
+
+    // the stubs run at CPL 0, the program at CPL 3
+    static constexpr uint16_t CODE_SELECTOR = 0x08;
+    static constexpr uint16_t DATA_SELECTOR = 0x10;
+    static constexpr uint16_t USER_CODE_SELECTOR = 0x1b;
+    static constexpr uint16_t USER_DATA_SELECTOR = 0x23;
+    static constexpr uint16_t TSS_SELECTOR = 0x28;
+
+    // what set_thread_area hands out, as on Linux
+    static constexpr uint32_t TLS_FIRST = 6;
+    static constexpr uint32_t TLS_ENTRIES = 3;
+    static constexpr uint32_t GDT_ENTRIES = 16;
+
+    static constexpr uint32_t GDT = LinuxProcess::SYSTEM_BASE;
+    static constexpr uint32_t IDT = LinuxProcess::SYSTEM_BASE + 0x100;
+    static constexpr uint32_t TSS = LinuxProcess::SYSTEM_BASE + 0x900;
+    static constexpr uint32_t TSS_SIZE = 0x68;
+    static constexpr uint32_t SYSCALL_STUB = LinuxProcess::SYSTEM_BASE + 0x1000;
+    static constexpr uint32_t FAULT_STUBS = SYSCALL_STUB + 0x10;    // OUT FAULT_PORT, AL for every exception
+    static constexpr uint32_t FAULT_STUB_SIZE = 2;
+    // the stubs' stack is the page below its top. the page tables are at the top of RAM instead,
+    // there are too many of them for the space below the executable
+    static constexpr uint32_t KERNEL_STACK_TOP = LinuxProcess::SYSTEM_BASE + 0x3000;
+    static constexpr uint32_t PAGE_DIRECTORY = LinuxProcess::SYSTEM_BASE + 0x3000;
+    static constexpr uint32_t SYSTEM_END = PAGE_DIRECTORY + LinuxProcess::PAGE_SIZE;
+
+    // struct termios of the kernel, which is what TCGETS fills
+    static constexpr uint32_t TERMIOS_SIZE = 36;
+
+    // static PIE executables are placed where Linux would put them
+    static constexpr uint32_t DYNAMIC_BASE = 0x56555000;
+
+    static uint32_t alignUp(uint32_t value, uint32_t alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    LinuxProcess::LinuxProcess(cpu::CPU &cpu)
+        : _cpu(cpu), _entry(0), _programHeaders(0), _programHeaderCount(0), _brkStart(0), _brk(0), _brkHigh(0),
+          _mmapTop(0), _stackBottom(0), _pageTables(0), _exited(false), _exitCode(0) {
+        _cpu.getIOBus().registerPorts(SYSCALL_PORT, 2, { this, &LinuxProcess::read, &LinuxProcess::trap, nullptr, nullptr });
+    }
+
+    LinuxProcess::~LinuxProcess() {
+        _cpu.getIOBus().unregisterPorts(SYSCALL_PORT, 2);
+    }
+
+    bool LinuxProcess::exited() {
+        return _exited;
+    }
+
+    int LinuxProcess::exitCode() {
+        return _exitCode;
+    }
+
+    bool LinuxProcess::load(const std::string &path, const std::vector<std::string> &argv, const std::vector<std::string> &envp) {
+        uint64_t memory = _cpu.getMemory().memorySize();
+
+        if (memory < 2 * STACK_SIZE) {
+            io::debug_print(io::ERROR, "%llu bytes of RAM are not enough for a process", (unsigned long long) memory);
+            return false;
+        }
+
+        _path = path;
+
+        // a page table for every 4 MiB of RAM, above the stack
+        uint32_t top = std::min<uint64_t>(memory, 0xfffff000) & ~(PAGE_SIZE - 1);
+        _pageTables = top - alignUp(top / PAGE_SIZE, 1024) * 4;
+        _stackBottom = _pageTables - STACK_SIZE;
+        _mmapTop = _stackBottom - PAGE_SIZE;
+        _unmapped.clear();
+
+        if (!loadExecutable(path))
+            return false;
+
+        setupSystem();
+        setupStack(argv, envp);
+
+        _cpu.setRegister(cpu::EIP, _entry);
+        return true;
+    }
+
+    bool LinuxProcess::loadExecutable(const std::string &path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            io::debug_print(io::ERROR, "Unable to open %s", path.c_str());
+            return false;
+        }
+
+        Elf32_Ehdr header;
+
+        if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || std::memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 ||
+            header.e_ident[EI_CLASS] != ELFCLASS32 || header.e_machine != EM_386 ||
+            (header.e_type != ET_EXEC && header.e_type != ET_DYN) || header.e_phentsize != sizeof(Elf32_Phdr)) {
+            io::debug_print(io::ERROR, "%s is not an i386 executable", path.c_str());
+            close(fd);
+            return false;
+        }
+
+        std::vector<Elf32_Phdr> segments(header.e_phnum);
+        uint64_t size = segments.size() * sizeof(Elf32_Phdr);
+
+        if (pread(fd, segments.data(), size, header.e_phoff) != (ssize_t) size) {
+            io::debug_print(io::ERROR, "%s is truncated", path.c_str());
+            close(fd);
+            return false;
+        }
+
+        uint32_t bias = header.e_type == ET_DYN ? DYNAMIC_BASE : 0;
+        uint32_t end = 0;
+        memory::Memory& memory = _cpu.getMemory();
+
+        _programHeaders = 0;
+
+        for (Elf32_Phdr& segment : segments) {
+            if (segment.p_type == PT_INTERP) {
+                io::debug_print(io::ERROR, "%s is dynamically linked, only static executables can be run", path.c_str());
+                close(fd);
+                return false;
+            }
+
+            if (segment.p_type == PT_PHDR)
+                _programHeaders = bias + segment.p_vaddr;
+
+            if (segment.p_type != PT_LOAD)
+                continue;
+
+            uint32_t address = bias + segment.p_vaddr;
+
+            if (segment.p_filesz > segment.p_memsz) {
+                io::debug_print(io::ERROR, "%s has a segment with more file data than memory", path.c_str());
+                close(fd);
+                return false;
+            }
+
+            if (address < SYSTEM_END || (uint64_t) address + segment.p_memsz > _mmapTop) {
+                io::debug_print(io::ERROR, "%s does not fit into guest RAM", path.c_str());
+                close(fd);
+                return false;
+            }
+
+            // the headers are mapped along with the first segment
+            if (!_programHeaders && header.e_phoff >= segment.p_offset && header.e_phoff < segment.p_offset + segment.p_filesz)
+                _programHeaders = address + header.e_phoff - segment.p_offset;
+
+            std::vector<uint8_t> data(segment.p_filesz);
+
+            if (pread(fd, data.data(), data.size(), segment.p_offset) != (ssize_t) data.size()) {
+                io::debug_print(io::ERROR, "%s is truncated", path.c_str());
+                close(fd);
+                return false;
+            }
+
+            memory.writeBlock(address, data.data(), data.size());
+            zero(address + segment.p_filesz, segment.p_memsz - segment.p_filesz);
+
+            end = std::max(end, address + segment.p_memsz);
+        }
+
+        close(fd);
+
+        _entry = bias + header.e_entry;
+        _programHeaderCount = header.e_phnum;
+
+        _brkStart = alignUp(end, PAGE_SIZE);
+        _brk = _brkStart;
+        _brkHigh = _brkStart;
+
+        return true;
+    }
+
+    void LinuxProcess::setDescriptor(uint32_t index, const Segment &segment) {
+        uint32_t low = (segment.limit & 0xffff) | (segment.base << 16);
+        uint32_t high = ((segment.base >> 16) & 0xff) | (segment.access << 8) | (segment.limit & 0xf0000) |
+                        (segment.flags << 20) | (segment.base & 0xff000000);
+
+        _cpu.getMemory().writeImm32(low, GDT + index * 8);
+        _cpu.getMemory().writeImm32(high, GDT + index * 8 + 4);
+    }
+
+    void LinuxProcess::setupSystem() {
+        memory::Memory& memory = _cpu.getMemory();
+
+        // flat 4 GiB code and data for both levels, 32 bit with page granularity
+        for (uint32_t index = 0; index < GDT_ENTRIES; index++)
+            setDescriptor(index, { 0, 0, 0, 0 });
+
+        setDescriptor(CODE_SELECTOR >> 3, { 0, 0xfffff, 0x9a, 0xc });
+        setDescriptor(DATA_SELECTOR >> 3, { 0, 0xfffff, 0x92, 0xc });
+        setDescriptor(USER_CODE_SELECTOR >> 3, { 0, 0xfffff, 0xfa, 0xc });
+        setDescriptor(USER_DATA_SELECTOR >> 3, { 0, 0xfffff, 0xf2, 0xc });
+
+        // the TSS only provides the stack the stubs run on
+        setDescriptor(TSS_SELECTOR >> 3, { TSS, TSS_SIZE - 1, 0x89, 0 });
+        memory.writeImm32(KERNEL_STACK_TOP, TSS + 4);
+        memory.writeImm32(DATA_SELECTOR, TSS + 8);
+
+        // every vector ends up in a fault stub, exceptions in their own and the rest like a #GP
+        for (uint32_t vector = 0; vector < 256; vector++) {
+            uint32_t stub = FAULT_STUBS + (vector < 32 ? vector : cpu::EXCEPTION_GP) * FAULT_STUB_SIZE;
+            uint32_t attributes = 0x8e00;   // present 32 bit interrupt gate
+
+            if (vector == 0x80) {
+                stub = SYSCALL_STUB;
+                attributes = 0xee00;        // callable from CPL 3 too
+            }
+
+            memory.writeImm32((CODE_SELECTOR << 16) | (stub & 0xffff), IDT + vector * 8);
+            memory.writeImm32((stub & 0xffff0000) | attributes, IDT + vector * 8 + 4);
+        }
+
+        // out SYSCALL_PORT, al ; iret
+        const uint8_t syscallStub[] = { 0xe6, (uint8_t) SYSCALL_PORT, 0xcf };
+        memory.writeBlock(SYSCALL_STUB, syscallStub, sizeof(syscallStub));
+
+        for (uint32_t vector = 0; vector < 32; vector++) {
+            const uint8_t faultStub[] = { 0xe6, (uint8_t) FAULT_PORT };
+            memory.writeBlock(FAULT_STUBS + vector * FAULT_STUB_SIZE, faultStub, sizeof(faultStub));
+        }
+
+        // RAM mapped 1:1. page 0 stays out so NULL pointers fault, the system area and the page
+        // tables are for CPL 0 only
+        uint32_t pages = (uint32_t) (std::min<uint64_t>(memory.memorySize(), 0xfffff000) / PAGE_SIZE);
+
+        for (uint32_t table = 0; table < (pages + 1023) / 1024; table++) {
+            uint32_t entry = (_pageTables + table * PAGE_SIZE) | memory::PAGE_PRESENT | memory::PAGE_WRITABLE | memory::PAGE_USER;
+            memory.writeImm32(entry, PAGE_DIRECTORY + table * 4);
+        }
+
+        for (uint32_t page = 1; page < pages; page++) {
+            uint32_t address = page * PAGE_SIZE;
+            uint32_t entry = address | memory::PAGE_PRESENT | memory::PAGE_WRITABLE;
+
+            if (address >= SYSTEM_END && address < _pageTables)
+                entry |= memory::PAGE_USER;
+
+            memory.writeImm32(entry, _pageTables + page * 4);
+        }
+
+        _cpu.loadGDT(GDT, GDT_ENTRIES * 8 - 1);
+        _cpu.loadIDT(IDT, 256 * 8 - 1);
+        _cpu.setControlRegister(cpu::CR3, PAGE_DIRECTORY);
+        _cpu.setControlRegister(cpu::CR0, _cpu.getRegister(cpu::CR0) | cpu::CR0_PE | cpu::CR0_PG);
+        _cpu.loadTaskRegister(TSS_SELECTOR);
+
+        // CS first, the stack has to be at the privilege level it sets
+        _cpu.loadSegment(cpu::CS, USER_CODE_SELECTOR);
+        _cpu.loadSegment(cpu::DS, USER_DATA_SELECTOR);
+        _cpu.loadSegment(cpu::ES, USER_DATA_SELECTOR);
+        _cpu.loadSegment(cpu::SS, USER_DATA_SELECTOR);
+        _cpu.loadSegment(cpu::FS, 0);
+        _cpu.loadSegment(cpu::GS, 0);
+
+        _cpu.setFlag(cpu::IF, 1);
+    }
+
+    void LinuxProcess::setupStack(const std::vector<std::string> &argv, const std::vector<std::string> &envp) {
+        memory::Memory& memory = _cpu.getMemory();
+        uint32_t top = _stackBottom + STACK_SIZE;
+
+        auto pushString = [&](const std::string& string) {
+            top -= string.size() + 1;
+            memory.writeBlock(top, (const uint8_t*) string.c_str(), string.size() + 1);
+            return top;
+        };
+
+        uint32_t execfn = pushString(_path);
+        uint32_t platform = pushString("i686");
+
+        std::vector<uint32_t> arguments;
+        std::vector<uint32_t> environment;
+
+        for (const std::string& argument : argv)
+            arguments.push_back(pushString(argument));
+
+        for (const std::string& variable : envp)
+            environment.push_back(pushString(variable));
+
+        uint8_t seed[16];
+        getrandom(seed, sizeof(seed), 0);
+        top = (top - sizeof(seed)) & ~15u;
+        memory.writeBlock(top, seed, sizeof(seed));
+        uint32_t random = top;
+
+        const uint32_t auxiliary[][2] = {
+                { AUX_PHDR, _programHeaders },
+                { AUX_PHENT, sizeof(Elf32_Phdr) },
+                { AUX_PHNUM, _programHeaderCount },
+                { AUX_PAGESZ, PAGE_SIZE },
+                { AUX_BASE, 0 },
+                { AUX_FLAGS, 0 },
+                { AUX_ENTRY, _entry },
+                { AUX_UID, (uint32_t) getuid() },
+                { AUX_EUID, (uint32_t) geteuid() },
+                { AUX_GID, (uint32_t) getgid() },
+                { AUX_EGID, (uint32_t) getegid() },
+                { AUX_PLATFORM, platform },
+                { AUX_HWCAP, 0 },
+                { AUX_CLKTCK, (uint32_t) sysconf(_SC_CLK_TCK) },
+                { AUX_SECURE, 0 },
+                { AUX_RANDOM, random },
+                { AUX_EXECFN, execfn },
+                { AUX_NULL, 0 },
+        };
+
+        // argc, argv, NULL, envp, NULL, auxv, with ESP 16 byte aligned
+        uint32_t words = 1 + arguments.size() + 1 + environment.size() + 1 + sizeof(auxiliary) / 4;
+        uint32_t stack = (top - words * 4) & ~15u;
+        uint32_t position = stack;
+
+        auto pushWord = [&](uint32_t value) {
+            memory.writeImm32(value, position);
+            position += 4;
+        };
+
+        pushWord(arguments.size());
+
+        for (uint32_t argument : arguments)
+            pushWord(argument);
+        pushWord(0);
+
+        for (uint32_t variable : environment)
+            pushWord(variable);
+        pushWord(0);
+
+        for (auto& entry : auxiliary) {
+            pushWord(entry[0]);
+            pushWord(entry[1]);
+        }
+
+        _cpu.setRegister(cpu::ESP, stack);
+    }
+
+    uint32_t LinuxProcess::read(void *context, uint16_t port, uint8_t size) {
+        return 0xffffffff;
+    }
+
+    void LinuxProcess::trap(void *context, uint16_t port, uint32_t value, uint8_t size) {
+        LinuxProcess* process = (LinuxProcess*) context;
+
+        if (port == SYSCALL_PORT)
+            process->syscall();
+        else
+            process->fault();
+    }
+
+    void LinuxProcess::terminate(int code) {
+        _exited = true;
+        _exitCode = code;
+
+        // nothing can wake it up again
+        _cpu.setFlag(cpu::IF, 0);
+        _cpu.halt();
+    }
+
+    void LinuxProcess::fault() {
+        // the stub tells which exception it is, EIP still points to it
+        uint32_t vector = (_cpu.getRegister(cpu::EIP) - FAULT_STUBS) / FAULT_STUB_SIZE;
+        bool errorCode = vector == 8 || (vector >= 10 && vector <= 14) || vector == 17;
+
+        uint32_t eip = _cpu.getMemory().readImm32(_cpu.getRegister(cpu::ESP) + (errorCode ? 4 : 0));
+        int signal;
+
+        switch (vector) {
+            case cpu::EXCEPTION_DE:
+                signal = SIGFPE;
+                break;
+            case cpu::EXCEPTION_UD:
+                signal = SIGILL;
+                break;
+            case 1:
+            case 3:
+                signal = SIGTRAP;
+                break;
+            default:
+                signal = SIGSEGV;
+                break;
+        }
+
+        io::debug_print(io::ERROR, "%s killed by %s, exception %u at EIP=0x%x", _path.c_str(), strsignal(signal), vector, eip);
+        terminate(128 + signal);
+    }
+
+    bool LinuxProcess::userRange(uint32_t address, uint32_t size) {
+        return address >= SYSTEM_END && (uint64_t) address + size <= _pageTables;
+    }
+
+    bool LinuxProcess::copyOut(uint32_t address, const void *data, uint32_t size) {
+        if (!userRange(address, size))
+            return false;
+
+        _cpu.getMemory().writeBlock(address, (const uint8_t*) data, size);
+        return true;
+    }
+
+    uint8_t *LinuxProcess::hostBuffer(uint32_t address, uint32_t size, bool write) {
+        memory::Memory& memory = _cpu.getMemory();
+
+        if (!userRange(address, size))
+            return nullptr;
+
+        // RAM is contiguous on the host, only the pages have to be checked
+        for (uint64_t page = address & ~(uint64_t) (PAGE_SIZE - 1); page < (uint64_t) address + size; page += PAGE_SIZE) {
+            if (!memory.hostPage(page, write))
+                return nullptr;
+        }
+
+        return (uint8_t*) memory.getMemLocation() + address;
+    }
+
+    int32_t LinuxProcess::readInto(int fd, uint32_t address, uint32_t size) {
+        if (!userRange(address, size))
+            return -EFAULT;
+
+        if (uint8_t* host = hostBuffer(address, size, true)) {
+            ssize_t count = ::read(fd, host, size);
+            return count < 0 ? -errno : count;
+        }
+
+        std::vector<uint8_t> buffer(size);
+        ssize_t count = ::read(fd, buffer.data(), size);
+
+        if (count < 0)
+            return -errno;
+
+        _cpu.getMemory().writeBlock(address, buffer.data(), count);
+        return count;
+    }
+
+    int32_t LinuxProcess::writeFrom(int fd, uint32_t address, uint32_t size) {
+        if (!userRange(address, size))
+            return -EFAULT;
+
+        if (uint8_t* host = hostBuffer(address, size, false)) {
+            ssize_t count = ::write(fd, host, size);
+            return count < 0 ? -errno : count;
+        }
+
+        std::vector<uint8_t> buffer(size);
+        _cpu.getMemory().readBlock(address, buffer.data(), size);
+
+        ssize_t count = ::write(fd, buffer.data(), size);
+        return count < 0 ? -errno : count;
+    }
+
+    std::string LinuxProcess::readString(uint32_t address) {
+        std::string string;
+        memory::Memory& memory = _cpu.getMemory();
+
+        while (string.size() < PATH_MAX && address < memory.memorySize()) {
+            char character = memory.readImm8(address++);
+
+            if (!character)
+                break;
+
+            string.push_back(character);
+        }
+
+        return string;
+    }
+
+    void LinuxProcess::zero(uint32_t address, uint32_t size) {
+        if (uint8_t* host = hostBuffer(address, size, true)) {
+            std::memset(host, 0, size);
+            return;
+        }
+
+        for (uint32_t i = 0; i < size; i++)
+            _cpu.getMemory().writeImm8(0, address + i);
+    }
+
+    int32_t LinuxProcess::brk(uint32_t address) {
+        if (address < _brkStart || address > _mmapTop)
+            return _brk;
+
+        // memory that was given back before has to be cleared again
+        if (address > _brk && _brk < _brkHigh)
+            zero(_brk, std::min(address, _brkHigh) - _brk);
+
+        _brk = address;
+        _brkHigh = std::max(_brkHigh, _brk);
+
+        return _brk;
+    }
+
+    int32_t LinuxProcess::mmap(uint32_t address, uint32_t length, uint32_t flags, int32_t fd, uint64_t offset) {
+        length = alignUp(length, PAGE_SIZE);
+
+        if (!length)
+            return -EINVAL;
+
+        bool fixed = flags & MAP_FIXED;
+        bool anonymous = flags & MAP_ANONYMOUS;
+
+        if (fixed) {
+            if ((address & (PAGE_SIZE - 1)) || !userRange(address, length))
+                return -EINVAL;
+
+            zero(address, length);
+        }
+        else {
+            // the hint is ignored. a range that was unmapped again is reused first, from its top
+            auto range = std::find_if(_unmapped.begin(), _unmapped.end(), [&](const auto& unmapped) {
+                return unmapped.second >= length;
+            });
+
+            if (range != _unmapped.end()) {
+                address = range->first + range->second - length;
+
+                if (range->second == length)
+                    _unmapped.erase(range);
+                else
+                    range->second -= length;
+
+                zero(address, length);
+            }
+            else {
+                // memory below _mmapTop was never handed out, or cleared when it was given back, so it is still zero
+                if (_mmapTop - length < _brk || length > _mmapTop)
+                    return -ENOMEM;
+
+                _mmapTop -= length;
+                address = _mmapTop;
+            }
+        }
+
+        if (!anonymous) {
+            uint8_t* host = hostBuffer(address, length, true);
+
+            if (!host)
+                return -EFAULT;
+
+            // private mappings are a copy, the rest of the last page stays zero
+            if (pread(fd, host, length, offset) < 0)
+                return -errno;
+        }
+
+        return address;
+    }
+
+    int32_t LinuxProcess::munmap(uint32_t address, uint32_t length) {
+        if ((address & (PAGE_SIZE - 1)) || !length)
+            return -EINVAL;
+
+        // the pages stay mapped, only mmap's part of RAM is handed out again. the executable, the
+        // break and the stack are never reused
+        uint64_t begin = std::max(address, _mmapTop);
+        uint64_t end = std::min<uint64_t>((uint64_t) address + alignUp(length, PAGE_SIZE), _stackBottom - PAGE_SIZE);
+
+        if (begin < end)
+            release(begin, end - begin);
+
+        return 0;
+    }
+
+    void LinuxProcess::release(uint32_t address, uint32_t length) {
+        uint32_t end = address + length;
+
+        // merged with the ranges it overlaps or touches
+        auto range = _unmapped.upper_bound(address);
+
+        if (range != _unmapped.begin() && std::prev(range)->first + std::prev(range)->second >= address) {
+            range = std::prev(range);
+            address = range->first;
+        }
+
+        while (range != _unmapped.end() && range->first <= end) {
+            end = std::max(end, range->first + range->second);
+            range = _unmapped.erase(range);
+        }
+
+        if (address == _mmapTop) {
+            // the lowest mapping is gone, the break may grow into it
+            zero(address, end - address);
+            _mmapTop = end;
+            return;
+        }
+
+        _unmapped[address] = end - address;
+    }
+
+    int32_t LinuxProcess::setThreadArea(uint32_t info) {
+        memory::Memory& memory = _cpu.getMemory();
+
+        int32_t entry = memory.readImm32(info);
+        uint32_t base = memory.readImm32(info + 4);
+        uint32_t limit = memory.readImm32(info + 8);
+        uint32_t flags = memory.readImm32(info + 12);
+
+        if (entry == -1) {
+            entry = TLS_FIRST;
+
+            if (!copyOut(info, &entry, 4))
+                return -EFAULT;
+        }
+
+        if (entry < (int32_t) TLS_FIRST || entry >= (int32_t) (TLS_FIRST + TLS_ENTRIES))
+            return -EINVAL;
+
+        // seg_32bit, contents, read_exec_only, limit_in_pages, seg_not_present
+        uint8_t access = 0x92 | 0x60 | ((flags >> 1 & 3) << 2);
+        if (flags & (1 << 3))
+            access &= ~0x02;
+        if (flags & (1 << 5))
+            access &= ~0x80;
+
+        uint8_t granularity = ((flags & 1) ? 0x4 : 0) | ((flags & (1 << 4)) ? 0x8 : 0);
+
+        setDescriptor(entry, { base, limit & 0xfffff, access, granularity });
+        return 0;
+    }
+
+    int32_t LinuxProcess::stat(int32_t result, const struct stat &info) {
+        // struct stat64 of i386
+        uint8_t buffer[96];
+        std::memset(buffer, 0, sizeof(buffer));
+
+        auto put32 = [&](uint32_t offset, uint32_t value) { std::memcpy(buffer + offset, &value, 4); };
+        auto put64 = [&](uint32_t offset, uint64_t value) { std::memcpy(buffer + offset, &value, 8); };
+
+        put64(0, info.st_dev);
+        put32(12, info.st_ino);
+        put32(16, info.st_mode);
+        put32(20, info.st_nlink);
+        put32(24, info.st_uid);
+        put32(28, info.st_gid);
+        put64(32, info.st_rdev);
+        put64(44, info.st_size);
+        put32(52, info.st_blksize);
+        put64(56, info.st_blocks);
+        put32(64, info.st_atim.tv_sec);
+        put32(68, info.st_atim.tv_nsec);
+        put32(72, info.st_mtim.tv_sec);
+        put32(76, info.st_mtim.tv_nsec);
+        put32(80, info.st_ctim.tv_sec);
+        put32(84, info.st_ctim.tv_nsec);
+        put64(88, info.st_ino);
+
+        return copyOut(result, buffer, sizeof(buffer)) ? 0 : -EFAULT;
+    }
+
+    void LinuxProcess::syscall() {
+        memory::Memory& memory = _cpu.getMemory();
+
+        uint32_t number = _cpu.getRegister(cpu::EAX);
+        uint32_t a = _cpu.getRegister(cpu::EBX);
+        uint32_t b = _cpu.getRegister(cpu::ECX);
+        uint32_t c = _cpu.getRegister(cpu::EDX);
+        uint32_t d = _cpu.getRegister(cpu::ESI);
+        uint32_t e = _cpu.getRegister(cpu::EDI);
+        uint32_t f = _cpu.getRegister(cpu::EBP);
+
+        // host calls return -1 and set errno, the guest expects -errno
+        auto host = [](long result) -> int32_t {
+            return result < 0 ? -errno : result;
+        };
+
+        int32_t result;
+
+        switch (number) {
+            case NR_EXIT:
+            case NR_EXIT_GROUP:
+                terminate(a & 0xff);
+                return;
+            case NR_READ:
+                result = readInto(a, b, c);
+                break;
+            case NR_WRITE:
+                result = writeFrom(a, b, c);
+                break;
+            case NR_OPEN:
+                result = host(open(readString(a).c_str(), b & ~O_LARGEFILE, c));
+                break;
+            case NR_OPENAT:
+                result = host(openat(a, readString(b).c_str(), c & ~O_LARGEFILE, d));
+                break;
+            case NR_CLOSE:
+                result = host(close(a));
+                break;
+            case NR_UNLINK:
+                result = host(unlink(readString(a).c_str()));
+                break;
+            case NR_UNLINKAT:
+                result = host(unlinkat(a, readString(b).c_str(), c));
+                break;
+            case NR_CHDIR:
+                result = host(chdir(readString(a).c_str()));
+                break;
+            case NR_RENAME:
+                result = host(rename(readString(a).c_str(), readString(b).c_str()));
+                break;
+            case NR_MKDIR:
+                result = host(mkdir(readString(a).c_str(), b));
+                break;
+            case NR_RMDIR:
+                result = host(rmdir(readString(a).c_str()));
+                break;
+            case NR_ACCESS:
+                result = host(access(readString(a).c_str(), b));
+                break;
+            case NR_FACCESSAT:
+                result = host(faccessat(a, readString(b).c_str(), c, 0));
+                break;
+            case NR_TIME: {
+                uint32_t now = time(nullptr);
+                result = a && !copyOut(a, &now, 4) ? -EFAULT : now;
+                break;
+            }
+            case NR_LSEEK:
+                result = host(lseek(a, (int32_t) b, c));
+                break;
+            case NR_LLSEEK: {
+                off_t position = lseek(a, ((uint64_t) b << 32) | c, e);
+                result = host(position);
+
+                if (position >= 0) {
+                    uint64_t value = position;
+                    result = copyOut(d, &value, 8) ? 0 : -EFAULT;
+                }
+                break;
+            }
+            case NR_GETPID:
+            case NR_GETTID:
+            case NR_SET_TID_ADDRESS:
+                result = getpid();
+                break;
+            case NR_GETPPID:
+                result = getppid();
+                break;
+            case NR_GETUID:
+            case NR_GETUID32:
+                result = getuid();
+                break;
+            case NR_GETEUID:
+            case NR_GETEUID32:
+                result = geteuid();
+                break;
+            case NR_GETGID:
+            case NR_GETGID32:
+                result = getgid();
+                break;
+            case NR_GETEGID:
+            case NR_GETEGID32:
+                result = getegid();
+                break;
+            case NR_KILL:
+            case NR_TGKILL: {
+                // only signals to the process itself, and only the deadly ones
+                uint32_t signal = number == NR_KILL ? b : c;
+
+                if (signal == 0) {
+                    result = 0;
+                    break;
+                }
+
+                terminate(128 + signal);
+                return;
+            }
+            case NR_DUP:
+                result = host(dup(a));
+                break;
+            case NR_DUP2:
+                result = host(dup2(a, b));
+                break;
+            case NR_PIPE: {
+                int fds[2];
+                result = host(pipe(fds));
+
+                if (result == 0 && !copyOut(a, fds, sizeof(fds))) {
+                    close(fds[0]);
+                    close(fds[1]);
+                    result = -EFAULT;
+                }
+                break;
+            }
+            case NR_BRK:
+                result = brk(a);
+                break;
+            case NR_IOCTL:
+                // terminal queries have the same layout on both sides
+                if (b == TCGETS || b == TIOCGWINSZ) {
+                    uint8_t* buffer = hostBuffer(c, b == TCGETS ? TERMIOS_SIZE : sizeof(struct winsize), true);
+                    result = buffer ? host(ioctl(a, b, buffer)) : -EFAULT;
+                }
+                else {
+                    result = -ENOTTY;
+                }
+                break;
+            case NR_FCNTL:
+            case NR_FCNTL64:
+                if (b == F_GETFD || b == F_SETFD || b == F_GETFL || b == F_SETFL || b == F_DUPFD || b == F_DUPFD_CLOEXEC)
+                    result = host(fcntl(a, b, c));
+                else
+                    result = -EINVAL;
+                break;
+            case NR_UMASK:
+                result = umask(a);
+                break;
+            case NR_GETTIMEOFDAY: {
+                struct timeval now;
+                gettimeofday(&now, nullptr);
+
+                const uint32_t value[] = { (uint32_t) now.tv_sec, (uint32_t) now.tv_usec };
+                result = a && !copyOut(a, value, sizeof(value)) ? -EFAULT : 0;
+                break;
+            }
+            case NR_CLOCK_GETTIME:
+            case NR_CLOCK_GETTIME64: {
+                struct timespec now;
+                result = host(clock_gettime(a, &now));
+
+                if (result == 0 && number == NR_CLOCK_GETTIME) {
+                    const uint32_t value[] = { (uint32_t) now.tv_sec, (uint32_t) now.tv_nsec };
+                    result = copyOut(b, value, sizeof(value)) ? 0 : -EFAULT;
+                }
+                else if (result == 0) {
+                    const uint32_t value[] = { (uint32_t) now.tv_sec, (uint32_t) ((uint64_t) now.tv_sec >> 32),
+                                               (uint32_t) now.tv_nsec, 0 };
+                    result = copyOut(b, value, sizeof(value)) ? 0 : -EFAULT;
+                }
+                break;
+            }
+            case NR_NANOSLEEP: {
+                struct timespec duration = { (int32_t) memory.readImm32(a), (int32_t) memory.readImm32(a + 4) };
+                result = host(nanosleep(&duration, nullptr));
+                break;
+            }
+            case NR_READLINK: {
+                std::string path = readString(a);
+
+                // the host's answer would be the emulator
+                if (path == "/proc/self/exe") {
+                    uint32_t count = std::min<uint32_t>(c, _path.size());
+                    result = copyOut(b, _path.c_str(), count) ? count : -EFAULT;
+                    break;
+                }
+
+                uint8_t* buffer = hostBuffer(b, c, true);
+                result = buffer ? host(readlink(path.c_str(), (char*) buffer, c)) : -EFAULT;
+                break;
+            }
+            case NR_GETCWD: {
+                uint8_t* buffer = hostBuffer(a, b, true);
+                result = buffer ? (getcwd((char*) buffer, b) ? strlen((char*) buffer) + 1 : -errno) : -EFAULT;
+                break;
+            }
+            case NR_MMAP: {
+                // the arguments are in a block at EBX, the offset in bytes
+                uint32_t arguments[6];
+                for (int i = 0; i < 6; i++)
+                    arguments[i] = memory.readImm32(a + i * 4);
+
+                result = mmap(arguments[0], arguments[1], arguments[3], arguments[4], arguments[5]);
+                break;
+            }
+            case NR_MMAP2:
+                result = mmap(a, b, d, e, (uint64_t) f * PAGE_SIZE);
+                break;
+            case NR_MUNMAP:
+                result = munmap(a, b);
+                break;
+            case NR_MPROTECT:
+            case NR_MADVISE:
+            case NR_RT_SIGACTION:
+            case NR_RT_SIGPROCMASK:
+            case NR_SIGALTSTACK:
+            case NR_SET_ROBUST_LIST:
+            case NR_SCHED_YIELD:
+                // nothing to protect, no signals are ever delivered and there are no other threads
+                result = 0;
+                break;
+            case NR_UNAME: {
+                // six fields of 65 characters
+                const char* fields[] = { "Linux", "x86e", "4.19.0", "#1", "i686", "(none)" };
+
+                for (int i = 0; i < 6; i++) {
+                    char field[65] = {};
+                    strncpy(field, fields[i], sizeof(field) - 1);
+
+                    if (i == 1)
+                        gethostname(field, sizeof(field) - 1);
+
+                    if (!copyOut(a + i * 65, field, sizeof(field)))
+                        break;
+                }
+
+                result = userRange(a, 6 * 65) ? 0 : -EFAULT;
+                break;
+            }
+            case NR_READV:
+            case NR_WRITEV: {
+                result = 0;
+
+                for (uint32_t i = 0; i < c; i++) {
+                    uint32_t base = memory.readImm32(b + i * 8);
+                    uint32_t length = memory.readImm32(b + i * 8 + 4);
+
+                    int32_t count = number == NR_READV ? readInto(a, base, length) : writeFrom(a, base, length);
+
+                    if (count < 0) {
+                        result = result ? result : count;
+                        break;
+                    }
+
+                    result += count;
+
+                    if ((uint32_t) count < length)
+                        break;
+                }
+                break;
+            }
+            case NR_STAT64:
+            case NR_LSTAT64:
+            case NR_FSTAT64:
+            case NR_FSTATAT64: {
+                struct ::stat info;
+                uint32_t target = b;
+
+                if (number == NR_STAT64)
+                    result = host(::stat(readString(a).c_str(), &info));
+                else if (number == NR_LSTAT64)
+                    result = host(lstat(readString(a).c_str(), &info));
+                else if (number == NR_FSTAT64)
+                    result = host(fstat(a, &info));
+                else {
+                    result = host(fstatat(a, readString(b).c_str(), &info, d));
+                    target = c;
+                }
+
+                if (result == 0)
+                    result = stat(target, info);
+                break;
+            }
+            case NR_GETDENTS64: {
+                // struct linux_dirent64 is the same everywhere
+                uint8_t* buffer = hostBuffer(b, c, true);
+                result = buffer ? host(::syscall(SYS_getdents64, a, buffer, c)) : -EFAULT;
+                break;
+            }
+            case NR_SET_THREAD_AREA:
+                result = setThreadArea(a);
+                break;
+            case NR_GETRANDOM: {
+                uint8_t* buffer = hostBuffer(a, b, true);
+                result = buffer ? host(getrandom(buffer, b, c)) : -EFAULT;
+                break;
+            }
+            case NR_FUTEX:
+            case NR_PRLIMIT64:
+            default:
+                io::debug_print(io::WARNING, "Unsupported syscall %u", number);
+                result = -ENOSYS;
+                break;
+        }
+
+        _cpu.setRegister(cpu::EAX, result);
+    }
+
+}